@@ -44,6 +44,9 @@ enum Compatibility
 
 #define ABS_ZERO (-273.15)  // Celsius
 
+#define PT100_A 3.9083e-3	// Callendar-Van Dusen coefficients for platinum resistance thermometers, above 0 C
+#define PT100_B -5.775e-7
+
 #define INCH_TO_MM (25.4)
 
 #define HEAT_SAMPLE_TIME (0.5) // Seconds
@@ -57,6 +60,11 @@ enum Compatibility
 #define HOT_ENOUGH_TO_EXTRUDE (170.0)       // Celsius
 #define TIME_TO_HOT (120.0)					// Seconds
 
+#define TUNING_HYSTERESIS (1.0)				// Autotune switches the heater this far either side of the target (Celsius)
+#define TUNING_CYCLES 5						// Default number of oscillations to measure; the first one is not counted
+#define TUNING_MAX_OVERSHOOT (40.0)			// Autotune gives up if the temperature goes this far over the target (Celsius)
+#define TUNING_TIME_LIMIT (1200.0)			// ...or if it takes longer than this (seconds)
+
 // If temperatures fall outside this range, something
 // nasty has happened.
 
@@ -66,9 +74,20 @@ enum Compatibility
 
 #define STANDBY_INTERRUPT_RATE 2.0e-4 // Seconds
 
-#define NUMBER_OF_PROBE_POINTS 5	  // Maximum number of probe points
+#define SEGMENT_MERGE_TOLERANCE 0.0	  // How far merged moves may stray from the path (mm); 0 for no merging
+#define MINIMUM_SEGMENT_LENGTH 0.0	  // Moves shorter than this are merged with their neighbours (mm)
+#define POSITION_CHECK_TOLERANCE 0.001 // How far the position Move reports may be from the end of the last move it was given (mm)
+#define EXTRUSION_RATIO_TOLERANCE 0.01 // Fractional difference in extrusion per mm allowed between merged moves
+#define DELTA_SEGMENTS_PER_SECOND 100.0 // Delta moves are cut into pieces this often...
+#define DELTA_MIN_SEGMENT_LENGTH 0.2 // ...but no shorter than this (mm)
+
+#define CHECKPOINT_INTERVAL 30.0	  // How often a print's checkpoint is written (seconds)
+#define CHECKPOINT_MAGIC 0x31505252	  // "RRP1" - the first word of a checkpoint that can be resumed from
+
+#define NUMBER_OF_PROBE_POINTS 25	  // Maximum number of probe points; more than 5 make a grid, up to 5x5
+#define MAX_PROBE_GRID_CELLS 16		  // The most rectangles NUMBER_OF_PROBE_POINTS points can make as a grid
+#define PROBE_GRID_TOLERANCE 0.05	  // Fraction of the grid spacing by which a grid probe point may be out
 #define Z_DIVE 8.0  				  // Height from which to probe the bed (mm)
-#define TRIANGLE_0 -0.001			  // Slightly less than 0 for point-in-triangle tests
 
 #define SILLY_Z_VALUE -9999.0
 
@@ -80,6 +99,7 @@ enum Compatibility
 #define MESSAGE_FILE "messages.txt"
 #define FOUR04_FILE "html404.htm"
 #define CONFIG_FILE "config.g"         // The file that sets the machine's parameters
+#define CHECKPOINT_FILE "resume.dat"   // Where a print's checkpoints go, in the system directory
 #define HOME_X_G "homex.g"
 #define HOME_Y_G "homey.g"
 #define HOME_Z_G "homez.g"
@@ -95,6 +115,11 @@ enum Compatibility
 
 #define LONG_TIME 300.0 // Seconds
 
+// Profiling the Spin()s and the step interrupt
+
+#define PROFILE_BUCKETS 7						// Histogram buckets; each is 4 times as long as the last...
+#define PROFILE_FIRST_BUCKET_BITS 10			// ...and the first is up to 2^10 cycles
+
 #define EOF_STRING "<!-- **EoF** -->"           // For HTML uploads
 
 #define FLASH_LED 'F' 							// Type byte of a message that is to flash an LED; the next two bytes define
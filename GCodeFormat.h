@@ -0,0 +1,222 @@
+/****************************************************************************************************
+
+RepRapFirmware - G Code Format
+
+What a G Code looks like, both as a line of text and as a record in a binary G Code (.bgc)
+file, and the functions that read and write those.  Nothing here depends on the machine or
+on any other part of the firmware, so the host programs in tools/ use exactly the same code.
+
+-----------------------------------------------------------------------------------------------------
+
+Version 0.1
+
+14 October 2026
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#ifndef GCODEFORMAT_H
+#define GCODEFORMAT_H
+
+#include <stdint.h>
+#include <ctype.h>
+
+#define GCODE_LETTERS 26 // The key letters A to Z are indexed when a G Code is complete
+#define NO_LETTER 255 // Index entry for a letter that isn't in the G Code
+
+// Binary G Code (.bgc) files.  These start with a header of the three characters BGC_MAGIC, a
+// version byte and a flags byte.  What follows is a list of records, each starting with an opcode:
+//
+//   BGC_GCODE: an ordinary ASCII G Code follows, ending with a newline.
+//   BGC_MOVE | field mask: a G1 move.  Each field in the mask (X, Y, Z, E, F in that order)
+//     is present as a zig-zag varint.  For X, Y, Z and F that is the change in the value since
+//     the last move that had it; X, Y and Z are absolute positions in units of BGC_RESOLUTION mm,
+//     and F is in BGC_RESOLUTION mm/minute.  E is not a change: it is this move's own (relative)
+//     extrusion in BGC_RESOLUTION mm.  If BGC_CHECKSUMS is set in the flags a final byte holds
+//     the sum of the record's other bytes.
+//
+// A binary move doesn't change where an absolute (M82) E value is measured from, so a file that
+// follows one with a G Code using absolute E must set that with a G92 E first.  tools/bgc.cpp
+// converts ordinary G Code files to this format, and checks the result.
+
+#define BGC_MAGIC "BGC"
+#define BGC_VERSION 1
+#define BGC_HEADER_LENGTH 5
+#define BGC_CHECKSUMS 1 // Flag: each move record ends with a checksum byte
+#define BGC_GCODE 0x00
+#define BGC_MOVE 0x20
+#define BGC_FIELDS 5 // X, Y, Z, E, F
+#define BGC_E_FIELD 3
+#define BGC_F_FIELD 4
+#define BGC_MAX_VARINT 5 // Bytes in the longest varint
+#define BGC_MAX_RECORD 32 // Longest possible record: opcode, 5 varints of at most 5 bytes, checksum
+#define BGC_RESOLUTION 0.001 // mm per unit in the file
+
+// Make a single pass over a complete G Code recording where each key letter
+// first appears, or NO_LETTER if it doesn't.
+
+inline void IndexGCodeLetters(const char* s, uint8_t index[GCODE_LETTERS])
+{
+	for(int8_t i = 0; i < GCODE_LETTERS; i++)
+		index[i] = NO_LETTER;
+	for(int i = 0; s[i] && i < NO_LETTER; i++)
+	{
+		char c = s[i];
+		if(c >= 'A' && c <= 'Z' && index[c - 'A'] == NO_LETTER)
+			index[c - 'A'] = i;
+	}
+}
+
+// Convert a decimal number like those in G Codes (optional sign, digits, optional
+// point and digits, optional exponent) to a float.  This is much quicker than strtod(),
+// which works in double precision.  Leading spaces are skipped; parsing stops at the first
+// character that can't be part of the number.
+
+inline float ReadGCodeFloat(const char* s)
+{
+	static const float powersOfTen[] = { 1.0, 1.0e1, 1.0e2, 1.0e3, 1.0e4, 1.0e5, 1.0e6, 1.0e7, 1.0e8, 1.0e9, 1.0e10 };
+	const int8_t maxPower = sizeof(powersOfTen)/sizeof(powersOfTen[0]) - 1;
+
+	while(*s == ' ')
+		s++;
+	bool negative = (*s == '-');
+	if(negative || *s == '+')
+		s++;
+
+	// Accumulate up to 9 significant digits in an integer; after that they can't
+	// affect a float, so just count the integer ones for the exponent.
+
+	uint32_t mantissa = 0;
+	int8_t digits = 0;
+	int exponent = 0;
+	while(isdigit(*s))
+	{
+		if(digits < 9)
+		{
+			mantissa = mantissa*10 + (*s - '0');
+			if(mantissa)
+				digits++;
+		} else
+			exponent++;
+		s++;
+	}
+	if(*s == '.')
+	{
+		s++;
+		while(isdigit(*s))
+		{
+			if(digits < 9)
+			{
+				mantissa = mantissa*10 + (*s - '0');
+				if(mantissa)
+					digits++;
+				exponent--;
+			}
+			s++;
+		}
+	}
+	if(*s == 'e' || *s == 'E')
+	{
+		s++;
+		bool negativeExponent = (*s == '-');
+		if(negativeExponent || *s == '+')
+			s++;
+		int e = 0;
+		while(isdigit(*s))
+		{
+			if(e < 100)
+				e = e*10 + (*s - '0');
+			s++;
+		}
+		exponent += negativeExponent ? -e : e;
+	}
+
+	float result = (float)mantissa;
+	while(exponent > 0)
+	{
+		int8_t p = (exponent > maxPower) ? maxPower : exponent;
+		result *= powersOfTen[p];
+		exponent -= p;
+	}
+	while(exponent < 0)
+	{
+		int8_t p = (-exponent > maxPower) ? maxPower : -exponent;
+		result /= powersOfTen[p];
+		exponent += p;
+	}
+	return negative ? -result : result;
+}
+
+// Write v as a zig-zag varint at p, returning the number of bytes used
+
+inline int8_t BgcWriteVarint(int32_t v, uint8_t* p)
+{
+	uint32_t u = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+	int8_t bytes = 0;
+	while(u >= 0x80)
+	{
+		p[bytes++] = (uint8_t)(u | 0x80);
+		u >>= 7;
+	}
+	p[bytes++] = (uint8_t)u;
+	return bytes;
+}
+
+// Read a zig-zag varint from p into v, returning the byte after it
+
+inline const uint8_t* BgcReadVarint(const uint8_t* p, int32_t& v)
+{
+	uint32_t u = 0;
+	int8_t shift = 0;
+	do
+	{
+		u |= (uint32_t)(*p & 0x7F) << shift;
+		shift += 7;
+	} while(*p++ & 0x80);
+	v = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+	return p;
+}
+
+// The sum of the first length bytes of a record, which is what its checksum byte holds
+
+inline uint8_t BgcChecksum(const uint8_t* r, int length)
+{
+	uint8_t sum = 0;
+	for(int i = 0; i < length; i++)
+		sum += r[i];
+	return sum;
+}
+
+// Work out the length of the binary record at r, of which available bytes are to hand.
+// For BGC_GCODE that is just the opcode; the text is read as an ordinary G Code.
+// Return 0 if it isn't all there yet, and -1 if it can't be a valid record.
+
+inline int BgcRecordLength(const uint8_t* r, int available, bool checksums)
+{
+	if(r[0] == BGC_GCODE)
+		return 1;
+	if((r[0] & ~((1 << BGC_FIELDS) - 1)) != BGC_MOVE)
+		return -1;
+	int length = 1;
+	for(int8_t field = 0; field < BGC_FIELDS; field++)
+	{
+		if(!(r[0] & (1 << field)))
+			continue;
+		int8_t bytes = 0;
+		do
+		{
+			if(length >= available)
+				return 0;
+			if(++bytes > BGC_MAX_VARINT)
+				return -1;
+		} while(r[length++] & 0x80);
+	}
+	if(checksums)
+		length++;
+	if(length > available)
+		return 0;
+	return length;
+}
+
+#endif
@@ -27,15 +27,19 @@ Licence: GPL
 
 const char axis_letters[AXES] = AXIS_LETTERS;
 
-GCodes::GCodes(Platform* p, Webserver* w)
+GCodes::GCodes(Platform* p, Webserver* w) :
+	webGCodeBuffer(p, "web: "),
+	fileGCodeBuffer(p, "file: "),
+	serialGCodeBuffer(p, "serial: "),
+	fileMacroGCodeBuffer(p, "macro: ")
 {
   active = false;
   platform = p;
   webserver = w;
-  webGCode = new GCodeBuffer(platform, "web: ");
-  fileGCode = new GCodeBuffer(platform, "file: ");
-  serialGCode = new GCodeBuffer(platform, "serial: ");
-  fileMacroGCode = new GCodeBuffer(platform, "macro: ");
+  webGCode = &webGCodeBuffer;
+  fileGCode = &fileGCodeBuffer;
+  serialGCode = &serialGCodeBuffer;
+  fileMacroGCode = &fileMacroGCodeBuffer;
 }
 
 void GCodes::Exit()
@@ -67,6 +71,10 @@ void GCodes::Init()
     lastPos[drive] = 0.0;
   fileBeingPrinted = NULL;
   fileToPrint = NULL;
+  binaryFile = NULL;
+  binaryChecksums = false;
+  binaryInGCode = false;
+  binaryStaged = 0;
   fileBeingWritten = NULL;
   configFile = NULL;
   doingFileMacro = false;
@@ -88,35 +96,234 @@ void GCodes::Init()
   limitAxes = true;
   axisHasBeenHomed[X_AXIS] = axisHasBeenHomed[Y_AXIS] = axisHasBeenHomed[Z_AXIS] = false;
   toolChangeSequence = 0;
+  queuedFileName[0] = 0;
+  printingFileName[0] = 0;
+  movePrintPosition.filePosition = -1;
+  checkpointFile = NULL;
+  checkpointSequence = 0;
+  checkpointMoves = 0;
+  checkpointTime = 0.0;
+  resumeSequence = 0;
   active = true;
   longWait = platform->Time();
   dwellTime = longWait;
 }
 
+// Take a whole line at a time straight from the file's buffer
+
 void GCodes::DoFilePrint(GCodeBuffer* gb)
 {
-	char b;
+	if(fileBeingPrinted != NULL && fileBeingPrinted == binaryFile)
+	{
+		DoBinaryFilePrint(gb);
+		return;
+	}
 
 	if(fileBeingPrinted != NULL)
 	{
-		if(fileBeingPrinted->Read(b))
+		const char* data;
+		int length;
+		int used;
+		while((length = fileBeingPrinted->ReadBlock(data)) > 0)
 		{
-			if(gb->Put(b))
+			bool complete = gb->Put(data, length, used);
+			fileBeingPrinted->Consume(used);
+			if(complete)
+			{
 				gb->SetFinished(ActOnCode(gb));
-		} else
+				return;
+			}
+		}
+		if(gb->Put('\n')) // In case there wasn't one ending the file
+			gb->SetFinished(ActOnCode(gb));
+		bool printFinished = Checkpointing();
+		fileBeingPrinted->Close();
+		fileBeingPrinted = NULL;
+		if(printFinished)
+			StopCheckpoints();
+	}
+}
+
+// Take one record at a time from a binary G Code file.  Moves go straight into moveBuffer
+// without being turned into text; anything else is an ordinary G Code.
+
+void GCodes::DoBinaryFilePrint(GCodeBuffer* gb)
+{
+	const char* data;
+	int length;
+	while((length = fileBeingPrinted->ReadBlock(data)) > 0)
+	{
+		if(binaryInGCode)
 		{
-			if(gb->Put('\n')) // In case there wasn't one ending the file
+			int used;
+			bool complete = gb->Put(data, length, used);
+			fileBeingPrinted->Consume(used);
+			if(complete)
+			{
+				binaryInGCode = false;
 				gb->SetFinished(ActOnCode(gb));
-			fileBeingPrinted->Close();
-			fileBeingPrinted = NULL;
+				return;
+			}
+			continue;
+		}
+
+		// Decode in place when the whole of any record must be in the file's buffer.
+		// Otherwise assemble it in binaryRecord, as it may be split across two buffer loads.
+
+		const uint8_t* record = (const uint8_t*)data;
+		int available = length;
+		if(binaryStaged > 0 || length < BGC_MAX_RECORD)
+		{
+			int n = BGC_MAX_RECORD - binaryStaged;
+			if(n > length)
+				n = length;
+			memcpy(&binaryRecord[binaryStaged], data, n);
+			record = binaryRecord;
+			available = binaryStaged + n;
+		}
+
+		int recordLength = BgcRecordLength(record, available, binaryChecksums);
+		if(recordLength < 0 || (recordLength == 0 && available >= BGC_MAX_RECORD))
+		{
+			AbandonBinaryFile("has a corrupt record");
+			return;
+		}
+		if(recordLength == 0)
+		{
+			fileBeingPrinted->Consume(available - binaryStaged);
+			binaryStaged = available;
+			continue;
+		}
+
+		if(binaryChecksums && record[0] != BGC_GCODE)
+		{
+			if(BgcChecksum(record, recordLength - 1) != record[recordLength - 1])
+			{
+				AbandonBinaryFile("has a checksum error");
+				return;
+			}
+		}
+
+		if(!DoBinaryRecord(record))
+			return; // Try again next time; nothing has been consumed
+
+		fileBeingPrinted->Consume(recordLength - binaryStaged);
+		binaryStaged = 0;
+		if(!binaryInGCode)
+			return;
+	}
+
+	if(binaryStaged > 0)
+		platform->Message(BOTH_ERROR_MESSAGE, "Binary G Code file ends part way through a record.\n");
+	if(binaryInGCode && gb->Put('\n'))
+		gb->SetFinished(ActOnCode(gb));
+	binaryInGCode = false;
+	binaryStaged = 0;
+	binaryFile = NULL;
+	fileBeingPrinted->Close();
+	fileBeingPrinted = NULL;
+}
+
+bool GCodes::DoBinaryRecord(const uint8_t* r)
+{
+	if(r[0] == BGC_GCODE)
+	{
+		binaryInGCode = true;
+		return true;
+	}
+	return DoBinaryMove(r);
+}
+
+// The equivalent of SetUpMove() and LoadMoveBufferFromGCode() for a binary move record.
+// Extrusion goes to the current tool's first drive, or is shared out if it is mixing.  As
+// for a G1, an extruding move with no tool selected is reported as an error and not done.
+
+bool GCodes::DoBinaryMove(const uint8_t* r)
+{
+	if(moveAvailable)
+		return false;
+
+	if(!reprap.GetMove()->GetCurrentUserPosition(moveBuffer))
+		return false;
+
+	// Decode the varints and bring the running values up to date
+
+	const uint8_t* p = &r[1];
+	for(int8_t field = 0; field < BGC_FIELDS; field++)
+	{
+		if(!(r[0] & (1 << field)))
+			continue;
+		int32_t delta;
+		p = BgcReadVarint(p, delta);
+		if(field == BGC_E_FIELD)
+			binaryPosition[field] = delta;
+		else
+			binaryPosition[field] += delta;
+	}
+
+	for(int8_t drive = AXES; drive < DRIVES; drive++)
+		moveBuffer[drive] = 0.0;
+
+	if(r[0] & (1 << BGC_E_FIELD))
+	{
+		Tool* tool = reprap.GetCurrentTool();
+		if(tool == NULL)
+		{
+			platform->Message(BOTH_ERROR_MESSAGE, "Attempting to extrude with no tool selected.\n");
+			return true;
+		}
+		if(tool->DriveCount() > 0 && tool->ToolCanDrive())
+		{
+			float e = binaryPosition[BGC_E_FIELD]*BGC_RESOLUTION;
+			if(tool->Mixing())
+			{
+				for(int8_t eDrive = 0; eDrive < tool->DriveCount(); eDrive++)
+					moveBuffer[tool->Drive(eDrive) + AXES] = e*tool->GetMix()[eDrive];
+			} else
+				moveBuffer[tool->Drive(0) + AXES] = e;
+		}
+	}
+
+	for(int8_t axis = 0; axis < AXES; axis++)
+	{
+		if(!(r[0] & (1 << axis)))
+			continue;
+		float moveArg = binaryPosition[axis]*BGC_RESOLUTION;
+		if (limitAxes && axis < 2 && axisHasBeenHomed[axis])
+		{
+			if (moveArg < 0.0)
+				moveArg = 0.0;
+			else if (moveArg > platform->AxisLength(axis))
+				moveArg = platform->AxisLength(axis);
 		}
+		moveBuffer[axis] = moveArg;
 	}
+
+	if(r[0] & (1 << BGC_F_FIELD))
+		moveBuffer[DRIVES] = binaryPosition[BGC_F_FIELD]*BGC_RESOLUTION*0.016666667; // mm/minute to mm/sec
+
+	checkEndStops = false;
+	moveAvailable = true;
+	return true;
+}
+
+void GCodes::AbandonBinaryFile(const char* why)
+{
+	snprintf(scratchString, STRING_LENGTH, "Binary G Code file %s; print abandoned.\n", why);
+	platform->Message(BOTH_ERROR_MESSAGE, scratchString);
+	binaryFile = NULL;
+	binaryInGCode = false;
+	binaryStaged = 0;
+	fileBeingPrinted->Close();
+	fileBeingPrinted = NULL;
 }
 
 void GCodes::Spin()
 {
   if(!active)
     return;
+
+  WriteCheckpoint();
     
   // Check each of the sources of G Codes (web, serial, and file) to
   // see if what they are doing has been done.  If it hasn't, return without
@@ -152,11 +359,16 @@ void GCodes::Spin()
 
   if(webserver->GCodeAvailable())
   {
-	  int8_t i = 0;
+	  // Take as much as makes up a complete G Code in one go.  It may be
+	  // split in two where the webserver's ring buffer wraps round.
 	  do
 	  {
-		  char b = webserver->ReadGCode();
-		  if(webGCode->Put(b))
+		  const char* data;
+		  int used;
+		  int length = webserver->ReadGCodeBlock(data);
+		  bool complete = webGCode->Put(data, length, used);
+		  webserver->ConsumeGCode(used);
+		  if(complete)
 		  {
 			  // we have a complete gcode
 			  if(webGCode->WritingFileDirectory() != NULL)
@@ -169,8 +381,7 @@ void GCodes::Spin()
 			  }
 			  break;	// stop after receiving a complete gcode in case we haven't finished processing it
 		  }
-		  ++i;
-	  } while ( i < 16 && webserver->GCodeAvailable());
+	  } while (webserver->GCodeAvailable());
 	  platform->ClassReport("GCodes", longWait);
 	  return;
   }
@@ -182,23 +393,26 @@ void GCodes::Spin()
   {
 	  if(platform->GetLine()->Status() & byteAvailable)
 	  {
-		  char b;
-		  platform->GetLine()->Read(b);
-		  WriteHTMLToFile(b, serialGCode);
+		  const char* data;
+		  int length = platform->GetLine()->ReadBlock(data);
+		  platform->GetLine()->Consume(WriteHTMLToFile(data, length, serialGCode));
 	  }
   } else
   {
 	  // Otherwise just deal in general with incoming bytes from the serial interface
 
-	  if(platform->GetLine()->Status() & byteAvailable)
+	  if(platform->GetLine()->LineAvailable())
 	  {
-		  // Read several bytes instead of just one. This approximately doubles the speed of file uploading.
-		  int8_t i = 0;
+		  // Wait till a whole line has arrived, then hand it over in one go.  It may be
+		  // split in two where the line buffer wraps round.
 		  do
 		  {
-			  char b;
-			  platform->GetLine()->Read(b);
-			  if(serialGCode->Put(b))	// add char to buffer and test whether the gcode is complete
+			  const char* data;
+			  int used;
+			  int length = platform->GetLine()->ReadBlock(data);
+			  bool complete = serialGCode->Put(data, length, used);
+			  platform->GetLine()->Consume(used);
+			  if(complete)	// test whether the gcode is complete
 			  {
 				  // we have a complete gcode
 				  if(serialGCode->WritingFileDirectory() != NULL)
@@ -211,8 +425,7 @@ void GCodes::Spin()
 				  }
 				  break;	// stop after receiving a complete gcode in case we haven't finished processing it
 			  }
-			  ++i;
-		  } while (i < 16 && (platform->GetLine()->Status() & byteAvailable));
+		  } while (platform->GetLine()->Status() & byteAvailable);
 		  platform->ClassReport("GCodes", longWait);
 		  return;
 	  }
@@ -386,7 +599,8 @@ bool GCodes::LoadMoveBufferFromGCode(GCodeBuffer *gb, bool doingG92, bool applyL
 			{
 				moveArg += moveBuffer[axis];
 			}
-			if (applyLimits && axis < 2 && axisHasBeenHomed[axis] && !doingG92)	// limit X & Y moves unless doing G92.  FIXME: No Z for the moment as we often need to move -ve to set the origin
+			if (applyLimits && axis < 2 && axisHasBeenHomed[axis] && !doingG92 &&	// limit X & Y moves unless doing G92.  FIXME: No Z for the moment as we often need to move -ve to set the origin
+					reprap.GetMove()->GetKinematics()->Type() != deltaKinematics)	// Delta X and Y are round the middle of the bed
 			{
 				if (moveArg < 0.0)
 				{
@@ -442,18 +656,29 @@ bool GCodes::SetUpMove(GCodeBuffer *gb)
   //relative movement required
   moveAvailable = LoadMoveBufferFromGCode(gb, false, !checkEndStops && limitAxes);
 
+  // Moves from the file being printed say where they leave it, for the checkpoints
+
+  if(moveAvailable && gb == fileGCode && Checkpointing())
+  {
+	  movePrintPosition.filePosition = fileBeingPrinted->BytesRead();
+	  for(int8_t drive = 0; drive <= DRIVES; drive++)
+		  movePrintPosition.coordinates[drive] = (drive < AXES || drive == DRIVES) ? moveBuffer[drive] : lastPos[drive - AXES];
+  }
+
   return true; 
 }
 
 // The Move class calls this function to find what to do next.
 
-bool GCodes::ReadMove(float m[], bool& ce)
+bool GCodes::ReadMove(float m[], bool& ce, PrintPosition& p)
 {
     if(!moveAvailable)
       return false; 
     for(int8_t i = 0; i <= DRIVES; i++) // 1 more for feedrate
       m[i] = moveBuffer[i];
     ce = checkEndStops;
+    p = movePrintPosition;
+    movePrintPosition.filePosition = -1;
     moveAvailable = false;
     checkEndStops = false;
     return true;
@@ -472,7 +697,7 @@ bool GCodes::DoFileMacro(const char* fileName)
 			return false;
 		if(fileBeingPrinted != NULL)
 			fractionOfFilePrinted = fileBeingPrinted->FractionRead();
-		fileBeingPrinted = platform->GetFileStore(platform->GetSysDir(), fileName, false);
+		fileBeingPrinted = platform->GetFileStore(platform->GetSysDir(), fileName, false, generalFile);
 		if(fileBeingPrinted == NULL)
 		{
 			snprintf(scratchString, STRING_LENGTH, "Macro file %s not found.\n ", fileName);
@@ -940,7 +1165,7 @@ char* GCodes::GetCurrentCoordinates()
 
 void GCodes::OpenFileToWrite(const char* directory, const char* fileName, GCodeBuffer *gb)
 {
-	fileBeingWritten = platform->GetFileStore(directory, fileName, true);
+	fileBeingWritten = platform->GetFileStore(directory, fileName, true, uploadFile);
 	if(fileBeingWritten == NULL)
 	{
 		platform->Message(HOST_MESSAGE, "Can't open GCode file for writing.\n");
@@ -952,7 +1177,10 @@ void GCodes::OpenFileToWrite(const char* directory, const char* fileName, GCodeB
 	eofStringCounter = 0;
 }
 
-void GCodes::WriteHTMLToFile(char b, GCodeBuffer *gb)
+// The data are scanned for the end-of-file string and written in one go, up to and
+// including the end of that string if it is there.  Returns how many bytes were used.
+
+int GCodes::WriteHTMLToFile(const char* data, int length, GCodeBuffer *gb)
 {
 	char reply[1];
 	reply[0] = 0;
@@ -960,27 +1188,31 @@ void GCodes::WriteHTMLToFile(char b, GCodeBuffer *gb)
 	if(fileBeingWritten == NULL)
 	{
 		platform->Message(HOST_MESSAGE, "Attempt to write to a null file.\n");
-		return;
+		return length;
 	}
 
-	fileBeingWritten->Write(b);
-
-	if(b == eofString[eofStringCounter])
+	for(int i = 0; i < length; i++)
 	{
-		eofStringCounter++;
-		if(eofStringCounter >= eofStringLength)
+		if(data[i] == eofString[eofStringCounter])
 		{
-			fileBeingWritten->Close();
-			fileBeingWritten = NULL;
-			gb->SetWritingFileDirectory(NULL);
-			char* r = reply;
-			if(platform->Emulating() == marlin)
-				r = "Done saving file.";
-			HandleReply(false, gb == serialGCode , r, 'M', 560, false);
-			return;
-		}
-	} else
-		eofStringCounter = 0;
+			eofStringCounter++;
+			if(eofStringCounter >= eofStringLength)
+			{
+				fileBeingWritten->Write(data, i + 1);
+				fileBeingWritten->Close();
+				fileBeingWritten = NULL;
+				gb->SetWritingFileDirectory(NULL);
+				char* r = reply;
+				if(platform->Emulating() == marlin)
+					r = "Done saving file.";
+				HandleReply(false, gb == serialGCode , r, 'M', 560, false);
+				return i + 1;
+			}
+		} else
+			eofStringCounter = 0;
+	}
+	fileBeingWritten->Write(data, length);
+	return length;
 }
 
 void GCodes::WriteGCodeToFile(GCodeBuffer *gb)
@@ -1036,10 +1268,296 @@ void GCodes::WriteGCodeToFile(GCodeBuffer *gb)
 void GCodes::QueueFileToPrint(const char* fileName)
 {
   if(fileToPrint != NULL)
+  {
+    if(fileToPrint == binaryFile)
+      binaryFile = NULL;
     fileToPrint->Close();
-  fileToPrint = platform->GetFileStore(platform->GetGCodeDir(), fileName, false);
+  }
+  fileToPrint = platform->GetFileStore(platform->GetGCodeDir(), fileName, false, printFile);
   if(fileToPrint == NULL)
+  {
 	platform->Message(BOTH_ERROR_MESSAGE, "GCode file not found\n");
+	return;
+  }
+  strncpy(queuedFileName, fileName, FILE_INFO_NAME_LENGTH);
+  queuedFileName[FILE_INFO_NAME_LENGTH - 1] = 0;
+
+  // Is it a binary G Code file?
+
+  const char* data;
+  if(fileToPrint->ReadBlock(data) < BGC_HEADER_LENGTH || strncmp(data, BGC_MAGIC, strlen(BGC_MAGIC)))
+	  return;
+  if(data[3] != BGC_VERSION || binaryFile != NULL)
+  {
+	  platform->Message(BOTH_ERROR_MESSAGE, binaryFile != NULL ? "A binary GCode file is already being printed\n" :
+			  "Unsupported binary GCode file version\n");
+	  fileToPrint->Close();
+	  fileToPrint = NULL;
+	  return;
+  }
+  binaryChecksums = (data[4] & BGC_CHECKSUMS) != 0;
+  fileToPrint->Consume(BGC_HEADER_LENGTH);
+  for(int8_t field = 0; field < BGC_FIELDS; field++)
+	  binaryPosition[field] = 0;
+  binaryInGCode = false;
+  binaryStaged = 0;
+  binaryFile = fileToPrint;
+}
+
+// While a text file is printed a checkpoint is written every CHECKPOINT_INTERVAL seconds, if a
+// move from it has finished since the last.  It says where the last finished move left the
+// file and the machine, so M916 can carry on from there after a power cut or another reset.
+// The file is made, and its one sector allocated, when the print starts; after that each
+// checkpoint is written over the same sector, which is one card write and nothing else.
+// Only the main file is checkpointed, not macros, so the Push/Pop stack is always empty.
+// That one write relies on FatFs sending a whole sector at a sector boundary straight to the card
+// (see FileStore::Overwrite()), so the record must be exactly one sector.  Because the file's
+// length doesn't change, the Flush() here is the only time its directory entry needs writing.
+
+void GCodes::StartCheckpoints()
+{
+  static_assert(CHECKPOINT_LENGTH == SECTOR_LENGTH, "A checkpoint must be exactly one card sector");
+  static_assert(sizeof(CheckpointRecord) <= CHECKPOINT_LENGTH, "The checkpoint record must fit in its sector");
+
+  if(checkpointFile != NULL)
+	  return;
+  checkpointFile = platform->GetFileStore(platform->GetSysDir(), CHECKPOINT_FILE, true, generalFile);
+  if(checkpointFile == NULL)
+  {
+	  platform->Message(BOTH_ERROR_MESSAGE, "Can't make the checkpoint file; this print can't be resumed\n");
+	  return;
+  }
+  PrintPosition p;
+  checkpointMoves = reprap.GetMove()->CompletedPrintPosition(p);
+  checkpointTime = platform->Time();
+
+  // Whatever is in the sector goes in the file: nothing for a new print, or the
+  // checkpoint being resumed from, so the file is never without it.
+
+  if(checkpointFile->Overwrite(0, (const byte*)checkpointSector, CHECKPOINT_LENGTH))
+	  checkpointFile->Flush();
+}
+
+void GCodes::WriteCheckpoint()
+{
+  if(!Checkpointing() || platform->Time() - checkpointTime < CHECKPOINT_INTERVAL)
+	  return;
+
+  CheckpointRecord record;
+  memset(&record, 0, sizeof(record));	// So the padding is the same for the checksum
+  uint32_t moves = reprap.GetMove()->CompletedPrintPosition(record.position);
+  if(moves == checkpointMoves || record.position.filePosition < 0)
+	  return;
+  checkpointMoves = moves;
+  checkpointTime = platform->Time();
+  checkpointSequence++;
+
+  record.magic = CHECKPOINT_MAGIC;
+  record.sequence = checkpointSequence;
+  strncpy(record.fileName, printingFileName, FILE_INFO_NAME_LENGTH);
+  record.fileName[FILE_INFO_NAME_LENGTH - 1] = 0;
+  Tool* tool = reprap.GetCurrentTool();
+  record.toolNumber = (tool == NULL) ? -1 : tool->Number();
+  Heat* heat = reprap.GetHeat();
+  for(int8_t heater = 0; heater < HEATERS; heater++)
+  {
+	  record.activeTemperatures[heater] = heat->GetActiveTemperature(heater);
+	  record.standbyTemperatures[heater] = heat->GetStandbyTemperature(heater);
+	  record.heaterOn[heater] = !heat->SwitchedOff(heater);
+  }
+  record.drivesRelative = drivesRelative;
+  record.axesRelative = axesRelative;
+  record.checksum = CheckpointChecksum(record);
+
+  memset(checkpointSector, 0, CHECKPOINT_LENGTH);
+  memcpy(checkpointSector, &record, sizeof(record));
+  checkpointFile->Overwrite(0, (const byte*)checkpointSector, CHECKPOINT_LENGTH);
+}
+
+// The print has finished, so there is nothing to resume.
+
+void GCodes::StopCheckpoints()
+{
+  if(checkpointFile == NULL)
+	  return;
+  memset(checkpointSector, 0, CHECKPOINT_LENGTH);
+  checkpointFile->Overwrite(0, (const byte*)checkpointSector, CHECKPOINT_LENGTH);
+  checkpointFile->Close();
+  checkpointFile = NULL;
+}
+
+uint32_t GCodes::CheckpointChecksum(const CheckpointRecord& r) const
+{
+  const uint8_t* b = (const uint8_t*)&r;
+  int length = (const uint8_t*)&r.checksum - b;
+  uint32_t sum = 5381;
+  for(int i = 0; i < length; i++)
+	  sum = sum*33 + b[i];
+  return sum;
+}
+
+// M916: carry on with the print the checkpoint was written for, from just after the last G
+// Code whose move had finished.  The heaters, the tool and the modes are put back as they
+// were, and the file is started from that place rather than being read from the beginning.
+// Axes that haven't been homed since the reset are taken to be where the checkpoint left
+// them, which they usually still are after a power cut.  Any that have been homed (X and Y,
+// say, but not Z, which would hit the print) are moved back there once the heaters are hot.
+// The checkpoint is read into checkpointSector, which isn't needed until the print restarts.
+
+bool GCodes::ResumeFromCheckpoint(char* reply, bool& error)
+{
+	const CheckpointRecord* r = (const CheckpointRecord*)checkpointSector;
+
+	switch(resumeSequence)
+	{
+	case 0: // Read the checkpoint and put everything back but the head
+	{
+		if(fileBeingPrinted != NULL || checkpointFile != NULL)
+		{
+			snprintf(reply, STRING_LENGTH, "Can't resume from the checkpoint while a print is under way");
+			error = true;
+			return true;
+		}
+		if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+			return false;
+
+		memset(checkpointSector, 0, CHECKPOINT_LENGTH);
+		FileStore* f = platform->GetFileStore(platform->GetSysDir(), CHECKPOINT_FILE, false, generalFile);
+		if(f != NULL)
+		{
+			char* b = (char*)checkpointSector;
+			for(unsigned int i = 0; i < sizeof(CheckpointRecord); i++)
+			{
+				if(!f->Read(b[i]))
+					break;
+			}
+			f->Close();
+		}
+		if(r->magic != CHECKPOINT_MAGIC || r->checksum != CheckpointChecksum(*r) || r->position.filePosition < 0)
+		{
+			snprintf(reply, STRING_LENGTH, "There is no print to resume - the checkpoint is missing, finished with or damaged");
+			error = true;
+			return true;
+		}
+
+		QueueFileToPrint(r->fileName);
+		if(fileToPrint == NULL || fileToPrint == binaryFile)
+		{
+			snprintf(reply, STRING_LENGTH, "Can't resume %s", r->fileName);
+			error = true;
+			return true;
+		}
+		fileToPrint->Seek(r->position.filePosition);
+
+		drivesRelative = r->drivesRelative;
+		axesRelative = r->axesRelative;
+		for(int8_t drive = AXES; drive < DRIVES; drive++)
+			lastPos[drive - AXES] = r->position.coordinates[drive];
+
+		// Tools are selected without their macros, which might move the head.
+
+		Heat* heat = reprap.GetHeat();
+		for(int8_t heater = 0; heater < HEATERS; heater++)
+		{
+			if(r->heaterOn[heater])
+			{
+				heat->SetActiveTemperature(heater, r->activeTemperatures[heater]);
+				heat->SetStandbyTemperature(heater, r->standbyTemperatures[heater]);
+			}
+		}
+		Tool* tool = reprap.GetTool(r->toolNumber);
+		if(tool != NULL)
+		{
+			float standby[HEATERS], active[HEATERS];
+			for(int8_t h = 0; h < tool->HeaterCount(); h++)
+			{
+				standby[h] = r->standbyTemperatures[tool->Heater(h)];
+				active[h] = r->activeTemperatures[tool->Heater(h)];
+			}
+			tool->SetTemperatureVariables(standby, active);
+		}
+		reprap.SelectTool(r->toolNumber);
+		for(int8_t heater = 0; heater < HEATERS; heater++)
+		{
+			if(!r->heaterOn[heater])
+				continue;
+			bool toolHeater = false;
+			for(int8_t h = 0; tool != NULL && h < tool->HeaterCount(); h++)
+			{
+				if(tool->Heater(h) == heater)
+					toolHeater = true;
+			}
+			if(toolHeater)
+				continue;
+			if(heater == HOT_BED)
+				heat->Activate(heater);
+			else
+				heat->Standby(heater);
+		}
+
+		// As G92 for the axes that haven't been homed
+
+		for(int8_t drive = 0; drive < DRIVES; drive++)
+		{
+			if(drive >= AXES)
+				moveBuffer[drive] = 0.0;
+			else if(!axisHasBeenHomed[drive])
+			{
+				moveBuffer[drive] = r->position.coordinates[drive];
+				axisHasBeenHomed[drive] = true;
+			}
+		}
+		reprap.GetMove()->Transform(moveBuffer);
+		reprap.GetMove()->SetLiveCoordinates(moveBuffer);
+		reprap.GetMove()->SetPositions(moveBuffer);
+		reprap.GetMove()->SetFeedrate(platform->InstantDv(platform->SlowestDrive()));
+		resumeSequence++;
+		return false;
+	}
+
+	case 1: // Wait for the heaters
+	{
+		bool heaters[HEATERS];
+		for(int8_t heater = 0; heater < HEATERS; heater++)
+			heaters[heater] = r->heaterOn[heater];
+		if(!reprap.GetHeat()->AllHeatersAtSetTemperatures(heaters))
+			return false;
+		resumeSequence++;
+		return false;
+	}
+
+	case 2: // Put the head back, and leave the print's feedrate set, as Pop() does
+		if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+			return false;
+		for(int8_t drive = 0; drive <= DRIVES; drive++)
+		{
+			if(drive < AXES || drive == DRIVES)
+				moveBuffer[drive] = r->position.coordinates[drive];
+			else
+				moveBuffer[drive] = 0.0;
+		}
+		checkEndStops = false;
+		moveAvailable = true;
+		resumeSequence++;
+		return false;
+
+	case 3: // Print from where the checkpoint was
+		if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+			return false;
+		strcpy(printingFileName, queuedFileName);
+		fileBeingPrinted = fileToPrint;
+		fileToPrint = NULL;
+		StartCheckpoints();
+		checkpointSequence = r->sequence;
+		snprintf(reply, STRING_LENGTH, "Resuming %s from byte %ld", r->fileName, r->position.filePosition);
+		break;
+
+	default:
+		break;
+	}
+
+	resumeSequence = 0;
+	return true;
 }
 
 void GCodes::DeleteFile(const char* fileName)
@@ -1057,7 +1575,7 @@ bool GCodes::SendConfigToLine()
 {
 	if(configFile == NULL)
 	{
-		configFile = platform->GetFileStore(platform->GetSysDir(), platform->GetConfigFile(), false);
+		configFile = platform->GetFileStore(platform->GetSysDir(), platform->GetConfigFile(), false, generalFile);
 		if(configFile == NULL)
 		{
 			platform->Message(HOST_MESSAGE, "Configuration file not found\n");
@@ -1216,10 +1734,8 @@ void GCodes::AddNewTool(GCodeBuffer *gb, char* reply)
 	if(seen)
 	{
 		if(tool == NULL)
-		{
-			tool = new Tool(toolNumber, drives, dCount, heaters, hCount);
-			reprap.AddTool(tool);
-		} else
+			reprap.AddTool(toolNumber, drives, dCount, heaters, hCount);
+		else
 			tool->Init(drives, dCount, heaters, hCount);
 	} else
 		reprap.PrintTool(toolNumber, reply);
@@ -1517,6 +2033,7 @@ bool GCodes::HandleMcode(int code, GCodeBuffer *gb)
 		{
 			fileToPrint = fileBeingPrinted;
 			fileBeingPrinted = NULL;
+			strcpy(queuedFileName, printingFileName);
 		}
 		if(!DisableDrives())
 			result = false;
@@ -1530,12 +2047,29 @@ bool GCodes::HandleMcode(int code, GCodeBuffer *gb)
 		result = DisableDrives();
 		break;
 
-	case 20:  // Deprecated...
+	case 20:  // List files: Snnn from the nnn-th, Pnnn this many, D1 newest first, V1 with sizes and dates
+	{
+		MassStorage* massStorage = platform->GetMassStorage();
+		int first = gb->Seen('S') ? gb->GetIValue() : 0;
+		int count = gb->Seen('P') ? gb->GetIValue() : DIRECTORY_INDEX_LENGTH;
+		FileSort sort = (gb->Seen('D') && gb->GetIValue() > 0) ? sortByDate : sortByName;
+		bool details = gb->Seen('V') && gb->GetIValue() > 0;
+		int next;
+		char* fileList = massStorage->FileList(platform->GetGCodeDir(), gb == serialGCode, sort, first, count, details, next);
 		if(platform->Emulating() == me || platform->Emulating() == reprapFirmware)
-			snprintf(reply, STRING_LENGTH, "GCode files:\n%s", platform->GetMassStorage()->FileList(platform->GetGCodeDir(), gb == serialGCode));
+		{
+			snprintf(reply, STRING_LENGTH, "GCode files:\n%s", fileList);
+			int total = massStorage->FileCount(platform->GetGCodeDir());
+			if(next < total && next > first)
+			{
+				int len = strlen(reply);
+				snprintf(&reply[len], STRING_LENGTH - len, "\n%d of %d files; M20 S%d for more", next - first, total, next);
+			}
+		}
 		else
-			snprintf(reply, STRING_LENGTH, "%s", platform->GetMassStorage()->FileList(platform->GetGCodeDir(), gb == serialGCode));
-		break;
+			snprintf(reply, STRING_LENGTH, "%s", fileList);
+	}
+	break;
 
 	case 21: // Initialise SD - ignore
 		break;
@@ -1549,11 +2083,20 @@ bool GCodes::HandleMcode(int code, GCodeBuffer *gb)
 	case 24: // Print/resume-printing the selected file
 		if(fileBeingPrinted != NULL)
 			break;
+		if(fileToPrint != NULL)
+			strcpy(printingFileName, queuedFileName);
 		fileBeingPrinted = fileToPrint;
 		fileToPrint = NULL;
+		if(fileBeingPrinted != NULL && fileBeingPrinted != binaryFile && checkpointFile == NULL)
+		{
+			memset(checkpointSector, 0, CHECKPOINT_LENGTH);	// Nothing to resume from until the first checkpoint
+			StartCheckpoints();
+		}
 		break;
 
 	case 25: // Pause the print
+		if(fileBeingPrinted != NULL)
+			strcpy(queuedFileName, printingFileName);
 		fileToPrint = fileBeingPrinted;
 		fileBeingPrinted = NULL;
 		break;
@@ -1581,6 +2124,61 @@ bool GCodes::HandleMcode(int code, GCodeBuffer *gb)
 		DeleteFile(gb->GetUnprecedentedString());
 		break;
 
+	case 36:	// Report what the slicer said about a file
+	{
+		const char* str = gb->GetUnprecedentedString();
+		GCodeFileInfo info;
+		if(platform->GetMassStorage()->GetGCodeFileInfo(platform->GetGCodeDir(), str, info))
+			snprintf(reply, STRING_LENGTH, "%s: %lu bytes, layer height %.2fmm, filament %.1fmm, print time %ds, generated by %s",
+					str, info.size, info.layerHeight, info.filamentUsed, (int)info.printTime, info.generatedBy[0] ? info.generatedBy : "unknown");
+		else
+			snprintf(reply, STRING_LENGTH, "Can't open file: %s", str);
+	}
+	break;
+
+	case 37:	// Simulation: S1 to start, S0 to finish when the moves are done; report either way
+		if(gb->Seen('S'))
+		{
+			if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+			{
+				result = false;
+				break;
+			}
+			if(gb->GetIValue() > 0)
+			{
+				for(int8_t drive = 0; drive <= DRIVES; drive++)
+					simulationPosition[drive] = moveBuffer[drive];
+				for(int8_t drive = 0; drive < DRIVES - AXES; drive++)
+					simulationLastPos[drive] = lastPos[drive];
+				for(int8_t axis = 0; axis < AXES; axis++)
+					simulationHomed[axis] = axisHasBeenHomed[axis];
+				reprap.GetMove()->StartSimulation();
+				snprintf(reply, STRING_LENGTH, "Simulating; the motors will not move");
+				break;
+			}
+			if(platform->Simulating())
+			{
+				// Report before the step count goes, then put everything back to where
+				// the motors really are; the simulated homing doesn't count.
+
+				reprap.GetMove()->SimulationReport(reply);
+				platform->SetSimulating(false);
+				for(int8_t drive = 0; drive <= DRIVES; drive++)
+					moveBuffer[drive] = simulationPosition[drive];
+				for(int8_t drive = 0; drive < DRIVES - AXES; drive++)
+					lastPos[drive] = simulationLastPos[drive];
+				for(int8_t axis = 0; axis < AXES; axis++)
+					axisHasBeenHomed[axis] = simulationHomed[axis];
+				reprap.GetMove()->Transform(moveBuffer);
+				reprap.GetMove()->SetLiveCoordinates(moveBuffer);
+				reprap.GetMove()->SetPositions(moveBuffer);
+				reprap.GetMove()->SetFeedrate(platform->InstantDv(platform->SlowestDrive()));
+				break;
+			}
+		}
+		reprap.GetMove()->SimulationReport(reply);
+		break;
+
 	case 82:
 		for(int8_t extruder = AXES; extruder < DRIVES; extruder++)
 			lastPos[extruder - AXES] = 0.0;
@@ -2042,6 +2640,30 @@ bool GCodes::HandleMcode(int code, GCodeBuffer *gb)
 	}
 	break;
 
+	case 303: // PID autotune: H heater, S temperature (0 to stop), P power from 0 to 1, C oscillations; without S, report
+		if(gb->Seen('S'))
+		{
+			float target = gb->GetFValue();
+			if(target <= 0.0)
+			{
+				reprap.GetHeat()->StopAutoTune();
+				snprintf(reply, STRING_LENGTH, "Autotune stopped");
+				break;
+			}
+			int heater = gb->Seen('H') ? gb->GetIValue() : 1;
+			float power = gb->Seen('P') ? gb->GetFValue() : 1.0;
+			int cycles = gb->Seen('C') ? gb->GetIValue() : TUNING_CYCLES;
+			if(reprap.GetHeat()->StartAutoTune(heater, target, power, cycles))
+				snprintf(reply, STRING_LENGTH, "Autotuning heater %d at %.1fC; M303 reports progress", heater, target);
+			else
+			{
+				snprintf(reply, STRING_LENGTH, "Can't autotune heater %d", heater);
+				error = true;
+			}
+		} else
+			reprap.GetHeat()->AutoTuneReport(reply);
+		break;
+
 	case 302: // Allow cold extrudes
 		reprap.AllowColdExtrude();
 		break;
@@ -2072,10 +2694,29 @@ bool GCodes::HandleMcode(int code, GCodeBuffer *gb)
 			seen = true;
 		}
 
-		if (!seen)
+		if (gb->Seen('C'))
+		{
+			platform->SetThermistorC(heater, gb->GetFValue());
+			seen = true;
+		}
+
+		if (gb->Seen('S')) // S0 thermistor, S1 PT100 (T is then its resistance at 0 C)
+		{
+			platform->SetTemperatureSensor(heater, (gb->GetIValue() == 1) ? pt100Sensor : thermistorSensor);
+			seen = true;
+		}
+
+		if (seen)
+			platform->BuildTemperatureTable(heater);
+		else
 		{
-			snprintf(reply, STRING_LENGTH, "Heater %d thermistor - Beta: %.1f, series R: %.1f, R at 25 C: %.1f",
-					heater, platform->ThermistorBeta(heater), platform->ThermistorSeriesR(heater), platform->ThermistorRAt25(heater) );
+			if(platform->GetTemperatureSensor(heater) == pt100Sensor)
+				snprintf(reply, STRING_LENGTH, "Heater %d PT100 - series R: %.1f, R at 0 C: %.1f",
+						heater, platform->ThermistorSeriesR(heater), platform->ThermistorRAt25(heater) );
+			else
+				snprintf(reply, STRING_LENGTH, "Heater %d thermistor - Beta: %.1f, series R: %.1f, R at 25 C: %.1f, C: %.3e",
+						heater, platform->ThermistorBeta(heater), platform->ThermistorSeriesR(heater), platform->ThermistorRAt25(heater),
+						platform->ThermistorC(heater) );
 		}
 	}
 
@@ -2254,6 +2895,86 @@ bool GCodes::HandleMcode(int code, GCodeBuffer *gb)
 		AddNewTool(gb, reply);
 		break;
 
+	case 665: // Set/report delta geometry: L diagonal rod, R tower radius, H homed height, S segments per second
+	{
+		Kinematics* kinematics = reprap.GetMove()->GetKinematics();
+		bool isDelta = kinematics->Type() == deltaKinematics;
+		float rod = kinematics->DiagonalRod();
+		float radius = kinematics->Radius();
+		float height = kinematics->HomedHeight();
+		bool seen = false;
+		if(gb->Seen('S'))
+		{
+			if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+			{
+				result = false;
+				break;
+			}
+			float s = gb->GetFValue();
+			if(s > 0.0)
+				kinematics->SetSegmentsPerSecond(s);
+		}
+		if(gb->Seen('L'))
+		{
+			rod = gb->GetFValue();
+			seen = true;
+		}
+		if(gb->Seen('R'))
+		{
+			radius = gb->GetFValue();
+			seen = true;
+		}
+		if(gb->Seen('H'))
+		{
+			height = gb->GetFValue();
+			seen = true;
+		}
+		if(!seen)
+		{
+			kinematics->Print(reply);
+			break;
+		}
+		if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+		{
+			result = false;
+			break;
+		}
+		if(rod <= radius || radius <= 0.0)
+		{
+			snprintf(reply, STRING_LENGTH, "Delta diagonal rod must be longer than the radius, which must be positive");
+			error = true;
+			break;
+		}
+		kinematics->SetDelta(rod, radius, height);
+		reprap.GetMove()->KinematicsChanged();
+		if(!isDelta)
+		{
+			for(int8_t axis = 0; axis < AXES; axis++)
+				axisHasBeenHomed[axis] = false;
+		}
+	}
+		break;
+
+	case 667: // Set/report the kinematics: S0 Cartesian, S1 CoreXY (M665 sets a delta)
+		if(gb->Seen('S'))
+		{
+			if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+			{
+				result = false;
+				break;
+			}
+			Kinematics* kinematics = reprap.GetMove()->GetKinematics();
+			if(gb->GetIValue() == 1)
+				kinematics->SetCoreXY();
+			else
+				kinematics->SetCartesian();
+			reprap.GetMove()->KinematicsChanged();
+			for(int8_t axis = 0; axis < AXES; axis++)
+				axisHasBeenHomed[axis] = false;
+		} else
+			reprap.GetMove()->GetKinematics()->Print(reply);
+		break;
+
 	case 566: // Set/print minimum feedrates
 		seen = false;
 		for(int8_t axis = 0; axis < AXES; axis++)
@@ -2362,11 +3083,62 @@ bool GCodes::HandleMcode(int code, GCodeBuffer *gb)
 			snprintf(reply, STRING_LENGTH, "Extrusion ancillary PWM: %.3f.", platform->GetExtrusionAncilliaryPWM());
 		break;
 
+	case 572: // Set/report tool P's pressure advance: S seconds of extruder velocity to add as extra extrusion
+		if(gb->Seen('P'))
+		{
+			int tNumber = gb->GetIValue();
+			Tool* tool = reprap.GetTool(tNumber);
+			if(tool == NULL)
+			{
+				snprintf(reply, STRING_LENGTH, "Pressure advance: no tool %d.", tNumber);
+				error = true;
+			} else if(gb->Seen('S'))
+			{
+				if(!AllMovesAreFinishedAndMoveBufferIsLoaded())
+				{
+					result = false;
+					break;
+				}
+				float k = gb->GetFValue();
+				tool->SetPressureAdvance((k > 0.0) ? k : 0.0);
+			} else
+				snprintf(reply, STRING_LENGTH, "Tool %d pressure advance: %.3f seconds.", tNumber, tool->PressureAdvance());
+		}
+		break;
+
 	case 573:
 		if(gb->Seen('P'))
 			snprintf(reply, STRING_LENGTH, "Average heater PWM: %.3f.", reprap.GetHeat()->GetAveragePWM(gb->GetIValue()));
 		break;
 
+	case 580: // Set/print move merging: D how far merged moves may stray from the path, S the shortest move kept on its own
+	{
+		float tolerance = reprap.GetMove()->SegmentMergeTolerance();
+		float minimumLength = reprap.GetMove()->MinimumSegmentLength();
+		seen = false;
+		if(gb->Seen('D'))
+		{
+			tolerance = gb->GetFValue()*distanceScale;
+			seen = true;
+		}
+		if(gb->Seen('S'))
+		{
+			minimumLength = gb->GetFValue()*distanceScale;
+			seen = true;
+		}
+		if(seen)
+		{
+			if(!AllMovesAreFinishedAndMoveBufferIsLoaded()) // Nothing must be held for merging when this changes
+			{
+				result = false;
+				break;
+			}
+			reprap.GetMove()->SetSegmentMerging(tolerance, minimumLength);
+		} else
+			snprintf(reply, STRING_LENGTH, "Moves merged within %.3fmm of the path; moves shorter than %.3fmm merged regardless", tolerance, minimumLength);
+	}
+	break;
+
 	case 906: // Set/Report Motor currents
 	{
 		seen = false;
@@ -2413,6 +3185,10 @@ bool GCodes::HandleMcode(int code, GCodeBuffer *gb)
 	}
 		break;
 
+	case 916: // Resume the print the checkpoint file was written for
+		result = ResumeFromCheckpoint(reply, error);
+		break;
+
 	case 998:
 		if(gb->Seen('P'))
 		{
@@ -2642,6 +3418,8 @@ GCodeBuffer::GCodeBuffer(Platform* p, const char* id)
   platform = p;
   identity = id;
   writingFileDirectory = NULL;  // Has to be done here as Init() is called every line.
+  gcodeBuffer[0] = 0;
+  IndexLetters();
 }
 
 void GCodeBuffer::Init()
@@ -2660,6 +3438,13 @@ int GCodeBuffer::CheckSum()
 	return cs;
 }
 
+// Record where each key letter first appears, so Seen() doesn't have to search for it
+
+void GCodeBuffer::IndexLetters()
+{
+	IndexGCodeLetters(gcodeBuffer, letterIndex);
+}
+
 // Add a byte to the code being assembled.  If false is returned, the code is
 // not yet complete.  If true, it is complete and ready to be acted upon.
 
@@ -2682,6 +3467,8 @@ bool GCodeBuffer::Put(char c)
       platform->Message(HOST_MESSAGE, "\n"); 
     }
 
+    IndexLetters();
+
     // Deal with line numbers and checksums
 
     if(Seen('*'))
@@ -2693,6 +3480,7 @@ bool GCodeBuffer::Put(char c)
     	{
     		snprintf(gcodeBuffer, GCODE_LENGTH, "M998 P%d", GetIValue());
     		Init();
+    		IndexLetters();
     		result = true;
     		return result;
     	}
@@ -2709,6 +3497,7 @@ bool GCodeBuffer::Put(char c)
     		// No...
     		gcodeBuffer[0] = 0;
     		Init();
+    		IndexLetters();
     		result = true;
     		return result;
     	}
@@ -2724,6 +3513,7 @@ bool GCodeBuffer::Put(char c)
     	}
     	gcodeBuffer[gp2] = 0;
     	Init();
+    	IndexLetters();
     }
 
     result = true;
@@ -2743,11 +3533,39 @@ bool GCodeBuffer::Put(char c)
   return result;
 }   
 
+// Add characters from a block of length characters until a code is complete (true
+// is returned) or the block is used up (false).  used is set to the number of
+// characters taken, so the caller can tell the source how many it has consumed.
+
+bool GCodeBuffer::Put(const char* data, int length, int& used)
+{
+  for(used = 0; used < length;)
+  {
+	  if(Put(data[used++]))
+		  return true;
+  }
+  return false;
+}
+
 // Is 'c' in the G Code string?
 // Leave the pointer there for a subsequent read.
 
 bool GCodeBuffer::Seen(char c)
 {
+  if(c >= 'A' && c <= 'Z')
+  {
+	  uint8_t i = letterIndex[c - 'A'];
+	  if(i == NO_LETTER)
+	  {
+		  readPointer = -1;
+		  return false;
+	  }
+	  readPointer = i;
+	  return true;
+  }
+
+  // Not a key letter, so search for it
+
   readPointer = 0;
   while(gcodeBuffer[readPointer])
   {
@@ -2769,7 +3587,7 @@ float GCodeBuffer::GetFValue()
      readPointer = -1;
      return 0.0;
   }
-  float result = (float)strtod(&gcodeBuffer[readPointer + 1], 0);
+  float result = ReadGCodeFloat(&gcodeBuffer[readPointer + 1]);
   readPointer = -1;
   return result; 
 }
@@ -2798,7 +3616,7 @@ const void GCodeBuffer::GetFloatArray(float a[], int& returnedLength)
 			returnedLength = 0;
 			return;
 		}
-		a[length] = (float)strtod(&gcodeBuffer[readPointer + 1], 0);
+		a[length] = ReadGCodeFloat(&gcodeBuffer[readPointer + 1]);
 		length++;
 		readPointer++;
 		while(gcodeBuffer[readPointer] && (gcodeBuffer[readPointer] != ' ') && (gcodeBuffer[readPointer] != LIST_SEPARATOR))
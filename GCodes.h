@@ -37,6 +37,7 @@ class GCodeBuffer
     GCodeBuffer(Platform* p, const char* id);
     void Init(); 										// Set it up
     bool Put(char c);									// Add a character to the end
+    bool Put(const char* data, int length, int& used);	// Add characters from a block until a G Code is complete
     bool Seen(char c);									// Is a character present?
     float GetFValue();									// Get a float after a key letter
     int GetIValue();									// Get an integer after a key letter
@@ -53,8 +54,10 @@ class GCodeBuffer
     
   private:
     int CheckSum();										// Compute the checksum (if any) at the end of the G Code
+    void IndexLetters();								// Record where each key letter first appears
     Platform* platform;									// Pointer to the RepRap's controlling class
     char gcodeBuffer[GCODE_LENGTH];						// The G Code
+    uint8_t letterIndex[GCODE_LETTERS];					// Where each of A to Z first appears in gcodeBuffer, or NO_LETTER
     const char* identity;								// Where we are from (web, file, serial line etc)
     int gcodePointer;									// Index in the buffer
     int readPointer;									// Where in the buffer to read next
@@ -65,6 +68,38 @@ class GCodeBuffer
 
 //****************************************************************************************************
 
+// Where a move from the file being printed leaves the print: just after the G Code that made
+// it, at its end point.  Move carries one with each move, so that when the move is done it is
+// known where the print can be restarted from.
+
+class PrintPosition
+{
+public:
+  long filePosition;										// Bytes into the file after the G Code; -1 if the move isn't from it
+  float coordinates[DRIVES + 1];							// X, Y and Z, the absolute extruder positions, and the feedrate (mm/s)
+};
+
+// A checkpoint of a print.  It is written over the start of the file CHECKPOINT_FILE, which
+// is made when the print starts, so that writing one is a single sector write.
+
+class CheckpointRecord
+{
+public:
+  uint32_t magic;											// CHECKPOINT_MAGIC if the print can be resumed from here
+  uint32_t sequence;										// Counts the checkpoints of the print
+  char fileName[FILE_INFO_NAME_LENGTH];						// The file being printed, in the G Code directory
+  PrintPosition position;									// Where the last finished move from it left it
+  int toolNumber;											// The selected tool, or -1
+  float activeTemperatures[HEATERS];
+  float standbyTemperatures[HEATERS];
+  bool heaterOn[HEATERS];									// Which heaters weren't switched off
+  bool drivesRelative;
+  bool axesRelative;
+  uint32_t checksum;										// Of all that comes before it
+};
+
+//****************************************************************************************************
+
 // The GCode interpreter
 
 class GCodes
@@ -76,7 +111,7 @@ class GCodes
     void Init();														// Set it up
     void Exit();														// Shut it down
     bool RunConfigurationGCodes();										// Run the configuration G Code file on reboot
-    bool ReadMove(float* m, bool& ce);									// Called by the Move class to get a movement set by the last G Code
+    bool ReadMove(float* m, bool& ce, PrintPosition& p);				// Called by the Move class to get a movement set by the last G Code, and where it leaves the print
     void QueueFileToPrint(const char* fileName);						// Open a file of G Codes to run
     void DeleteFile(const char* fileName);								// Does what it says
     bool GetProbeCoordinates(int count, float& x, float& y, float& z);	// Get pre-recorded probe coordinates
@@ -89,9 +124,19 @@ class GCodes
   private:
   
     void DoFilePrint(GCodeBuffer* gb);									// Get G Codes from a file and print them
+    void DoBinaryFilePrint(GCodeBuffer* gb);							// Get records from a binary G Code file and print them
+    bool DoBinaryRecord(const uint8_t* r);								// Act on a binary record; false if it must wait
+    bool DoBinaryMove(const uint8_t* r);								// Load moveBuffer straight from a binary move record
+    void AbandonBinaryFile(const char* why);							// Report a bad binary file and stop printing it
     bool AllMovesAreFinishedAndMoveBufferIsLoaded();					// Wait for move queue to exhaust and the current position is loaded
     bool DoCannedCycleMove(bool ce);									// Do a move from an internally programmed canned cycle
     bool DoFileMacro(const char* fileName);						// Run a GCode macro in a file
+    bool Checkpointing() const;											// Is a text file being printed with checkpoints (not a macro)?
+    void StartCheckpoints();											// Make the checkpoint file for the print starting
+    void WriteCheckpoint();												// Write a checkpoint if one is due and there is something new
+    void StopCheckpoints();												// Mark the checkpoint as finished with and close it
+    uint32_t CheckpointChecksum(const CheckpointRecord& r) const;		// Of everything in a checkpoint before the checksum
+    bool ResumeFromCheckpoint(char* reply, bool& error);				// M916; call repeatedly till it returns true
     bool FileCannedCyclesReturn();										// End a macro
     bool ActOnCode(GCodeBuffer* gb);									// Do a G, M or T Code
     bool HandleGcode(int code, GCodeBuffer* gb);						// Do a G Code
@@ -123,7 +168,7 @@ class GCodes
     		const char* fileName, GCodeBuffer *gb);
     void WriteGCodeToFile(GCodeBuffer *gb);								// Write this GCode into a file
     bool SendConfigToLine();											// Deal with M503
-    void WriteHTMLToFile(char b, GCodeBuffer *gb);						// Save an HTML file (usually to upload a new web interface)
+    int WriteHTMLToFile(const char* data, int length, GCodeBuffer *gb);	// Save an HTML file (usually to upload a new web interface)
     bool OffsetAxes(GCodeBuffer *gb);									// Set offsets - deprecated, use G10
     int8_t Heater(int8_t head) const;									// Legacy G codes start heaters at 0, but we use 0 for the bed.  This sorts that out.
     void AddNewTool(GCodeBuffer *gb, char* reply);						// Create a new tool definition
@@ -135,6 +180,10 @@ class GCodes
     Webserver* webserver;						// The webserver class
     float dwellTime;							// How long a pause for a dwell (seconds)?
     bool dwellWaiting;							// We are in a dwell
+    GCodeBuffer webGCodeBuffer;					// The G Code buffers live here rather than on the heap...
+    GCodeBuffer fileGCodeBuffer;				// ...
+    GCodeBuffer serialGCodeBuffer;				// ...
+    GCodeBuffer fileMacroGCodeBuffer;			// ...and the pointers below point at them
     GCodeBuffer* webGCode;						// The sources...
     GCodeBuffer* fileGCode;						// ...
     GCodeBuffer* serialGCode;					// ...
@@ -158,6 +207,12 @@ class GCodes
     float distanceScale;						// MM or inches
     FileStore* fileBeingPrinted;				// The file being printed at the moment (if any)
     FileStore* fileToPrint;						// A file to print in the future, or one that has been paused
+    FileStore* binaryFile;						// The binary G Code file being (or to be) printed, if any
+    bool binaryChecksums;						// Do its move records carry checksums?
+    bool binaryInGCode;							// Are we in the middle of an ASCII G Code in it?
+    int32_t binaryPosition[BGC_FIELDS];			// The last value of each field decoded from it
+    uint8_t binaryRecord[BGC_MAX_RECORD];		// Space to assemble a record split between buffer loads
+    int binaryStaged;							// How much of the record is in binaryRecord
     FileStore* fileBeingWritten;				// A file to write G Codes (or sometimes HTML) in
     FileStore* configFile;						// A file containing a macro
     float fractionOfFilePrinted;				// Only used to record the main file when a macro is being printed
@@ -177,7 +232,19 @@ class GCodes
     float longWait;								// Timer for things that happen occasionally (seconds)
     bool limitAxes;								// Don't think outside the box.
     bool axisHasBeenHomed[3];						// These record which of the axes have been homed
+    float simulationPosition[DRIVES+1];			// Where M37 S1 started, to go back to at S0...
+    float simulationLastPos[DRIVES - AXES];		// ...and the extruders...
+    bool simulationHomed[3];					// ...and which axes had really been homed
     int8_t toolChangeSequence;					// Steps through the tool change procedure
+    char queuedFileName[FILE_INFO_NAME_LENGTH];	// The name of fileToPrint...
+    char printingFileName[FILE_INFO_NAME_LENGTH]; // ...and of the file that was started
+    PrintPosition movePrintPosition;			// Where the move in moveBuffer leaves the print
+    FileStore* checkpointFile;					// Open for the whole of a print that is checkpointed
+    uint32_t checkpointSector[CHECKPOINT_LENGTH/4]; // The record padded to a whole sector, word aligned for the card
+    uint32_t checkpointSequence;				// How many checkpoints of this print have been written
+    uint32_t checkpointMoves;					// How many moves from the print had finished at the last one
+    float checkpointTime;						// When the last one was written
+    int8_t resumeSequence;						// Steps through M916
 };
 
 //*****************************************************************************************************
@@ -228,6 +295,11 @@ inline bool GCodes::HaveIncomingData() const
 	return fileBeingPrinted != NULL || webserver->GCodeAvailable() || (platform->GetLine()->Status() & byteAvailable);
 }
 
+inline bool GCodes::Checkpointing() const
+{
+	return checkpointFile != NULL && fileBeingPrinted != NULL && fileBeingPrinted != binaryFile && stackPointer == 0 && !doingFileMacro;
+}
+
 inline bool GCodes::NoHome() const
 {
    return !(homeX || homeY || homeZ || homeAxisMoveCount);
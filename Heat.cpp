@@ -24,46 +24,206 @@ Heat::Heat(Platform* p, GCodes* g)
 {
   platform = p;
   gCodes = g;
-  for(int8_t heater=0; heater < HEATERS; heater++)
-    pids[heater] = new PID(platform, heater);
   active = false;
 }
 
 void Heat::Init()
 {
+  active = false;
   for(int8_t heater=0; heater < HEATERS; heater++)
-    pids[heater]->Init();
-  lastTime = platform->Time();
-  longWait = lastTime;
+  {
+	platform->SetHeater(heater, 0.0);
+	temperatures[heater] = platform->GetTemperature(heater);
+	lastTemperatures[heater] = temperatures[heater];
+	activeTemperatures[heater] = ABS_ZERO;
+	standbyTemperatures[heater] = ABS_ZERO;
+	iStates[heater] = 0.0;
+	dStates[heater] = 0.0;
+	averagePWMs[heater] = 0.0;
+	powers[heater] = 0.0;
+	appliedPowers[heater] = 0.0;
+	heatingTimes[heater] = 0.0;
+	badTemperatureCounts[heater] = 0;
+	heaterActive[heater] = false; 		// Default to standby temperature
+	switchedOff[heater] = true;
+	temperatureFault[heater] = false;
+	heatingUp[heater] = false;
+	heatingFault[heater] = false;
+	faultTemperatures[heater] = ABS_ZERO;
+  }
+  faultsToReport = 0;
+  tuningHeater = -1;
+  tuningFinished = false;
+  shortestTick = FLT_MAX;
+  longestTick = 0.0;
+  lastTickCycles = platform->CycleCount();
+  longWait = platform->Time();
   active = true;
 }
 
+// The ADC interrupt is held off while the controllers are stopped, so none of them can be
+// part way through when the heaters are turned off.
+
 void Heat::Exit()
 {
+  platform->DisableAdcInterrupt();
+  active = false;
+  tuningHeater = -1;
   for(int8_t heater=0; heater < HEATERS; heater++)
-	 pids[heater]->SwitchOff();
+  {
+	 powers[heater] = 0.0;
+	 appliedPowers[heater] = 0.0;
+	 platform->SetHeater(heater, 0.0);
+	 heaterActive[heater] = false;
+	 switchedOff[heater] = true;
+	 heatingUp[heater] = false;
+  }
+  platform->EnableAdcInterrupt();
   platform->Message(HOST_MESSAGE, "Heat class exited.\n");
-  active = false;
 }
 
+// All the heater control is done in Tick(); this just passes on what it has found.
+// Without the A to D converter's interrupt the controllers are run from here.  The
+// PWM outputs are set here rather than in the interrupt, as analogWrite() can't be
+// interrupted by itself (the main loop uses it for the cooling fan).
+
 void Heat::Spin()
 {
   if(!active)
     return;
-    
-  float t = platform->Time();
-  if(t - lastTime < platform->HeatSampleTime())
-    return;
-  lastTime = t;
-  for(int8_t heater=0; heater < HEATERS; heater++)
-    pids[heater]->Spin();
+
+  if(!platform->AdcFreeRunning())
+	  Tick();
+  ApplyPowers();
+
+  uint32_t faults = faultsToReport;
+  while(faults)
+  {
+	  int8_t heater = __builtin_ctz(faults);
+	  faults &= faults - 1;
+	  __disable_irq();
+	  faultsToReport &= ~(1ul << heater);
+	  __enable_irq();
+	  if(heatingFault[heater])
+		  snprintf(scratchString, STRING_LENGTH, "Heating fault on heater %d, T = %.1f C; still not at temperature after %f seconds.\n",
+				  heater, faultTemperatures[heater], platform->TimeToHot());
+	  else
+		  snprintf(scratchString, STRING_LENGTH, "Temperature fault on heater %d, T = %.1f C\n", heater, faultTemperatures[heater]);
+	  platform->Message(HOST_MESSAGE, scratchString);
+	  reprap.FlagTemperatureFault(heater);
+  }
+
+  // Finish tuning when Tick() says it's done
+
+  if(tuningFinished && tuningHeater < 0)		// StopAutoTune() got there first
+	  tuningFinished = false;
+  if(tuningFinished)
+  {
+	  int8_t heater = tuningHeater;
+	  tuningHeater = -1;
+	  tuningFinished = false;
+	  switchedOff[heater] = true;
+	  if(tuningFailed || tuningCyclesDone <= 1)
+		  snprintf(scratchString, STRING_LENGTH, "Autotune of heater %d failed after %.0f seconds.\n", heater, tuningTime);
+	  else
+	  {
+		  int counted = tuningCyclesDone - 1;
+		  float period = tuningPeriods/counted;
+		  float amplitude = tuningAmplitudes/counted;
+
+		  // The relay swings the PID output (which is in [0, 255]) by 255*tuningPower
+
+		  float ku = 4.0*(0.5*255.0*tuningPower)/(PI*amplitude);
+		  float kp = 0.6*ku;
+		  float ki = kp/(0.5*period);		// Per second...
+		  float kd = kp*period/8.0;
+		  float st = platform->HeatSampleTime();
+		  platform->SetPidValues(heater, kp, ki*st, kd/st);	// ...and per sample, as M301 and SetPidValues() want them
+		  snprintf(scratchString, STRING_LENGTH, "Autotune of heater %d: period %.1fs, amplitude %.1fC; set P:%f I:%f D:%f\n",
+				  heater, period, amplitude, kp, ki*st, kd/st);
+	  }
+	  platform->Message(HOST_MESSAGE, scratchString);
+  }
+
   platform->ClassReport("Heat", longWait);
 }
 
+bool Heat::StartAutoTune(int8_t heater, float target, float power, int cycles)
+{
+  if(heater < 0 || heater >= HEATERS || tuningHeater >= 0 || temperatureFault[heater])
+	  return false;
+  tuningTarget = target;
+  tuningPower = (power > 0.0 && power <= 1.0) ? power : 1.0;
+  tuningCycles = (cycles > 1) ? cycles : TUNING_CYCLES;
+  tuningCyclesDone = 0;
+  tuningOn = false;
+  tuningTime = 0.0;
+  tuningCycleStart = 0.0;
+  tuningHigh = -FLT_MAX;
+  tuningLow = FLT_MAX;
+  tuningPeriods = 0.0;
+  tuningAmplitudes = 0.0;
+  tuningFailed = false;
+  tuningFinished = false;
+  heatingUp[heater] = false;
+  switchedOff[heater] = false;
+  tuningHeater = heater;		// Tick() starts on it from here
+  return true;
+}
+
+void Heat::StopAutoTune()
+{
+  int8_t heater = tuningHeater;
+  if(heater < 0)
+	  return;
+  tuningHeater = -1;
+  tuningFinished = false;
+  switchedOff[heater] = true;	// Tick() turns the power off
+}
+
+void Heat::AutoTuneReport(char* reply)
+{
+  int8_t heater = tuningHeater;
+  if(heater < 0)
+	  snprintf(reply, STRING_LENGTH, "No heater is being tuned");
+  else
+	  snprintf(reply, STRING_LENGTH, "Tuning heater %d at %.1fC: %d of %d oscillations after %.0f seconds, now %.1fC",
+			  heater, tuningTarget, tuningCyclesDone, tuningCycles, tuningTime, temperatures[heater]);
+}
+
+// The time between runs is measured with the processor's cycle counter, which the
+// interrupt can read safely, and which doesn't wrap round for about 50 seconds.
+
+void Heat::Tick()
+{
+  if(!active)
+    return;
+
+  uint32_t now = platform->CycleCount();
+  float dt = (float)(now - lastTickCycles)/(float)CPU_CLOCK_RATE;
+  if(dt < platform->HeatSampleTime())
+    return;
+  lastTickCycles = now;
+  if(dt < shortestTick)
+	  shortestTick = dt;
+  if(dt > longestTick)
+	  longestTick = dt;
+
+  for(int8_t heater = 0; heater < HEATERS; heater++)
+	  Control(heater, dt);
+}
+
 void Heat::Diagnostics() 
 {
   platform->Message(HOST_MESSAGE, "Heat Diagnostics:\n");
-  // TODO - Put something useful in here
+  if(longestTick > 0.0)
+	  snprintf(scratchString, STRING_LENGTH, "Heater control every %.3fs; shortest %.3fs, longest %.3fs\n",
+			  platform->HeatSampleTime(), shortestTick, longestTick);
+  else
+	  snprintf(scratchString, STRING_LENGTH, "Heater control has not run\n");
+  platform->Message(HOST_MESSAGE, scratchString);
+  shortestTick = FLT_MAX;
+  longestTick = 0.0;
 }
 
 bool Heat::AllHeatersAtSetTemperatures(bool heaters[])
@@ -80,11 +240,11 @@ bool Heat::AllHeatersAtSetTemperatures(bool heaters[])
 
 bool Heat::HeaterAtSetTemperature(int8_t heater)
 {
-	if(pids[heater]->SwitchedOff())  // If it hasn't anything to do, it must be right wherever it is...
+	if(switchedOff[heater])  // If it hasn't anything to do, it must be right wherever it is...
 		return true;
 
 	float dt = GetTemperature(heater);
-	if(pids[heater]->Active())
+	if(heaterActive[heater])
 	{
 		if(GetActiveTemperature(heater) < TEMPERATURE_LOW_SO_DONT_CARE)
 			dt = 0.0;
@@ -104,45 +264,45 @@ bool Heat::HeaterAtSetTemperature(int8_t heater)
 
 //******************************************************************************************************
 
-PID::PID(Platform* p, int8_t h)
+void Heat::SetPower(int8_t heater, float power)
 {
-  platform = p;
-  heater = h;
+  powers[heater] = power;
+  averagePWMs[heater] = averagePWMs[heater]*(1.0 - INV_HEAT_PWM_AVERAGE_COUNT) + power;
 }
 
-void PID::Init()
+void Heat::ApplyPowers()
 {
-  platform->SetHeater(heater, 0.0);
-  temperature = platform->GetTemperature(heater);
-  activeTemperature = ABS_ZERO;
-  standbyTemperature = ABS_ZERO;
-  lastTemperature = temperature;
-  temp_iState = 0.0;
-  temp_dState = 0.0;
-  badTemperatureCount = 0;
-  temperatureFault = false;
-  active = false; 		// Default to standby temperature
-  switchedOff = true;
-  heatingUp = false;
-  averagePWM = 0.0;
+  for(int8_t heater = 0; heater < HEATERS; heater++)
+  {
+	  float power = powers[heater];
+	  if(power != appliedPowers[heater])
+	  {
+		  platform->SetHeater(heater, power);
+		  appliedPowers[heater] = power;
+	  }
+  }
 }
 
-void PID::SwitchOn()
+void Heat::Fault(int8_t heater, bool heating)
 {
-//	if(reprap.Debug())
-//	{
-//		snprintf(scratchString, STRING_LENGTH, "Heater %d switched on.\n", heater);
-//		platform->Message(BOTH_MESSAGE, scratchString);
-//	}
-	switchedOff = false;
+  platform->CutOffHeater(heater);	// Now, not when Spin() next runs
+  powers[heater] = 0.0;
+  temperatureFault[heater] = true;
+  switchedOff[heater] = true;
+  heatingFault[heater] = heating;
+  faultTemperatures[heater] = temperatures[heater];
+  faultsToReport |= 1ul << heater;
 }
 
+// The PID gains are set for HeatSampleTime(), so the integral and derivative
+// terms are scaled by how far the measured time step is from that.
 
-void PID::Spin()
+void Heat::Control(int8_t heater, float dt)
 {
   // Always know our temperature, regardless of whether we have been switched on or not
 
-  temperature = platform->GetTemperature(heater);
+  float temperature = platform->GetTemperature(heater);
+  temperatures[heater] = temperature;
 
   // If we're not switched on, or there's a fault, turn the power off and go home.
   // If we're not switched on, then nothing is using us.  This probably means that
@@ -150,10 +310,10 @@ void PID::Spin()
   // are not switched on.  This is safe, as the next bit of code always turns our
   // heater off in that case anyway.
 
-  if(temperatureFault || switchedOff)
+  if(temperatureFault[heater] || switchedOff[heater])
   {
-	  platform->SetHeater(heater, 0.0); // Make sure...
-	  averagePWM = averagePWM*(1.0 - INV_HEAT_PWM_AVERAGE_COUNT);
+	  SetPower(heater, 0.0); // Make sure...
+	  lastTemperatures[heater] = temperature;
 	  return;
   }
 
@@ -162,104 +322,125 @@ void PID::Spin()
 
   if(temperature < BAD_LOW_TEMPERATURE || temperature > BAD_HIGH_TEMPERATURE)
   {
-	  badTemperatureCount++;
-	  if(badTemperatureCount > MAX_BAD_TEMPERATURE_COUNT)
+	  badTemperatureCounts[heater]++;
+	  if(badTemperatureCounts[heater] > MAX_BAD_TEMPERATURE_COUNT)
 	  {
-		  platform->SetHeater(heater, 0.0);
-		  temperatureFault = true;
-		  switchedOff = true;
-		  snprintf(scratchString, STRING_LENGTH, "Temperature fault on heater %d, T = %.1f C\n", heater, temperature);
-		  platform->Message(HOST_MESSAGE, scratchString);
-		  reprap.FlagTemperatureFault(heater);
+		  Fault(heater, false);
+		  return;
 	  }
   } else
   {
-	  badTemperatureCount = 0;
+	  badTemperatureCounts[heater] = 0;
+  }
+
+  if(heater == tuningHeater)
+  {
+	  AutoTuneStep(heater, temperature, dt);
+	  lastTemperatures[heater] = temperature;
+	  return;
   }
 
   // Now check how long it takes to warm up.  If too long, maybe the thermistor is not in contact with the heater
 
-  if(heatingUp && heater != HOT_BED) // FIXME - also check bed warmup time?
+  float target = Target(heater);
+  if(heatingUp[heater] && heater != HOT_BED) // FIXME - also check bed warmup time?
   {
-	  float tmp = standbyTemperature;
-	  if(active)
-		  tmp = activeTemperature;
-	  tmp -= TEMPERATURE_CLOSE_ENOUGH;
-	  if(temperature < tmp)
+	  if(temperature < target - TEMPERATURE_CLOSE_ENOUGH)
 	  {
-		  float tim = platform->Time() - timeSetHeating;
-		  if(tim > TIME_TO_HOT)
+		  heatingTimes[heater] += dt;
+		  if(heatingTimes[heater] > platform->TimeToHot())
 		  {
-			  platform->SetHeater(heater, 0.0);
-			  temperatureFault = true;
-			  switchedOff = true;
-			  snprintf(scratchString, STRING_LENGTH, "Heating fault on heater %d, T = %.1f C; still not at temperature after %f seconds.\n",
-					  heater, temperature, tim);
-			  platform->Message(HOST_MESSAGE, scratchString);
-			  reprap.FlagTemperatureFault(heater);
+			  Fault(heater, true);
+			  return;
 		  }
 	  } else
-		  heatingUp = false;
+		  heatingUp[heater] = false;
   }
 
-  float error = ((active) ? activeTemperature : standbyTemperature) - temperature;
+  float error = target - temperature;
   
   if(!platform->UsePID(heater))
   {
-	if(error > 0.0)
-	{
-		platform->SetHeater(heater, 1.0);
-		averagePWM = averagePWM*(1.0 - INV_HEAT_PWM_AVERAGE_COUNT) + 1.0;
-	} else
-	{
-		platform->SetHeater(heater, 0.0);
-		averagePWM = averagePWM*(1.0 - INV_HEAT_PWM_AVERAGE_COUNT);
-	}
+	SetPower(heater, (error > 0.0) ? 1.0 : 0.0);
+	lastTemperatures[heater] = temperature;
     return; 
   }
   
-  if(error < -platform->FullPidBand(heater))
+  if(error < -platform->FullPidBand(heater) || error > platform->FullPidBand(heater))
   {
-     temp_iState = 0.0;
-     platform->SetHeater(heater, 0.0);
-     averagePWM = averagePWM*(1.0 - INV_HEAT_PWM_AVERAGE_COUNT);
-     lastTemperature = temperature;
+     iStates[heater] = 0.0;
+     SetPower(heater, (error > 0.0) ? 1.0 : 0.0);
+     lastTemperatures[heater] = temperature;
      return;
   }
-  if(error > platform->FullPidBand(heater))
-  {
-     temp_iState = 0.0;
-     platform->SetHeater(heater, 1.0);
-     averagePWM = averagePWM*(1.0 - INV_HEAT_PWM_AVERAGE_COUNT) + 1.0;
-     lastTemperature = temperature;
-     return;
-  }  
-   
-  temp_iState += error * platform->PidKi(heater);
-  
-  if (temp_iState < platform->PidMin(heater)) temp_iState = platform->PidMin(heater);
-  else if (temp_iState > platform->PidMax(heater)) temp_iState = platform->PidMax(heater);
+
+  float scale = dt/platform->HeatSampleTime();
+  float iState = iStates[heater] + error*platform->PidKi(heater)*scale;
+  if (iState < platform->PidMin(heater)) iState = platform->PidMin(heater);
+  else if (iState > platform->PidMax(heater)) iState = platform->PidMax(heater);
+  iStates[heater] = iState;
    
-  temp_dState =  platform->PidKd(heater)*(temperature - lastTemperature)*(1.0 - platform->DMix(heater)) + platform->DMix(heater)*temp_dState; 
+  float dMix = platform->DMix(heater);
+  dStates[heater] = platform->PidKd(heater)*(temperature - lastTemperatures[heater])*(1.0 - dMix)/scale + dMix*dStates[heater];
 
-  float result = platform->PidKp(heater)*error + temp_iState - temp_dState;
+  float result = platform->PidKp(heater)*error + iState - dStates[heater];
 
-  lastTemperature = temperature;
+  lastTemperatures[heater] = temperature;
 
   // Legacy - old RepRap PID parameters were set to give values in [0, 255] for 1 byte PWM control
   // TODO - maybe change them to give [0.0, 1.0]?
 
   if (result < 0.0) result = 0.0;
   else if (result > 255.0) result = 255.0;
-  result = result/255.0;
+  SetPower(heater, result/255.0);
+}
+
+// An oscillation starts each time the heater is switched on.  The first is the heat-up
+// from wherever the temperature started, so it isn't counted.
+
+void Heat::AutoTuneStep(int8_t heater, float temperature, float dt)
+{
+  if(tuningFinished)
+  {
+	  SetPower(heater, 0.0);
+	  return;
+  }
 
-  if(!temperatureFault)
-	  platform->SetHeater(heater, result);
+  tuningTime += dt;
+  if(temperature > tuningTarget + TUNING_MAX_OVERSHOOT || tuningTime > TUNING_TIME_LIMIT)
+  {
+	  SetPower(heater, 0.0);
+	  tuningFailed = true;
+	  tuningFinished = true;
+	  return;
+  }
 
-  averagePWM = averagePWM*(1.0 - INV_HEAT_PWM_AVERAGE_COUNT) + result;
+  if(temperature > tuningHigh)
+	  tuningHigh = temperature;
+  if(temperature < tuningLow)
+	  tuningLow = temperature;
 
-//  char buffer[100];
-//  snprintf(buffer, ARRAY_SIZE(buffer), "Heat: e=%f, P=%f, I=%f, d=%f, r=%f\n", error, platform->PidKp(heater)*error, temp_iState, temp_dState, result);
-//  platform->Message(HOST_MESSAGE, buffer);
+  if(tuningOn && temperature > tuningTarget + TUNING_HYSTERESIS)
+	  tuningOn = false;
+  else if(!tuningOn && temperature < tuningTarget - TUNING_HYSTERESIS)
+  {
+	  tuningOn = true;
+	  if(tuningCyclesDone > 1)
+	  {
+		  tuningPeriods += tuningTime - tuningCycleStart;
+		  tuningAmplitudes += 0.5*(tuningHigh - tuningLow);
+	  }
+	  if(tuningCyclesDone >= tuningCycles)
+	  {
+		  SetPower(heater, 0.0);
+		  tuningFinished = true;
+		  return;
+	  }
+	  tuningCyclesDone++;
+	  tuningCycleStart = tuningTime;
+	  tuningHigh = temperature;
+	  tuningLow = temperature;
+  }
 
+  SetPower(heater, tuningOn ? tuningPower : 0.0);
 }
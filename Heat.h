@@ -22,53 +22,15 @@ Licence: GPL
 #define HEAT_H
 
 /**
- * This class implements a PID controller for the heaters
- */
-
-class PID
-{
-  friend class Heat;
-  protected:
-  
-    PID(Platform* p, int8_t h);
-    void Init();									// (Re)Set everything to start
-    void Spin();									// Called in a tight loop to keep things running
-    void SetActiveTemperature(const float& t);		// Set the temperature required when working (Celsius)
-    float GetActiveTemperature();					// Get the active temperature
-    void SetStandbyTemperature(const float& t);		// Set the temperature to use when idle (celsius)
-    float GetStandbyTemperature();					// Get the idle temperature
-    void Activate();								// Switch from idle to active
-    void Standby();									// Switch from active to idle
-    bool Active();									// Are we active?
-    void SwitchOff();								// Not even standby - all heater power off
-    bool SwitchedOff();								// Are we switched off?
-    void ResetFault();								// Reset a fault condition - only call this if you know what you are doing
-    float GetTemperature();							// Get the current temperature
-    float GetAveragePWM();							// Return the running average PWM to the heater.  Answer is a fraction in [0, 1].
-
-  private:
-
-    void SwitchOn();
-  
-    Platform* platform;								// The instance of the class that is the RepRap hardware
-    float activeTemperature;						// The required active temperature
-    float standbyTemperature;						// The required standby temperature
-    float temperature;								// The current temperature
-    float lastTemperature;							// The previous current temperature
-    float temp_iState;								// The integral PID component
-    float temp_dState;								// The derivative PID component
-    bool active;									// Are we active or standby?
-    bool switchedOff;								// Becomes false when someone tells us our active or standby temperatures
-    int8_t heater;									// The index of our heater
-    int8_t badTemperatureCount;						// Count of sequential dud readings
-    bool temperatureFault;							// Has our heater developed a fault?
-    float timeSetHeating;							// When we were switched on
-    bool heatingUp;									// Are we heating up?
-    float averagePWM;								// The running average of the PWM.
-};
-
-/**
- * The master class that controls all the heaters in the RepRap machine
+ * The master class that controls all the heaters in the RepRap machine.
+ *
+ * The PID controllers run from Tick(), which the A to D converter's interrupt calls
+ * when it has fresh readings, every HeatSampleTime() seconds.  So neither the heater
+ * timing nor the time step the PID terms use depends on how busy the main loop is.
+ * The time step is measured, not assumed.  Everything about the heaters is kept in
+ * arrays with an entry for each one, so the controllers work through them in turn.
+ * Spin() only reports faults that Tick() has found, as the interrupt can't send
+ * messages.
  */
 
 class Heat
@@ -80,6 +42,7 @@ class Heat
     void Spin();												// Called in a tight loop to keep everything going
     void Init();												// Set everything up
     void Exit();												// Shut everything down
+    void Tick();												// Run the heater controllers if it is time; called from an interrupt
     void SetActiveTemperature(int8_t heater, const float& t);	// Set a heater's active temperature (celsius)
     float GetActiveTemperature(int8_t heater);					// What is a heater's active temperature?
     void SetStandbyTemperature(int8_t heater, const float& t);	// Set a heater's standby temperature (celsius)
@@ -93,96 +56,68 @@ class Heat
     bool HeaterAtSetTemperature(int8_t heater);					// Is a specific heater at temperature within tolerance?
     void Diagnostics();											// Output useful information
     float GetAveragePWM(int8_t heater);							// Return the running average PWM to the heater.    Answer is a fraction in [0, 1].
+    bool StartAutoTune(int8_t heater, float target,				// Start tuning a heater's PID by making it oscillate round target...
+    		float power, int cycles);							// ...switching between off and power (fraction) for cycles oscillations
+    void StopAutoTune();										// Give up tuning and turn the heater off
+    void AutoTuneReport(char* reply);							// Say how the tuning is going
     
   private:
   
+    void Control(int8_t heater, float dt);						// One heater's PID or bang-bang step
+    void Fault(int8_t heater, bool heatingFault);				// Turn a heater off and have Spin() report it
+    void SetPower(int8_t heater, float power);					// Ask for a heater's PWM and keep its average
+    void ApplyPowers();											// Set the heater PWMs that have changed; main loop only
+    float Target(int8_t heater);								// The temperature a heater is aiming for
+    void AutoTuneStep(int8_t heater, float temperature, float dt); // Drive the heater being tuned
+
     Platform* platform;							// The instance of the RepRap hardware class
     GCodes* gCodes;								// The instance of the G Code interpreter class
-    bool active;								// Are we active?
-    PID* pids[HEATERS];							// A PID controller for each heater
-    float lastTime;								// The last time our Spin() was called
+    volatile bool active;						// Are we active?
     float longWait;								// Long time for things that happen occasionally
-};
-
-
-//***********************************************************************************************************
-
-// PID
-
-inline bool PID::Active()
-{
-	return active;
-}
-
-inline void PID::SetActiveTemperature(const float& t)
-{
-  SwitchOn();
-  activeTemperature = t;
-}
-
-inline float PID::GetActiveTemperature()
-{
-  return activeTemperature;
-}
-
-inline void PID::SetStandbyTemperature(const float& t)
-{
-  SwitchOn();
-  standbyTemperature = t;
-}
-
-inline float PID::GetStandbyTemperature()
-{
-  return standbyTemperature;
-}
-
-inline float PID::GetTemperature()
-{
-  return temperature;
-}
-
-inline void PID::Activate()
-{
-  SwitchOn();
-  active = true;
-  if(!heatingUp)
-	  timeSetHeating = platform->Time();
-  heatingUp = activeTemperature > temperature;
-}
 
-inline void PID::Standby()
-{
-  SwitchOn();
-  active = false;
-  if(!heatingUp)
-	  timeSetHeating = platform->Time();
-  heatingUp = standbyTemperature > temperature;
-}
-
-inline void PID::ResetFault()
-{
-	temperatureFault = false;
-	badTemperatureCount = 0;
-}
-
-inline void PID::SwitchOff()
-{
-	platform->SetHeater(heater, 0.0);
-	active = false;
-	switchedOff = true;
-	heatingUp = false;
-}
-
-
-inline bool PID::SwitchedOff()
-{
-	return switchedOff;
-}
-
-inline float PID::GetAveragePWM()
-{
-	return averagePWM*INV_HEAT_PWM_AVERAGE_COUNT;
-}
+    // The controllers' state
+
+    float temperatures[HEATERS];				// The current temperatures
+    float lastTemperatures[HEATERS];			// The temperatures at the last tick
+    float activeTemperatures[HEATERS];			// The required active temperatures
+    float standbyTemperatures[HEATERS];			// The required standby temperatures
+    float iStates[HEATERS];						// The integral PID components
+    float dStates[HEATERS];						// The derivative PID components
+    float averagePWMs[HEATERS];					// The running averages of the PWMs
+    volatile float powers[HEATERS];				// The PWMs the controllers want, which Spin() sets...
+    float appliedPowers[HEATERS];				// ...and what it last set them to
+    float heatingTimes[HEATERS];				// How long each has been heating up (seconds)
+    int8_t badTemperatureCounts[HEATERS];		// Counts of sequential dud readings
+    bool heaterActive[HEATERS];					// Active or standby?
+    volatile bool switchedOff[HEATERS];			// Becomes false when someone tells us our active or standby temperatures
+    volatile bool temperatureFault[HEATERS];	// Has the heater developed a fault?
+    volatile bool heatingUp[HEATERS];			// Is it heating up?
+
+    // Tick() timing and the faults it has found for Spin() to report
+
+    uint32_t lastTickCycles;					// The cycle count when the controllers last ran
+    float shortestTick, longestTick;			// The measured time steps since the last diagnostics
+    volatile uint32_t faultsToReport;			// A bit for each heater that has gone wrong
+    bool heatingFault[HEATERS];					// Was it too slow to heat, rather than out of range?
+    float faultTemperatures[HEATERS];			// The temperature when it went wrong
+
+    // Relay-feedback autotune: the heater being tuned is switched fully on below the target
+    // and off above it.  The period and height of the oscillation that results give the
+    // ultimate gain and period, and Ziegler-Nichols turns those into PID values.
+
+    volatile int8_t tuningHeater;				// The heater being tuned, or -1
+    float tuningTarget;							// The temperature to oscillate round
+    float tuningPower;							// The power when on, as a fraction
+    int tuningCycles;							// The number of oscillations to measure
+    int tuningCyclesDone;						// The number started so far
+    bool tuningOn;								// Is the heater on at the moment?
+    float tuningTime;							// Seconds since tuning started
+    float tuningCycleStart;						// When the current oscillation started
+    float tuningHigh, tuningLow;				// Its highest and lowest temperatures
+    float tuningPeriods, tuningAmplitudes;		// Sums over the oscillations counted
+    volatile bool tuningFinished;				// Tick() has something for Spin() to report
+    bool tuningFailed;							// It went wrong
+};
 
 //**********************************************************************************
 
@@ -190,45 +125,56 @@ inline float PID::GetAveragePWM()
 
 inline bool Heat::SwitchedOff(int8_t heater)
 {
-	return pids[heater]->SwitchedOff();
+	return switchedOff[heater];
 }
 
 inline void Heat::SetActiveTemperature(int8_t heater, const float& t)
 {
   if (heater >= 0 && heater < HEATERS)
   {
-    pids[heater]->SetActiveTemperature(t);
+    switchedOff[heater] = false;
+    activeTemperatures[heater] = t;
   }
 }
 
 inline float Heat::GetActiveTemperature(int8_t heater)
 {
-	return (heater >= 0 && heater < HEATERS) ? pids[heater]->GetActiveTemperature() : ABS_ZERO;
+	return (heater >= 0 && heater < HEATERS) ? activeTemperatures[heater] : ABS_ZERO;
 }
 
 inline void Heat::SetStandbyTemperature(int8_t heater, const float& t)
 {
   if (heater >= 0 && heater < HEATERS)
   {
-    pids[heater]->SetStandbyTemperature(t);
+    switchedOff[heater] = false;
+    standbyTemperatures[heater] = t;
   }
 }
 
 inline float Heat::GetStandbyTemperature(int8_t heater)
 {
-  return (heater >= 0 && heater < HEATERS) ? pids[heater]->GetStandbyTemperature() : ABS_ZERO;
+  return (heater >= 0 && heater < HEATERS) ? standbyTemperatures[heater] : ABS_ZERO;
 }
 
 inline float Heat::GetTemperature(int8_t heater)
 {
-  return (heater >= 0 && heater < HEATERS) ? pids[heater]->GetTemperature() : ABS_ZERO;
+  return (heater >= 0 && heater < HEATERS) ? temperatures[heater] : ABS_ZERO;
+}
+
+inline float Heat::Target(int8_t heater)
+{
+  return heaterActive[heater] ? activeTemperatures[heater] : standbyTemperatures[heater];
 }
 
 inline void Heat::Activate(int8_t heater)
 {
   if (heater >= 0 && heater < HEATERS)
   {
-    pids[heater]->Activate();
+    switchedOff[heater] = false;
+    heaterActive[heater] = true;
+    if(!heatingUp[heater])
+    	heatingTimes[heater] = 0.0;
+    heatingUp[heater] = activeTemperatures[heater] > temperatures[heater];
   }
 }
 
@@ -236,7 +182,11 @@ inline void Heat::Standby(int8_t heater)
 {
   if (heater >= 0 && heater < HEATERS)
   {
-    pids[heater]->Standby();
+    switchedOff[heater] = false;
+    heaterActive[heater] = false;
+    if(!heatingUp[heater])
+    	heatingTimes[heater] = 0.0;
+    heatingUp[heater] = standbyTemperatures[heater] > temperatures[heater];
   }
 }
 
@@ -244,15 +194,14 @@ inline void Heat::ResetFault(int8_t heater)
 {
   if (heater >= 0 && heater < HEATERS)
   {
-    pids[heater]->ResetFault();
+	badTemperatureCounts[heater] = 0;
+	temperatureFault[heater] = false;
   }
 }
 
 inline float Heat::GetAveragePWM(int8_t heater)
 {
-	return pids[heater]->GetAveragePWM();
+	return averagePWMs[heater]*INV_HEAT_PWM_AVERAGE_COUNT;
 }
 
-
-
 #endif
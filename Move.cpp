@@ -26,6 +26,7 @@ Move::Move(Platform* p, GCodes* g)
   active = false;
   platform = p;
   gCodes = g;
+  kinematics = new Kinematics();
   
   // Build the DDA ring
   
@@ -55,8 +56,6 @@ Move::Move(Platform* p, GCodes* g)
     lookAheadRingGetPointer = lookAheadRingAddPointer;
   }    
   
-  lookAheadDDA = new DDA(this, platform, NULL);
-  
 }
 
 void Move::Init()
@@ -70,7 +69,29 @@ void Move::Init()
   // Empty the rings
   
   ddaRingGetPointer = ddaRingAddPointer; 
-  ddaRingLocked = false;
+  ddaRingAdded = 0;
+  ddaRingTaken = 0;
+  ddaRingFinished = 0;
+  ddaRingMostUsed = 0;
+  segmentMergeTolerance = SEGMENT_MERGE_TOLERANCE;
+  minimumSegmentLength = MINIMUM_SEGMENT_LENGTH;
+  movePending = false;
+  segmentsLeft = 0;
+  expectedPositionKnown = false;
+  nextPrintPosition.filePosition = -1;
+  completedPrintPosition.filePosition = -1;
+  completedPrintMoves = 0;
+  kinematics->Init();
+  planningCycles = 0;
+  simulationStartMoves = 0;
+  simulationStartTime = 0.0;
+  endSpeedMoves = 0;
+  endSpeedMissTotal = 0;
+  endSpeedWorstMiss = 0;
+  endSpeedWorstPlanned = 0;
+  endSpeedWorstReached = 0;
+  for(i = 0; i < DRIVES - AXES; i++)
+	  advanceRemainders[i] = 0.0;
   
   for(i = 0; i <= LOOK_AHEAD_RING_LENGTH; i++)
   {
@@ -95,12 +116,11 @@ void Move::Init()
   }
 
   int8_t slow = platform->SlowestDrive();
-  lastMove->Init(ep, platform->HomeFeedRate(slow), platform->InstantDv(slow), platform->MaxFeedrate(slow),
-		  platform->Acceleration(slow), false);
+  lastMove->Init(ep, liveCoordinates, platform->HomeFeedRate(slow), platform->InstantDv(slow), platform->MaxFeedrate(slow),
+		  platform->Acceleration(slow), 0.0, false);
   lastMove->Release();
   liveCoordinates[DRIVES] = platform->HomeFeedRate(slow);
 
-  //SetStepHypotenuse();
 
   currentFeedrate = -1.0;
 
@@ -112,17 +132,28 @@ void Move::Init()
   lastZHit = 0.0;
   zProbing = false;
 
+  // Only the first five points get defaults; the rest are for grids, which have to be set
+
   for(uint8_t point = 0; point < NUMBER_OF_PROBE_POINTS; point++)
   {
-	  xBedProbePoints[point] = (0.3 + 0.6*(float)(point%2))*platform->AxisLength(X_AXIS);
-	  yBedProbePoints[point] = (0.0 + 0.9*(float)(point/2))*platform->AxisLength(Y_AXIS);
+	  if(point < 5)
+	  {
+		  xBedProbePoints[point] = (0.3 + 0.6*(float)(point%2))*platform->AxisLength(X_AXIS);
+		  yBedProbePoints[point] = (0.0 + 0.9*(float)(point/2))*platform->AxisLength(Y_AXIS);
+	  } else
+	  {
+		  xBedProbePoints[point] = 0.0;
+		  yBedProbePoints[point] = 0.0;
+	  }
 	  zBedProbePoints[point] = 0.0;
 	  probePointSet[point] = unset;
   }
 
-  xRectangle = 1.0/(0.8*platform->AxisLength(X_AXIS));
-  yRectangle = xRectangle;
-  identityBedTransform = true;
+  gridColumns = 0;
+  gridRows = 0;
+
+  shortestStepInterval = UINT32_MAX;
+  plannerStarvedCount = 0;
 
   lastTime = platform->Time();
   longWait = lastTime;
@@ -142,6 +173,7 @@ void Move::Spin()
     
   // Do some look-ahead work, if there's any to do
     
+  uint32_t planStart = platform->CycleCount();
   DoLookAhead();
   
   // If there's space in the DDA ring, and there is a completed
@@ -156,57 +188,187 @@ void Move::Spin()
          platform->Message(HOST_MESSAGE, "Can't add to non-full DDA ring!\n"); // Should never happen...
      }
   }
+  planningCycles += platform->CycleCount() - planStart;
+
+  // Finish cutting up a move before taking anything else
+
+  if(segmentsLeft > 0)
+  {
+	  AddSegments();
+	  if(segmentsLeft > 0)
+	  {
+		  platform->ClassReport("Move", longWait);
+		  return;
+	  }
+  }
   
+  // A held move goes into the look-ahead as soon as nothing more may come to be merged
+  // with it, or the machine would otherwise stop for want of it.
+
+  if(movePending && !LookAheadRingFull() &&
+		  (addNoMoreMoves || !gCodes->HaveIncomingData() || (LookAheadRingEmpty() && NoLiveMovement())))
+  {
+	  movePending = false;
+	  AddMove(pendingMove, pendingCheckEndStops, pendingPrintPosition);
+  }
+
   // If we either don't want to, or can't, add to the look-ahead ring, go home.
   
-  if(addNoMoreMoves || LookAheadRingFull())
+  if(addNoMoreMoves || LookAheadRingFull() || segmentsLeft > 0)
   {
 	  platform->ClassReport("Move", longWait);
 	  return;
   }
  
   // If there's a G Code move available, add it to the look-ahead
-  // ring for processing.
+  // ring for processing, or merge it with the one being held.
 
   bool checkEndStopsOnNextMove;
-  if(gCodes->ReadMove(nextMove, checkEndStopsOnNextMove))
+  if(gCodes->ReadMove(nextMove, checkEndStopsOnNextMove, nextPrintPosition))
   {
 	Transform(nextMove);
 
     currentFeedrate = nextMove[DRIVES]; // Might be G1 with just an F field
+    for(int8_t axis = 0; axis < AXES; axis++)
+    	expectedPosition[axis] = nextMove[axis];
+    expectedPositionKnown = !checkEndStopsOnNextMove;	// Endstops end moves where they are hit
+
+    if(segmentMergeTolerance <= 0.0 && minimumSegmentLength <= 0.0)
+    	AddMove(nextMove, checkEndStopsOnNextMove, nextPrintPosition);
+    else if(!MergeMove(nextMove, checkEndStopsOnNextMove, nextPrintPosition))
+    {
+    	movePending = false;
+    	AddMove(pendingMove, pendingCheckEndStops, pendingPrintPosition);
+    	HoldMove(nextMove, checkEndStopsOnNextMove, nextPrintPosition);
+    }
+  }
+  platform->ClassReport("Move", longWait);
+}
+
+// A move that isn't straight for the motors is cut into pieces that take no longer
+// than 1/SegmentsPerSecond() each at the requested feedrate, and are at least
+// DELTA_MIN_SEGMENT_LENGTH long.  Moves that check endstops are never cut up, as each
+// delta tower stops separately at the top of its travel.  Only the last piece finishing
+// leaves the print somewhere it could be restarted from.
+
+void Move::AddMove(float move[], bool ce, const PrintPosition& p)
+{
+	if(ce || kinematics->Linear())
+	{
+		AddSegment(move, ce, &p);
+		return;
+	}
+
+	const float* start = lastMove->CartesianEndPoint();
+	float length = 0.0;
+	for(int8_t axis = 0; axis < AXES; axis++)
+	{
+		float d = move[axis] - start[axis];
+		length += d*d;
+	}
+	length = sqrt(length);
+	int segments = 1;
+	if(move[DRIVES] > 0.0)
+		segments = (int)ceil(kinematics->SegmentsPerSecond()*length/move[DRIVES]);
+	int most = (int)(length/DELTA_MIN_SEGMENT_LENGTH);
+	if(segments > most)
+		segments = most;
+	if(segments <= 1)
+	{
+		AddSegment(move, ce, &p);
+		return;
+	}
+
+	float r = 1.0/(float)segments;
+	for(int8_t drive = 0; drive < DRIVES; drive++)
+	{
+		if(drive < AXES)
+		{
+			segmentPosition[drive] = start[drive];
+			segmentStep[drive] = (move[drive] - start[drive])*r;
+			segmentEnd[drive] = move[drive];
+		} else
+			segmentStep[drive] = move[drive]*r;
+	}
+	segmentPosition[DRIVES] = move[DRIVES];
+	segmentCheckEndStops = ce;
+	segmentPrintPosition = p;
+	segmentsLeft = segments;
+	AddSegments();
+}
+
+void Move::AddSegments()
+{
+	float segment[DRIVES + 1];
+	while(segmentsLeft > 0 && !LookAheadRingFull())
+	{
+		segmentsLeft--;
+		for(int8_t drive = 0; drive < DRIVES; drive++)
+		{
+			if(drive < AXES)
+			{
+				segmentPosition[drive] = (segmentsLeft > 0) ? segmentPosition[drive] + segmentStep[drive] : segmentEnd[drive];
+				segment[drive] = segmentPosition[drive];
+			} else
+				segment[drive] = segmentStep[drive];
+		}
+		segment[DRIVES] = segmentPosition[DRIVES];
+		AddSegment(segment, segmentCheckEndStops, (segmentsLeft > 0) ? NULL : &segmentPrintPosition);
+	}
+}
+
+// The planner works in XYZ, so the look-ahead entry gets both the Cartesian end point
+// (for its direction and length) and the motor positions (for the DDA to step).  The
+// speed and acceleration limits are for the motors, so they are applied in the direction
+// the motors move, and then scaled to the Cartesian path that the feedrate is along.
+
+void Move::AddSegment(float move[], bool ce, const PrintPosition* p)
+{
+    float motors[AXES];
+    if(!kinematics->CartesianToMotors(move, motors))
+    {
+    	snprintf(scratchString, STRING_LENGTH, "Move to X%.1f Y%.1f Z%.1f is out of reach.\n", move[X_AXIS], move[Y_AXIS], move[Z_AXIS]);
+    	platform->Message(HOST_MESSAGE, scratchString);
+    	expectedPositionKnown = false;
+    	return;
+    }
 
     bool noMove = true;
+    float cartesianLength = 0.0;
+    const float* start = lastMove->CartesianEndPoint();
     for(int8_t drive = 0; drive < DRIVES; drive++)
     {
-    	nextMachineEndPoints[drive] = LookAhead::EndPointToMachine(drive, nextMove[drive]);
     	if(drive < AXES)
     	{
-    		if(nextMachineEndPoints[drive] - lastMove->MachineCoordinates()[drive] != 0)
+    		nextMachineEndPoints[drive] = LookAhead::EndPointToMachine(drive, motors[drive]);
+    		long steps = nextMachineEndPoints[drive] - lastMove->MachineCoordinates()[drive];
+    		if(steps != 0)
     		    noMove = false;
-    		normalisedDirectionVector[drive] = nextMove[drive] - lastMove->MachineToEndPoint(drive);
+    		normalisedDirectionVector[drive] = (float)steps/platform->DriveStepsPerUnit(drive);
+    		float d = move[drive] - start[drive];
+    		cartesianLength += d*d;
     	} else
     	{
+    		nextMachineEndPoints[drive] = LookAhead::EndPointToMachine(drive, move[drive]);
     		if(nextMachineEndPoints[drive] != 0)
     		    noMove = false;
-    		normalisedDirectionVector[drive] = nextMove[drive];
+    		normalisedDirectionVector[drive] = move[drive];
+    		cartesianLength += move[drive]*move[drive];
     	}
     }
 
     // Throw it away if there's no real movement.
     
     if(noMove)
-    {
-       platform->ClassReport("Move", longWait);
        return;
-    }
     
     // Compute the direction of motion, moved to the positive hyperquadrant
 
     Absolute(normalisedDirectionVector, DRIVES);
-    if(Normalise(normalisedDirectionVector, DRIVES) <= 0.0)
+    float motorLength = Normalise(normalisedDirectionVector, DRIVES);
+    if(motorLength <= 0.0)
     {
     	platform->Message(HOST_MESSAGE, "\nAttempt to normailse zero-length move.\n");  // Should never get here - noMove above should catch it
-        platform->ClassReport("Move", longWait);
         return;
     }
     
@@ -216,17 +378,139 @@ void Move::Spin()
 
      // Set the feedrate maximum and minimum, and the acceleration
 
-     float minSpeed = VectorBoxIntersection(normalisedDirectionVector, platform->InstantDvs(), DRIVES);
-     float acceleration = VectorBoxIntersection(normalisedDirectionVector, platform->Accelerations(), DRIVES);
-     float maxSpeed = VectorBoxIntersection(normalisedDirectionVector, platform->MaxFeedrates(), DRIVES);
+     float scale = (cartesianLength > 0.0) ? sqrt(cartesianLength)/motorLength : 1.0;	// Cartesian mm per motor mm along this move
+     float minSpeed = scale*VectorBoxIntersection(normalisedDirectionVector, platform->InstantDvs(), DRIVES);
+     float acceleration = scale*VectorBoxIntersection(normalisedDirectionVector, platform->Accelerations(), DRIVES);
+     float maxSpeed = scale*VectorBoxIntersection(normalisedDirectionVector, platform->MaxFeedrates(), DRIVES);
+
+     // Pressure advance makes an extruder run at (v + K*a) times its share of the move
+     // while accelerating, so slow the move, or failing that its acceleration, to keep
+     // that within the extruder's maximum feedrate.  Moves with no XY(Z) motion don't get advance.
 
-     if(!LookAheadRingAdd(nextMachineEndPoints, nextMove[DRIVES], minSpeed, maxSpeed, acceleration, checkEndStopsOnNextMove))
+     float advance = 0.0;
+     Tool* tool = reprap.GetCurrentTool();
+     if(tool != NULL && tool->PressureAdvance() > 0.0)
+     {
+    	 for(int8_t axis = 0; axis < AXES; axis++)
+    	 {
+    		 if(normalisedDirectionVector[axis] > 0.0)
+    			 advance = tool->PressureAdvance();
+    	 }
+     }
+     if(advance > 0.0)
+     {
+    	 for(int8_t drive = AXES; drive < DRIVES; drive++)
+    	 {
+    		 if(move[drive] <= 0.0)
+    			 continue;
+    		 float limit = scale*platform->MaxFeedrate(drive)/normalisedDirectionVector[drive];
+    		 if(maxSpeed + advance*acceleration > limit)
+    		 {
+    			 maxSpeed = limit - advance*acceleration;
+    			 if(maxSpeed < minSpeed)
+    			 {
+    				 maxSpeed = minSpeed;
+    				 float a = (limit - minSpeed)/advance;
+    				 if(a <= 0.0)
+    				 {
+    					 advance = 0.0;		// Can't be done; leave it out
+    					 break;
+    				 }
+    				 if(a < acceleration)
+    					 acceleration = a;
+    			 }
+    		 }
+    	 }
+     }
+
+     if(!LookAheadRingAdd(nextMachineEndPoints, move, minSpeed, maxSpeed, acceleration, advance, ce, p))
     	platform->Message(HOST_MESSAGE, "Can't add to non-full look ahead ring!\n"); // Should never happen...
-  }
-  platform->ClassReport("Move", longWait);
 }
 
+void Move::HoldMove(float move[], bool ce, const PrintPosition& p)
+{
+	for(int8_t drive = 0; drive <= DRIVES; drive++)
+		pendingMove[drive] = move[drive];
+	float length = 0.0;
+	const float* start = lastMove->CartesianEndPoint();
+	for(int8_t axis = 0; axis < AXES; axis++)
+	{
+		if(segmentsLeft > 0)
+			pendingStart[axis] = segmentEnd[axis];	// Where the move being cut up will end
+		else
+			pendingStart[axis] = start[axis];
+		float d = move[axis] - pendingStart[axis];
+		length += d*d;
+	}
+	pendingLength = sqrt(length);
+	pendingDeviation = 0.0;
+	pendingCheckEndStops = ce;
+	pendingPrintPosition = p;
+	movePending = true;
+}
+
+// The held move and the new one are merged if they go at the same speed, extrude the same
+// amount per mm, and the point between them is near enough to the line from the start of the
+// held move to the end of the new one.  Each merge moves that line by no more than the
+// distance of the point left out from it, so adding up those distances bounds how far the
+// merged move is from every point merged into it.  Extrusions are relative, so they add.
 
+bool Move::MergeMove(float move[], bool ce, const PrintPosition& p)
+{
+	if(!movePending)
+	{
+		HoldMove(move, ce, p);
+		return true;
+	}
+	if(ce || pendingCheckEndStops || move[DRIVES] != pendingMove[DRIVES] || pendingLength <= 0.0)
+		return false;
+
+	float d1[AXES], chord[AXES];
+	float length = 0.0;
+	float chordLength = 0.0;
+	for(int8_t axis = 0; axis < AXES; axis++)
+	{
+		d1[axis] = pendingMove[axis] - pendingStart[axis];
+		float d2 = move[axis] - pendingMove[axis];
+		chord[axis] = d1[axis] + d2;
+		length += d2*d2;
+		chordLength += chord[axis]*chord[axis];
+	}
+	length = sqrt(length);
+	chordLength = sqrt(chordLength);
+	if(length <= 0.0 || chordLength <= 0.0)
+		return false;
+
+	for(int8_t drive = AXES; drive < DRIVES; drive++)
+	{
+		float r1 = pendingMove[drive]/pendingLength;
+		float r2 = move[drive]/length;
+		float biggest = (fabs(r1) > fabs(r2)) ? fabs(r1) : fabs(r2);
+		if(fabs(r1 - r2) > EXTRUSION_RATIO_TOLERANCE*biggest)
+			return false;
+	}
+
+	// The distance of the end of the held move from the new line is |d1 x chord|/|chord|
+
+	float cx = d1[Y_AXIS]*chord[Z_AXIS] - d1[Z_AXIS]*chord[Y_AXIS];
+	float cy = d1[Z_AXIS]*chord[X_AXIS] - d1[X_AXIS]*chord[Z_AXIS];
+	float cz = d1[X_AXIS]*chord[Y_AXIS] - d1[Y_AXIS]*chord[X_AXIS];
+	float deviation = pendingDeviation + sqrt(cx*cx + cy*cy + cz*cz)/chordLength;
+	float allowed = segmentMergeTolerance;
+	if((pendingLength < minimumSegmentLength || length < minimumSegmentLength) && minimumSegmentLength > allowed)
+		allowed = minimumSegmentLength;
+	if(deviation > allowed)
+		return false;
+
+	for(int8_t axis = 0; axis < AXES; axis++)
+		pendingMove[axis] = move[axis];
+	for(int8_t drive = AXES; drive < DRIVES; drive++)
+		pendingMove[drive] += move[drive];
+	pendingLength = chordLength;
+	pendingDeviation = deviation;
+	pendingPrintPosition = p;
+	return true;
+}
 
 /*
  * Take a unit positive-hyperquadrant vector, and return the factor needed to obtain
@@ -295,9 +579,50 @@ void Move::Absolute(float v[], int8_t dimensions)
 
 void Move::SetPositions(float move[])
 {
+	float motors[AXES];
+	if(!kinematics->CartesianToMotors(move, motors))
+	{
+		platform->Message(HOST_MESSAGE, "Position set is out of reach.\n");
+		for(int8_t axis = 0; axis < AXES; axis++)
+			motors[axis] = move[axis];
+	}
 	for(uint8_t drive = 0; drive < DRIVES; drive++)
-		lastMove->SetDriveCoordinateAndZeroEndSpeed(move[drive], drive);
+		lastMove->SetDriveCoordinateAndZeroEndSpeed((drive < AXES) ? motors[drive] : move[drive], drive);
+	lastMove->SetCartesianEndPoint(move);
 	lastMove->SetFeedRate(move[DRIVES]);
+	expectedPositionKnown = false;
+}
+
+// After the kinematics change the motors stay where they are, and XYZ is worked out from them.
+
+void Move::KinematicsChanged()
+{
+	for(int8_t axis = 0; axis < AXES; axis++)
+		lastMove->SetDriveCoordinateAndZeroEndSpeed(lastMove->MachineToEndPoint(axis), axis);
+	expectedPositionKnown = false;
+}
+
+// An endstop or the Z probe has stopped a move that went through non-Cartesian kinematics.
+// The motors are where the interrupt got them to; if redefine is set, the axis that hit the stop
+// is now at position, and the motor positions are adjusted to agree.  This is called from
+// the interrupt, but only once a move; for a delta it runs the kinematics.
+
+float Move::KinematicStop(int8_t axis, float position, bool redefine, LookAhead* la, DDA* hitDDA)
+{
+	float motors[AXES], c[AXES];
+	for(int8_t i = 0; i < AXES; i++)
+		motors[i] = ComputeCurrentCoordinate(i, la, hitDDA);
+	kinematics->MotorsToCartesian(motors, c);
+	if(redefine)
+	{
+		c[axis] = position;
+		if(!kinematics->CartesianToMotors(c, motors))
+			kinematics->MotorsToCartesian(motors, c);
+	}
+	for(int8_t i = 0; i < AXES; i++)
+		la->SetDriveCoordinateAndZeroEndSpeed(motors[i], i);
+	la->SetCartesianEndPoint(c);
+	return c[axis];
 }
 
 void Move::SetFeedrate(float feedRate)
@@ -305,10 +630,42 @@ void Move::SetFeedrate(float feedRate)
 	lastMove->SetFeedRate(feedRate);
 }
 
+// The interrupt may copy in a newer position while this is copying it out; if the count
+// has changed, copy it again.
+
+uint32_t Move::CompletedPrintPosition(PrintPosition& p)
+{
+	uint32_t count;
+	do
+	{
+		count = completedPrintMoves;
+		__DMB();
+		p = completedPrintPosition;
+		__DMB();
+	} while(count != completedPrintMoves);
+	return count;
+}
+
 
 void Move::Diagnostics() 
 {
   platform->Message(HOST_MESSAGE, "Move Diagnostics:\n");
+  uint32_t interval = shortestStepInterval;
+  if(interval != UINT32_MAX)
+	  snprintf(scratchString, STRING_LENGTH, "Maximum step rate (steps/second): %.1f\n", (float)STEP_CLOCK_RATE/(float)interval);
+  else
+	  snprintf(scratchString, STRING_LENGTH, "Maximum step rate (steps/second): no steps taken\n");
+  platform->Message(HOST_MESSAGE, scratchString);
+  shortestStepInterval = UINT32_MAX;
+  snprintf(scratchString, STRING_LENGTH, "Look ahead ring count: %d of %d\n", lookAheadRingCount, LOOK_AHEAD_RING_LENGTH);
+  platform->Message(HOST_MESSAGE, scratchString);
+  snprintf(scratchString, STRING_LENGTH, "DDA ring: %u of %d in use, at most %u; %u underruns (moves waiting in look-ahead, none ready to step)\n",
+		  (unsigned int)(ddaRingAdded - ddaRingFinished), DDA_RING_LENGTH, (unsigned int)ddaRingMostUsed, (unsigned int)plannerStarvedCount);
+  platform->Message(HOST_MESSAGE, scratchString);
+  plannerStarvedCount = 0;
+  ddaRingMostUsed = 0;
+  if(platform->Simulating())
+    platform->Message(HOST_MESSAGE, "Simulating: the motors are not being driven\n");
 /*  if(active)
     platform->Message(HOST_MESSAGE, " active\n");
   else
@@ -327,10 +684,6 @@ void Move::Diagnostics()
       platform->Message(HOST_MESSAGE, " dda: not active\n");
     
   }
-  if(ddaRingLocked)
-    platform->Message(HOST_MESSAGE, " dda ring is locked\n");
-  else
-    platform->Message(HOST_MESSAGE, " dda ring is not locked\n");
   if(addNoMoreMoves)
     platform->Message(HOST_MESSAGE, " addNoMoreMoves is true\n\n");
   else
@@ -343,6 +696,10 @@ void Move::Diagnostics()
 // to use the result as the basis for the
 // next move because the look ahead ring
 // is full.  True otherwise.
+// A move held for merging hasn't reached the look-ahead yet, and while a move is being cut
+// up the last look-ahead entry is only one of its pieces, so then the position is the end
+// of the held move, or of the whole move being cut up.  Merged or not, that must be where
+// the last move GCodes sent ends; if it isn't, say so.
 
 bool Move::GetCurrentMachinePosition(float m[])
 {
@@ -352,13 +709,37 @@ bool Move::GetCurrentMachinePosition(float m[])
   for(int8_t i = 0; i < DRIVES; i++)
   {
     if(i < AXES)
-      m[i] = lastMove->MachineToEndPoint(i);
-    else
+    {
+      if(movePending)
+    	m[i] = pendingMove[i];
+      else if(segmentsLeft > 0)
+    	m[i] = segmentEnd[i];
+      else
+        m[i] = lastMove->CartesianEndPoint()[i];
+    } else
       m[i] = 0.0; //FIXME This resets extruders to 0.0, even the inactive ones (is this behaviour desired?)
       //m[i] = lastMove->MachineToEndPoint(i); //FIXME TEST alternative that does not reset extruders to 0
   }
+  if(expectedPositionKnown)
+  {
+	for(int8_t axis = 0; axis < AXES; axis++)
+	{
+	  if(fabs(m[axis] - expectedPosition[axis]) > POSITION_CHECK_TOLERANCE)
+	  {
+		snprintf(scratchString, STRING_LENGTH, "Move position X%.3f Y%.3f Z%.3f is not where the last move ended: X%.3f Y%.3f Z%.3f\n",
+				m[X_AXIS], m[Y_AXIS], m[Z_AXIS], expectedPosition[X_AXIS], expectedPosition[Y_AXIS], expectedPosition[Z_AXIS]);
+		platform->Message(HOST_MESSAGE, scratchString);
+		expectedPositionKnown = false;
+		break;
+	  }
+	}
+  }
   if(currentFeedrate >= 0.0)
     m[DRIVES] = currentFeedrate;
+  else if(movePending)
+    m[DRIVES] = pendingMove[DRIVES];
+  else if(segmentsLeft > 0)
+    m[DRIVES] = segmentPosition[DRIVES];
   else
     m[DRIVES] = lastMove->FeedRate();
   currentFeedrate = -1.0;
@@ -376,194 +757,203 @@ bool Move::GetCurrentUserPosition(float m[])
 }
 
 
-//void Move::SetStepHypotenuse()
-//{
-//	  // The stepDistances array is a look-up table of the Euclidean distance
-//	  // between the start and end of a step.  If the step is just along one axis,
-//	  // it's just that axis's step length.  If it's more, it is a Pythagoran
-//	  // sum of all the axis steps that take part.
-//
-//	  float d, e;
-//	  int i, j;
-//
-//	  for(i = 0; i < (1<<DRIVES); i++)
-//	  {
-//	    d = 0.0;
-//	    for(j = 0; j < DRIVES; j++)
-//	    {
-//	       if(i & (1<<j))
-//	       {
-//	          e = 1.0/platform->DriveStepsPerUnit(j);
-//	          d += e*e;
-//	       }
-//	    }
-//	    stepDistances[i] = sqrt(d);
-//	  }
-//
-//	  // We don't want 0.  If no axes/extruders are moving these should never be used.
-//	  // But try to be safe.
-//
-//	  stepDistances[0] = 1.0/platform->DriveStepsPerUnit(AXES); //FIXME this is not multi extruder safe (but we should never get here)
-//}
+// Simulation runs G Codes through the look-ahead and the DDAs and the step interrupt in real
+// time, but Platform doesn't touch the step, direction and enable pins; it counts the steps.
+// Homing and probing moves stop at once.  So a file can be run through on the bench to
+// see how fast the planner and the interrupt keep up with it.
 
+void Move::StartSimulation()
+{
+  platform->SetSimulating(true);
+  planningCycles = 0;
+  simulationStartMoves = ddaRingAdded;
+  simulationStartTime = platform->Time();
+  ddaRingMostUsed = 0;
+  plannerStarvedCount = 0;
+  shortestStepInterval = UINT32_MAX;
+  endSpeedMoves = 0;
+  endSpeedMissTotal = 0;
+  endSpeedWorstMiss = 0;
+  endSpeedWorstPlanned = 0;
+  endSpeedWorstReached = 0;
+}
+
+void Move::SimulationReport(char* reply)
+{
+  float seconds = platform->Time() - simulationStartTime;
+  uint32_t moves = ddaRingAdded - simulationStartMoves;
+  uint32_t steps = platform->SimulatedSteps();
+  uint32_t interval = shortestStepInterval;
+  uint32_t ended = endSpeedMoves;
+  snprintf(reply, STRING_LENGTH, "%lu moves, %lu steps in %.1fs: %.0f steps/s, peak %.0f steps/s; planning %.1fus per move; DDA ring at most %u of %d, %u underruns; "
+		  "end speeds %.2fmm/s from the plan on average, at worst %.2fmm/s (planned %.2fmm/s, reached %.2fmm/s)",
+		  (unsigned long)moves, (unsigned long)steps, seconds, (seconds > 0.0) ? steps/seconds : 0.0,
+		  (interval != UINT32_MAX) ? (float)STEP_CLOCK_RATE/(float)interval : 0.0,
+		  (moves > 0) ? (float)planningCycles*1.0e6/((float)CPU_CLOCK_RATE*moves) : 0.0,
+		  (unsigned int)ddaRingMostUsed, DDA_RING_LENGTH, (unsigned int)plannerStarvedCount,
+		  (ended > 0) ? (float)endSpeedMissTotal*0.001/(float)ended : 0.0, endSpeedWorstMiss*0.001,
+		  endSpeedWorstPlanned*0.001, endSpeedWorstReached*0.001);
+}
 
 // Take an item from the look-ahead ring and add it to the DDA ring, if
-// possible.
+// possible.  The entry is finished before the count that lets the interrupt
+// see it goes up; the memory barrier stops that being reordered.
 
 bool Move::DDARingAdd(LookAhead* lookAhead)
 {
-  if(GetDDARingLock())
+  if(DDARingFull())
+    return false;
+  if(ddaRingAddPointer->Active())  // Should never happen...
   {
-    if(DDARingFull())
-    {
-      ReleaseDDARingLock();
-      return false;
-    }
-    if(ddaRingAddPointer->Active())  // Should never happen...
-    {
-      platform->Message(HOST_MESSAGE, "Attempt to alter an active ring buffer entry!\n");
-      ReleaseDDARingLock();
-      return false;
-    }
+    platform->Message(HOST_MESSAGE, "Attempt to alter an active ring buffer entry!\n");
+    return false;
+  }
 
-    // We don't care about Init()'s return value - that should all have been sorted
-    // out by LookAhead.
+  // We don't care about Init()'s return value - that should all have been sorted
+  // out by LookAhead.
     
-    float u, v;
-    ddaRingAddPointer->Init(lookAhead, u, v, false);
-    ddaRingAddPointer = ddaRingAddPointer->Next();
-    ReleaseDDARingLock();
-    return true;
-  }
-  return false;
+  float u, v;
+  ddaRingAddPointer->Init(lookAhead, u, v, false);
+  ddaRingAddPointer = ddaRingAddPointer->Next();
+  __DMB();
+  ddaRingAdded++;
+  uint32_t used = ddaRingAdded - ddaRingFinished;
+  if(used > ddaRingMostUsed)
+    ddaRingMostUsed = used;
+  return true;
 }
 
-// Get a movement from the DDA ring, if we can.
+// Get a movement from the DDA ring, if we can.  Only called from the interrupt.
 
 DDA* Move::DDARingGet()
 {
-  DDA* result = NULL;
-  if(GetDDARingLock())
-  {
-    if(DDARingEmpty())
-    {
-      ReleaseDDARingLock();
-      return NULL;
-    }
-    result = ddaRingGetPointer;
-    ddaRingGetPointer = ddaRingGetPointer->Next();
-    ReleaseDDARingLock();
-    return result;
-  }
-  return NULL;
+  if(DDARingEmpty())
+    return NULL;
+  __DMB();	// Don't look at the entry before seeing the count that says it is there
+  DDA* result = ddaRingGetPointer;
+  ddaRingGetPointer = ddaRingGetPointer->Next();
+  ddaRingTaken++;
+  return result;
 }
 
-// Do the look-ahead calculations
+// Do the look-ahead calculations.
+//
+// Planning is incremental.  When a move gets a successor, the speed limit at the junction
+// between them is set from the angle between them.  Then a backward pass runs from the
+// newest move, which is always assumed to end stopped, recalculating the fastest end
+// speed each move can have and still slow down for the moves after it.  It stops as soon
+// as a move's value doesn't change, because nothing before that can change either.  A forward
+// pass from there then limits the speeds to what can be reached by accelerating.  Moves
+// are committed (marked complete) for execution from the oldest end of the ring, so
+// any committed move can always be followed by a stop.
 
 void Move::DoLookAhead()
 {
   if(LookAheadRingEmpty())
     return;
   
+  LookAhead* newest = lookAheadRingAddPointer->Previous();
   LookAhead* n0;
   LookAhead* n1;
-  LookAhead* n2;
-  
-  float u, v;
-  
-  // If there are a reasonable number of moves in there (LOOK_AHEAD), or if we are
-  // doing single moves with no other move immediately following on, run up and down
-  // the moves using the DDA Init() function to reduce the start or the end speed
-  // or both to the maximum that can be achieved because of the requirements of
-  // the adjacent moves. 
-    
-  if(addNoMoreMoves || !gCodes->HaveIncomingData() || lookAheadRingCount > LOOK_AHEAD)
-  { 
-    
-    // Run up the moves
-    
-    n1 = lookAheadRingGetPointer;
-    n0 = n1->Previous();
-    n2 = n1->Next();
-    while(n2 != lookAheadRingAddPointer)
-    {
-      if(!(n1->Processed() & complete))
-      {
-        if(n1->Processed() & vCosineSet)
-        {
-          u = n0->V();
-          v = n1->V();
-          if(lookAheadDDA->Init(n1, u, v, false) & change)
-          {
-            n0->SetV(u);
-            n1->SetV(v); 
-          }
-        }
-      }
-      n0 = n1;
-      n1 = n2;
-      n2 = n2->Next();
-    }
-    
-    // Now run down
-    
-    do
-    { 
-      if(!(n1->Processed() & complete))
-      {
-        if(n1->Processed() & vCosineSet)
-        {
-          u = n0->V();
-          v = n1->V();
-          if(lookAheadDDA->Init(n1, u, v, false) & change)
-          {
-            n0->SetV(u);
-            n1->SetV(v); 
-          }
-          n1->SetProcessed(complete);
-        }
-      }
-      n2 = n1;
-      n1 = n0;
-      n0 = n0->Previous();      
-    }while(n0 != lookAheadRingGetPointer);
-    n0->SetProcessed(complete);
+  bool replan = false;
+  bool flush = addNoMoreMoves || !gCodes->HaveIncomingData();
+  float stopSpeed = platform->InstantDv(platform->SlowestDrive());
+
+  // The move before the newest one got its junction speed limit when the newest
+  // was added (see LookAhead::Init()); plan it if that hasn't been done.
+
+  n1 = newest->Previous();
+  if(lookAheadRingCount > 1 && n1->Processed() == vCosineSet && n1->BackwardV() < 0.0)
+    replan = true;
+
+  // If nothing is following on, the newest move must end stopped.
+  // The next thing may be the slowest; be prepared.
+
+  if(flush && newest->Processed() == unprocessed)
+  {
+    newest->SetMaxV(stopSpeed);
+    newest->SetProcessed(vCosineSet);
+    replan = true;
   }
 
-  // If there are any new unprocessed moves in there, set their end speeds
-  // according to the cosine of the angle between them.
-  
-  if(addNoMoreMoves || !gCodes->HaveIncomingData() || lookAheadRingCount > 1)
+  if(replan)
   {
-    n1 = lookAheadRingGetPointer;
-    n0 = n1->Previous();
-    n2 = n1->Next();
-    while(n2 != lookAheadRingAddPointer)
+    // Backward pass, from the last move with a known junction speed limit
+
+    LookAhead* last = (newest->Processed() == vCosineSet) ? newest : newest->Previous();
+    float b;
+    if(last == newest)
+      b = last->MaxV();
+    else
+      b = MaxStartSpeed(newest, last->MaxV(), stopSpeed);
+    n1 = last;
+    for(;;)
     {
-      if(n1->Processed() == unprocessed)
+      if(b == n1->BackwardV())
+        break;
+      n1->SetBackwardV(b);
+      n0 = n1->Previous();
+      if(n0->Processed() != vCosineSet)
       {
-        //float c = fmin(n1->FeedRate(), n2->FeedRate());
-    	float c = n1->V();
-        float m = fmin(n1->MinSpeed(), n2->MinSpeed());  // FIXME we use min as one move's max may not be able to cope with the min for the other.  But should this be max?
-        c = c*n1->Cosine();
-        if(c < m)
-        	c = m;
-        n1->SetV(c);
-        n1->SetProcessed(vCosineSet);
-      } 
-      n0 = n1;
-      n1 = n2;
-      n2 = n2->Next();
+        n1 = n0;  // Committed (or already executed) - its speed is fixed
+        break;
+      }
+      b = MaxStartSpeed(n1, n0->MaxV(), b);
+      n1 = n0;
     }
 
-    // If we are just doing one isolated move, set its end velocity to an appropriate minimum speed.
+    // Forward pass, from the start of the first move to change up to the last one
 
-    if(addNoMoreMoves || !gCodes->HaveIncomingData())
+    while(n1 != last)
     {
-    	n1->SetV(platform->InstantDv(platform->SlowestDrive())); // The next thing may be the slowest; be prepared.
-    	n1->SetProcessed(complete);
+      n0 = n1;
+      n1 = n1->Next();
+      n1->SetV(MaxEndSpeed(n1, n0->V(), n1->BackwardV()));
     }
   }
+
+  // Commit moves from the oldest end of the ring.  We keep LOOK_AHEAD moves to plan over,
+  // unless nothing more is coming, or the DDA ring is running dry.
+
+  n1 = lookAheadRingGetPointer;
+  int uncommitted = lookAheadRingCount;
+  bool committedWaiting = false;
+  while(uncommitted > 0 && (n1->Processed() & complete))
+  {
+    committedWaiting = true;
+    n1 = n1->Next();
+    uncommitted--;
+  }
+  while(uncommitted > 0 && n1->Processed() == vCosineSet &&
+		  (flush || uncommitted > LOOK_AHEAD || (!committedWaiting && DDARingEmpty())))
+  {
+    n1->SetProcessed(complete);
+    committedWaiting = true;
+    n1 = n1->Next();
+    uncommitted--;
+  }
+}
+
+// Return the fastest speed that the start of move la can have, not more than startLimit,
+// from which it can still slow down to endSpeed by the end.
+
+float Move::MaxStartSpeed(LookAhead* la, float startLimit, float endSpeed)
+{
+  float u2 = endSpeed*endSpeed + la->TwoALength();
+  if(u2 >= startLimit*startLimit)
+    return startLimit;
+  return sqrt(u2);
+}
+
+// Return the fastest speed that the end of move la can have, not more than endLimit,
+// that can be reached by accelerating from startSpeed.
+
+float Move::MaxEndSpeed(LookAhead* la, float startSpeed, float endLimit)
+{
+  float v2 = startSpeed*startSpeed + la->TwoALength();
+  if(v2 >= endLimit*endLimit)
+    return endLimit;
+  return sqrt(v2);
 }
 
 // This is the function that's called by the timer interrupt to step the motors.
@@ -595,14 +985,21 @@ void Move::Interrupt()
     return;
   }
   
-  // Yes - it's finished.  Throw it away so the code above will then find a new one.
+  // Yes - it's finished.  Throw it away so the code above will then find a new one,
+  // and give its entry back.  If there isn't one ready, but there are moves waiting in
+  // the look-ahead, the planner has starved the DDA ring.
   
   dda = NULL;
+  __DMB();	// Finish with the entry before Move::Spin() can reuse it
+  ddaRingFinished++;
+  if(DDARingEmpty() && !LookAheadRingEmpty())
+    plannerStarvedCount++;
 }
 
 // Records a new lookahead object and adds it to the lookahead ring, returns false if it's full
 
-bool Move::LookAheadRingAdd(long ep[], float requestedFeedRate, float minSpeed, float maxSpeed, float acceleration, bool ce)
+bool Move::LookAheadRingAdd(long ep[], const float cartesianEp[], float minSpeed, float maxSpeed, float acceleration, float advance, bool ce,
+		const PrintPosition* p)
 {
     if(LookAheadRingFull())
       return false;
@@ -611,7 +1008,9 @@ bool Move::LookAheadRingAdd(long ep[], float requestedFeedRate, float minSpeed,
       platform->Message(HOST_MESSAGE, "Attempt to alter a non-released lookahead ring entry!\n");
       return false;
     }
-    lookAheadRingAddPointer->Init(ep, requestedFeedRate, minSpeed, maxSpeed, acceleration, ce);
+    lookAheadRingAddPointer->Init(ep, cartesianEp, cartesianEp[DRIVES], minSpeed, maxSpeed, acceleration, advance, ce);
+    if(p != NULL)
+    	lookAheadRingAddPointer->printPosition = *p;
     lastMove = lookAheadRingAddPointer;
     lookAheadRingAddPointer = lookAheadRingAddPointer->Next();
     lookAheadRingCount++;
@@ -637,57 +1036,69 @@ LookAhead* Move::LookAheadRingGet()
 
 void Move::BedTransform(float xyzPoint[])
 {
-	if(identityBedTransform)
-		return;
-
-	switch(NumberOfProbePoints())
-	{
-	case 0:
-		return;
-
-	case 3:
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] + aX*xyzPoint[X_AXIS] + aY*xyzPoint[Y_AXIS] + aC;
-		break;
-
-	case 4:
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] + SecondDegreeTransformZ(xyzPoint[X_AXIS], xyzPoint[Y_AXIS]);
-		break;
-
-	case 5:
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] + TriangleZ(xyzPoint[X_AXIS], xyzPoint[Y_AXIS]);
-		break;
-
-	default:
-		platform->Message(HOST_MESSAGE, "BedTransform: wrong number of sample points.");
-	}
+	if(bedCompensation != noCompensation)
+		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] + BedZ(xyzPoint[X_AXIS], xyzPoint[Y_AXIS]);
 }
 
 // Invert the bed transform BEFORE the axis transform
 
 void Move::InverseBedTransform(float xyzPoint[])
 {
-	if(identityBedTransform)
-		return;
+	if(bedCompensation != noCompensation)
+		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] - BedZ(xyzPoint[X_AXIS], xyzPoint[Y_AXIS]);
+}
 
-	switch(NumberOfProbePoints())
+// Everything here was worked out by SetProbedBedEquation().  Points off
+// the probed area get the nearest triangle's plane or rectangle's surface
+// extended.
+
+float Move::BedZ(float x, float y) const
+{
+	switch(bedCompensation)
 	{
-	case 0:
-		return;
+	case planeCompensation:
+		return bedPlanes[0][0]*x + bedPlanes[0][1]*y + bedPlanes[0][2];
 
-	case 3:
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] - (aX*xyzPoint[X_AXIS] + aY*xyzPoint[Y_AXIS] + aC);
-		break;
+	case triangleCompensation:
+	{
+		// Triangle i is between the rays from the centre to corners i and i+1
 
-	case 4:
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] - SecondDegreeTransformZ(xyzPoint[X_AXIS], xyzPoint[Y_AXIS]);
-		break;
+		float dx = x - xBedProbePoints[4];
+		float dy = y - yBedProbePoints[4];
+		int8_t i;
+		bool before = triangleRays[0][0]*dy - triangleRays[0][1]*dx <= 0.0;
+		for(i = 0; i < 3; i++)
+		{
+			bool after = triangleRays[i+1][0]*dy - triangleRays[i+1][1]*dx <= 0.0;
+			if(before && !after)
+				break;
+			before = after;
+		}
+		return bedPlanes[i][0]*x + bedPlanes[i][1]*y + bedPlanes[i][2];
+	}
 
-	case 5:
-		xyzPoint[Z_AXIS] = xyzPoint[Z_AXIS] - TriangleZ(xyzPoint[X_AXIS], xyzPoint[Y_AXIS]);
-		break;
+	case gridCompensation:
+	{
+		float u = (x - gridX0)*gridXScale;
+		float v = (y - gridY0)*gridYScale;
+		int column = (int)u;
+		int row = (int)v;
+		if(column < 0 || u < 0.0)
+			column = 0;
+		else if(column >= gridColumns)
+			column = gridColumns - 1;
+		if(row < 0 || v < 0.0)
+			row = 0;
+		else if(row >= gridRows)
+			row = gridRows - 1;
+		u -= column;
+		v -= row;
+		const float* c = gridCells[row*gridColumns + column];
+		return c[0] + c[1]*u + v*(c[2] + c[3]*u);
+	}
 
 	default:
-		platform->Message(HOST_MESSAGE, "InverseBedTransform: wrong number of sample points.");
+		return 0.0;
 	}
 }
 
@@ -758,73 +1169,92 @@ void Move::SetAxisCompensation(int8_t axis, float tangent)
 	}
 }
 
-void Move::BarycentricCoordinates(int8_t p1, int8_t p2, int8_t p3, float x, float y, float& l1, float& l2, float& l3)
+void Move::SetPlane(float* plane, int8_t p0, int8_t p1, int8_t p2)
 {
-	float y23 = yBedProbePoints[p2] - yBedProbePoints[p3];
-	float x3 = x - xBedProbePoints[p3];
-	float x32 = xBedProbePoints[p3] - xBedProbePoints[p2];
-	float y3 = y - yBedProbePoints[p3];
-	float x13 = xBedProbePoints[p1] - xBedProbePoints[p3];
-	float y13 = yBedProbePoints[p1] - yBedProbePoints[p3];
-	float iDet = 1.0/(y23*x13+x32*y13);
-	l1 = (y23*x3 + x32*y3)*iDet;
-	l2 = (-y13*x3 + x13*y3)*iDet;
-	l3 = 1.0 - l1 - l2;
+	float a, b, c, d;   // Implicit plane equation - what we need to do a proper job
+
+	float x10 = xBedProbePoints[p1] - xBedProbePoints[p0];
+	float y10 = yBedProbePoints[p1] - yBedProbePoints[p0];
+	float z10 = zBedProbePoints[p1] - zBedProbePoints[p0];
+	float x20 = xBedProbePoints[p2] - xBedProbePoints[p0];
+	float y20 = yBedProbePoints[p2] - yBedProbePoints[p0];
+	float z20 = zBedProbePoints[p2] - zBedProbePoints[p0];
+	a = y10*z20 - z10*y20;
+	b = z10*x20 - x10*z20;
+	c = x10*y20 - y10*x20;
+	d = -(xBedProbePoints[p1]*a + yBedProbePoints[p1]*b + zBedProbePoints[p1]*c);
+	plane[0] = -a/c;
+	plane[1] = -b/c;
+	plane[2] = -d/c;
 }
 
-/*
- * Interpolate on a triangular grid.  The triangle corners are indexed:
- *
- *   ^  [1]      [2]
- *   |
- *   Y      [4]
- *   |
- *   |  [0]      [3]
- *      -----X---->
- *
- */
-float Move::TriangleZ(float x, float y)
+void Move::SetGridCell(int cell, int8_t p0, int8_t p1, int8_t p2, int8_t p3)
 {
-	float l1, l2, l3;
-	int8_t j;
-	for(int8_t i = 0; i < 4; i++)
+	gridCells[cell][0] = zBedProbePoints[p0];
+	gridCells[cell][1] = zBedProbePoints[p1] - zBedProbePoints[p0];
+	gridCells[cell][2] = zBedProbePoints[p2] - zBedProbePoints[p0];
+	gridCells[cell][3] = zBedProbePoints[p3] - zBedProbePoints[p2] - zBedProbePoints[p1] + zBedProbePoints[p0];
+}
+
+// A grid is probed a row at a time, starting at the lowest Y, and along each row in X.
+// The spacings must be the same all over, so the rectangle a point is in can be
+// found by a multiplication.
+
+bool Move::SetGrid(int points)
+{
+	int columns = 1;
+	while(columns < points && fabs(yBedProbePoints[columns] - yBedProbePoints[0]) <= fabs(xBedProbePoints[1] - xBedProbePoints[0])*PROBE_GRID_TOLERANCE)
+		columns++;
+	int rows = points/columns;
+	if(columns < 2 || rows < 2 || rows*columns != points || (rows - 1)*(columns - 1) > MAX_PROBE_GRID_CELLS)
+	{
+		platform->Message(HOST_MESSAGE, "Bed probe points are not a grid, probed a row at a time.\n");
+		return false;
+	}
+
+	float dx = (xBedProbePoints[columns - 1] - xBedProbePoints[0])/(columns - 1);
+	float dy = (yBedProbePoints[points - 1] - yBedProbePoints[0])/(rows - 1);
+	for(int point = 0; point < points; point++)
 	{
-		j = (i+1)%4;
-		BarycentricCoordinates(i, j, 4, x, y, l1, l2, l3);
-		if(l1 > TRIANGLE_0 && l2 > TRIANGLE_0 && l3 > TRIANGLE_0 )
-			return l1*zBedProbePoints[i] + l2*zBedProbePoints[j] + l3*zBedProbePoints[4];
+		if(fabs(xBedProbePoints[point] - xBedProbePoints[0] - dx*(point%columns)) > fabs(dx)*PROBE_GRID_TOLERANCE ||
+				fabs(yBedProbePoints[point] - yBedProbePoints[0] - dy*(point/columns)) > fabs(dy)*PROBE_GRID_TOLERANCE)
+		{
+			snprintf(scratchString, STRING_LENGTH, "Bed probe point %d is out of line with the grid.\n", point);
+			platform->Message(HOST_MESSAGE, scratchString);
+			return false;
+		}
 	}
-	platform->Message(HOST_MESSAGE, "Triangle interpolation: point outside all triangles!");
-	return 0.0;
+
+	gridX0 = xBedProbePoints[0];
+	gridY0 = yBedProbePoints[0];
+	gridXScale = 1.0/dx;
+	gridYScale = 1.0/dy;
+	gridColumns = columns - 1;
+	gridRows = rows - 1;
+	for(int row = 0; row < gridRows; row++)
+	{
+		for(int column = 0; column < gridColumns; column++)
+		{
+			int p = row*columns + column;
+			SetGridCell(row*gridColumns + column, p, p + 1, p + columns, p + columns + 1);
+		}
+	}
+	return true;
 }
 
 void Move::SetProbedBedEquation(char* reply)
 {
 	float x10, y10, z10;
-	float x20, y20, z20;
+	int points = NumberOfProbePoints();
 
-	switch(NumberOfProbePoints())
+	switch(points)
 	{
 	case 3:
 		/*
 		 * Transform to a plane
 		 */
-		float a, b, c, d;   // Implicit plane equation - what we need to do a proper job
-
-		x10 = xBedProbePoints[1] - xBedProbePoints[0];
-		y10 = yBedProbePoints[1] - yBedProbePoints[0];
-		z10 = zBedProbePoints[1] - zBedProbePoints[0];
-		x20 = xBedProbePoints[2] - xBedProbePoints[0];
-		y20 = yBedProbePoints[2] - yBedProbePoints[0];
-		z20 = zBedProbePoints[2] - zBedProbePoints[0];
-		a = y10*z20 - z10*y20;
-		b = z10*x20 - x10*z20;
-		c = x10*y20 - y10*x20;
-		d = -(xBedProbePoints[1]*a + yBedProbePoints[1]*b + zBedProbePoints[1]*c);
-		aX = -a/c;
-		aY = -b/c;
-		aC = -d/c;
-		identityBedTransform = false;
+		SetPlane(bedPlanes[0], 0, 1, 2);
+		bedCompensation = planeCompensation;
 		break;
 
 	case 4:
@@ -838,15 +1268,32 @@ void Move::SetProbedBedEquation(char* reply)
 		 *   |  [0]      [3]
 		 *      -----X---->
 		 *
-		 *   These are the scaling factors to apply to x and y coordinates to get them into the
-		 *   unit interval [0, 1].
+		 *   This is a grid of one rectangle.
 		 */
-		xRectangle = 1.0/(xBedProbePoints[3] - xBedProbePoints[0]);
-		yRectangle = 1.0/(yBedProbePoints[1] - yBedProbePoints[0]);
-		identityBedTransform = false;
+		gridX0 = xBedProbePoints[0];
+		gridY0 = yBedProbePoints[0];
+		gridXScale = 1.0/(xBedProbePoints[3] - xBedProbePoints[0]);
+		gridYScale = 1.0/(yBedProbePoints[1] - yBedProbePoints[0]);
+		gridColumns = 1;
+		gridRows = 1;
+		SetGridCell(0, 0, 3, 1, 2);
+		bedCompensation = gridCompensation;
 		break;
 
 	case 5:
+		/*
+		 * Interpolate on a triangular grid.  The triangle corners are indexed:
+		 *
+		 *   ^  [1]      [2]
+		 *   |
+		 *   Y      [4]
+		 *   |
+		 *   |  [0]      [3]
+		 *      -----X---->
+		 *
+		 * The corners are moved out to twice their distance from the centre, and each
+		 * triangle is a plane.
+		 */
 		for(int8_t i = 0; i < 4; i++)
 		{
 			x10 = xBedProbePoints[i] - xBedProbePoints[4];
@@ -855,12 +1302,31 @@ void Move::SetProbedBedEquation(char* reply)
 			xBedProbePoints[i] = xBedProbePoints[4] + 2.0*x10;
 			yBedProbePoints[i] = yBedProbePoints[4] + 2.0*y10;
 			zBedProbePoints[i] = zBedProbePoints[4] + 2.0*z10;
+			triangleRays[i][0] = x10;
+			triangleRays[i][1] = y10;
 		}
-		identityBedTransform = false;
+		for(int8_t i = 0; i < 4; i++)
+			SetPlane(bedPlanes[i], i, (i + 1)%4, 4);
+
+		// The search in BedZ() wants the corners clockwise; if they are
+		// anticlockwise, reversing the rays reverses the test.
+
+		if(triangleRays[0][0]*triangleRays[1][1] - triangleRays[0][1]*triangleRays[1][0] > 0.0)
+		{
+			for(int8_t i = 0; i < 4; i++)
+			{
+				triangleRays[i][0] = -triangleRays[i][0];
+				triangleRays[i][1] = -triangleRays[i][1];
+			}
+		}
+		bedCompensation = triangleCompensation;
 		break;
 
 	default:
-		platform->Message(HOST_MESSAGE, "Attempt to set bed compensation before all probe points have been recorded.");
+		if(points > 5 && SetGrid(points))
+			bedCompensation = gridCompensation;
+		else
+			platform->Message(HOST_MESSAGE, "Attempt to set bed compensation before all probe points have been recorded.");
 	}
 
 	snprintf(reply, STRING_LENGTH, "Bed equation fits points ");
@@ -913,11 +1379,11 @@ Sets up the DDA to take us between two positions and extrude states.
 The start velocity is u, and the end one is v.  The requested maximum feedrate
 is in myLookAheadEntry->FeedRate().
 
-Almost everything that needs to be done to set this up is also useful
-for GCode look-ahead, so this one function is used for both.  It flags when
-u and v cannot be satisfied with the distance available and reduces them 
-proportionately to give values that can just be achieved, which is why they
-are passed by reference.
+This is only called when a move is transferred from the look-ahead ring to the
+DDA ring; the look-ahead planning itself uses the lengths and unit vectors
+cached in the LookAhead entries.  It flags when u and v cannot be satisfied
+with the distance available and reduces them proportionately to give values
+that can just be achieved, which is why they are passed by reference.
 
 The return value is indicates if the move is a trapezium or triangle, and if
 the u and u values need to be changed.
@@ -1005,6 +1471,93 @@ MovementProfile DDA::AccelerationCalculation(float& u, float& v, MovementProfile
 }
 
 
+/*
+
+Pressure advance adds K times an extruder's velocity to its position, so while the move
+accelerates from u to its peak speed the extruder gets K*(peak - u)*(its share of the move)
+extra, and while it decelerates to v it loses K*(peak - v)*(its share).  Rather than
+step the extruder separately, its Bresenham delta is raised for the acceleration phase and
+lowered for the deceleration phase so that those extra steps are spread evenly over them.
+Move::AddMove() has already kept the faster rate within the extruder's limit.  The deltas
+are whole numbers and can't go past 0 or totalSteps, so the part of the advance that they
+leave out is carried into the next move.  A retraction ends the pressure, and the carry.
+
+*/
+
+void DDA::AdvanceCalculation(float u, float v)
+{
+	advancedDrives = 0;
+	float k = myLookAheadEntry->PressureAdvance();
+	if(k <= 0.0)
+	{
+		for(int8_t drive = AXES; drive < DRIVES; drive++)
+			move->advanceRemainders[drive - AXES] = 0.0;
+		return;
+	}
+	if(!extrusionMove)
+		return;
+
+	// With no cruise the peak speed is where the acceleration stops
+
+	float peak = myLookAheadEntry->FeedRate();
+	if(startDStep <= stopAStep + 1 && stopAStep >= 0)
+	{
+		float vPeak = sqrt(u*u + 2.0*acceleration*distance*(float)stopAStep/(float)totalSteps);
+		if(vPeak < peak)
+			peak = vPeak;
+	}
+	long decelerationSteps = totalSteps - startDStep;
+
+	for(int8_t drive = AXES; drive < DRIVES; drive++)
+	{
+		cruiseDelta[drive] = delta[drive];
+		if(directions[drive] != FORWARDS)
+			move->advanceRemainders[drive - AXES] = 0.0;
+		if(directions[drive] != FORWARDS || delta[drive] <= 0 || delta[drive] >= totalSteps)
+			continue;
+		float share = (float)delta[drive]/distance;		// Extruder steps per mm of the move
+		float left = move->advanceRemainders[drive - AXES];
+		float extra = 0.0;								// Steps to add while accelerating...
+		float fewer = 0.0;								// ...and to take off while decelerating
+		if(stopAStep > 0)
+		{
+			if(peak > u)
+				extra = k*(peak - u)*share;
+			if(left > 0.0)
+			{
+				extra += left;
+				left = 0.0;
+			}
+		}
+		if(decelerationSteps > 0)
+		{
+			if(peak > v)
+				fewer = k*(peak - v)*share;
+			if(left < 0.0)
+			{
+				fewer -= left;
+				left = 0.0;
+			}
+		}
+		long da = delta[drive];
+		long dd = delta[drive];
+		if(extra > 0.0)
+			da += (long)(extra*(float)totalSteps/(float)stopAStep);
+		if(fewer > 0.0)
+			dd -= (long)(fewer*(float)totalSteps/(float)decelerationSteps);
+		accelerationDelta[drive] = (da < totalSteps) ? da : totalSteps;
+		decelerationDelta[drive] = (dd > 0) ? dd : 0;
+		if(stopAStep > 0)
+			left += extra - (float)(accelerationDelta[drive] - delta[drive])*(float)stopAStep/(float)totalSteps;
+		if(decelerationSteps > 0)
+			left -= fewer - (float)(delta[drive] - decelerationDelta[drive])*(float)decelerationSteps/(float)totalSteps;
+		move->advanceRemainders[drive - AXES] = left;
+		advancedDrives |= 1<<drive;
+		if(stopAStep > 0)
+			delta[drive] = accelerationDelta[drive];
+	}
+}
+
 MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v, bool debug)
 {
   int8_t drive;
@@ -1013,8 +1566,6 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v, bool debug)
   myLookAheadEntry = lookAhead;
   MovementProfile result = moving;
   totalSteps = -1;
-  distance = 0.0;
-  float d;
   long* targetPosition = myLookAheadEntry->MachineCoordinates();
   v = myLookAheadEntry->V();
   long* positionNow = myLookAheadEntry->Previous()->MachineCoordinates();
@@ -1022,21 +1573,25 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v, bool debug)
   checkEndStops = myLookAheadEntry->CheckEndStops();
   int8_t bigDirection;
 
-  // How far are we going, both in steps and in mm?
+  // How far are we going, both in steps and in mm?  The look-ahead entry worked that
+  // out when it was made, unless an endstop has since moved where the last move ended.
+
+  const long* steps = myLookAheadEntry->Steps();
+  for(drive = 0; drive < AXES; drive++)
+  {
+	if(targetPosition[drive] - positionNow[drive] != steps[drive])
+	{
+		myLookAheadEntry->CacheGeometry();
+		break;
+	}
+  }
+  distance = myLookAheadEntry->Length();
   
   for(drive = 0; drive < DRIVES; drive++)
   {
-    if(drive < AXES) // X, Y, & Z
-      delta[drive] = targetPosition[drive] - positionNow[drive];  // XYZ Absolute
-    else
-    {
-      delta[drive] = targetPosition[drive];  // Es Relative
-      if(delta[drive])
-    	  extrusionMove = true;
-    }
-
-    d = myLookAheadEntry->MachineToEndPoint(drive, delta[drive]);
-    distance += d*d;
+    delta[drive] = steps[drive];
+    if(drive >= AXES && delta[drive])
+    	extrusionMove = true;
     
     if(delta[drive] >= 0)
       directions[drive] = FORWARDS;
@@ -1070,11 +1625,29 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v, bool debug)
   counter[0] = -totalSteps/2;
   for(drive = 1; drive < DRIVES; drive++)
     counter[drive] = counter[0];
+
+  movingDriveCount = 0;
+  for(drive = 0; drive < DRIVES; drive++)
+  {
+    if(delta[drive] > 0)
+      movingDrives[movingDriveCount++] = drive;
+  }
+
+  // CoreXY endstops are on the X and Y axes, not on the motors, so check the
+  // ones for the axes the move goes along.
+
+  endStopsToCheck = 0;
+  if(checkEndStops && move->kinematics->Type() == coreXYKinematics)
+  {
+	for(drive = 0; drive < DRIVES; drive++)
+	{
+		if((drive < AXES) ? myLookAheadEntry->unitVector[drive] != 0.0 : delta[drive] > 0)
+			endStopsToCheck |= 1<<drive;
+	}
+  }
   
   // Acceleration and velocity calculations
   
-  distance = sqrt(distance);
-  
   // Decide the appropriate acceleration and instantDv values
   // timeStep is set here to the distance of the
   // biggest-move axis step.  It will be divided
@@ -1087,6 +1660,7 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v, bool debug)
   timeStep = distance/(float)totalSteps;
 
   result = AccelerationCalculation(u, v, result);
+  AdvanceCalculation(u, v);
   
   // The initial velocity
   
@@ -1110,6 +1684,28 @@ MovementProfile DDA::Init(LookAhead* lookAhead, float& u, float& v, bool debug)
   
   timeStep = timeStep/velocity;
   //timeStep = sqrt(2.0*timeStep/acceleration);
+
+  // Everything the interrupt needs is converted to fixed point here, so
+  // Step() does no floating point arithmetic.  Rates are for the drive
+  // that makes the most steps.
+
+  float rateScale = (float)(1 << STEP_RATE_SHIFT)*(float)totalSteps/distance;
+  stepRate = (uint32_t)(velocity*rateScale);
+  cruiseRate = (uint32_t)(myLookAheadEntry->FeedRate()*rateScale);
+  plannedEndRate = (uint32_t)(myLookAheadEntry->V()*rateScale);
+  rateToSpeed = (uint32_t)(1000.0*(float)(1 << SPEED_SHIFT)/rateScale);
+  slowestRate = (uint32_t)(instantDv*rateScale);
+  if(slowestRate < 1)
+	  slowestRate = 1;
+  if(cruiseRate < slowestRate)
+	  cruiseRate = slowestRate;
+  if(stepRate < slowestRate)
+	  stepRate = slowestRate;
+  if(stepRate > cruiseRate)
+	  stepRate = cruiseRate;
+  accelerationPerTick = (uint32_t)(acceleration*rateScale*(float)(1 << ACCELERATION_SHIFT)/(float)STEP_CLOCK_RATE);
+  cruiseInterval = ((uint32_t)STEP_CLOCK_RATE << STEP_RATE_SHIFT)/cruiseRate;
+  stepInterval = ((uint32_t)STEP_CLOCK_RATE << STEP_RATE_SHIFT)/stepRate;
   
   if(debug)
   {
@@ -1129,16 +1725,31 @@ void DDA::Start()
   for(int8_t drive = 0; drive < DRIVES; drive++)
     platform->SetDirection(drive, directions[drive]);
 
+  // Enable the drives here, so the interrupt doesn't have to check
+
+  for(int8_t i = 0; i < movingDriveCount; i++)
+    platform->Enable(movingDrives[i]);
 
   if(extrusionMove)
 	  platform->ExtrudeOn();
   else
 	  platform->ExtrudeOff();
 
-  platform->SetInterrupt(timeStep); // seconds
+  platform->SetInterruptTicks(stepInterval);
   active = true;  
 }
 
+bool DDA::StopDrive(int8_t drive)
+{
+  delta[drive] = 0;
+  for(int8_t i = 0; i < movingDriveCount; i++)
+  {
+	if(delta[movingDrives[i]] > 0)
+		return true;
+  }
+  return false;
+}
+
 void DDA::Step()
 {
   if(!active)
@@ -1147,34 +1758,47 @@ void DDA::Step()
   if(!move->active)
 	  return;
 
-  int drivesMoving = 0;
-  
-  for(int8_t drive = 0; drive < DRIVES; drive++)
+  // Work out which drives step on this tick in one pass over the drives
+  // that move at all, then step them together.
+
+  uint32_t drivesStepping = 0;
+  int8_t drive;
+
+  for(int8_t i = 0; i < movingDriveCount; i++)
   {
+    drive = movingDrives[i];
     counter[drive] += delta[drive];
     if(counter[drive] > 0)
     {
-      platform->Step(drive);
-
       counter[drive] -= totalSteps;
-      
-      drivesMoving |= 1<<drive;
+      drivesStepping |= 1<<drive;
+    }
+  }
 
-      // Hit anything?
-  
-      if(checkEndStops)
+  platform->StepDrives(drivesStepping);
+
+  // Hit anything?
+
+  if(checkEndStops)
+  {
+    uint32_t checking = (endStopsToCheck != 0) ? endStopsToCheck : drivesStepping;
+    while(checking)
+    {
+      drive = __builtin_ctz(checking);
+      checking &= checking - 1;
+      EndStopHit esh = platform->Stopped(drive);
+      if(esh == lowHit)
       {
-        EndStopHit esh = platform->Stopped(drive);
-        if(esh == lowHit)
-        {
-          move->HitLowStop(drive, myLookAheadEntry, this);
-          active = false;
-        }
-        if(esh == highHit)
-        {
-          move->HitHighStop(drive, myLookAheadEntry, this);
-          active = false;
-        }
+        move->HitLowStop(drive, myLookAheadEntry, this);
+        active = false;
+      }
+      if(esh == highHit)
+      {
+        move->HitHighStop(drive, myLookAheadEntry, this);
+        if(drive < AXES && move->kinematics->Type() == deltaKinematics)
+        	active = active && StopDrive(drive);	// The other towers carry on to their own endstops
+        else
+        	active = false;
       }
     }
   }
@@ -1183,50 +1807,81 @@ void DDA::Step()
   
   if(active) 
   {
-	  timeStep = distance/(totalSteps * velocity);
-      //timeStep = move->stepDistances[drivesMoving]/velocity;
-      
-    // Simple Euler integration to get velocities.
-    // Maybe one day do a Runge-Kutta?
-	//  char s[50];
-	  if(stepCount < stopAStep)
-	  {
-		  velocity += acceleration*timeStep;
-		  if (velocity > myLookAheadEntry->FeedRate())
-		  {
-			  velocity = myLookAheadEntry->FeedRate();
-		  }
-		  //snprintf(s, 50, "V: %.4f, D: %.4f\n", velocity, move->stepDistances[drivesMoving]);
-		 // platform->Message(HOST_MESSAGE, s);
-	  }
-	  if(stepCount >= startDStep)
-	  {
-		  velocity -= acceleration*timeStep;
-		  if (velocity < instantDv)
-		  {
-			  velocity = instantDv;
-		  }
-		 // snprintf(s, 50, "V: %.4f, D: %.4f\n", velocity, move->stepDistances[drivesMoving]);
-		  //platform->Message(HOST_MESSAGE, s);
-	  }
-    
-    // Euler is only approximate.
-/*
-// 78 -> 96 #2
-    if(velocity < 0.0) //instantDv)
-      velocity = instantDv;
-*/
+	// Simple Euler integration to get velocities, all in fixed point.
+	// The rate change is the acceleration times the interval just gone.
+	// Maybe one day do a Runge-Kutta?
+
+	if(stepCount < stopAStep && stepRate < cruiseRate)
+	{
+		stepRate += (uint32_t)(((uint64_t)accelerationPerTick*stepInterval) >> ACCELERATION_SHIFT);
+		if(stepRate >= cruiseRate)
+		{
+			stepRate = cruiseRate;
+			stepInterval = cruiseInterval;
+		} else
+			stepInterval = ((uint32_t)STEP_CLOCK_RATE << STEP_RATE_SHIFT)/stepRate;
+	}
+	if(stepCount >= startDStep && stepRate > slowestRate)
+	{
+		uint32_t dr = (uint32_t)(((uint64_t)accelerationPerTick*stepInterval) >> ACCELERATION_SHIFT);
+		if(stepRate > slowestRate + dr)
+			stepRate -= dr;
+		else
+			stepRate = slowestRate;
+		stepInterval = ((uint32_t)STEP_CLOCK_RATE << STEP_RATE_SHIFT)/stepRate;
+	}
+
+	if(stepInterval < move->shortestStepInterval)
+		move->shortestStepInterval = stepInterval;
+
     stepCount++;
     active = stepCount < totalSteps;
+
+    // Change the advanced extruders' rates at the ends of the acceleration and of the cruise
+
+    if(advancedDrives && (stepCount == stopAStep || stepCount == startDStep))
+    {
+    	long* newDelta = (stepCount == startDStep) ? decelerationDelta : cruiseDelta;
+    	uint32_t drives = advancedDrives;
+    	while(drives)
+    	{
+    		drive = __builtin_ctz(drives);
+    		drives &= drives - 1;
+    		delta[drive] = newDelta[drive];
+    	}
+    }
     
-    platform->SetInterrupt(timeStep);
+    platform->SetInterruptTicks(stepInterval);
   }
   
   if(!active)
   {
+	if(stepCount >= totalSteps)
+	{
+		// Compare the speed the move ended at with the one the look-ahead planned
+		// for it, in micrometres/second so moves of different drives can be compared
+
+		uint32_t planned = (uint32_t)(((uint64_t)plannedEndRate*rateToSpeed) >> SPEED_SHIFT);
+		uint32_t reached = (uint32_t)(((uint64_t)stepRate*rateToSpeed) >> SPEED_SHIFT);
+		uint32_t miss = (reached > planned) ? reached - planned : planned - reached;
+		move->endSpeedMoves++;
+		move->endSpeedMissTotal += miss;
+		if(miss > move->endSpeedWorstMiss)
+		{
+			move->endSpeedWorstMiss = miss;
+			move->endSpeedWorstPlanned = planned;
+			move->endSpeedWorstReached = reached;
+		}
+	}
 	for(int8_t drive = 0; drive < DRIVES; drive++)
-		move->liveCoordinates[drive] = myLookAheadEntry->MachineToEndPoint(drive); // Don't use SetLiveCoordinates because that applies the transform
+		move->liveCoordinates[drive] = myLookAheadEntry->MachineToEndPoint(drive); // Motor positions; LiveCoordinates() applies the kinematics
 	move->liveCoordinates[DRIVES] = myLookAheadEntry->FeedRate();
+	if(myLookAheadEntry->printPosition.filePosition >= 0)
+	{
+		move->completedPrintPosition = myLookAheadEntry->printPosition;
+		__DMB();
+		move->completedPrintMoves++;
+	}
     myLookAheadEntry->Release();
     platform->SetInterrupt(STANDBY_INTERRUPT_RATE);
     platform->ExtrudeOff();
@@ -1240,15 +1895,22 @@ LookAhead::LookAhead(Move* m, Platform* p, LookAhead* n)
   move = m;
   platform = p;
   next = n;
+  for(int8_t drive = 0; drive < DRIVES; drive++)
+	  endPoint[drive] = 0;
+  for(int8_t axis = 0; axis < AXES; axis++)
+	  cartesian[axis] = 0.0;
+  cartesianStale = false;
 }
 
-void LookAhead::Init(long ep[], float fRate, float minS, float maxS, float acc, bool ce)
+void LookAhead::Init(long ep[], const float cartesianEp[], float fRate, float minS, float maxS, float acc, float adv, bool ce)
 {
   v = fRate;
   requestedFeedrate = fRate;
   minSpeed = minS;
   maxSpeed = maxS;
   acceleration = acc;
+  pressureAdvance = adv;
+  printPosition.filePosition = -1;
 
   if(v < minSpeed)
   {
@@ -1263,68 +1925,95 @@ void LookAhead::Init(long ep[], float fRate, float minS, float maxS, float acc,
 
   for(int8_t i = 0; i < DRIVES; i++)
     endPoint[i] = ep[i];
+  SetCartesianEndPoint(cartesianEp);
   
   checkEndStops = ce;
-  
-  // Cosines are lazily evaluated; flag this
-  // as unevaluated
-  
-  cosine = 2.0;
-    
-  // Only bother with lookahead when we
-  // are printing a file, so set processed
-  // complete when we aren't.
-  
-  if(reprap.GetGCodes()->HaveIncomingData())
-    processed = unprocessed;
-  else
-    processed = complete|vCosineSet;
+  CacheGeometry();
+
+  // Not planned yet - nothing is known about the junction speed
+  // at the end of this move until the next one arrives.
+
+  maxV = v;
+  backwardV = -1.0;
+  processed = unprocessed;
+
+  // But we now know the junction speed at the end of the previous move, if it is still
+  // waiting for one.  Set it according to the cosine of the angle between the two.
+
+  if(previous->processed == unprocessed)
+  {
+	  float c = previous->requestedFeedrate*previous->Cosine();
+	  float m = fmin(previous->minSpeed, minSpeed);  // FIXME we use min as one move's max may not be able to cope with the min for the other.  But should this be max?
+	  if(c < m)
+		  c = m;
+	  previous->maxV = c;
+	  previous->processed = vCosineSet;
+  }
 }
 
 
-// This returns the cosine of the angle between
-// the movement up to this, and the movement
-// away from this.  Uses lazy evaluation.
+// Cache what the planner and the DDA need: the steps each drive makes, the length
+// of the move, its direction as a unit vector, and twice its acceleration times its
+// length (v^2 = u^2 + 2as).  Absolute moves for axes; relative for extruders.  The
+// direction and length are in XYZ, whatever the motors do.
 
-float LookAhead::Cosine()
+void LookAhead::CacheGeometry()
 {
-  if(cosine < 1.5)
-    return cosine;
-    
-  cosine = 0.0;
-  float a2 = 0.0;
-  float b2 = 0.0;
-  float m1;
-  float m2;
+  float d;
+  const float* start = previous->CartesianEndPoint();
+  const float* end = CartesianEndPoint();
+  length = 0.0;
   for(int8_t drive = 0; drive < DRIVES; drive++)
   {
-	  m1 = MachineToEndPoint(drive);
-
-	  // Absolute moves for axes; relative for extruders
-
 	  if(drive < AXES)
 	  {
-		  m2 = Next()->MachineToEndPoint(drive) - m1;
-		  m1 = m1 - Previous()->MachineToEndPoint(drive);
+		  steps[drive] = endPoint[drive] - previous->endPoint[drive];
+		  d = end[drive] - start[drive];
 	  } else
 	  {
-		  m2 = Next()->MachineToEndPoint(drive);
+		  steps[drive] = endPoint[drive];
+		  d = MachineToEndPoint(drive, steps[drive]);
 	  }
-	  a2 += m1*m1;
-	  b2 += m2*m2;
-	  cosine += m1*m2;
+	  unitVector[drive] = d;
+	  length += d*d;
   }
-  
-  if(a2 <= 0.0 || b2 <= 0.0) // Avoid division by 0.0
+  length = sqrt(length);
+  if(length > 0.0)
   {
-	cosine = 0.0;
-    return cosine;
+	  d = 1.0/length;
+	  for(int8_t drive = 0; drive < DRIVES; drive++)
+		  unitVector[drive] *= d;
   }
- 
-  cosine = cosine/( (float)sqrt(a2*b2) );
+  twoALength = 2.0*acceleration*length;
+}
+
+// This returns the cosine of the angle between
+// the movement up to this, and the movement
+// away from this.
+
+float LookAhead::Cosine()
+{
+  float cosine = 0.0;
+  for(int8_t drive = 0; drive < DRIVES; drive++)
+	  cosine += unitVector[drive]*next->unitVector[drive];
   return cosine;
 }
 
+// If an endstop has moved the motor endpoints, the XYZ one is worked out again from them.
+
+const float* LookAhead::CartesianEndPoint()
+{
+	if(cartesianStale)
+	{
+		float motors[AXES];
+		for(int8_t axis = 0; axis < AXES; axis++)
+			motors[axis] = MachineToEndPoint(axis);
+		cartesianStale = false;
+		move->GetKinematics()->MotorsToCartesian(motors, cartesian);
+	}
+	return cartesian;
+}
+
 //Returns units (mm) from steps for a particular drive
 float LookAhead::MachineToEndPoint(int8_t drive, long coord)
 {
@@ -1354,3 +2043,155 @@ void LookAhead::PrintMove()
 
 
 
+
+//***************************************************************************************************
+
+// The kinematics
+
+Kinematics::Kinematics()
+{
+}
+
+void Kinematics::Init()
+{
+	type = cartesianKinematics;
+	diagonalRod = 0.0;
+	radius = 0.0;
+	homedHeight = 0.0;
+	diagonalRodSquared = 0.0;
+	segmentsPerSecond = DELTA_SEGMENTS_PER_SECOND;
+}
+
+void Kinematics::SetCartesian()
+{
+	type = cartesianKinematics;
+}
+
+void Kinematics::SetCoreXY()
+{
+	type = coreXYKinematics;
+}
+
+// The towers are at 210, 330 and 90 degrees round the origin, which is the middle of the bed.
+
+void Kinematics::SetDelta(float rod, float deltaRadius, float height)
+{
+	type = deltaKinematics;
+	diagonalRod = rod;
+	radius = deltaRadius;
+	homedHeight = height;
+	diagonalRodSquared = rod*rod;
+	const float angles[AXES] = { 210.0, 330.0, 90.0 };
+	for(int8_t tower = 0; tower < AXES; tower++)
+	{
+		towerX[tower] = radius*cos(angles[tower]*PI/180.0);
+		towerY[tower] = radius*sin(angles[tower]*PI/180.0);
+	}
+}
+
+bool Kinematics::CartesianToMotors(const float c[], float m[]) const
+{
+	switch(type)
+	{
+	case coreXYKinematics:
+		m[X_AXIS] = c[X_AXIS] + c[Y_AXIS];
+		m[Y_AXIS] = c[X_AXIS] - c[Y_AXIS];
+		m[Z_AXIS] = c[Z_AXIS];
+		return true;
+
+	case deltaKinematics:
+		// Each carriage is a rod's length from the effector
+
+		for(int8_t tower = 0; tower < AXES; tower++)
+		{
+			float dx = c[X_AXIS] - towerX[tower];
+			float dy = c[Y_AXIS] - towerY[tower];
+			float h2 = diagonalRodSquared - dx*dx - dy*dy;
+			if(h2 <= 0.0)
+				return false;
+			m[tower] = c[Z_AXIS] + sqrt(h2);
+		}
+		return true;
+
+	case cartesianKinematics:
+	default:
+		for(int8_t axis = 0; axis < AXES; axis++)
+			m[axis] = c[axis];
+		return true;
+	}
+}
+
+/*
+
+Delta forward kinematics.  The effector is at the intersection of three spheres of
+the rod's radius round the carriages.  Subtracting the first tower's sphere from those of
+the other two gives two planes, on which x and y are linear in z.  Putting those back in the
+first sphere gives a quadratic in z; the effector is the lower root.
+
+*/
+
+void Kinematics::MotorsToCartesian(const float m[], float c[]) const
+{
+	switch(type)
+	{
+	case coreXYKinematics:
+		c[X_AXIS] = 0.5*(m[X_AXIS] + m[Y_AXIS]);
+		c[Y_AXIS] = 0.5*(m[X_AXIS] - m[Y_AXIS]);
+		c[Z_AXIS] = m[Z_AXIS];
+		return;
+
+	case deltaKinematics:
+	{
+		float k[AXES];
+		for(int8_t tower = 0; tower < AXES; tower++)
+			k[tower] = towerX[tower]*towerX[tower] + towerY[tower]*towerY[tower] + m[tower]*m[tower];
+
+		// a_i x + b_i y = e_i + g_i z for towers 1 and 2 against tower 0
+
+		float a1 = 2.0*(towerX[1] - towerX[0]), b1 = 2.0*(towerY[1] - towerY[0]);
+		float a2 = 2.0*(towerX[2] - towerX[0]), b2 = 2.0*(towerY[2] - towerY[0]);
+		float e1 = k[1] - k[0], g1 = -2.0*(m[1] - m[0]);
+		float e2 = k[2] - k[0], g2 = -2.0*(m[2] - m[0]);
+		float det = 1.0/(a1*b2 - a2*b1);
+		float x0 = (e1*b2 - e2*b1)*det, xz = (g1*b2 - g2*b1)*det;
+		float y0 = (a1*e2 - a2*e1)*det, yz = (a1*g2 - a2*g1)*det;
+
+		float dx = x0 - towerX[0];
+		float dy = y0 - towerY[0];
+		float a = xz*xz + yz*yz + 1.0;
+		float b = 2.0*(dx*xz + dy*yz - m[0]);
+		float cc = dx*dx + dy*dy + m[0]*m[0] - diagonalRodSquared;
+		float disc = b*b - 4.0*a*cc;
+		float z = (-b - sqrt((disc > 0.0) ? disc : 0.0))/(2.0*a);
+		c[X_AXIS] = x0 + xz*z;
+		c[Y_AXIS] = y0 + yz*z;
+		c[Z_AXIS] = z;
+		return;
+	}
+
+	case cartesianKinematics:
+	default:
+		for(int8_t axis = 0; axis < AXES; axis++)
+			c[axis] = m[axis];
+		return;
+	}
+}
+
+void Kinematics::Print(char* reply) const
+{
+	switch(type)
+	{
+	case coreXYKinematics:
+		snprintf(reply, STRING_LENGTH, "Kinematics: CoreXY");
+		break;
+
+	case deltaKinematics:
+		snprintf(reply, STRING_LENGTH, "Kinematics: delta, diagonal rod %.2fmm, radius %.2fmm, homed height %.2fmm, %.0f segments/second",
+				diagonalRod, radius, homedHeight, segmentsPerSecond);
+		break;
+
+	case cartesianKinematics:
+	default:
+		snprintf(reply, STRING_LENGTH, "Kinematics: Cartesian");
+	}
+}
@@ -21,9 +21,12 @@ Licence: GPL
 #ifndef MOVE_H
 #define MOVE_H
 
-#define DDA_RING_LENGTH 5
-#define LOOK_AHEAD_RING_LENGTH 30
-#define LOOK_AHEAD 20         // Must be less than LOOK_AHEAD_RING_LENGTH
+#define DDA_RING_LENGTH 5			// Moves queued for the step interrupt, counting the one it is running; all are used
+#define LOOK_AHEAD_RING_LENGTH 40  // Set the size of the look-ahead ring here; it is allocated at construction
+#define LOOK_AHEAD 30         // Moves kept for planning before the oldest is committed.  Must be less than LOOK_AHEAD_RING_LENGTH
+#define STEP_RATE_SHIFT 8     // DDA step rates are fixed point steps/second with this many fraction bits
+#define ACCELERATION_SHIFT 16 // Extra fraction bits for the per-tick step rate change
+#define SPEED_SHIFT 24        // Fraction bits of a DDA's factor from step rate to micrometres/second
 
 
 enum MovementProfile
@@ -53,6 +56,62 @@ enum PointCoordinateSet
 	zSet = 4
 };
 
+// How the probed bed heights are interpolated
+
+enum BedCompensation
+{
+	noCompensation = 0,
+	planeCompensation = 1,		// Three points
+	triangleCompensation = 2,	// Five points: four triangles round a centre
+	gridCompensation = 3		// Four corners, or a grid of more than five points
+};
+
+// The geometry that turns XYZ positions into motor positions
+
+enum KinematicsType
+{
+	cartesianKinematics = 0,	// Each motor drives one axis
+	coreXYKinematics = 1,		// Motor A moves X+Y, motor B moves X-Y, Z is Cartesian
+	deltaKinematics = 2			// Three towers, with carriages that move the effector on diagonal rods
+};
+
+/**
+ * This class converts between Cartesian (XYZ) positions and motor positions, all in mm.  The
+ * planner works in XYZ; the DDAs step the motors.  Only the first AXES entries of the arrays
+ * are touched - extruders are the same for all of them.
+ */
+class Kinematics
+{
+public:
+
+	Kinematics();
+	void Init();
+	KinematicsType Type() const;
+	bool Linear() const;											// Do straight lines in XYZ give straight lines for the motors?
+	void SetCartesian();
+	void SetCoreXY();
+	void SetDelta(float rod, float deltaRadius, float height);		// Diagonal rod length, tower radius and homed height (mm)
+	float DiagonalRod() const;
+	float Radius() const;
+	float HomedHeight() const;										// The nozzle's Z with all the carriages at the top
+	float HomedCarriageHeight() const;								// A tower's motor position at its endstop
+	float SegmentsPerSecond() const;								// How finely non-linear moves are cut up
+	void SetSegmentsPerSecond(float s);
+	bool CartesianToMotors(const float c[], float m[]) const;		// Inverse kinematics; false if the point can't be reached
+	void MotorsToCartesian(const float m[], float c[]) const;		// Forward kinematics
+	void Print(char* reply) const;									// Say what it is
+
+private:
+
+	KinematicsType type;
+	float diagonalRod;
+	float radius;
+	float homedHeight;
+	float segmentsPerSecond;
+	float towerX[AXES], towerY[AXES];								// Where the delta towers are
+	float diagonalRodSquared;
+};
+
 /**
  * This class implements a look-ahead buffer for moves.  It allows colinear
  * moves not to decelerate between them, sets velocities at ends and beginnings
@@ -67,20 +126,31 @@ class LookAhead
 protected:
 
 	LookAhead(Move* m, Platform* p, LookAhead* n);
-	void Init(long ep[], float requsestedFeedRate, float minSpeed, 		// Set up this move
-			float maxSpeed, float acceleration, bool ce);
+	void Init(long ep[], const float cartesianEp[],						// Set up this move
+			float requsestedFeedRate, float minSpeed,
+			float maxSpeed, float acceleration, float advance, bool ce);
 	LookAhead* Next();													// Next one in the ring
 	LookAhead* Previous();												// Previous one in the ring
 	long* MachineCoordinates();											// Endpoints of a move in machine coordinates
 	float MachineToEndPoint(int8_t drive);								// Convert a move endpoint to real mm coordinates
 	static float MachineToEndPoint(int8_t drive, long coord);			// Convert any number to a real coordinate
 	static long EndPointToMachine(int8_t drive, float coord);			// Convert real mm to a machine coordinate
+	const float* CartesianEndPoint();									// Where the move ends in XYZ (main loop only)
+	void SetCartesianEndPoint(const float c[]);							// Set that once the motor endpoints agree with it
 	float FeedRate();													// How fast is the set speed for this move
 	float MinSpeed();													// What is the slowest that this move can be
 	float MaxSpeed();													// What is the fastest this move can be
 	float Acceleration();												// What is the acceleration available for this move
+	float PressureAdvance();											// The extruder advance (seconds) for this move
 	float V();															// The speed at the end of the move
 	void SetV(float vv);												// Set the end speed
+	float MaxV();														// The speed limit at the junction with the next move
+	void SetMaxV(float vv);												// Set that
+	float BackwardV();													// The end speed from the last backward planning pass
+	float TwoALength();													// 2*acceleration*length of this move
+	float Length();														// The length of this move (mm)
+	const long* Steps();												// The steps (signed) each drive makes in this move
+	void SetBackwardV(float vv);										// Set that
 	void SetFeedRate(float f);											// Set the desired feedrate
 	int8_t Processed();													// Where we are in the look-ahead prediction sequence
 	void SetProcessed(MovementState ms);								// Set where we are the the look ahead processing
@@ -96,14 +166,24 @@ private:
 	LookAhead* next;				// Next entry in the ring
 	LookAhead* previous;			// Previous entry in the ring
 	long endPoint[DRIVES+1];  		// Machine coordinates of the endpoint.  Should never use the +1, but safety first
-	float Cosine();					// The angle between the previous move and this one
+	float Cosine();					// The angle between this move and the next one
+	void CacheGeometry();			// Work out steps, unitVector, length and twoALength from the endpoints
     bool checkEndStops;				// Check endstops for this move
-    float cosine;					// Store for the cosine value - the function uses lazy evaluation
+    long steps[DRIVES];				// How far each drive moves (steps)
+    float cartesian[AXES];			// The XYZ endpoint...
+    volatile bool cartesianStale;	// ...which an endstop may have left to be worked out again from the motors
+    float unitVector[DRIVES];		// The direction of the move in real (mm) coordinates, unit length
+    float length;					// The length of the move (mm)
+    float twoALength;				// 2*acceleration*length, for the planner's v^2 = u^2 + 2as
     float v;        				// The feedrate we can actually do
+    float maxV;						// The junction speed limit at the end of this move
+    float backwardV;				// The end speed the backward planning pass last gave (-ve if not yet planned)
     float requestedFeedrate; 		// The requested feedrate
     float minSpeed;					// The slowest that this move may run at
     float maxSpeed;					// The fastest this move may run at
     float acceleration;				// The fastest acceleration allowed
+    float pressureAdvance;			// Seconds of extruder velocity to add in as extra extrusion
+    PrintPosition printPosition;	// Where finishing this move leaves the file being printed (filePosition -1 if nowhere)
     volatile int8_t processed;		// The stage in the look ahead process that this move is at.
 };
 
@@ -119,7 +199,7 @@ class DDA
 protected:
 
 	DDA(Move* m, Platform* p, DDA* n);
-	MovementProfile Init(LookAhead* lookAhead, float& u, float& v, bool debug); // Set up the DDA.  Also used experimentally in look ahead.
+	MovementProfile Init(LookAhead* lookAhead, float& u, float& v, bool debug); // Set up the DDA when it goes into the DDA ring
 	void Start();													// Start executing the DDA.  I.e. move the move.
 	void Step();													// Take one step of the DDA.  Called by timed interrupt.
 	bool Active();													// Is the DDA running?
@@ -130,19 +210,36 @@ private:
 
 	MovementProfile AccelerationCalculation(float& u, float& v, 	// Compute acceleration profiles
 			MovementProfile result);
+	void AdvanceCalculation(float u, float v);						// Work out the extruder step rates for pressure advance
+	bool StopDrive(int8_t drive);									// Stop one drive; return whether any others are still going
 
 	Move* move;								// The main movement control class
 	Platform* platform;						// The RepRap machine
 	DDA* next;								// The next one in the ring
 	LookAhead* myLookAheadEntry;			// The look-ahead entry corresponding to this DDA
 	long counter[DRIVES];					// Step counters
-	long delta[DRIVES];						// How far to move each drive
+	long delta[DRIVES];						// How far to move each drive (in the current phase for advanced extruders)
+	long cruiseDelta[DRIVES];				// Advanced extruders' deltas while cruising...
+	long accelerationDelta[DRIVES];			// ...accelerating...
+	long decelerationDelta[DRIVES];			// ...and decelerating
+	uint32_t advancedDrives;				// Bitmap of the extruders whose deltas change with the phase of the move
 	bool directions[DRIVES];				// Forwards or backwards?
+	int8_t movingDrives[DRIVES];			// The drives that have steps to make in this move
+	int8_t movingDriveCount;				// How many of them there are
 	long totalSteps;						// Total number of steps for this move
 	long stepCount;							// How many steps we have already taken
 	bool checkEndStops;						// Are we checking endstops?
-    float timeStep;							// The current timestep (seconds)
-    float velocity;							// The current velocity
+	uint32_t endStopsToCheck;				// Which, if not the ones whose drives step (CoreXY checks the axes that move)
+    float timeStep;							// The initial timestep (seconds) - only used by Init() and debugging
+    float velocity;							// The initial velocity - only used by Init() and debugging
+    uint32_t stepInterval;					// The current time between steps (STEP_CLOCK_RATE ticks)
+    uint32_t stepRate;						// The current step rate of the biggest drive (steps/second << STEP_RATE_SHIFT)
+    uint32_t cruiseRate;					// The step rate at the requested feedrate (steps/second << STEP_RATE_SHIFT)
+    uint32_t cruiseInterval;				// The time between steps at the requested feedrate (ticks)
+    uint32_t slowestRate;					// The step rate at instantDv (steps/second << STEP_RATE_SHIFT)
+    uint32_t plannedEndRate;				// The step rate the look-ahead planned for the end of the move (steps/second << STEP_RATE_SHIFT)
+    uint32_t rateToSpeed;					// Step rate to micrometres/second (<< SPEED_SHIFT), to compare moves' end speeds
+    uint32_t accelerationPerTick;			// Step rate change per tick (steps/second^2 << (STEP_RATE_SHIFT + ACCELERATION_SHIFT))
     long stopAStep;							// The stepcount at which we stop accelerating
     long startDStep;						// The stepcount at which we start decelerating
     float distance;							// How long is the move in real distance
@@ -174,6 +271,8 @@ class Move
     bool AllMovesAreFinished();					// Is the look-ahead ring empty?  Stops more moves being added as well.
     void ResumeMoving();						// Allow moves to be added after a call to AllMovesAreFinished()
     void DoLookAhead();							// Run the look-ahead procedure
+    float MaxStartSpeed(LookAhead* la, float startLimit, float endSpeed); // Fastest start to move la that can slow to endSpeed
+    float MaxEndSpeed(LookAhead* la, float startSpeed, float endLimit); // Fastest end to move la reachable from startSpeed
     void HitLowStop(int8_t drive,				// What to do when a low endstop is hit
     		LookAhead* la, DDA* hitDDA);
     void HitHighStop(int8_t drive, 				// What to do when a high endstop is hit
@@ -193,7 +292,6 @@ class Move
     bool XYProbeCoordinatesSet(int index);		// Just XY set for this one?
     void SetZProbing(bool probing);				// Set the Z probe live
     void SetProbedBedEquation(char* reply);		// When we have a full set of probed points, work out the bed's equation
-    float SecondDegreeTransformZ(float x, float y); // Used for second degree bed equation
     float GetLastProbedZ();						// What was the Z when the probe last fired?
     void SetAxisCompensation(int8_t axis, float tangent); // Set an axis-pair compensation angle
     float AxisCompensation(int8_t axis);		// The tangent value
@@ -201,9 +299,17 @@ class Move
     void Transform(float move[]);				// Take a position and apply the bed and the axis-angle compensations
     void InverseTransform(float move[]);		// Go from a transformed point back to user coordinates
     void Diagnostics();							// Report useful stuff
+    void SetSegmentMerging(float tolerance,		// Set how much moves may be merged
+    		float minimumLength);
+    float SegmentMergeTolerance() const;		// How far merged moves may stray from the path
+    float MinimumSegmentLength() const;			// Shorter moves are merged regardless
+    void StartSimulation();						// Run moves without driving the motors, and time the planner and the stepping
+    void SimulationReport(char* reply);			// Say how the simulation went
+    Kinematics* GetKinematics() const;			// The machine's geometry
+    uint32_t CompletedPrintPosition(PrintPosition& p); // Where the last finished move from the printed file left it; returns how many there have been
+    void KinematicsChanged();					// The geometry has been altered, so motor positions mean new things
     float ComputeCurrentCoordinate(int8_t drive,// Turn a DDA value back into a real world coordinate
     		LookAhead* la, DDA* runningDDA);
-    //void SetStepHypotenuse();					// Set up the hypotenuse lengths for multiple axis steps, like step both X and Y at once
     float Normalise(float v[], int8_t dimensions);  // Normalise a vector to unit length
     void Absolute(float v[], int8_t dimensions);	// Put a vector in the positive hyperquadrant
     float Magnitude(const float v[], int8_t dimensions);  // Return the length of a vector
@@ -219,41 +325,54 @@ class Move
     void InverseBedTransform(float move[]);		        // Go from a bed-transformed point back to user coordinates
     void AxisTransform(float move[]);			        // Take a position and apply the axis-angle compensations
     void InverseAxisTransform(float move[]);		    // Go from an axis transformed point back to user coordinates
-    void BarycentricCoordinates(int8_t p0, int8_t p1,   // Compute the barycentric coordinates of a point in a trinagle
-    		int8_t p2, float x, float y, float& l1,     // (see http://en.wikipedia.org/wiki/Barycentric_coordinate_system).
-    		float& l2, float& l3);
-    float TriangleZ(float x, float y);					// Interpolate onto a triangular grid
+    float BedZ(float x, float y) const;					// The bed height correction at (x, y)
+    void SetPlane(float* plane, int8_t p0,				// Work out the plane z = plane[0]*x + plane[1]*y + plane[2]...
+    		int8_t p1, int8_t p2);						// ...through three probe points
+    void SetGridCell(int cell, int8_t p0, int8_t p1,	// Work out a grid rectangle's bilinear coefficients from its corners,...
+    		int8_t p2, int8_t p3);						// ...which are at (0, 0), (1, 0), (0, 1) and (1, 1) in its unit square
+    bool SetGrid(int points);							// Check the probe points make a regular grid, and set it up
     bool DDARingAdd(LookAhead* lookAhead);				// Add a processed look-ahead entry to the DDA ring
     DDA* DDARingGet();									// Get the next DDA ring entry to be run
     bool DDARingEmpty();								// Anything there?
     bool NoLiveMovement();								// Is a move running, or are there any queued?
     bool DDARingFull();									// Any more room?
-    bool GetDDARingLock();								// Lock the ring so only this function may access it
-    void ReleaseDDARingLock();							// Release the DDA ring lock
     bool LookAheadRingEmpty();							// Anything there?
     bool LookAheadRingFull();							// Any more room?
-    bool LookAheadRingAdd(long ep[], float requestedFeedRate, 	// Add an entry to the look-ahead ring for processing
+    bool LookAheadRingAdd(long ep[], const float cartesianEp[], // Add an entry to the look-ahead ring for processing; cartesianEp has the feedrate
     		float minSpeed, float maxSpeed,
-    		float acceleration, bool ce);
+    		float acceleration, float advance, bool ce, const PrintPosition* p); // p is NULL if finishing it doesn't leave the print anywhere
     LookAhead* LookAheadRingGet();						// Get the next entry from the look-ahead ring
+    void AddMove(float move[], bool ce, const PrintPosition& p); // Put a transformed move into the look-ahead ring, cut up if the kinematics need it
+    void AddSegment(float move[], bool ce, const PrintPosition* p); // Put one straight piece of a move into the look-ahead ring
+    void AddSegments();									// Add as many pieces of a cut-up move as there is room for
+    float KinematicStop(int8_t axis, float position,	// Stop a move through the kinematics where it is, perhaps...
+    		bool redefine, LookAhead* la, DDA* hitDDA);	// ...saying that an axis is now at position; return that axis's coordinate
+    void HoldMove(float move[], bool ce, const PrintPosition& p); // Keep a move back to see if the next can be merged with it
+    bool MergeMove(float move[], bool ce, const PrintPosition& p); // Merge a move with the held one, if they are near enough in line
 
 
     Platform* platform;									// The RepRap machine
     GCodes* gCodes;										// The G Codes processing class
+    Kinematics* kinematics;								// The machine's geometry
     
-    // These implement the DDA ring
+    // These implement the DDA ring.  Move::Spin() is the only thing that adds to it, and the
+    // step interrupt the only thing that takes from it, so each end has its own pointer and
+    // count and no lock is needed.  The counts only go up; the differences between them say
+    // how many entries are waiting and in use.
     
-    DDA* dda;
-    DDA* ddaRingAddPointer;
-    DDA* ddaRingGetPointer;
-    volatile bool ddaRingLocked;
+    DDA* dda;											// The DDA the interrupt is running, if any
+    DDA* ddaRingAddPointer;								// Only used by Move::Spin()...
+    DDA* ddaRingGetPointer;								// ...and by the interrupt
+    volatile uint32_t ddaRingAdded;						// DDAs added, written only by Move::Spin()...
+    volatile uint32_t ddaRingTaken;						// ...started by the interrupt...
+    volatile uint32_t ddaRingFinished;					// ...and finished by it, so their entries can be used again
+    uint32_t ddaRingMostUsed;							// The most entries in use at once since the last report
     
     // These implement the look-ahead ring
 
     LookAhead* lookAheadRingAddPointer;
     LookAhead* lookAheadRingGetPointer;
     LookAhead* lastMove;
-    DDA* lookAheadDDA;
     int lookAheadRingCount;
 
     float lastTime;									// The last time we were called (secs)
@@ -262,20 +381,67 @@ class Move
     float currentFeedrate;							// Err... the current feed rate...
     float liveCoordinates[DRIVES + 1];				// The last endpoint that the machine moved to
     float nextMove[DRIVES + 1];  					// The endpoint of the next move to processExtra entry is for feedrate
+    PrintPosition nextPrintPosition;				// Where it leaves the file being printed
+    PrintPosition completedPrintPosition;			// Where the last finished move from the file left it (set by the interrupt)...
+    volatile uint32_t completedPrintMoves;			// ...counting them, so a copy torn by the interrupt can be spotted
     float normalisedDirectionVector[DRIVES];		// Used to hold a unit-length vector in the direction of motion
-    //float stepDistances[(1<<DRIVES)];				// The length of steps in different numbers of dimensions
+    float advanceRemainders[DRIVES - AXES];			// Pressure advance steps rounded out of one move, to go in the next
     long nextMachineEndPoints[DRIVES+1];			// The next endpoint in machine coordinates (i.e. steps)
     float xBedProbePoints[NUMBER_OF_PROBE_POINTS];	// The X coordinates of the points on the bed at which to probe
     float yBedProbePoints[NUMBER_OF_PROBE_POINTS];	// The X coordinates of the points on the bed at which to probe
     float zBedProbePoints[NUMBER_OF_PROBE_POINTS];	// The X coordinates of the points on the bed at which to probe
     uint8_t probePointSet[NUMBER_OF_PROBE_POINTS];	// Has the XY of this point been set?  Has the Z been probed?
-    float aX, aY, aC; 								// Bed plane explicit equation z' = z + aX*x + aY*y + aC
     float tanXY, tanYZ, tanXZ; 						// Axis compensation - 90 degrees + angle gives angle between axes
-    bool identityBedTransform;						// Is the bed transform in operation?
-    float xRectangle, yRectangle;					// The side lengths of the rectangle used for second-degree bed compensation
+
+    // The bed transform is worked out once, when the bed has been probed, so applying it
+    // is a switch, a short search and a few multiply-adds.
+
+    BedCompensation bedCompensation;				// Which transform is in operation, if any
+    float bedPlanes[4][3];							// Planes z = a*x + b*y + c: the whole bed, or the four triangles
+    float triangleRays[4][2];						// Directions from the centre point to the triangle corners
+    float gridX0, gridY0;							// The grid's lowest corner...
+    float gridXScale, gridYScale;					// ...and the reciprocals of its spacings
+    int gridColumns, gridRows;						// The number of rectangles across the grid in X and Y
+    float gridCells[MAX_PROBE_GRID_CELLS][4];		// z = c0 + c1*u + c2*v + c3*u*v, with (u, v) in the unit square of a rectangle
     float lastZHit;									// The last Z value hit by the probe
     bool zProbing;									// Are we bed probing as well as moving?
     float longWait;									// A long time for things that need to be done occasionally
+
+    // Runs of short moves in nearly the same direction are merged into one before they go
+    // into the look-ahead.  The newest move is held back until it is known whether the next
+    // one can be added to it.
+
+    float segmentMergeTolerance;					// The most the merged path can be from the points it leaves out (mm)
+    float minimumSegmentLength;						// Moves shorter than this are merged with the next even round corners (mm)
+    bool movePending;								// Is a move being held?
+    bool pendingCheckEndStops;						// Does it check the endstops?
+    float pendingMove[DRIVES + 1];					// Its transformed end point, extrusions and feedrate
+    PrintPosition pendingPrintPosition;				// Where the last move merged into it leaves the print
+    float pendingStart[AXES];						// Where it starts
+
+    // Moves that aren't straight lines for the motors are cut into pieces short enough for the
+    // difference not to matter.  Pieces are made as the look-ahead ring has room for them.
+
+    int segmentsLeft;								// Pieces of the current move still to add
+    bool segmentCheckEndStops;						// Do they check the endstops?
+    float segmentPosition[DRIVES + 1];				// The end of the last piece added, and the feedrate
+    float segmentStep[DRIVES];						// How far each piece goes (extruders are relative)
+    float segmentEnd[AXES];							// Where the whole move ends, which the last piece goes to exactly
+    float expectedPosition[AXES];					// The end of the last move from GCodes, which the position should agree with...
+    bool expectedPositionKnown;						// ...unless something else has put the machine somewhere else since
+    PrintPosition segmentPrintPosition;				// Where the whole move leaves the print; only the last piece carries it
+    float pendingLength;							// Its length in XYZ
+    float pendingDeviation;							// The most it may be from any point merged into it
+    volatile uint32_t shortestStepInterval;			// The shortest step interval (ticks) used since the last diagnostic report
+    volatile uint32_t plannerStarvedCount;			// Underruns: moves that finished with the DDA ring empty but moves waiting in the look-ahead, since the last report
+    uint64_t planningCycles;						// Processor cycles spent in look-ahead and DDA set-up since the simulation started
+    volatile uint32_t endSpeedMoves;				// Moves that ran to their end since the simulation started...
+    volatile uint64_t endSpeedMissTotal;			// ...the sum of how far their end speeds were from the plan (micrometres/second)...
+    volatile uint32_t endSpeedWorstMiss;			// ...the biggest of those...
+    volatile uint32_t endSpeedWorstPlanned;			// ...and the planned and the reached end speeds of that move
+    volatile uint32_t endSpeedWorstReached;
+    uint32_t simulationStartMoves;					// ddaRingAdded when the simulation started
+    float simulationStartTime;						// When it started
 };
 
 //********************************************************************************************************
@@ -319,6 +485,11 @@ inline float LookAhead::Acceleration()
 	return acceleration;
 }
 
+inline float LookAhead::PressureAdvance()
+{
+	return pressureAdvance;
+}
+
 inline void LookAhead::SetV(float vv)
 {
   v = vv;
@@ -329,6 +500,41 @@ inline float LookAhead::V()
   return v;
 }
 
+inline float LookAhead::MaxV()
+{
+  return maxV;
+}
+
+inline void LookAhead::SetMaxV(float vv)
+{
+  maxV = vv;
+}
+
+inline float LookAhead::Length()
+{
+	return length;
+}
+
+inline const long* LookAhead::Steps()
+{
+	return steps;
+}
+
+inline float LookAhead::TwoALength()
+{
+  return twoALength;
+}
+
+inline float LookAhead::BackwardV()
+{
+  return backwardV;
+}
+
+inline void LookAhead::SetBackwardV(float vv)
+{
+  backwardV = vv;
+}
+
 inline void LookAhead::SetFeedRate(float f)
 {
 	requestedFeedrate = f;
@@ -361,10 +567,18 @@ inline bool LookAhead::CheckEndStops()
 inline void LookAhead::SetDriveCoordinateAndZeroEndSpeed(float a, int8_t drive)
 {
   endPoint[drive] = EndPointToMachine(drive, a);
-  cosine = 2.0;
+  if(drive < AXES)
+	  cartesianStale = true;
   v = platform->InstantDv(platform->SlowestDrive());
 }
 
+inline void LookAhead::SetCartesianEndPoint(const float c[])
+{
+  for(int8_t axis = 0; axis < AXES; axis++)
+	  cartesian[axis] = c[axis];
+  cartesianStale = false;
+}
+
 inline long* LookAhead::MachineCoordinates()
 {
 	return endPoint;
@@ -390,23 +604,23 @@ inline float DDA::InstantDv()
 
 //***************************************************************************************
 
+// Nothing waiting for the interrupt to start
+
 inline bool Move::DDARingEmpty()
 {
-  return ddaRingGetPointer == ddaRingAddPointer;
+  return ddaRingTaken == ddaRingAdded;
 }
 
 inline bool Move::NoLiveMovement()
 {
-  if(dda != NULL)
-    return false;
-  return DDARingEmpty();
+  return ddaRingFinished == ddaRingAdded;
 }
 
-// Leave a gap of 2 as the last Get result may still be being processed
+// Entries are free once the interrupt has finished with them
 
 inline bool Move::DDARingFull()
 {
-  return ddaRingAddPointer->Next()->Next() == ddaRingGetPointer;
+  return ddaRingAdded - ddaRingFinished >= DDA_RING_LENGTH;
 }
 
 inline bool Move::LookAheadRingEmpty()
@@ -414,43 +628,39 @@ inline bool Move::LookAheadRingEmpty()
   return lookAheadRingCount == 0;
 }
 
-// Leave a gap of 2 as the last Get result may still be being processed
+// An entry can't be used until the DDA that ran it has released it.  The entry before the
+// oldest one is kept too, as the oldest move starts from its end point.
 
 inline bool Move::LookAheadRingFull()
 {
   if(!(lookAheadRingAddPointer->Processed() & released))
     return true;
-  return lookAheadRingAddPointer->Next()->Next() == lookAheadRingGetPointer;  // probably not needed; just return the bool in the if above
+  return lookAheadRingAddPointer->Next() == lookAheadRingGetPointer;
 }
 
-inline bool Move::GetDDARingLock()
-{
-  if(ddaRingLocked)
-    return false;
-  ddaRingLocked = true;
-  return true;
-}
-
-inline void Move::ReleaseDDARingLock()
-{
-  ddaRingLocked = false;
-}
+// The interrupt leaves the live coordinates as motor positions
 
 inline void Move::LiveCoordinates(float m[])
 {
-	for(int8_t drive = 0; drive <= DRIVES; drive++)
+	for(int8_t drive = AXES; drive <= DRIVES; drive++)
 		m[drive] = liveCoordinates[drive];
+	kinematics->MotorsToCartesian(liveCoordinates, m);
 	InverseTransform(m);
 }
 
 
 // These are the actual numbers that we want to be the coordinates, so
-// don't transform them.
+// don't transform them (other than through the kinematics).
 
 inline void Move::SetLiveCoordinates(float coords[])
 {
-	for(int8_t drive = 0; drive <= DRIVES; drive++)
+	for(int8_t drive = AXES; drive <= DRIVES; drive++)
 		liveCoordinates[drive] = coords[drive];
+	if(!kinematics->CartesianToMotors(coords, liveCoordinates))
+	{
+		for(int8_t axis = 0; axis < AXES; axis++)
+			liveCoordinates[axis] = coords[axis];
+	}
 }
 
 // To wait until all the current moves in the buffers are
@@ -462,7 +672,12 @@ inline void Move::SetLiveCoordinates(float coords[])
 inline bool Move::AllMovesAreFinished()
 {
   addNoMoreMoves = true;
-  return LookAheadRingEmpty() && NoLiveMovement();
+  return !movePending && segmentsLeft <= 0 && LookAheadRingEmpty() && NoLiveMovement();
+}
+
+inline Kinematics* Move::GetKinematics() const
+{
+	return kinematics;
 }
 
 inline void Move::ResumeMoving()
@@ -470,6 +685,22 @@ inline void Move::ResumeMoving()
   addNoMoreMoves = false;
 }
 
+inline void Move::SetSegmentMerging(float tolerance, float minimumLength)
+{
+	segmentMergeTolerance = tolerance;
+	minimumSegmentLength = minimumLength;
+}
+
+inline float Move::SegmentMergeTolerance() const
+{
+	return segmentMergeTolerance;
+}
+
+inline float Move::MinimumSegmentLength() const
+{
+	return minimumSegmentLength;
+}
+
 inline void Move::SetXBedProbePoint(int index, float x)
 {
 	if(index < 0 || index >= NUMBER_OF_PROBE_POINTS)
@@ -537,7 +768,7 @@ inline float Move::GetLastProbedZ()
 
 inline void Move::SetIdentityTransform()
 {
-	identityBedTransform = true;
+	bedCompensation = noCompensation;
 }
 
 inline bool Move::AllProbeCoordinatesSet(int index)
@@ -570,30 +801,30 @@ inline int Move::NumberOfXYProbePoints()
 	return NUMBER_OF_PROBE_POINTS;
 }
 
-/*
- * Transform to a ruled-surface quadratic.  The corner points for interpolation are indexed:
- *
- *   ^  [1]      [2]
- *   |
- *   Y
- *   |
- *   |  [0]      [3]
- *      -----X---->
- *
- *   The values of x and y are transformed to put them in the interval [0, 1].
- */
-inline float Move::SecondDegreeTransformZ(float x, float y)
-{
-	x = (x - xBedProbePoints[0])*xRectangle;
-	y = (y - yBedProbePoints[0])*yRectangle;
-	return (1.0 - x)*(1.0 - y)*zBedProbePoints[0] + x*(1.0 - y)*zBedProbePoints[3] + (1.0 - x)*y*zBedProbePoints[1] + x*y*zBedProbePoints[2];
-}
 
 
 
 
 inline void Move::HitLowStop(int8_t drive, LookAhead* la, DDA* hitDDA)
 {
+	if(drive < AXES && kinematics->Type() != cartesianKinematics)
+	{
+		// The endstop says where an XYZ axis is, not a motor.  Delta Z probes are low stops too.
+
+		if(drive == Z_AXIS)
+		{
+			if(zProbing && gCodes->GetAxisHasBeenHomed(drive))
+				lastZHit = KinematicStop(drive, 0.0, false, la, hitDDA) - platform->ZProbeStopHeight();
+			else
+			{
+				KinematicStop(drive, platform->ZProbeStopHeight(), true, la, hitDDA);
+				lastZHit = zProbing ? 0.0 : platform->ZProbeStopHeight();
+			}
+		} else
+			KinematicStop(drive, 0.0, true, la, hitDDA);
+		return;
+	}
+
 	float hitPoint = 0.0;
 	if(drive == Z_AXIS)
 	{
@@ -624,9 +855,16 @@ inline void Move::HitLowStop(int8_t drive, LookAhead* la, DDA* hitDDA)
 	la->SetDriveCoordinateAndZeroEndSpeed(hitPoint, drive);
 }
 
+// Delta towers have their endstops at the top, and each stops on its own.
+
 inline void Move::HitHighStop(int8_t drive, LookAhead* la, DDA* hitDDA)
 {
-  la->SetDriveCoordinateAndZeroEndSpeed(platform->AxisLength(drive), drive);
+  if(drive < AXES && kinematics->Type() == deltaKinematics)
+	  la->SetDriveCoordinateAndZeroEndSpeed(kinematics->HomedCarriageHeight(), drive);
+  else if(drive < AXES && kinematics->Type() == coreXYKinematics)
+	  KinematicStop(drive, platform->AxisLength(drive), true, la, hitDDA);
+  else
+	  la->SetDriveCoordinateAndZeroEndSpeed(platform->AxisLength(drive), drive);
 }
 
 inline float Move::ComputeCurrentCoordinate(int8_t drive, LookAhead* la, DDA* runningDDA)
@@ -655,4 +893,46 @@ inline float Move::AxisCompensation(int8_t axis)
 
 
 
+//******************************************************************************************************
+
+inline KinematicsType Kinematics::Type() const
+{
+	return type;
+}
+
+inline bool Kinematics::Linear() const
+{
+	return type != deltaKinematics;
+}
+
+inline float Kinematics::DiagonalRod() const
+{
+	return diagonalRod;
+}
+
+inline float Kinematics::Radius() const
+{
+	return radius;
+}
+
+inline float Kinematics::HomedHeight() const
+{
+	return homedHeight;
+}
+
+inline float Kinematics::HomedCarriageHeight() const
+{
+	return homedHeight + sqrt(diagonalRodSquared - radius*radius);
+}
+
+inline float Kinematics::SegmentsPerSecond() const
+{
+	return segmentsPerSecond;
+}
+
+inline void Kinematics::SetSegmentsPerSecond(float s)
+{
+	segmentsPerSecond = s;
+}
+
 #endif
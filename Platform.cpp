@@ -51,6 +51,8 @@ const int8_t heat_on_pins[HEATERS] = HEAT_ON_PINS;
 const float thermistor_betas[HEATERS] = THERMISTOR_BETAS;
 const float thermistor_series_rs[HEATERS] = THERMISTOR_SERIES_RS;
 const float thermistor_25_rs[HEATERS] = THERMISTOR_25_RS;
+const float thermistor_cs[HEATERS] = THERMISTOR_CS;
+const TemperatureSensor temperature_sensors[HEATERS] = TEMPERATURE_SENSORS;
 const bool use_pids[HEATERS] = USE_PIDS;
 const float pid_kis[HEATERS] = PID_KIS;
 const float pid_kds[HEATERS] = PID_KDS;
@@ -111,9 +113,6 @@ Platform::Platform()
   
   massStorage = new MassStorage(this);
   
-  for(int8_t i=0; i < MAX_FILES; i++)
-    files[i] = new FileStore(this);
-  
   network = new Network();
   
   active = false;
@@ -132,11 +131,15 @@ void Platform::Init()
 
   line->Init();
   messageIndent = 0;
+  webOutput.Init();
 
   massStorage->Init();
 
   for(file=0; file < MAX_FILES; file++)
-    files[file]->Init();
+    files[file].Init(this);
+  printFileBuffersUser = NULL;
+  uploadFileBufferUser = NULL;
+  webFileBufferUser = NULL;
 
   fileStructureInitialised = true;
 
@@ -207,6 +210,8 @@ void Platform::Init()
 	  thermistorBetas[heater] = thermistor_betas[heater];
 	  thermistorSeriesRs[heater] = thermistor_series_rs[heater];
 	  thermistorRAt25[heater] = thermistor_25_rs[heater];
+	  thermistorCs[heater] = thermistor_cs[heater];
+	  temperatureSensors[heater] = temperature_sensors[heater];
 	  usePIDs[heater] = use_pids[heater];
 	  pidKis[heater] = pid_kis[heater];
 	  pidKds[heater] = pid_kds[heater];
@@ -233,15 +238,38 @@ void Platform::Init()
     requires a unified variant file. If implemented this would be much better
 	to allow for different hardware in the future
   */
+  stepPorts[0] = PIOA;
+  stepPorts[1] = PIOB;
+  stepPorts[2] = PIOC;
+  stepPorts[3] = PIOD;
+
   for(drive = 0; drive < DRIVES; drive++)
   {
 
+	  stepPortIndex[drive] = -1;
+	  stepPinBits[drive] = 0;
 	  if(stepPins[drive] >= 0)
 	  {
+		  const PinDescription* pd;
 		  if(drive == E0_DRIVE || drive == E3_DRIVE) //STEP_PINS {14, 25, 5, X2, 41, 39, X4, 49}
+		  {
 			  pinModeNonDue(stepPins[drive], OUTPUT);
-		  else
+			  pd = &nonDuePinDescription[stepPins[drive]];
+		  } else
+		  {
 			  pinMode(stepPins[drive], OUTPUT);
+			  pd = &g_APinDescription[stepPins[drive]];
+		  }
+		  for(int8_t port = 0; port < STEP_PORTS; port++)
+		  {
+			  if(pd->pPort == stepPorts[port])
+			  {
+				  stepPortIndex[drive] = port;
+				  stepPinBits[drive] = pd->ulPin;
+			  }
+		  }
+		  if(stepPortIndex[drive] < 0)
+			  Message(HOST_MESSAGE, "Step pin is not on PIOA to PIOD.\n");
 	  }
 	  if(directionPins[drive] >= 0)
 	  {
@@ -260,6 +288,9 @@ void Platform::Init()
 	  Disable(drive);
 	  driveEnabled[drive] = false;
   }
+  simulating = false;
+  simulatedSteps = 0;
+  adcFreeRunning = false; // Until InitialiseAdc() below
 
   for(drive = 0; drive < DRIVES; drive++)
   {
@@ -282,7 +313,16 @@ void Platform::Init()
     		pinModeNonDue(heatOnPins[heater], OUTPUT);
     	else
     		pinMode(heatOnPins[heater], OUTPUT);
-    thermistorRAt25[heater] = ( thermistorRAt25[heater]*exp(-thermistorBetas[heater]/(25.0 - ABS_ZERO)) );
+    heatPorts[heater] = NULL;
+    heaterCutOff[heater] = false;
+    if(heatOnPins[heater] >= 0)
+    {
+    	const PinDescription* pd = (heater == E0_HEATER || heater == E1_HEATER) ?
+    			&nonDuePinDescription[heatOnPins[heater]] : &g_APinDescription[heatOnPins[heater]];
+    	heatPorts[heater] = pd->pPort;
+    	heatPinBits[heater] = pd->ulPin;
+    }
+    BuildTemperatureTable(heater);
     tempSum[heater] = 0;
   }
 
@@ -292,7 +332,16 @@ void Platform::Init()
 	  analogWriteNonDue(coolingFanPin, 255); //inverse logic for Duet v0.6 amd later; this turns it off
   }
 
+  // Start the cycle counter that profiling uses
+
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
   InitialiseInterrupts();
+  adcFreeRunning = ADC_FREE_RUNNING;
+  if(adcFreeRunning)
+	  InitialiseAdc();
   
   addToTime = 0.0;
   lastTimeCall = 0;
@@ -356,10 +405,29 @@ void Platform::Spin()
   network->Spin();
   line->Spin();
 
+  // Hand any queued web messages to the webserver
+
+  char tag;
+  const char* message;
+  while(webOutput.GetTagged(tag, message))
+  {
+	  if(tag == 'm' || tag == 'e')
+		  reprap.GetWebserver()->MessageStringToWebInterface(message, tag == 'e');
+	  else
+		  reprap.GetWebserver()->AppendReplyToWebInterface(message, tag == 'b');
+	  webOutput.ConsumeTagged(message);
+  }
+
+  for(int8_t i = 0; i < MAX_FILES; i++)
+	  files[i].Spin();
+
   if(Time() - lastTime < POLL_TIME)
     return;
-  PollZHeight();
-  PollTemperatures();
+  if(!adcFreeRunning)
+  {
+	  PollZHeight();
+	  PollTemperatures();
+  }
   lastTime = Time();
   ClassReport("Platform", longWait);
 
@@ -371,8 +439,10 @@ void Platform::Spin()
 
 void TC3_Handler()
 {
+  uint32_t start = DWT->CYCCNT;
   TC_GetStatus(TC1, 0);
   reprap.Interrupt();
+  reprap.InterruptProfile()->Record(DWT->CYCCNT - start);
 }
 
 void Platform::InitialiseInterrupts()
@@ -385,6 +455,119 @@ void Platform::InitialiseInterrupts()
   SetInterrupt(STANDBY_INTERRUPT_RATE);
 }
 
+// Set the A to D converter running by itself over the channels the thermistors and the
+// Z probe use.  Readings come 10-bit, as from analogRead(), tagged with their channel
+// numbers.  The PDC fills one buffer while the interrupt averages the other.
+
+void Platform::InitialiseAdc()
+{
+  int8_t channel;
+  for(channel = 0; channel < ADC_CHANNELS; channel++)
+	  adcChannelUser[channel] = -1;
+  uint32_t channelMask = 0;
+  int channels = 0;
+  for(int8_t heater = 0; heater <= HEATERS; heater++)
+  {
+	  int8_t pin = (heater < HEATERS) ? tempSensePins[heater] : zProbePin;
+	  if(pin < 0)
+		  continue;
+	  uint32_t c = g_APinDescription[pin + A0].ulADCChannelNumber;
+	  if(c >= ADC_CHANNELS || adcChannelUser[c] != -1)
+		  continue;
+	  adcChannelUser[c] = (heater < HEATERS) ? heater : ADC_Z_PROBE;
+	  channelMask |= 1u << c;
+	  channels++;
+  }
+  adcBufferLength = channels*ADC_SEQUENCES_PER_BUFFER;
+  adcBufferFilled = 0;
+  zProbeSettling = true;
+  if(channels == 0)
+	  return;
+
+  pmc_enable_periph_clk(ID_ADC);
+  ADC->ADC_PTCR = ADC_PTCR_RXTDIS;
+  ADC->ADC_CHDR = ~channelMask;
+  ADC->ADC_CHER = channelMask;
+  ADC->ADC_EMR |= ADC_EMR_TAG;
+  ADC->ADC_MR = (ADC->ADC_MR & ~(ADC_MR_PRESCAL_Msk | ADC_MR_TRGEN)) | ADC_MR_PRESCAL(ADC_PRESCALE) | ADC_MR_LOWRES_BITS_10 | ADC_MR_FREERUN_ON;
+  ADC->ADC_RPR = (uint32_t)adcBuffers[0];
+  ADC->ADC_RCR = adcBufferLength;
+  ADC->ADC_RNPR = (uint32_t)adcBuffers[1];
+  ADC->ADC_RNCR = adcBufferLength;
+  ADC->ADC_PTCR = ADC_PTCR_RXTEN;
+  ADC->ADC_IER = ADC_IER_ENDRX;
+  NVIC_SetPriority(ADC_IRQn, 15);	// Below the step interrupt
+  NVIC_EnableIRQ(ADC_IRQn);
+  ADC->ADC_CR = ADC_CR_START;
+}
+
+void ADC_Handler()
+{
+  if(ADC->ADC_ISR & ADC_ISR_ENDRX)
+  {
+	  reprap.GetPlatform()->AdcInterrupt();
+	  reprap.GetHeat()->Tick();		// The heater controllers run when it's time, on the new readings
+  }
+}
+
+// The PDC has finished a buffer and gone on to the other.  Average each channel's
+// readings in it into the same moving averages that polling keeps, then give the
+// buffer back as the one to fill after the current one.
+//
+// The IR probe's modulation is swapped every other buffer.  The buffer filling when
+// it changes has some readings from before and some after, so its Z readings are
+// left out, and every phase gets one whole buffer.  The phases are all the same length.
+
+void Platform::AdcInterrupt()
+{
+  long sums[ADC_CHANNELS];
+  uint8_t counts[ADC_CHANNELS];
+  for(int8_t channel = 0; channel < ADC_CHANNELS; channel++)
+  {
+	  sums[channel] = 0;
+	  counts[channel] = 0;
+  }
+
+  const uint16_t* buffer = adcBuffers[adcBufferFilled];
+  for(uint16_t i = 0; i < adcBufferLength; i++)
+  {
+	  uint16_t reading = buffer[i];
+	  uint8_t channel = reading >> ADC_LCDR_CHNB_Pos;
+	  sums[channel] += reading & ADC_LCDR_LDATA_Msk;
+	  counts[channel]++;
+  }
+
+  ADC->ADC_RNPR = (uint32_t)buffer;
+  ADC->ADC_RNCR = adcBufferLength;	// This clears the interrupt
+  adcBufferFilled = 1 - adcBufferFilled;
+
+  bool zUsed = false;
+  for(int8_t channel = 0; channel < ADC_CHANNELS; channel++)
+  {
+	  int8_t user = adcChannelUser[channel];
+	  if(user == -1 || counts[channel] == 0)
+		  continue;
+	  long reading = sums[channel]/counts[channel];
+	  if(user >= 0)
+		  tempSum[user] = tempSum[user] + reading - tempSum[user]/NUMBER_OF_A_TO_D_READINGS_AVERAGED;
+	  else if(zProbeType != 0 && !zProbeSettling)
+	  {
+		  if(zModOnThisTime)
+			  zProbeOnSum = zProbeOnSum + reading - zProbeOnSum/NUMBER_OF_A_TO_D_READINGS_AVERAGED;
+		  else
+			  zProbeOffSum = zProbeOffSum + reading - zProbeOffSum/NUMBER_OF_A_TO_D_READINGS_AVERAGED;
+		  zUsed = true;
+	  }
+  }
+
+  zProbeSettling = false;
+  if(zUsed && zProbeType >= 2)
+  {
+	  SwapZProbeModulation();
+	  zProbeSettling = true;
+  }
+}
+
 //void Platform::DisableInterrupts()
 //{
 //	NVIC_DisableIRQ(TC3_IRQn);
@@ -396,6 +579,42 @@ void Platform::InitialiseInterrupts()
 void Platform::Diagnostics() 
 {
   Message(HOST_MESSAGE, "Platform Diagnostics:\n"); 
+  snprintf(scratchString, STRING_LENGTH, "Output dropped: USB %u messages (%u bytes), web %u messages (%u bytes)\n",
+		  (unsigned int)line->DroppedMessages(), (unsigned int)line->Dropped(),
+		  (unsigned int)webOutput.DroppedMessages(), (unsigned int)webOutput.Dropped());
+  Message(HOST_MESSAGE, scratchString);
+  PrintRamBudget();
+}
+
+// Everything big is allocated once, either inside its owner or by new at construction,
+// so the sizes of the classes and their rings are where the RAM goes.
+
+void Platform::PrintRamBudget()
+{
+  Message(HOST_MESSAGE, "RAM budget (bytes):\n");
+  snprintf(scratchString, STRING_LENGTH, " Platform %u: file pool %u (%d x %u), file buffers %u, web output ring %u\n",
+		  (unsigned int)sizeof(Platform), (unsigned int)sizeof(files), MAX_FILES, (unsigned int)sizeof(FileStore),
+		  (unsigned int)(sizeof(printFileBuffers) + sizeof(uploadFileBuffer) + sizeof(webFileBuffer)),
+		  (unsigned int)sizeof(webOutput));
+  Message(HOST_MESSAGE, scratchString);
+  snprintf(scratchString, STRING_LENGTH, " Serial line %u, mass storage %u, network %u + HTTP ring %u (%d x %u)\n",
+		  (unsigned int)sizeof(Line), (unsigned int)sizeof(MassStorage), (unsigned int)sizeof(Network),
+		  (unsigned int)(HTTP_STATE_SIZE*sizeof(NetRing)), HTTP_STATE_SIZE, (unsigned int)sizeof(NetRing));
+  Message(HOST_MESSAGE, scratchString);
+  snprintf(scratchString, STRING_LENGTH, " GCodes %u, including G Code buffers 4 x %u; webserver %u; heat %u\n",
+		  (unsigned int)sizeof(GCodes), (unsigned int)sizeof(GCodeBuffer), (unsigned int)sizeof(Webserver),
+		  (unsigned int)sizeof(Heat));
+  Message(HOST_MESSAGE, scratchString);
+  snprintf(scratchString, STRING_LENGTH, " Move %u + look-ahead ring %u (%d x %u) + DDA ring %u (%d x %u) + kinematics %u\n",
+		  (unsigned int)sizeof(Move),
+		  (unsigned int)(LOOK_AHEAD_RING_LENGTH*sizeof(LookAhead)), LOOK_AHEAD_RING_LENGTH, (unsigned int)sizeof(LookAhead),
+		  (unsigned int)(DDA_RING_LENGTH*sizeof(DDA)), DDA_RING_LENGTH, (unsigned int)sizeof(DDA),
+		  (unsigned int)sizeof(Kinematics));
+  Message(HOST_MESSAGE, scratchString);
+  snprintf(scratchString, STRING_LENGTH, " RepRap %u, including tool pool %u (%d x %u, %d in use)\n",
+		  (unsigned int)sizeof(RepRap), (unsigned int)(MAX_TOOLS*sizeof(Tool)), MAX_TOOLS, (unsigned int)sizeof(Tool),
+		  reprap.ToolsInUse());
+  Message(HOST_MESSAGE, scratchString);
 }
 
 // Print memory stats to USB and append them to the current webserver reply, and
@@ -455,10 +674,59 @@ void Platform::ClassReport(char* className, float &lastTime)
 // should compute it for you (i.e. it won't need to be calculated at run time).
 
 // If the A->D converter has a range of 0..1023 and the measured voltage is V (between 0 and 1023)
-// then the thermistor resistance, R = V.RS/(1024 - V)
-// and the temperature, T = BETA/ln(R/R_INF)
+// then the sensor resistance, R = V.RS/(1024 - V)
+// For a thermistor the temperature, T = 1/(A + B.ln(R) + C.ln(R)^3), where B is 1/BETA and A makes
+// T right at 25 C.  With C = 0 this is the Beta equation, T = BETA/ln(R/R_INF).
+// For a PT100, R = R0.(1 + a.T + b.T^2) with T in degrees celsius.
 // To get degrees celsius (instead of kelvin) add -273.15 to T
 
+float Platform::SensorTemperature(int8_t heater, float reading) const
+{
+  float r = reading*thermistorSeriesRs[heater]/((AD_RANGE + 1) - reading);
+
+  if(temperatureSensors[heater] == pt100Sensor)
+  {
+	  float d = PT100_A*PT100_A - 4.0*PT100_B*(1.0 - r/thermistorRAt25[heater]);
+	  if(d < 0.0)
+		  return ABS_ZERO;
+	  return (sqrt(d) - PT100_A)/(2.0*PT100_B);
+  }
+
+  float lnR = log(r);
+  float lnR25 = log(thermistorRAt25[heater]);
+  float c = thermistorCs[heater];
+  float b = 1.0/thermistorBetas[heater];
+  float a = 1.0/(25.0 - ABS_ZERO) - b*lnR25 - c*lnR25*lnR25*lnR25;
+  return ABS_ZERO + 1.0/(a + b*lnR + c*lnR*lnR*lnR);
+}
+
+// The table has the temperatures at the A to D readings 0, AD_RANGE/TEMPERATURE_TABLE_SEGMENTS, ...
+// AD_RANGE.  The curve is very steep near the ends of the range, so any piece where the middle
+// of the straight line is more than TEMPERATURE_TABLE_ERROR from the curve is marked to be calculated
+// instead.  For the usual thermistors that is only well outside the temperatures used for printing.
+// The ADC interrupt reads the table, so the new one is built to one side and copied in with that
+// interrupt held off.
+
+void Platform::BuildTemperatureTable(int8_t heater)
+{
+  const float step = AD_RANGE/(float)TEMPERATURE_TABLE_SEGMENTS;
+  for(int i = 0; i <= TEMPERATURE_TABLE_SEGMENTS; i++)
+	  scratchTable[i] = SensorTemperature(heater, i*step + 0.5);
+  for(int i = 0; i < (TEMPERATURE_TABLE_SEGMENTS + 31)/32; i++)
+	  scratchCalculated[i] = 0;
+  for(int i = 0; i < TEMPERATURE_TABLE_SEGMENTS; i++)
+  {
+	  float middle = 0.5*(scratchTable[i] + scratchTable[i + 1]);
+	  if(fabs(middle - SensorTemperature(heater, (i + 0.5)*step + 0.5)) > TEMPERATURE_TABLE_ERROR)
+		  scratchCalculated[i >> 5] |= 1ul << (i & 31);
+  }
+
+  DisableAdcInterrupt();
+  memcpy(temperatureTables[heater], scratchTable, sizeof(scratchTable));
+  memcpy(temperatureCalculated[heater], scratchCalculated, sizeof(scratchCalculated));
+  EnableAdcInterrupt();
+}
+
 // Result is in degrees celsius
 
 float Platform::GetTemperature(int8_t heater)
@@ -473,9 +741,14 @@ float Platform::GetTemperature(int8_t heater)
 //	  // Thermistor is disconnected
 //	  return ABS_ZERO;
 //  }
-  float r = (float)rawTemp + 0.5;
-  r = ABS_ZERO + thermistorBetas[heater]/log( (r*thermistorSeriesRs[heater]/((AD_RANGE + 1) - r))/thermistorRAt25[heater] );
-  return r;
+  float p = (float)rawTemp*(TEMPERATURE_TABLE_SEGMENTS/AD_RANGE);
+  int i = (int)p;
+  if(i >= TEMPERATURE_TABLE_SEGMENTS)
+	  i = TEMPERATURE_TABLE_SEGMENTS - 1;
+  if(temperatureCalculated[heater][i >> 5] & (1ul << (i & 31)))
+	  return SensorTemperature(heater, (float)rawTemp + 0.5);
+  const float* t = &temperatureTables[heater][i];
+  return t[0] + (p - i)*(t[1] - t[0]);
 }
 
 
@@ -487,6 +760,14 @@ void Platform::SetHeater(int8_t heater, const float& power)
     return;
   
   byte p = (byte)(255.0*fmin(1.0, fmax(0.0, power)));
+  if(heaterCutOff[heater])
+  {
+	  if(p == 0)
+		  return;
+	  if(heaterPinWasPeripheral[heater])
+		  heatPorts[heater]->PIO_PDR = heatPinBits[heater];	// Give the pin back to the PWM
+	  heaterCutOff[heater] = false;
+  }
   if(HEAT_ON == 0)
 	  p = 255 - p;
   if(heater == E0_HEATER || heater == E1_HEATER) //HEAT_ON_PINS {6, X5, X7, 7, 8, 9}
@@ -496,8 +777,34 @@ void Platform::SetHeater(int8_t heater, const float& power)
 }
 
 
+// The PIO takes the pin over from the PWM and drives it to off, so this doesn't wait for
+// the main loop to get round to SetHeater() and doesn't touch the PWM that it uses.  Each
+// step is one register write, so it is safe in the ADC interrupt.
+
+void Platform::CutOffHeater(int8_t heater)
+{
+  if(heatPorts[heater] == NULL)
+	  return;
+  uint32_t bit = heatPinBits[heater];
+  Pio* port = heatPorts[heater];
+  if(HEAT_ON == 0)
+	  port->PIO_SODR = bit;
+  else
+	  port->PIO_CODR = bit;
+  if(!heaterCutOff[heater])
+	  heaterPinWasPeripheral[heater] = !(port->PIO_PSR & bit);
+  port->PIO_OER = bit;
+  port->PIO_PER = bit;
+  heaterCutOff[heater] = true;
+}
+
 EndStopHit Platform::Stopped(int8_t drive)
 {
+	// Simulated homing and probing finish at once
+
+	if(simulating)
+		return (lowStopPins[drive] >= 0 || (zProbeType > 0 && drive != Y_AXIS)) ? lowHit : noStop;
+
 	if(zProbeType > 0)
 	{  // Z probe is used for both X and Z.
 		if(drive != Y_AXIS)
@@ -536,6 +843,7 @@ MassStorage::MassStorage(Platform* p)
 
 void MassStorage::Init()
 {
+	InvalidateFileInfo();
 	hsmciPinsinit();
 	// Initialize SD MMC stack
 	sd_mmc_init();
@@ -623,93 +931,169 @@ char* MassStorage::CombineName(const char* directory, const char* fileName)
   return scratchString;
 }
 
-// List the flat files in a directory.  No sub-directories or recursion.
+// Read the names, sizes and dates of the flat files in a directory (no sub-directories or
+// recursion) and sort them.  This is only done when a different directory is asked about, or
+// when a file has been written or deleted since the last time.
 
-char* MassStorage::FileList(const char* directory, bool fromLine)
+bool MassStorage::IndexDirectory(const char* directory)
 {
-//  File dir, entry;
+  if(indexValid && !strcmp(indexDirectory, directory))
+	  return true;
+
   DIR dir;
   FILINFO entry;
-  FRESULT res;
-  char loc[64];
-  int len = 0;
-  char fileListBracket = FILE_LIST_BRACKET;
-  char fileListSeparator = FILE_LIST_SEPARATOR;
+  char loc[FILE_INFO_NAME_LENGTH];
+  int len = strlen(directory);
 
-  if(fromLine)
+  if(len >= FILE_INFO_NAME_LENGTH)
   {
-	  if(platform->Emulating() == marlin)
+	  platform->Message(HOST_MESSAGE, "IndexDirectory - directory name too long: ");
+	  platform->Message(HOST_MESSAGE, directory);
+	  platform->Message(HOST_MESSAGE, "\n");
+	  return false;
+  }
+  strncpy(loc, directory, len - 1);
+  loc[len - 1] = 0;
+
+  indexValid = false;
+  if(f_opendir(&dir, loc) != FR_OK)
+	  return false;
+
+  entry.lfname = NULL;
+  entry.lfsize = 0;
+  indexLength = 0;
+  while(f_readdir(&dir, &entry) == FR_OK && entry.fname[0])
+  {
+	  if(entry.fattrib & AM_DIR)
+		  continue;
+	  if(indexLength >= DIRECTORY_INDEX_LENGTH)
 	  {
-		  fileListBracket = 0;
-		  fileListSeparator = '\n';
+		  platform->Message(HOST_MESSAGE, "IndexDirectory - directory: ");
+		  platform->Message(HOST_MESSAGE, directory);
+		  platform->Message(HOST_MESSAGE, " has too many files; not all are listed.\n");
+		  break;
 	  }
+	  strncpy(indexName[indexLength], entry.fname, INDEX_NAME_LENGTH - 1);
+	  indexName[indexLength][INDEX_NAME_LENGTH - 1] = 0;
+	  indexSize[indexLength] = entry.fsize;
+	  indexTimeStamp[indexLength] = ((uint32_t)entry.fdate << 16) | entry.ftime;
+	  indexLength++;
   }
 
-  len = strlen(directory);
-  strncpy(loc,directory,len-1);
-  loc[len - 1 ] = 0;
-
-//  if(reprap.debug()) {
-//	  platform->Message(HOST_MESSAGE, "Opening: ");
-//	  platform->Message(HOST_MESSAGE, loc);
-//	  platform->Message(HOST_MESSAGE, "\n");
-//  }
+  // Insertion sorts; the index isn't long, and isn't made often
 
-  res = f_opendir(&dir,loc);
-  if(res == FR_OK)
+  for(int i = 0; i < indexLength; i++)
   {
+	  indexByName[i] = i;
+	  indexByDate[i] = i;
+  }
+  for(int i = 1; i < indexLength; i++)
+  {
+	  uint8_t e = indexByName[i];
+	  int j = i;
+	  while(j > 0 && strcmp(indexName[indexByName[j - 1]], indexName[e]) > 0)
+	  {
+		  indexByName[j] = indexByName[j - 1];
+		  j--;
+	  }
+	  indexByName[j] = e;
 
-//	  if(reprap.debug()) {
-//		  platform->Message(HOST_MESSAGE, "Directory open\n");
-//	  }
+	  e = indexByDate[i];
+	  j = i;
+	  while(j > 0 && indexTimeStamp[indexByDate[j - 1]] < indexTimeStamp[e])
+	  {
+		  indexByDate[j] = indexByDate[j - 1];
+		  j--;
+	  }
+	  indexByDate[j] = e;
+  }
 
-	  int p = 0;
-//  int q;
-	  int foundFiles = 0;
+  strcpy(indexDirectory, directory);
+  indexValid = true;
+  return true;
+}
 
-	  f_readdir(&dir,0);
+int MassStorage::FileCount(const char* directory)
+{
+  return IndexDirectory(directory) ? indexLength : 0;
+}
 
-	  while((f_readdir(&dir,&entry) == FR_OK) && (foundFiles < MAX_FILES))
-	  {
-		  foundFiles++;
+bool MassStorage::GetFileEntry(const char* directory, int i, FileSort sort, const char*& name, unsigned long& size, uint32_t& timeStamp)
+{
+  if(!IndexDirectory(directory) || i < 0 || i >= indexLength)
+	  return false;
+  int e = (sort == sortByDate) ? indexByDate[i] : indexByName[i];
+  name = indexName[e];
+  size = indexSize[e];
+  timeStamp = indexTimeStamp[e];
+  return true;
+}
 
-		  if(strlen(entry.fname) > 0)
-		  {
-			int q = 0;
-			if(fileListBracket)
-				fileList[p++] = fileListBracket;
-			while(entry.fname[q])
-			{
-			  fileList[p++] = entry.fname[q];
-			  //SerialUSB.print(entry.fname[q]);
-			  q++;
-			  if(p >= FILE_LIST_LENGTH - 10) // Caution...
-			  {
-				platform->Message(HOST_MESSAGE, "FileList - directory: ");
-				platform->Message(HOST_MESSAGE, directory);
-				platform->Message(HOST_MESSAGE, " has too many files!\n");
-				return "";
-			  }
-			}
-			if(fileListBracket)
-				fileList[p++] = fileListBracket;
-			fileList[p++] = fileListSeparator;
-		  }
-	  }
+// FAT dates count years from 1980 and times are to 2 seconds
 
-	  if(foundFiles <= 0)
-		return "NONE";
+void MassStorage::TimeStampString(uint32_t timeStamp, char* s)
+{
+  uint16_t date = timeStamp >> 16;
+  uint16_t time = timeStamp & 0xFFFF;
+  snprintf(s, 20, "%04u-%02u-%02uT%02u:%02u:%02u", 1980 + (date >> 9), (date >> 5) & 0x0F, date & 0x1F,
+		  time >> 11, (time >> 5) & 0x3F, (time & 0x1F)*2);
+}
 
-	  fileList[--p] = 0; // Get rid of the last separator
-	  return fileList;
+// List files in a directory from its index.  Up to count of them are listed starting at the
+// first, fewer if they won't all fit; next is set to the number of the one after the last
+// listed so that the rest can be asked for.  With details each name is followed by the file's
+// size and date.
+
+char* MassStorage::FileList(const char* directory, bool fromLine, FileSort sort, int first, int count, bool details, int& next)
+{
+  char fileListBracket[2] = { FILE_LIST_BRACKET, 0 };
+  char fileListSeparator = FILE_LIST_SEPARATOR;
+  char entry[INDEX_NAME_LENGTH + 40];
+  char date[20];
+
+  if(fromLine)
+  {
+	  if(platform->Emulating() == marlin)
+	  {
+		  fileListBracket[0] = 0;
+		  fileListSeparator = '\n';
+	  }
   }
 
-	return "";
+  if(first < 0)
+	  first = 0;
+  next = first;
+  if(!IndexDirectory(directory))
+	  return "";
+  if(indexLength <= 0)
+	  return "NONE";
+
+  int p = 0;
+  for(int i = first; i < indexLength && i - first < count; i++)
+  {
+	  int e = (sort == sortByDate) ? indexByDate[i] : indexByName[i];
+	  int n = snprintf(entry, ARRAY_SIZE(entry), "%s%s%s", fileListBracket, indexName[e], fileListBracket);
+	  if(details)
+	  {
+		  TimeStampString(indexTimeStamp[e], date);
+		  n += snprintf(&entry[n], ARRAY_SIZE(entry) - n, " %lu %s", indexSize[e], date);
+	  }
+	  if(p + n + 1 >= FILE_LIST_LENGTH)
+		  break;
+	  if(p > 0)
+		  fileList[p++] = fileListSeparator;
+	  memcpy(&fileList[p], entry, n);
+	  p += n;
+	  next = i + 1;
+  }
+  fileList[p] = 0;
+  return fileList;
 }
 
 // Delete a file
 bool MassStorage::Delete(const char* directory, const char* fileName)
 {
+	InvalidateFileInfo();
 	char* location = platform->GetMassStorage()->CombineName(directory, fileName);
 	if( f_unlink (location) != FR_OK)
 	{
@@ -721,21 +1105,299 @@ bool MassStorage::Delete(const char* directory, const char* fileName)
 	return true;
 }
 
+// Find out whether a file exists, and if it does its size and modification time, remembering
+// the answer so that files asked about again and again (such as those of the web interface)
+// don't need FatFs to search the directory.  Anything that writes or deletes a file forgets it
+// all.
+
+bool MassStorage::GetFileInfo(const char* directory, const char* fileName, unsigned long& size, uint32_t& timeStamp)
+{
+	char* location = CombineName(directory, fileName);
+	bool cacheable = strlen(location) < FILE_INFO_NAME_LENGTH;
+
+	if(cacheable)
+	{
+		for(int8_t i = 0; i < FILE_INFO_CACHE_LENGTH; i++)
+		{
+			if(!strcmp(fileInfoName[i], location))
+			{
+				size = fileInfoSize[i];
+				timeStamp = fileInfoTimeStamp[i];
+				return fileInfoExists[i];
+			}
+		}
+	}
+
+	FILINFO entry;
+	entry.lfname = NULL;
+	entry.lfsize = 0;
+	bool exists = (f_stat(location, &entry) == FR_OK);
+	size = exists ? entry.fsize : 0;
+	timeStamp = exists ? ((uint32_t)entry.fdate << 16) | entry.ftime : 0;
+
+	if(cacheable)
+	{
+		strcpy(fileInfoName[fileInfoNext], location);
+		fileInfoExists[fileInfoNext] = exists;
+		fileInfoSize[fileInfoNext] = size;
+		fileInfoTimeStamp[fileInfoNext] = timeStamp;
+		fileInfoNext = (fileInfoNext + 1) % FILE_INFO_CACHE_LENGTH;
+	}
+	return exists;
+}
+
+// Free clusters times sectors per cluster times 512 byte sectors
+
+uint64_t MassStorage::FreeSpace()
+{
+	DWORD freeClusters;
+	FATFS* fs;
+	if(f_getfree("0:", &freeClusters, &fs) != FR_OK)
+	{
+		platform->Message(HOST_MESSAGE, "Can't find the free space on the SD card.\n");
+		return 0;
+	}
+	return (uint64_t)freeClusters * fs->csize * 512;
+}
+
+// Scan the start and end of a G Code file for what the slicer wrote in comments there, without
+// reading the rest however big it is.  Each comment line is looked at for the ways that the
+// common slicers put things.
+
+bool MassStorage::GetGCodeFileInfo(const char* directory, const char* fileName, GCodeFileInfo& info)
+{
+	char* location = CombineName(directory, fileName);
+	bool cacheable = strlen(location) < FILE_INFO_NAME_LENGTH;
+
+	if(cacheable)
+	{
+		for(int8_t i = 0; i < GCODE_INFO_CACHE_LENGTH; i++)
+		{
+			if(!strcmp(gcodeInfoName[i], location))
+			{
+				info = gcodeInfo[i];
+				return true;
+			}
+		}
+	}
+
+	if(f_open(&gcodeInfoFile, location, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+		return false;
+
+	info.size = gcodeInfoFile.fsize;
+	info.layerHeight = 0.0;
+	info.filamentUsed = 0.0;
+	info.printTime = 0.0;
+	info.generatedBy[0] = 0;
+
+	if(info.size <= GCODE_INFO_HEAD_LENGTH + GCODE_INFO_TAIL_LENGTH)
+		ScanGCodeInfo(0, info.size, false, true, info);
+	else
+	{
+		ScanGCodeInfo(0, GCODE_INFO_HEAD_LENGTH, false, false, info);
+		ScanGCodeInfo(info.size - GCODE_INFO_TAIL_LENGTH, GCODE_INFO_TAIL_LENGTH, true, true, info);
+	}
+	f_close(&gcodeInfoFile);
+
+	if(cacheable)
+	{
+		strcpy(gcodeInfoName[gcodeInfoNext], location);
+		gcodeInfo[gcodeInfoNext] = info;
+		gcodeInfoNext = (gcodeInfoNext + 1) % GCODE_INFO_CACHE_LENGTH;
+	}
+	return true;
+}
+
+// Read length bytes from start a buffer at a time, and parse them a line at a time.  Part
+// lines at the start (if skipFirstLine) and at the end (unless toEnd) are ignored.
+
+void MassStorage::ScanGCodeInfo(unsigned long start, unsigned long length, bool skipFirstLine, bool toEnd, GCodeFileInfo& info)
+{
+	if(f_lseek(&gcodeInfoFile, start) != FR_OK)
+		return;
+
+	int kept = 0;
+	bool skipping = skipFirstLine;
+	while(length > 0)
+	{
+		UINT n = GCODE_INFO_BUFFER_LENGTH - kept;
+		if(n > length)
+			n = length;
+		if(f_read(&gcodeInfoFile, &gcodeInfoBuffer[kept], n, &n) != FR_OK || n == 0)
+			break;
+		length -= n;
+		int end = kept + n;
+		int lineStart = 0;
+		for(int i = kept; i < end; i++)
+		{
+			if(gcodeInfoBuffer[i] == '\n' || gcodeInfoBuffer[i] == '\r')
+			{
+				gcodeInfoBuffer[i] = 0;
+				if(!skipping)
+					ParseGCodeInfoLine(&gcodeInfoBuffer[lineStart], info);
+				skipping = false;
+				lineStart = i + 1;
+			}
+		}
+		kept = end - lineStart;
+		if(kept >= GCODE_INFO_BUFFER_LENGTH)
+		{
+			kept = 0;			// Too long to be a slicer comment
+			skipping = true;
+		} else
+			memmove(gcodeInfoBuffer, &gcodeInfoBuffer[lineStart], kept);
+	}
+	if(toEnd && kept > 0 && !skipping)
+	{
+		gcodeInfoBuffer[kept] = 0;
+		ParseGCodeInfoLine(gcodeInfoBuffer, info);
+	}
+}
+
+// The first of each value found is kept.  Comments are like these:
+//
+// Slic3r:     ; layer_height = 0.2   ; filament used = 1234.5mm (3.0cm3)   ; estimated printing time = 1h 2m 3s
+// Cura:       ;Layer height: 0.2     ;Filament used: 1.2345m               ;TIME:3723
+// Simplify3D: ;   layerHeight,0.2    ;   Filament length: 1234.5 mm        ;   Build time: 1 hours 2 minutes
+
+void MassStorage::ParseGCodeInfoLine(const char* line, GCodeFileInfo& info)
+{
+	char lower[GCODE_INFO_BUFFER_LENGTH+1];
+
+	while(*line == ' ' || *line == '\t')
+		line++;
+	if(*line != ';')
+		return;
+	line++;
+	while(*line == ' ' || *line == '\t')
+		line++;
+
+	int i;
+	for(i = 0; line[i]; i++)
+		lower[i] = tolower(line[i]);
+	lower[i] = 0;
+
+	if(!info.generatedBy[0] && ((i = StringContains(lower, "generated by")) >= 0 || (i = StringContains(lower, "generated with")) >= 0))
+	{
+		while(line[i] == ' ')
+			i++;
+		strncpy(info.generatedBy, &line[i], GENERATOR_LENGTH);
+		info.generatedBy[GENERATOR_LENGTH] = 0;
+		return;
+	}
+
+	const char* number = SkipToNumber(lower);
+	if(number == NULL)
+		return;
+
+	if(info.layerHeight <= 0.0 &&
+			(StringStartsWith(lower, "layer_height") || StringStartsWith(lower, "layer height") || StringStartsWith(lower, "layerheight")))
+	{
+		info.layerHeight = ReadGCodeFloat(number);
+		return;
+	}
+
+	if(info.filamentUsed <= 0.0 && (StringStartsWith(lower, "filament used") || StringStartsWith(lower, "filament length")))
+	{
+		info.filamentUsed = ReadGCodeFloat(number);
+		const char* unit = SkipNumber(number);
+		while(*unit == ' ')
+			unit++;
+		if(unit[0] == 'm' && unit[1] != 'm')
+			info.filamentUsed *= 1000.0;		// Metres
+		return;
+	}
+
+	if(info.printTime <= 0.0 && (StringStartsWith(lower, "time:") || StringStartsWith(lower, "estimated printing time") ||
+			StringStartsWith(lower, "build time") || StringStartsWith(lower, "print time")))
+		info.printTime = ReadDuration(number);
+}
+
+const char* MassStorage::SkipToNumber(const char* s)
+{
+	while(*s && !isdigit(*s) && !(*s == '.' && isdigit(s[1])))
+		s++;
+	return *s ? s : NULL;
+}
+
+const char* MassStorage::SkipNumber(const char* s)
+{
+	while(isdigit(*s) || *s == '.')
+		s++;
+	return s;
+}
+
+// Add up something like "1d 2h 3m 4s" or "1 hours 2 minutes" in seconds; a bare number is seconds
+
+float MassStorage::ReadDuration(const char* s)
+{
+	float total = 0.0;
+	while((s = SkipToNumber(s)) != NULL)
+	{
+		float value = ReadGCodeFloat(s);
+		s = SkipNumber(s);
+		while(*s == ' ')
+			s++;
+		switch(*s)
+		{
+		case 'd':
+			value *= 86400.0;
+			break;
+		case 'h':
+			value *= 3600.0;
+			break;
+		case 'm':
+			value *= 60.0;
+			break;
+		default:
+			break;
+		}
+		total += value;
+		while(isalpha(*s))
+			s++;
+	}
+	return total;
+}
+
+void MassStorage::InvalidateFileInfo()
+{
+	indexValid = false;
+	for(int8_t i = 0; i < GCODE_INFO_CACHE_LENGTH; i++)
+		gcodeInfoName[i][0] = 0;
+	gcodeInfoNext = 0;
+	for(int8_t i = 0; i < FILE_INFO_CACHE_LENGTH; i++)
+		fileInfoName[i][0] = 0;
+	fileInfoNext = 0;
+}
+
 //------------------------------------------------------------------------------------------------
 
 
-FileStore::FileStore(Platform* p)
+FileStore::FileStore()
 {
-   platform = p;  
+   platform = NULL;
+   inUse = false;
 }
 
 
-void FileStore::Init()
+void FileStore::Init(Platform* p)
 {
+  platform = p;
   bufferPointer = 0;
   inUse = false;
   writing = false;
   lastBufferEntry = 0;
+  SetBuffers(ownBuffer, NULL, FILE_BUF_LEN);
+}
+
+// Platform uses this to give the file bigger buffers than its own for printing,
+// uploading and serving web pages.  If next is not NULL the file is double buffered.
+
+void FileStore::SetBuffers(byte* b, byte* next, int length)
+{
+  buf = b;
+  nextBuf = next;
+  bufferLength = length;
 }
 
 
@@ -747,12 +1409,15 @@ bool FileStore::Open(const char* directory, const char* fileName, bool write)
   char* location = platform->GetMassStorage()->CombineName(directory, fileName);
 
   writing = write;
-  lastBufferEntry = FILE_BUF_LEN - 1;
+  lastBufferEntry = bufferLength - 1;
   bytesRead = 0;
+  nextBufferEntries = 0;
+  endOfFileRead = false;
   FRESULT openReturn;
 
   if(writing)
   {
+	  platform->GetMassStorage()->InvalidateFileInfo();
 	  openReturn = f_open(&file, location, FA_CREATE_ALWAYS | FA_WRITE);
 	  if (openReturn != FR_OK)
 	  {
@@ -778,7 +1443,7 @@ bool FileStore::Open(const char* directory, const char* fileName, bool write)
 		  platform->Message(HOST_MESSAGE, "\n");
 		  return false;
 	  }
-	  bufferPointer = FILE_BUF_LEN;
+	  bufferPointer = bufferLength;
   }
 
   inUse = true;
@@ -790,6 +1455,8 @@ void FileStore::Close()
   if(writing)
 	  WriteBuffer();
   f_close(&file);
+  if(writing)
+	  platform->GetMassStorage()->InvalidateFileInfo();	// Its size and date have changed
   platform->ReturnFileStore(this);
   inUse = false;
   writing = false;
@@ -807,6 +1474,76 @@ void FileStore::GoToEnd()
   f_lseek(&file, e);
 }
 
+// Start reading again from a place in the file.  The card is read from the sector the
+// place is in, so double-buffered read-ahead still works in whole sectors; the bytes
+// before the place are read and dropped.
+
+void FileStore::Seek(unsigned long position)
+{
+  if(!inUse || writing)
+  {
+    platform->Message(HOST_MESSAGE, "Attempt to seek on a file that isn't open for reading.\n");
+    return;
+  }
+  unsigned long sectorStart = position - position%SECTOR_LENGTH;
+  if(f_lseek(&file, sectorStart) != FR_OK)
+  {
+    platform->Message(HOST_MESSAGE, "Error seeking in file.\n");
+    return;
+  }
+  bytesRead = sectorStart;
+  bufferPointer = bufferLength;
+  lastBufferEntry = bufferLength - 1;
+  nextBufferEntries = 0;
+  endOfFileRead = false;
+
+  unsigned long skip = position - sectorStart;
+  while(skip > 0)
+  {
+    const char* data;
+    int available = ReadBlock(data);
+    if(available <= 0)
+      return;
+    if((unsigned long)available > skip)
+      available = (int)skip;
+    Consume(available);
+    skip -= available;
+  }
+}
+
+// Write a block at a place in a file open for writing, after anything still in the buffer.
+// FatFs sends whole sectors from a sector boundary straight to the card, so that is one card
+// write per sector, as long as position and length are whole sectors.  FatFs only marks the file
+// as written, so its directory entry isn't touched until the next Flush() or Close().
+
+bool FileStore::Overwrite(unsigned long position, const byte* data, unsigned int length)
+{
+  if(!inUse || !writing)
+  {
+    platform->Message(HOST_MESSAGE, "Attempt to overwrite a file that isn't open for writing.\n");
+    return false;
+  }
+  if(bufferPointer > 0)
+	  WriteBuffer();
+  unsigned int written;
+  if(f_lseek(&file, position) != FR_OK || f_write(&file, data, length, &written) != FR_OK || written != length)
+  {
+    platform->Message(HOST_MESSAGE, "Error overwriting file.\n");
+    return false;
+  }
+  return true;
+}
+
+void FileStore::Flush()
+{
+  if(!inUse || !writing)
+    return;
+  if(bufferPointer > 0)
+	  WriteBuffer();
+  f_sync(&file);
+  platform->GetMassStorage()->InvalidateFileInfo();
+}
+
 unsigned long FileStore::Length()
 {
   if(!inUse)
@@ -818,6 +1555,11 @@ unsigned long FileStore::Length()
 	return 0;
 }
 
+unsigned long FileStore::BytesRead()
+{
+	return bytesRead;
+}
+
 float FileStore::FractionRead()
 {
 	unsigned long len = Length();
@@ -831,7 +1573,10 @@ int8_t FileStore::Status()
   if(!inUse)
     return nothing;
 
-  if(lastBufferEntry == FILE_BUF_LEN)
+  if(lastBufferEntry == bufferLength)
+	return byteAvailable;
+
+  if(nextBuf != NULL && (!endOfFileRead || nextBufferEntries > 0))
 	return byteAvailable;
 
   if(bufferPointer < lastBufferEntry)
@@ -842,15 +1587,64 @@ int8_t FileStore::Status()
 
 void FileStore::ReadBuffer()
 {
-	FRESULT readStatus;
-	readStatus = f_read(&file, buf, FILE_BUF_LEN, &lastBufferEntry);	// Read a chunk of file
-	if (readStatus)
+	if(nextBuf == NULL)
 	{
-		platform->Message(HOST_MESSAGE, "Error reading file.\n");
+		FRESULT readStatus;
+		readStatus = f_read(&file, buf, bufferLength, &lastBufferEntry);	// Read a chunk of file
+		if (readStatus)
+		{
+			platform->Message(HOST_MESSAGE, "Error reading file.\n");
+		}
+	} else
+	{
+		// Double buffered: swap in however much of the one behind Spin() has read.  If
+		// it hasn't read any, read one chunk now rather than waiting to fill the buffer.
+
+		if(nextBufferEntries == 0 && !endOfFileRead)
+			ReadAhead();
+		byte* b = buf;
+		buf = nextBuf;
+		nextBuf = b;
+		lastBufferEntry = nextBufferEntries;
+		nextBufferEntries = 0;
 	}
 	bufferPointer = 0;
 }
 
+// Read the next chunk of the file into the buffer behind the one being consumed.  The
+// chunks are whole sectors from a sector boundary in the file, so FatFs can transfer them
+// from the card straight into the buffer with a multi-sector read.  If the file isn't at a
+// boundary the chunk stops at the next one, and those after it are aligned again.
+
+void FileStore::ReadAhead()
+{
+	unsigned int n = bufferLength - nextBufferEntries;
+	if(n > FILE_READ_AHEAD_CHUNK)
+		n = FILE_READ_AHEAD_CHUNK;
+	unsigned int misaligned = f_tell(&file)%SECTOR_LENGTH;
+	if(misaligned != 0 && n > SECTOR_LENGTH - misaligned)
+		n = SECTOR_LENGTH - misaligned;
+	unsigned int got;
+	if(f_read(&file, &nextBuf[nextBufferEntries], n, &got) != FR_OK)
+	{
+		platform->Message(HOST_MESSAGE, "Error reading file.\n");
+		endOfFileRead = true;
+		return;
+	}
+	nextBufferEntries += got;
+	if(got < n)
+		endOfFileRead = true;
+}
+
+// Spread the reading of a double-buffered file over the main loop a chunk at a time,
+// rather than stalling it to fill a whole buffer when the current one runs out.
+
+void FileStore::Spin()
+{
+	if(inUse && !writing && nextBuf != NULL && !endOfFileRead && nextBufferEntries < bufferLength)
+		ReadAhead();
+}
+
 bool FileStore::Read(char& b)
 {
   if(!inUse)
@@ -859,7 +1653,7 @@ bool FileStore::Read(char& b)
     return false;
   }
 
-  if(bufferPointer >= FILE_BUF_LEN)
+  if(BufferUsedUp())
 	  ReadBuffer();
 
   if(bufferPointer >= lastBufferEntry)
@@ -874,6 +1668,33 @@ bool FileStore::Read(char& b)
   return true;
 }
 
+// Give direct access to the unread part of the buffer, so whole lines can be taken
+// from it without going byte by byte through Read().  Call Consume() afterwards to
+// say how much was used.
+
+int FileStore::ReadBlock(const char*& data)
+{
+  if(!inUse)
+  {
+    platform->Message(HOST_MESSAGE, "Attempt to read from a non-open file.\n");
+    return 0;
+  }
+
+  if(BufferUsedUp())
+	  ReadBuffer();
+
+  data = (const char*)&buf[bufferPointer];
+  if(bufferPointer >= lastBufferEntry)
+	  return 0;
+  return lastBufferEntry - bufferPointer;
+}
+
+void FileStore::Consume(int n)
+{
+  bufferPointer += n;
+  bytesRead += n;
+}
+
 void FileStore::WriteBuffer()
 {
 	FRESULT writeStatus;
@@ -895,7 +1716,7 @@ void FileStore::Write(char b)
   }
   buf[bufferPointer] = b;
   bufferPointer++;
-  if(bufferPointer >= FILE_BUF_LEN)
+  if(bufferPointer >= bufferLength)
 	  WriteBuffer();
 }
 
@@ -906,15 +1727,51 @@ void FileStore::Write(const char* b)
     platform->Message(HOST_MESSAGE, "Attempt to write string to a non-open file.\n");
     return;
   }
-  int i = 0;
-  while(b[i])
-    Write(b[i++]);
+  Write(b, strlen(b));
+}
+
+// Bytes are copied into the buffer, which is written each time it fills.  When the
+// buffer is empty whole buffers' worth go straight from data to the card.  The buffer
+// length is a multiple of the sector size, so FatFs can write them without copying.
+
+void FileStore::Write(const char* data, unsigned int length)
+{
+	if(!inUse)
+	{
+		platform->Message(HOST_MESSAGE, "Attempt to write block to a non-open file.\n");
+		return;
+	}
+	while(length > 0)
+	{
+		if(bufferPointer == 0 && length >= (unsigned int)bufferLength)
+		{
+			unsigned int n = length - length % bufferLength;
+			FRESULT writeStatus = f_write(&file, data, n, &lastBufferEntry);
+			if((writeStatus != FR_OK) || (lastBufferEntry != n))
+			{
+				platform->Message(HOST_MESSAGE, "Error writing file.  Disc may be full.\n");
+				return;
+			}
+			data += n;
+			length -= n;
+			continue;
+		}
+		unsigned int n = bufferLength - bufferPointer;
+		if(n > length)
+			n = length;
+		memcpy(&buf[bufferPointer], data, n);
+		bufferPointer += n;
+		data += n;
+		length -= n;
+		if(bufferPointer >= bufferLength)
+			WriteBuffer();
+	}
 }
 
 
 //-----------------------------------------------------------------------------------------------------
 
-FileStore* Platform::GetFileStore(const char* directory, const char* fileName, bool write)
+FileStore* Platform::GetFileStore(const char* directory, const char* fileName, bool write, FileUse use)
 {
   FileStore* result = NULL;
 
@@ -922,14 +1779,15 @@ FileStore* Platform::GetFileStore(const char* directory, const char* fileName, b
 	  return NULL;
 
   for(int i = 0; i < MAX_FILES; i++)
-    if(!files[i]->inUse)
+    if(!files[i].inUse)
     {
-      files[i]->inUse = true;
-      if(files[i]->Open(directory, fileName, write))
-        return files[i];
+      files[i].inUse = true;
+      AssignFileBuffers(&files[i], use);
+      if(files[i].Open(directory, fileName, write))
+        return &files[i];
       else
       {
-        files[i]->inUse = false;
+        ReturnFileStore(&files[i]);
         return NULL;
       }
     }
@@ -945,14 +1803,62 @@ MassStorage* Platform::GetMassStorage()
 
 void Platform::ReturnFileStore(FileStore* fs)
 {
+  if(printFileBuffersUser == fs)
+	  printFileBuffersUser = NULL;
+  if(uploadFileBufferUser == fs)
+	  uploadFileBufferUser = NULL;
+  if(webFileBufferUser == fs)
+	  webFileBufferUser = NULL;
+  fs->SetBuffers(fs->ownBuffer, NULL, FILE_BUF_LEN);
+
   for(int i = 0; i < MAX_FILES; i++)
-      if(files[i] == fs)
+      if(&files[i] == fs)
         {
-          files[i]->inUse = false;
+          files[i].inUse = false;
           return;
         }
 }
 
+// Give a file being opened the big buffer(s) for what it is to be used for.  There
+// is one set of each; if they are taken the file makes do with its own small buffer.
+
+void Platform::AssignFileBuffers(FileStore* fs, FileUse use)
+{
+  switch(use)
+  {
+  case printFile:
+	  if(printFileBuffersUser == NULL)
+	  {
+		  printFileBuffersUser = fs;
+		  fs->SetBuffers(printFileBuffers[0], printFileBuffers[1], PRINT_FILE_BUF_LEN);
+		  return;
+	  }
+	  break;
+
+  case uploadFile:
+	  if(uploadFileBufferUser == NULL)
+	  {
+		  uploadFileBufferUser = fs;
+		  fs->SetBuffers(uploadFileBuffer, NULL, UPLOAD_FILE_BUF_LEN);
+		  return;
+	  }
+	  break;
+
+  case webFile:
+	  if(webFileBufferUser == NULL)
+	  {
+		  webFileBufferUser = fs;
+		  fs->SetBuffers(webFileBuffer, NULL, WEB_FILE_BUF_LEN);
+		  return;
+	  }
+	  break;
+
+  default:
+	  break;
+  }
+  fs->SetBuffers(fs->ownBuffer, NULL, FILE_BUF_LEN);
+}
+
 void Platform::Message(char type, const char* message)
 {
 	switch(type)
@@ -977,12 +1883,12 @@ void Platform::Message(char type, const char* message)
 
 	case WEB_MESSAGE:
 		// Message that is to be sent to the web
-		reprap.GetWebserver()->MessageStringToWebInterface(message, false);
+		webOutput.PutTagged('m', message);
 		break;
 
 	case WEB_ERROR_MESSAGE:
 		// Message that is to be sent to the web - flags an error
-		reprap.GetWebserver()->MessageStringToWebInterface(message, true);
+		webOutput.PutTagged('e', message);
 		break;
 
 	case BOTH_MESSAGE:
@@ -990,7 +1896,7 @@ void Platform::Message(char type, const char* message)
 		for(uint8_t i = 0; i < messageIndent; i++)
 			line->Write(' ');
 		line->Write(message);
-		reprap.GetWebserver()->MessageStringToWebInterface(message, false);
+		webOutput.PutTagged('m', message);
 		break;
 
 	case BOTH_ERROR_MESSAGE:
@@ -1001,7 +1907,7 @@ void Platform::Message(char type, const char* message)
 		for(uint8_t i = 0; i < messageIndent; i++)
 			line->Write(' ');
 		line->Write(message);
-		reprap.GetWebserver()->MessageStringToWebInterface(message, true);
+		webOutput.PutTagged('e', message);
 		break;
 
 
@@ -1032,12 +1938,12 @@ void Platform::AppendMessage(char type, const char* message)
 
 	case WEB_MESSAGE:
 		// Message that is to be sent to the web
-		reprap.GetWebserver()->AppendReplyToWebInterface(message, false);
+		webOutput.PutTagged('a', message);
 		break;
 
 	case WEB_ERROR_MESSAGE:
 		// Message that is to be sent to the web - flags an error
-		reprap.GetWebserver()->AppendReplyToWebInterface(message, true);
+		webOutput.PutTagged('b', message);
 		break;
 
 	case BOTH_MESSAGE:
@@ -1045,7 +1951,7 @@ void Platform::AppendMessage(char type, const char* message)
 		for(uint8_t i = 0; i < messageIndent; i++)
 			line->Write(' ');
 		line->Write(message);
-		reprap.GetWebserver()->AppendReplyToWebInterface(message, false);
+		webOutput.PutTagged('a', message);
 		break;
 
 	case BOTH_ERROR_MESSAGE:
@@ -1056,7 +1962,7 @@ void Platform::AppendMessage(char type, const char* message)
 		for(uint8_t i = 0; i < messageIndent; i++)
 			line->Write(' ');
 		line->Write(message);
-		reprap.GetWebserver()->AppendReplyToWebInterface(message, true);
+		webOutput.PutTagged('b', message);
 		break;
 
 
@@ -1088,6 +1994,8 @@ void Line::Init()
 {
 	getIndex = 0;
 	numChars = 0;
+	lineCount = 0;
+	output.Init();
 //	alternateInput = NULL;
 //	alternateOutput = NULL;
 	SerialUSB.begin(BAUD_RATE);
@@ -1096,7 +2004,21 @@ void Line::Init()
 
 void Line::Spin()
 {
-	// Read the serial data in blocks to avoid excessive flow control
+	// Send what's waiting a packet at a time, so a host that is slow to read holds up the
+	// main loop for one packet at most
+
+	const char* data;
+	uint16_t n = output.Get(data);
+	if(n > 0)
+	{
+		if(n > usbOutputChunk)
+			n = usbOutputChunk;
+		SerialUSB.write((const uint8_t*)data, n);
+		output.Consume(n);
+	}
+
+	// Read the serial data in blocks to avoid excessive flow control.  The buffer is
+	// bigger than the USB driver's, so each time round we can empty that.
 	if (numChars <= lineBufsize/2)
 	{
 		int16_t target = SerialUSB.available() + (int16_t)numChars;
@@ -1110,6 +2032,8 @@ void Line::Spin()
 			if (incomingByte < 0) break;
 			buffer[(getIndex + numChars) % lineBufsize] = (char)incomingByte;
 			++numChars;
+			if(incomingByte == '\n')
+				++lineCount;
 		}
 	}
 }
@@ -1124,12 +2048,87 @@ void Line::InjectString(char* string)
 	{
 		buffer[(getIndex + numChars) % lineBufsize] = string[i];
 		numChars++;
+		if(string[i] == '\n')
+			lineCount++;
 		i++;
 	}
 }
 
 //***************************************************************************************************
 
+// Output rings
+
+void OutputRing::Init()
+{
+	putIndex = 0;
+	getIndex = 0;
+	dropped = 0;
+	droppedMessages = 0;
+}
+
+bool OutputRing::Put(const char* s)
+{
+	uint16_t n = strlen(s);
+	if(n == 0)
+		return true;
+	if(n > Free())
+	{
+		dropped += n;
+		droppedMessages++;
+		return false;
+	}
+	uint16_t put = putIndex;
+	uint16_t first = outputRingLength - put;
+	if(first > n)
+		first = n;
+	memcpy(&buffer[put], s, first);
+	memcpy(buffer, &s[first], n - first);
+	putIndex = (put + n) & (outputRingLength - 1);	// Only now can the reader see it
+	return true;
+}
+
+// A tagged string is stored as the tag, the string and its terminating 0. If it won't fit
+// before the end of the buffer a 0 where the tag should be tells the reader to go back to the start.
+
+bool OutputRing::PutTagged(char tag, const char* s)
+{
+	uint16_t n = strlen(s) + 2;
+	uint16_t put = putIndex;
+	uint16_t tail = outputRingLength - put;
+	if(n + ((tail < n) ? tail : 0) > Free())
+	{
+		dropped += n - 2;
+		droppedMessages++;
+		return false;
+	}
+	if(tail < n)
+	{
+		buffer[put] = 0;
+		put = 0;
+	}
+	buffer[put] = tag;
+	strcpy(&buffer[put + 1], s);
+	putIndex = (put + n) & (outputRingLength - 1);
+	return true;
+}
+
+bool OutputRing::GetTagged(char& tag, const char*& s)
+{
+	if(getIndex == putIndex)
+		return false;
+	if(buffer[getIndex] == 0)
+	{
+		getIndex = 0;
+		if(getIndex == putIndex)
+			return false;
+	}
+	tag = buffer[getIndex];
+	s = &buffer[getIndex + 1];
+	return true;
+}
+
+//***************************************************************************************************
+
 // Network/Ethernet class
 
 // C calls to interface with LWIP (http://savannah.nongnu.org/projects/lwip/)
@@ -1145,6 +2144,10 @@ extern "C"
 
 void RepRapNetworkSendOutput(char* data, int length, void* pbuf, void* pcb, void* hs);
 
+// Give received data back to lwip when we have read it
+
+void RepRapNetworkReleaseInput(void* pbuf);
+
 // When lwip releases storage, set the local copy of the pointer to 0 to stop
 // it being used again.
 
@@ -1155,8 +2158,8 @@ void RepRapNetworkInputBufferReleased(void* pb)
 
 void RepRapNetworkConnectionError(void* h)
 {
-	reprap.GetPlatform()->GetNetwork()->ConnectionError(h);
-	reprap.GetWebserver()->ConnectionError();
+	if(reprap.GetPlatform()->GetNetwork()->ConnectionError(h))
+		reprap.GetWebserver()->ConnectionError();
 }
 
 // Called to put out a message via the RepRap firmware.
@@ -1166,11 +2169,11 @@ void RepRapNetworkMessage(char* s)
 	reprap.GetPlatform()->Message(HOST_MESSAGE, s);
 }
 
-// Called to push data into the RepRap firmware.
+// Called to push data into the RepRap firmware.  Returns false if it can't be taken yet.
 
-void RepRapNetworkReceiveInput(char* data, int length, void* pbuf, void* pcb, void* hs)
+bool RepRapNetworkReceiveInput(char* data, int length, void* pbuf, void* pcb, void* hs)
 {
-	reprap.GetPlatform()->GetNetwork()->ReceiveInput(data, length, pbuf, pcb, hs);
+	return reprap.GetPlatform()->GetNetwork()->ReceiveInput(data, length, pbuf, pcb, hs);
 }
 
 // Called when transmission of outgoing data is complete to allow
@@ -1181,11 +2184,6 @@ void RepRapNetworkSentPacketAcknowledged()
 	reprap.GetPlatform()->GetNetwork()->SentPacketAcknowledged();
 }
 
-bool RepRapNetworkHasALiveClient()
-{
-	return reprap.GetPlatform()->GetNetwork()->Status() & clientLive;
-}
-
 // This one is in ethernetif.c
 
 void RepRapNetworkSetMACAddress(const u8_t mac[]);
@@ -1221,8 +2219,12 @@ void Network::Reset()
 	outputPointer = 0;
 	writeEnabled = false;
 	closePending = false;
+	finishPending = false;
 	status = nothing;
 	sentPacketsOutstanding = 0;
+	readEntry = NULL;
+	requestPcb = NULL;
+	requestHs = NULL;
 }
 
 void Network::CleanRing()
@@ -1244,6 +2246,10 @@ void Network::Init()
 	}
 	CleanRing();
 	Reset();
+	divertedEntry = NULL;
+	divertedPointer = 0;
+	divertedPcb = NULL;
+	divertedHs = NULL;
 	RepRapNetworkSetMACAddress(reprap.GetPlatform()->MACAddress());
 	init_ethernet(reprap.GetPlatform()->IPAddress(), reprap.GetPlatform()->NetMask(), reprap.GetPlatform()->GateWay());
 	active = true;
@@ -1251,6 +2257,13 @@ void Network::Init()
 	windowedSendPackets = WINDOWED_SEND_PACKETS;
 }
 
+// Requests from all the open connections queue in the ring in the order they arrived, and
+// are dealt with one at a time.  The connection of the request being dealt with is recorded
+// in requestPcb and requestHs; until its response has been finished, only input from
+// that connection is read.  A connection that is kept alive can queue several requests.
+// The input of one request (an upload) can be diverted to be read on the side, so the
+// others don't have to wait for all of it to arrive.
+
 void Network::Spin()
 {
 	if(!active || !enabled)
@@ -1263,46 +2276,170 @@ void Network::Spin()
 
 	ethernet_task();
 
-	// Anything come in from the network to act on?
+	// Step over ring entries that have been read, or dropped because their connection went
+
+	while(netRingGetPointer != netRingAddPointer && !netRingGetPointer->Active())
+		netRingGetPointer = netRingGetPointer->Next();
 
-	if(!netRingGetPointer->Active())
+	// Still reading the last one?
+
+	if(readEntry != NULL)
 		return;
 
-	// Finished reading the active ring element?
+	// Anything come in from the network to act on?
 
-	if(!netRingGetPointer->ReadFinished())
+	NetRing* r = netRingGetPointer;
+	for(int8_t i = 0; i < HTTP_STATE_SIZE; i++)
 	{
-		// No - Finish reading any data that's been received.
-
-		if(inputPointer < inputLength)
+		if(r->Active() && r->Hs() != divertedHs && (requestHs == NULL || r->Hs() == requestHs))
+		{
+			readEntry = r;
+			inputPointer = 0;
+			inputLength = r->Length();
+			inputBuffer = r->Data();
+			if(requestHs == NULL)
+			{
+				requestPcb = r->Pcb();
+				requestHs = r->Hs();
+				writeEnabled = true;
+				status = clientLive;
+			}
 			return;
-
-		// Haven't started reading it yet - set that up.
-
-		inputPointer = 0;
-		inputLength = netRingGetPointer->Length();
-		inputBuffer = netRingGetPointer->Data();
+		}
+		r = r->Next();
 	}
 }
 
-// Webserver calls this to read bytes that have come in from the network
+// Webserver calls this to read bytes that have come in from the network.
+// A ring entry is given back as soon as it has been read.
 
 bool Network::Read(char& b)
 {
+	if(readEntry == NULL || inputPointer >= inputLength)
+		return false;
+	b = inputBuffer[inputPointer];
+	Consume(1);
+	return true;
+}
+
+int Network::ReadBlock(const char*& data)
+{
+	if(readEntry == NULL)
+		return 0;
+	data = &inputBuffer[inputPointer];
+	return inputLength - inputPointer;
+}
+
+void Network::Consume(int n)
+{
+	if(readEntry == NULL)
+		return;
+	inputPointer += n;
 	if(inputPointer >= inputLength)
 	{
+		ReleaseEntry(readEntry);
+		readEntry = NULL;
 		inputLength = -1;
 		inputPointer = 0;
-		netRingGetPointer->SetReadFinished(); // Past tense...
-		SetWriteEnable(true);
-		//reprap.GetPlatform()->Message(HOST_MESSAGE, "Network - data read.\n");
+	}
+}
+
+// The current request's connection has more coming in than is worth holding everything
+// else up for.  Its input from here on, starting with what is left of the entry being read,
+// is read with ReadDivertedBlock() instead, and other requests are dealt with meanwhile.
+// Only one connection can be diverted at a time.
+
+void Network::DivertInput()
+{
+	if(requestHs == NULL || divertedHs != NULL)
+	{
+		reprap.GetPlatform()->Message(HOST_MESSAGE, "Network::DivertInput() - No request, or one is diverted already.\n");
+		return;
+	}
+	divertedEntry = readEntry;
+	divertedPointer = inputPointer;
+	divertedPcb = requestPcb;
+	divertedHs = requestHs;
+	readEntry = NULL;
+	inputLength = -1;
+	inputPointer = 0;
+	requestPcb = NULL;
+	requestHs = NULL;
+	status = nothing;
+}
+
+int Network::ReadDivertedBlock(const char*& data)
+{
+	if(divertedHs == NULL)
+		return 0;
+	if(divertedEntry == NULL)
+	{
+		// The oldest entry from the diverted connection is next
+
+		NetRing* r = netRingGetPointer;
+		for(int8_t i = 0; i < HTTP_STATE_SIZE && divertedEntry == NULL; i++)
+		{
+			if(r->Active() && r->Hs() == divertedHs)
+			{
+				divertedEntry = r;
+				divertedPointer = 0;
+			}
+			r = r->Next();
+		}
+		if(divertedEntry == NULL)
+			return 0;
+	}
+	data = &divertedEntry->Data()[divertedPointer];
+	return divertedEntry->Length() - divertedPointer;
+}
+
+void Network::ConsumeDiverted(int n)
+{
+	if(divertedEntry == NULL)
+		return;
+	divertedPointer += n;
+	if(divertedPointer >= divertedEntry->Length())
+	{
+		ReleaseEntry(divertedEntry);
+		divertedEntry = NULL;
+		divertedPointer = 0;
+	}
+}
+
+// Once the diverted input has all been read, its request can be answered, but only when no
+// other request is being dealt with.  Anything still unread on the connection is read next.
+
+bool Network::ResumeDiverted()
+{
+	if(divertedHs == NULL || requestHs != NULL || readEntry != NULL || closePending || finishPending)
 		return false;
+	requestPcb = divertedPcb;
+	requestHs = divertedHs;
+	if(divertedEntry != NULL)
+	{
+		readEntry = divertedEntry;
+		inputBuffer = divertedEntry->Data();
+		inputPointer = divertedPointer;
+		inputLength = divertedEntry->Length();
 	}
-	b = inputBuffer[inputPointer];
-	inputPointer++;
+	divertedEntry = NULL;
+	divertedPointer = 0;
+	divertedPcb = NULL;
+	divertedHs = NULL;
+	writeEnabled = true;
+	status = clientLive;
 	return true;
 }
 
+// Give a ring entry's pbuf back to lwip and free the entry
+
+void Network::ReleaseEntry(NetRing* r)
+{
+	if(r->Pbuf() != NULL)
+		RepRapNetworkReleaseInput(r->Pbuf());
+	r->Free();
+}
+
 // Webserver calls this to write bytes that need to go out to the network
 
 void Network::Write(char b)
@@ -1329,54 +2466,113 @@ void Network::Write(char b)
 	// Buffer full?  If so, send it.
 
 	if(outputPointer == ARRAY_SIZE(outputBuffer))
-	{
-		if(windowedSendPackets > 1)
-			++sentPacketsOutstanding;
-		else
-			SetWriteEnable(false);  // Stop further writing from Webserver until the network tells us that this has gone
+		SendOutputBuffer();
+}
 
-		RepRapNetworkSendOutput(outputBuffer, outputPointer, netRingGetPointer->Pbuf(), netRingGetPointer->Pcb(), netRingGetPointer->Hs());
-		outputPointer = 0;
+// Copy as much of a block as the network will take straight into the output
+// buffer, sending it each time it fills.  Returns the number of bytes taken, which
+// is less than length if the network can accept no more for now.
+
+size_t Network::Write(const char* data, size_t length)
+{
+	size_t written = 0;
+	while(written < length && CanWrite())
+	{
+		size_t n = ARRAY_SIZE(outputBuffer) - outputPointer;
+		if(n > length - written)
+			n = length - written;
+		memcpy(&outputBuffer[outputPointer], &data[written], n);
+		outputPointer += n;
+		written += n;
+		if(outputPointer == ARRAY_SIZE(outputBuffer))
+			SendOutputBuffer();
 	}
+	return written;
+}
+
+void Network::SendOutputBuffer()
+{
+	if(windowedSendPackets > 1)
+		++sentPacketsOutstanding;
+	else
+		SetWriteEnable(false);  // Stop further writing from Webserver until the network tells us that this has gone
+
+	RepRapNetworkSendOutput(outputBuffer, outputPointer, NULL, requestPcb, requestHs);
+	outputPointer = 0;
 }
 
 void Network::InputBufferReleased(void* pb)
 {
-	if(netRingGetPointer->Pbuf() != pb)
+	NetRing* r = netRingGetPointer;
+	for(int8_t i = 0; i < HTTP_STATE_SIZE; i++)
 	{
-		reprap.GetPlatform()->Message(HOST_MESSAGE, "Network::InputBufferReleased() - Pointers don't match!\n");
-		return;
+		if(r->Active() && r->Pbuf() == pb)
+		{
+			r->ReleasePbuf();
+			return;
+		}
+		r = r->Next();
 	}
-	netRingGetPointer->ReleasePbuf();
+	reprap.GetPlatform()->Message(HOST_MESSAGE, "Network::InputBufferReleased() - Pointers don't match!\n");
 }
 
-void Network::ConnectionError(void* h)
+// Throw away anything queued from a connection that has gone or is going
+
+void Network::DropRequests(void* h)
 {
-	// h points to an http state block that the caller is about to release, so we need to stop referring to it.
-	// The state block is usually but not always in use by the current http request being processed, in which case we abandon the current request.
-	if (netRingGetPointer != netRingAddPointer && netRingGetPointer->Hs() == h)
+	NetRing* r = netRingGetPointer;
+	for(int8_t i = 0; i < HTTP_STATE_SIZE; i++)
 	{
-		netRingGetPointer->Free();
-		netRingGetPointer = netRingGetPointer->Next();
+		if(r->Active() && r->Hs() == h)
+		{
+			if(r == readEntry)
+			{
+				readEntry = NULL;
+				inputLength = -1;
+				inputPointer = 0;
+			}
+			if(r == divertedEntry)
+			{
+				divertedEntry = NULL;
+				divertedPointer = 0;
+			}
+			ReleaseEntry(r);
+		}
+		r = r->Next();
 	}
+}
+
+// h points to an http state block that the caller is about to release, so we need to stop referring to it.
+// Returns true if it belonged to the request being dealt with, which has had to be abandoned.
+// A diverted connection that goes just stops being diverted.
+
+bool Network::ConnectionError(void* h)
+{
+	DropRequests(h);
+	if(h == divertedHs)
+	{
+		divertedPcb = NULL;
+		divertedHs = NULL;
+	}
+	if(h != requestHs)
+		return false;
 
 	// Reset the network layer. In particular, this clears the output buffer to make sure nothing more gets sent,
-	// and sets status to 'nothing' so that we can accept another connection attempt.
+	// and sets status to 'nothing' so that we can deal with another request.
 	Reset();
+	return true;
 }
 
+// Returns false if the ring is full; lwip will then offer the data again later.
 
-void Network::ReceiveInput(char* data, int length, void* pbuf, void* pcb, void* hs)
+bool Network::ReceiveInput(char* data, int length, void* pbuf, void* pcb, void* hs)
 {
-	status = clientLive;
 	if(netRingAddPointer->Active())
-	{
-		reprap.GetPlatform()->Message(HOST_MESSAGE, "Network::ReceiveInput() - Ring buffer full!\n");
-		return;
-	}
+		return false;
 	netRingAddPointer->Init(data, length, pbuf, pcb, hs);
 	netRingAddPointer = netRingAddPointer->Next();
 	//reprap.GetPlatform()->Message(HOST_MESSAGE, "Network - input received.\n");
+	return true;
 }
 
 
@@ -1396,6 +2592,8 @@ void Network::SetWriteEnable(bool enable)
 		return;
 	if(closePending)
 		Close();
+	else if(finishPending)
+		FinishResponse();
 }
 
 void Network::SentPacketAcknowledged()
@@ -1409,6 +2607,9 @@ void Network::SentPacketAcknowledged()
 		if (closePending && sentPacketsOutstanding == 0)
 		{
 			Close();
+		} else if (finishPending)
+		{
+			FinishResponse();
 		}
 	} else
 		SetWriteEnable(true);
@@ -1427,33 +2628,59 @@ void Network::Write(const char* s)
 		Write(s[i++]);
 }
 
+// The response to the current request is complete, but the connection stays open for
+// more.  Once the last of the output has gone to lwip the next request can be read.
+
+void Network::FinishResponse()
+{
+	if(requestHs == NULL)
+		return;
+	if(outputPointer > 0 && CanWrite())
+		SendOutputBuffer();
+	if(outputPointer > 0 || !CanWrite())
+	{
+		finishPending = true;
+		return;
+	}
+	finishPending = false;
+	if(readEntry != NULL)
+		return;		// The next request on this connection has come in already, so go straight on to it
+	requestPcb = NULL;
+	requestHs = NULL;
+	status = nothing;
+}
 
 void Network::Close()
 {
-	if(Status() && clientLive)
+	if(requestHs != NULL)
 	{
 		if(outputPointer > 0)
 		{
-			SetWriteEnable(false);
-			RepRapNetworkSendOutput(outputBuffer, outputPointer, netRingGetPointer->Pbuf(), netRingGetPointer->Pcb(), netRingGetPointer->Hs());
-			outputPointer = 0;
 			closePending = true;
+			if(CanWrite())
+				SendOutputBuffer();
 			return;
 		}
-		RepRapNetworkSendOutput((char*)NULL, 0, netRingGetPointer->Pbuf(), netRingGetPointer->Pcb(), netRingGetPointer->Hs());
-		netRingGetPointer->Free();
-		netRingGetPointer = netRingGetPointer->Next();
+		void* h = requestHs;
+		RepRapNetworkSendOutput((char*)NULL, 0, NULL, requestPcb, h);
+		DropRequests(h);	// Anything else that came on the connection can't be answered now
+		requestPcb = NULL;
+		requestHs = NULL;
+		sentPacketsOutstanding = 0;	// Acknowledgements won't come for a closed connection
 		//reprap.GetPlatform()->Message(HOST_MESSAGE, "Network - output sent and closed.\n");
 	} else
 		reprap.GetPlatform()->Message(HOST_MESSAGE, "Network::Close() - Attempt to close a closed connection!\n");
 	closePending = false;
+	finishPending = false;
 	status = nothing;
 	//Reset();
 }
 
+// No input is offered while the last response is still being finished off
+
 int8_t Network::Status() const
 {
-	if(inputPointer >= inputLength)
+	if(readEntry == NULL || inputPointer >= inputLength || closePending || finishPending)
 		return status;
 	return status | clientConnected | byteAvailable;
 }
@@ -63,6 +63,8 @@ Licence: GPL
 #define SHORT_STRING_LENGTH 40
 #define TIME_TO_REPRAP 1.0e6 	// Convert seconds to the units used by the machine (usually microseconds)
 #define TIME_FROM_REPRAP 1.0e-6 // Convert the units used by the machine (usually microseconds) to seconds
+#define CPU_CLOCK_RATE 84000000	// Processor cycles per second, as counted by the DWT cycle counter
+#define STEP_CLOCK_RATE 656250	// Ticks per second of the step interrupt timer (TIMER_CLOCK4 = MCK/128 = 84MHz/128)
 
 /**************************************************************************************************/
 
@@ -71,6 +73,7 @@ Licence: GPL
 #define DRIVES 8 // The number of drives in the machine, including X, Y, and Z plus extruder drives
 #define AXES 3 // The number of movement axes in the machine, usually just X, Y and Z. <= DRIVES
 #define HEATERS 6 // The number of heaters in the machine; 0 is the heated bed even if there isn't one.
+#define MAX_TOOLS 8 // The most tools M563 can define; they come from a fixed pool
 
 // The numbers of entries in each array must correspond with the values of DRIVES,
 // AXES, or HEATERS. Set values to -1 to flag unavailability.
@@ -78,6 +81,8 @@ Licence: GPL
 // DRIVES
 
 #define STEP_PINS {14, 25, 5, X2, 41, 39, X4, 49}
+#define STEP_PORTS 4	// The step pins lie in PIOA to PIOD
+#define STEP_PULSE_CYCLES 84	// Processor cycles the step pins are held low for: 1us, the shortest pulse the drivers take
 #define DIRECTION_PINS {15, 26, 4, X3, 35, 53, 51, 48}
 #define FORWARDS true // What to send to go...
 #define BACKWARDS (!FORWARDS) // ...in each direction
@@ -132,6 +137,8 @@ Licence: GPL
 #define THERMISTOR_BETAS {3988.0, 4138.0, 4138.0, 4138.0, 4138.0, 4138.0} // Bed thermistor: B57861S104F40; Extruder thermistor: RS 198-961
 #define THERMISTOR_SERIES_RS {1000, 1000, 1000, 1000, 1000, 1000} // Ohms in series with the thermistors
 #define THERMISTOR_25_RS {10000.0, 100000.0, 100000.0, 100000.0, 100000.0, 100000.0} // Thermistor ohms at 25 C = 298.15 K
+#define THERMISTOR_CS {0.0, 0.0, 0.0, 0.0, 0.0, 0.0} // Steinhart-Hart C coefficients; 0 for the plain Beta equation
+#define TEMPERATURE_SENSORS {thermistorSensor, thermistorSensor, thermistorSensor, thermistorSensor, thermistorSensor, thermistorSensor}
 #define USE_PIDS {false, true, true, true, true, true} // PID or bang-bang for this heater?
 #define PID_KIS { 2.2, 0.5 / HEAT_SAMPLE_TIME, 0.5 / HEAT_SAMPLE_TIME, 0.5 / HEAT_SAMPLE_TIME, 0.5 / HEAT_SAMPLE_TIME, 0.5 / HEAT_SAMPLE_TIME} // Integral PID constants, adjusted by ab for Ormerod hot end
 #define PID_KDS {80, 100 * HEAT_SAMPLE_TIME, 100 * HEAT_SAMPLE_TIME, 100 * HEAT_SAMPLE_TIME, 100 * HEAT_SAMPLE_TIME, 100 * HEAT_SAMPLE_TIME}// Derivative PID constants
@@ -147,11 +154,25 @@ Licence: GPL
 
 #define AD_RANGE 1023.0							//16383 // The A->D converter that measures temperatures gives an int this big as its max value
 
+#define TEMPERATURE_TABLE_SEGMENTS 128				// Temperatures are interpolated in a table of this many pieces over the A to D range...
+#define TEMPERATURE_TABLE_ERROR 0.1					// ...except where interpolating would be more than this far out (C), where they are calculated
+
 #define NUMBER_OF_A_TO_D_READINGS_AVERAGED 4	// must be an even number, preferably a power of 2 for performance, and no greater than 64
 												// We hope that the compiler is clever enough to spot that division by this is a >> operation, but it doesn't really matter
 
 #define POLL_TIME 0.006                         // Poll the A to D converters this often (seconds)
 
+// Normally the A to D converter runs by itself, converting the thermistor and Z probe channels
+// in turn, and the PDC puts the readings in a buffer.  An interrupt averages each buffer when it is
+// full, so nothing waits for a conversion and the sampling doesn't depend on how busy the main loop is.
+// Set ADC_FREE_RUNNING false to go back to polling with analogRead() every POLL_TIME.
+
+#define ADC_FREE_RUNNING true
+#define ADC_CHANNELS 16							// The SAM3X8E's A to D channels
+#define ADC_PRESCALE 255						// The A to D clock is MCK/(2*(ADC_PRESCALE + 1)), about 164kHz
+#define ADC_SEQUENCES_PER_BUFFER 4				// Readings of each channel in a PDC buffer; about 200 buffers a second with 7 channels
+#define ADC_Z_PROBE -2							// adcChannelUser[] value for the channel the Z probe is on
+
 #define HOT_BED 0 	// The index of the heated bed; set to -1 if there is no heated bed
 #define E0_HEATER 1 //the index of the first extruder heater
 #define E1_HEATER 2 //the index of the second extruder heater
@@ -164,14 +185,28 @@ Licence: GPL
 // File handling
 
 #define MAX_FILES 7								// Maximum number of simultaneously open files
-#define FILE_BUF_LEN 256						// File write buffer size
+#define FILE_BUF_LEN 256						// Default file buffer size
+#define PRINT_FILE_BUF_LEN 2048					// Size of each of the two buffers for the file being printed
+#define UPLOAD_FILE_BUF_LEN 4096				// Buffer size for a file being uploaded; a multiple of the sector size as it is written whole
+#define WEB_FILE_BUF_LEN 1024					// Buffer size for a file being served to the web
+#define FILE_READ_AHEAD_CHUNK 1024				// Read ahead this much per Spin(); a multiple of the 512 byte sector
+#define SECTOR_LENGTH 512						// The SD card's sector; whole aligned sectors go to and from the card directly
+#define CHECKPOINT_LENGTH SECTOR_LENGTH			// A print checkpoint takes up one sector
 #define SD_SPI 4 								// Pin for the SD card (if any)
 #define WEB_DIR "0:/www/" 						// Place to find web files on the SD card
 #define GCODE_DIR "0:/gcodes/" 					// Ditto - g-codes
 #define SYS_DIR "0:/sys/" 						// Ditto - system files
 #define TEMP_DIR "0:/tmp/" 						// Ditto - temporary files
 #define FILE_LIST_LENGTH (1000) 				// Maximum length of file list
-#define MAX_FILES (42)							// Maximum number of files displayed
+#define DIRECTORY_INDEX_LENGTH 200				// Maximum number of files in a directory that are listed
+#define INDEX_NAME_LENGTH 13					// An 8.3 file name and its terminator
+#define FILE_INFO_CACHE_LENGTH 8				// How many files' directory entries are remembered
+#define FILE_INFO_NAME_LENGTH 48				// Longest full path name that is remembered
+#define GCODE_INFO_HEAD_LENGTH 2048				// How much of the start of a G Code file is searched for slicer comments...
+#define GCODE_INFO_TAIL_LENGTH 8192				// ...and of its end
+#define GCODE_INFO_BUFFER_LENGTH 256			// Buffer for reading them; longer lines are ignored
+#define GCODE_INFO_CACHE_LENGTH 4				// How many files' slicer comments are remembered
+#define GENERATOR_LENGTH 31						// Longest slicer name that is kept
 
 /****************************************************************************************************/
 
@@ -179,7 +214,7 @@ Licence: GPL
 
 #define CLIENT_CLOSE_DELAY 0.002				// Seconds to wait after serving a page
 
-#define HTTP_STATE_SIZE 5						// Size of ring buffer used for HTTP requests
+#define HTTP_STATE_SIZE 8						// Size of ring buffer used for HTTP requests from all connections
 
 #define IP_ADDRESS {192, 168, 1, 10} 			// Need some sort of default...
 #define NET_MASK {255, 255, 255, 0}
@@ -202,7 +237,9 @@ const unsigned int httpOutputBufferSize = 2 * 1432;
 
 #define BAUD_RATE 115200 						// Communication speed of the USB if needed.
 
-const uint16_t lineBufsize = 256;				// use a power of 2 for good performance
+const uint16_t lineBufsize = 2048;				// use a power of 2 for good performance; deep enough for a fast host streaming lines
+const uint16_t outputRingLength = 2048;			// Messages waiting to go to the USB or the web; use a power of 2
+const uint16_t usbOutputChunk = 64;				// The most written to the USB per spin (one USB packet)
 
 /****************************************************************************************************/
 
@@ -215,6 +252,36 @@ enum EndStopHit
 
 /***************************************************************************************************/
 
+// What a heater's temperature is measured with
+
+enum TemperatureSensor
+{
+  thermistorSensor = 0,							// Beta equation, or Steinhart-Hart with a C coefficient
+  pt100Sensor = 1								// Platinum resistance; the "R at 25 C" is its resistance at 0 C
+};
+
+/***************************************************************************************************/
+
+// What a file is opened for.  This decides the size of its buffer.
+
+enum FileUse
+{
+  generalFile = 0,								// FILE_BUF_LEN
+  printFile = 1,								// Double buffered; PRINT_FILE_BUF_LEN each
+  uploadFile = 2,								// UPLOAD_FILE_BUF_LEN
+  webFile = 3									// WEB_FILE_BUF_LEN
+};
+
+// How files are listed
+
+enum FileSort
+{
+  sortByName = 0,								// Alphabetically
+  sortByDate = 1								// Newest first
+};
+
+/***************************************************************************************************/
+
 // Input and output - these are ORed into an int8_t
 // By the Status() functions of the IO classes.
 
@@ -281,11 +348,20 @@ public:
 	void SentPacketAcknowledged();			 // Called to tell us a packet has gone
 	void Write(char b);						 // Send a byte to the network
 	void Write(const char* s);				 // Send a string to the network
-	void Close();							 // Close the connection represented by this ring entry
-	void ReceiveInput(char* data, int length,// Called to give us some input
+	size_t Write(const char* data, size_t length); // Send a block; returns how much was taken
+	void Close();							 // Close the connection of the current request
+	void FinishResponse();					 // End the response to the current request, keeping its connection open
+	int ReadBlock(const char*& data);		 // Point to the unread bytes of the current ring entry; return how many
+	void Consume(int n);					 // Mark the first n bytes from ReadBlock() as read
+	void DivertInput();						 // Put the rest of the current request's input aside and let other requests in
+	bool InputDiverted() const;				 // Is there a diverted connection (it goes if the connection does)?
+	int ReadDivertedBlock(const char*& data);// Point to the next diverted input; return how many bytes
+	void ConsumeDiverted(int n);			 // Mark the first n bytes from ReadDivertedBlock() as read
+	bool ResumeDiverted();					 // Make the diverted connection the current request again, if nothing else is
+	bool ReceiveInput(char* data, int length,// Called to give us some input; false if there is no room
 			void* pb, void* pc, void* h);
 	void InputBufferReleased(void* pb);		 // Called to release the input buffer
-	void ConnectionError(void* h);			 // Called when a network error has occured
+	bool ConnectionError(void* h);			 // Called when a network error has occured; true if it hit the current request
 	bool Active() const;					 // Is the network connection live?
 	bool LinkIsUp();						 // Is the network link up?
 	void Enable();
@@ -304,6 +380,9 @@ private:
 
 	void Reset();
 	void CleanRing();
+	void SendOutputBuffer();
+	void ReleaseEntry(NetRing* r);
+	void DropRequests(void* h);
 	char* inputBuffer;
 	char outputBuffer[httpOutputBufferSize];
 	int inputPointer;
@@ -311,10 +390,18 @@ private:
 	int outputPointer;
 	bool writeEnabled;
 	bool closePending;
+	bool finishPending;						// FinishResponse() is waiting for output to go
 	bool enabled;
 	int8_t status;
 	NetRing* netRingGetPointer;
 	NetRing* netRingAddPointer;
+	NetRing* readEntry;						// The ring entry being read, if any
+	void* requestPcb;						// The connection of the request being dealt with...
+	void* requestHs;						// ...or NULL if there isn't one
+	NetRing* divertedEntry;					// The diverted ring entry being read, if any...
+	int divertedPointer;					// ...and how far into it
+	void* divertedPcb;						// The connection whose input is diverted...
+	void* divertedHs;						// ...or NULL if there isn't one
 	bool active;
 	uint8_t sentPacketsOutstanding;		// count of TCP packets we have sent that have not been acknowledged
 	uint8_t windowedSendPackets;
@@ -322,16 +409,52 @@ private:
 
 // This class handles serial I/O - typically via USB
 
+// Messages are queued here by whoever sends them and taken off by the Spin() of whatever
+// delivers them, so a slow consumer never holds up the sender.  Only the main loop uses them,
+// so one writer and one reader with their own indices need no locking.  A fragment that
+// doesn't fit is thrown away whole (and its bytes counted), rather than waiting for room.
+
+class OutputRing
+{
+public:
+
+	void Init();
+	bool Put(const char* s);					// Queue some text
+	bool PutTagged(char tag, const char* s);	// Queue a string that must come out whole, with a (non-zero) tag saying what it is
+	uint16_t Get(const char*& data);			// Point to the queued characters that are contiguous in memory; return how many
+	void Consume(uint16_t n);					// Mark the first n characters from Get() as sent
+	bool GetTagged(char& tag, const char*& s); // Point to the next string from PutTagged(), if there is one
+	void ConsumeTagged(const char* s);			// Mark the string from GetTagged() as sent
+	uint16_t Free() const;						// How many more characters will fit
+	uint32_t Dropped() const;					// How many characters have been thrown away...
+	uint32_t DroppedMessages() const;			// ...and how many fragments they were in
+	bool Empty() const;							// Nothing waiting?
+
+private:
+
+	char buffer[outputRingLength];
+	volatile uint16_t putIndex;
+	volatile uint16_t getIndex;
+	uint32_t dropped;
+	uint32_t droppedMessages;
+};
+
 class Line
 {
 public:
 
 	int8_t Status() const; // Returns OR of IOStatus
+	bool LineAvailable() const; // Is there a whole line (or a full buffer) waiting?
 	int Read(char& b);
+	int ReadBlock(const char*& data); // Point to the characters waiting in the buffer that are contiguous in memory; return how many
+	void Consume(int n);	// Mark the first n characters from ReadBlock() as read
 	void Write(char b);
 	void Write(const char* s);
 	void Write(float f);
 	void Write(long l);
+	uint32_t Dropped() const;	// Output (bytes) thrown away because the host wasn't reading...
+	uint32_t DroppedMessages() const; // ...and how many messages it was in
+	bool OutputEmpty() const;	// Has everything queued been sent?
 
 friend class Platform;
 friend class RepRap;
@@ -349,15 +472,41 @@ private:
 	char buffer[lineBufsize];
 	uint16_t getIndex;
 	uint16_t numChars;
+	uint16_t lineCount;		// How many newlines there are in buffer
+	OutputRing output;		// Waiting to go to the host
+};
+
+// What the slicer said about a G Code file in the comments at its start and end.
+// Anything that wasn't found is 0.
+
+class GCodeFileInfo
+{
+public:
+  unsigned long size;										// Bytes
+  float layerHeight;										// mm
+  float filamentUsed;										// mm
+  float printTime;											// Seconds
+  char generatedBy[GENERATOR_LENGTH+1];
 };
 
 class MassStorage
 {
 public:
 
-  char* FileList(const char* directory, bool fromLine); // Returns a list of all the files in the named directory
+  char* FileList(const char* directory, bool fromLine, // Returns a list of some of the files in the named directory...
+		  FileSort sort, int first, int count, bool details, int& next); // ...and the number of the one after the last listed
+  int FileCount(const char* directory);					// How many files there are in the named directory
+  bool GetFileEntry(const char* directory, int i, FileSort sort, // The name, size and date of the i-th file in the directory
+		  const char*& name, unsigned long& size, uint32_t& timeStamp);
+  void TimeStampString(uint32_t timeStamp, char* s);		// Write a FAT time stamp as YYYY-MM-DDTHH:MM:SS in s
+  bool GetGCodeFileInfo(const char* directory, const char* fileName, // What the slicer said about a G Code file
+		  GCodeFileInfo& info);
   char* CombineName(const char* directory, const char* fileName);
   bool Delete(const char* directory, const char* fileName);
+  bool GetFileInfo(const char* directory, const char* fileName, // Does a file exist, and if so its size
+		  unsigned long& size, uint32_t& timeStamp);				// and FAT date (high 16 bits) and time
+  void InvalidateFileInfo();								// Forget remembered directory entries
+  uint64_t FreeSpace();										// Bytes free on the SD card
 
 friend class Platform;
 
@@ -368,7 +517,32 @@ protected:
 
 private:
 
+  bool IndexDirectory(const char* directory);
+  void ScanGCodeInfo(unsigned long start, unsigned long length, bool skipFirstLine, bool toEnd, GCodeFileInfo& info);
+  void ParseGCodeInfoLine(const char* line, GCodeFileInfo& info);
+  const char* SkipToNumber(const char* s);
+  const char* SkipNumber(const char* s);
+  float ReadDuration(const char* s);
+
   char fileList[FILE_LIST_LENGTH];
+  char indexDirectory[FILE_INFO_NAME_LENGTH];				// The directory that has been indexed...
+  bool indexValid;											// ...if the index is up to date
+  int indexLength;											// How many files there are in it
+  char indexName[DIRECTORY_INDEX_LENGTH][INDEX_NAME_LENGTH];
+  unsigned long indexSize[DIRECTORY_INDEX_LENGTH];
+  uint32_t indexTimeStamp[DIRECTORY_INDEX_LENGTH];
+  uint8_t indexByName[DIRECTORY_INDEX_LENGTH];				// The entries in alphabetical order...
+  uint8_t indexByDate[DIRECTORY_INDEX_LENGTH];				// ...and newest first
+  char gcodeInfoName[GCODE_INFO_CACHE_LENGTH][FILE_INFO_NAME_LENGTH]; // Remembered slicer comments
+  GCodeFileInfo gcodeInfo[GCODE_INFO_CACHE_LENGTH];
+  int8_t gcodeInfoNext;
+  FIL gcodeInfoFile;										// Opened separately, so no FileStore is disturbed
+  char gcodeInfoBuffer[GCODE_INFO_BUFFER_LENGTH+1];
+  char fileInfoName[FILE_INFO_CACHE_LENGTH][FILE_INFO_NAME_LENGTH]; // Remembered directory entries...
+  bool fileInfoExists[FILE_INFO_CACHE_LENGTH];
+  unsigned long fileInfoSize[FILE_INFO_CACHE_LENGTH];
+  uint32_t fileInfoTimeStamp[FILE_INFO_CACHE_LENGTH];
+  int8_t fileInfoNext;										// ...and the next one to replace
   char scratchString[STRING_LENGTH];
   Platform* platform;
   FATFS fileSystem;
@@ -382,29 +556,45 @@ public:
 
 	int8_t Status();        	// Returns OR of IOStatus
 	bool Read(char& b);     	// Read 1 byte
+	int ReadBlock(const char*& data); // Point to the unread bytes in the buffer, refilling it if needed; return how many (0 at the end)
+	void Consume(int n);		// Mark the first n bytes from ReadBlock() as read
 	void Write(char b);     	// Write 1 byte
 	void Write(const char* s); 	// Write a string
+	void Write(const char* data, unsigned int length); // Write a block
 	void Close();				// Shut the file and tidy up
 	void GoToEnd();         	// Position the file at the end (so you can write on the end).
+	void Seek(unsigned long position); // Carry on reading from this many bytes into the file
+	bool Overwrite(unsigned long position, const byte* data, unsigned int length); // Write straight to the card at a place in the file
+	void Flush();				// Write out the buffer and the file's size and date, but leave it open
 	unsigned long Length(); 	// File size in bytes
+	unsigned long BytesRead();	// How many bytes have been read
 	float FractionRead();   	// How far in we are
 
 friend class Platform;
 
 protected:
 
-	FileStore(Platform* p);
-	void Init();
+	FileStore();
+	void Init(Platform* p);
+	void Spin();				// Fill the buffer behind the one being read, if there is one
     bool Open(const char* directory, const char* fileName, bool write);
+    void SetBuffers(byte* b, byte* next, int length); // Use other buffers than ownBuffer
 
 private:
 
   bool inUse;
-  byte buf[FILE_BUF_LEN];
+  byte ownBuffer[FILE_BUF_LEN];	// The buffer used unless Platform provides bigger ones
+  byte* buf;					// The buffer being read or written
+  byte* nextBuf;				// The buffer being read ahead into, or NULL if not double buffered
+  int bufferLength;				// The size of buf (and nextBuf)
+  unsigned int nextBufferEntries; // How much of nextBuf has been read
+  bool endOfFileRead;			// Has reading ahead got to the end of the file?
   int bufferPointer;
   unsigned long bytesRead;
   
   void ReadBuffer();
+  void ReadAhead();
+  bool BufferUsedUp() const;	// Has the buffer been read to its end, with more of the file to come?
   void WriteBuffer();
 
   FIL file;
@@ -442,14 +632,21 @@ class Platform
   void Diagnostics();
   
   void PrintMemoryUsage();  // Print memory stats for debugging
+  void PrintRamBudget();    // Print where the fixed buffers, rings and pools put the RAM, by subsystem
 
   void ClassReport(char* className, float &lastTime);  // Called on return to check everything's live.
 
   // Timing
   
   float Time(); // Returns elapsed seconds since some arbitrary time
+  uint32_t CycleCount() const; // Processor cycles, for timing short pieces of code
+  void AdcInterrupt();			// Average a full buffer of A to D readings; only called from the ADC interrupt
+  bool AdcFreeRunning() const;	// Are the A to D converter's readings taken in its interrupt?
+  void DisableAdcInterrupt();	// Hold off the ADC interrupt (and the heater control it runs)...
+  void EnableAdcInterrupt();	// ...and let it go again
   
   void SetInterrupt(float s); // Set a regular interrupt going every s seconds; if s is -ve turn interrupt off
+  void SetInterruptTicks(uint32_t ticks); // Set the interrupt going every ticks counts of STEP_CLOCK_RATE - no floats, for the step ISR
   
   //void DisableInterrupts();
 
@@ -469,7 +666,7 @@ class Platform
   friend class FileStore;
   
   MassStorage* GetMassStorage();
-  FileStore* GetFileStore(const char* directory, const char* fileName, bool write);
+  FileStore* GetFileStore(const char* directory, const char* fileName, bool write, FileUse use);
   void EnableNetwork();
   void DisableNetwork();
   bool NetworkEnabled();
@@ -494,8 +691,12 @@ class Platform
   void SetDirection(byte drive, bool direction);
   void SetDirectionValue(byte drive, bool dVal);
   bool GetDirectionValue(byte drive);
-  void Step(byte drive);
-  void Disable(byte drive); // There is no drive enable; drives get enabled automatically the first time they are used.
+  void Enable(byte drive); // Called when a move starts; the step interrupt assumes its drives are enabled
+  void StepDrives(uint32_t driveMask); // Step all the drives whose bits are set, one PIO register write per port
+  void Disable(byte drive);
+  void SetSimulating(bool sim); // In simulation the step, direction and enable pins are left alone and the steps are counted instead
+  bool Simulating() const;
+  uint32_t SimulatedSteps() const;
   void SetMotorCurrent(byte drive, float current);
   float MotorCurrent(byte drive) const;
   float DriveStepsPerUnit(int8_t drive) const;
@@ -539,6 +740,7 @@ class Platform
   
   float GetTemperature(int8_t heater); // Result is in degrees celsius
   void SetHeater(int8_t heater, const float& power); // power is a fraction in [0,1]
+  void CutOffHeater(int8_t heater);	// Force a heater's pin off at once, from the interrupt if need be; SetHeater() undoes it
   float PidKp(int8_t heater) const;
   float PidKi(int8_t heater) const;
   float PidKd(int8_t heater) const;
@@ -553,6 +755,11 @@ class Platform
   void SetThermistorBeta(int8_t heater, float b);
   void SetThermistorSeriesR(int8_t heater, float r);
   void SetThermistorRAt25(int8_t heater, float r);
+  float ThermistorC(int8_t heater) const;
+  void SetThermistorC(int8_t heater, float c);
+  TemperatureSensor GetTemperatureSensor(int8_t heater) const;
+  void SetTemperatureSensor(int8_t heater, TemperatureSensor ts);
+  void BuildTemperatureTable(int8_t heater);			// Call once after changing any of a heater's sensor parameters
   float HeatSampleTime() const;
   void SetHeatSampleTime(float st);
   void CoolingFan(float speed);
@@ -565,6 +772,7 @@ class Platform
   protected:
   
   void ReturnFileStore(FileStore* f);  
+  void AssignFileBuffers(FileStore* f, FileUse use);
   
   private:
   
@@ -578,6 +786,7 @@ class Platform
   Compatibility compatibility;
 
   void InitialiseInterrupts();
+  void InitialiseAdc();
   int GetRawZHeight() const;
   
 // DRIVES
@@ -585,10 +794,15 @@ class Platform
   void SetSlowestDrive();
 
   int8_t stepPins[DRIVES];
+  uint32_t stepPinBits[DRIVES];	// The bit for each step pin in its PIO port
+  int8_t stepPortIndex[DRIVES];	// The port (index into stepPorts[]) for each step pin, or -1 for none
+  Pio* stepPorts[STEP_PORTS];
   int8_t directionPins[DRIVES];
   int8_t enablePins[DRIVES];
   bool disableDrives[DRIVES];
   bool driveEnabled[DRIVES];
+  bool simulating;
+  volatile uint32_t simulatedSteps;
   bool directions[DRIVES];
   int8_t lowStopPins[DRIVES];
   int8_t highStopPins[DRIVES];
@@ -607,9 +821,9 @@ class Platform
   int8_t zProbePin;
   int8_t zProbeModulationPin;
   int8_t zProbeType;
-  bool zModOnThisTime;
-  long zProbeOnSum;		// sum of readings taken when IR led is on
-  long zProbeOffSum;	// sum of readings taken when IR led is on
+  volatile bool zModOnThisTime;
+  volatile long zProbeOnSum;		// sum of readings taken when IR led is on
+  volatile long zProbeOffSum;	// sum of readings taken when IR led is on
   int zProbeADValue;
   float zProbeStopHeight;
   bool zProbeEnable;
@@ -621,6 +835,16 @@ class Platform
 
   void InitZProbe();
   void PollZHeight();
+  void SwapZProbeModulation();
+
+// A to D converter, when it runs by itself
+
+  bool adcFreeRunning;
+  int8_t adcChannelUser[ADC_CHANNELS];	// The heater each channel measures, ADC_Z_PROBE, or -1 if it isn't used
+  uint16_t adcBuffers[2][ADC_CHANNELS*ADC_SEQUENCES_PER_BUFFER];
+  uint16_t adcBufferLength;				// Readings in each buffer: the channels in use times ADC_SEQUENCES_PER_BUFFER
+  int8_t adcBufferFilled;				// The buffer that will be full at the next interrupt
+  bool zProbeSettling;					// The modulation changed while the buffer was filling, so its Z readings are mixed
 
   float axisLengths[AXES];
   float homeFeedrates[AXES];
@@ -631,12 +855,23 @@ class Platform
   int GetRawTemperature(byte heater) const;
   void PollTemperatures();
 
-  long tempSum[HEATERS];
+  volatile long tempSum[HEATERS];
   int8_t tempSensePins[HEATERS];
   int8_t heatOnPins[HEATERS];
+  Pio* heatPorts[HEATERS];			// The PIO port of each heater pin, or NULL for none...
+  uint32_t heatPinBits[HEATERS];	// ...and its bit there
+  volatile bool heaterCutOff[HEATERS];	// Has CutOffHeater() taken the pin from the PWM?
+  bool heaterPinWasPeripheral[HEATERS];	// Was it the PWM's (rather than the PIO's) when it did?
   float thermistorBetas[HEATERS];
   float thermistorSeriesRs[HEATERS];
   float thermistorRAt25[HEATERS];
+  float thermistorCs[HEATERS];
+  TemperatureSensor temperatureSensors[HEATERS];
+  float temperatureTables[HEATERS][TEMPERATURE_TABLE_SEGMENTS + 1];	// Temperatures at the ends of the pieces...
+  uint32_t temperatureCalculated[HEATERS][(TEMPERATURE_TABLE_SEGMENTS + 31)/32]; // ...and the bits of pieces that are too curved for that
+  float scratchTable[TEMPERATURE_TABLE_SEGMENTS + 1];	// BuildTemperatureTable() works in these...
+  uint32_t scratchCalculated[(TEMPERATURE_TABLE_SEGMENTS + 31)/32]; // ...while the ADC interrupt uses the old table
+  float SensorTemperature(int8_t heater, float reading) const; // The exact temperature for an A to D reading
   bool usePIDs[HEATERS];
   float pidKis[HEATERS];
   float pidKds[HEATERS];
@@ -655,11 +890,18 @@ class Platform
 
   Line* line;
   uint8_t messageIndent;
+  OutputRing webOutput;							// Waiting to go to the web interface
 
 // Files
 
   MassStorage* massStorage;
-  FileStore* files[MAX_FILES];
+  FileStore files[MAX_FILES];					// A fixed pool, handed out by GetFileStore()
+  byte printFileBuffers[2][PRINT_FILE_BUF_LEN];	// Shared out by AssignFileBuffers()...
+  byte uploadFileBuffer[UPLOAD_FILE_BUF_LEN];
+  byte webFileBuffer[WEB_FILE_BUF_LEN];
+  FileStore* printFileBuffersUser;				// ...which records who has them
+  FileStore* uploadFileBufferUser;
+  FileStore* webFileBufferUser;
   bool fileStructureInitialised;
   char* webDir;
   char* gcodeDir;
@@ -679,6 +921,46 @@ class Platform
 
 // Seconds
 
+// The processor's free-running cycle counter; it wraps round every 51 seconds
+
+inline void Platform::SetSimulating(bool sim)
+{
+	simulating = sim;
+	simulatedSteps = 0;
+}
+
+inline bool Platform::Simulating() const
+{
+	return simulating;
+}
+
+inline uint32_t Platform::SimulatedSteps() const
+{
+	return simulatedSteps;
+}
+
+inline bool Platform::AdcFreeRunning() const
+{
+	return adcFreeRunning;
+}
+
+inline void Platform::DisableAdcInterrupt()
+{
+	NVIC_DisableIRQ(ADC_IRQn);
+	__DSB();
+}
+
+inline void Platform::EnableAdcInterrupt()
+{
+	if(adcFreeRunning)
+		NVIC_EnableIRQ(ADC_IRQn);
+}
+
+inline uint32_t Platform::CycleCount() const
+{
+  return DWT->CYCCNT;
+}
+
 inline float Platform::Time()
 {
   unsigned long now = micros();
@@ -836,7 +1118,7 @@ inline bool Platform::GetDirectionValue(byte drive)
 
 inline void Platform::SetDirection(byte drive, bool direction)
 {
-	if(directionPins[drive] < 0)
+	if(directionPins[drive] < 0 || simulating)
 		return;
 	bool d;
 	if(direction == FORWARDS)
@@ -860,26 +1142,48 @@ inline void Platform::Disable(byte drive)
 	driveEnabled[drive] = false;
 }
 
-inline void Platform::Step(byte drive)
+inline void Platform::Enable(byte drive)
 {
-	if(stepPins[drive] < 0)
+	if(driveEnabled[drive] || enablePins[drive] < 0 || simulating)
 		return;
-	if(!driveEnabled[drive] && enablePins[drive] >= 0)
+	if(drive == Z_AXIS || drive==E0_DRIVE || drive==E2_DRIVE) //ENABLE_PINS {29, 27, X1, X0, 37, X8, 50, 47}
+		digitalWriteNonDue(enablePins[drive], ENABLE_DRIVE);
+	else
+		digitalWrite(enablePins[drive], ENABLE_DRIVE);
+	driveEnabled[drive] = true;
+}
+
+// Pulse the step pins of all the drives in the mask low then high.  Pins that share
+// a PIO port are written together, so all the drives step at the same instant.  The
+// pins are held low for at least STEP_PULSE_CYCLES, timed by the cycle counter.
+
+inline void Platform::StepDrives(uint32_t driveMask)
+{
+	if(simulating)
 	{
-		if(drive == Z_AXIS || drive==E0_DRIVE || drive==E2_DRIVE) //ENABLE_PINS {29, 27, X1, X0, 37, X8, 50, 47}
-			digitalWriteNonDue(enablePins[drive], ENABLE_DRIVE);
-		else
-			digitalWrite(enablePins[drive], ENABLE_DRIVE);
-		driveEnabled[drive] = true;
+		simulatedSteps += __builtin_popcount(driveMask);
+		return;
 	}
-	if(drive == E0_DRIVE || drive == E3_DRIVE) //STEP_PINS {14, 25, 5, X2, 41, 39, X4, 49}
+	uint32_t portBits[STEP_PORTS] = {0, 0, 0, 0};
+	while(driveMask)
 	{
-		digitalWriteNonDue(stepPins[drive], 0);
-		digitalWriteNonDue(stepPins[drive], 1);
-	} else
+		int8_t drive = __builtin_ctz(driveMask);
+		driveMask &= driveMask - 1;
+		if(stepPortIndex[drive] >= 0)
+			portBits[stepPortIndex[drive]] |= stepPinBits[drive];
+	}
+	for(int8_t port = 0; port < STEP_PORTS; port++)
+	{
+		if(portBits[port])
+			stepPorts[port]->PIO_CODR = portBits[port];
+	}
+	uint32_t pulseStart = CycleCount();
+	while(CycleCount() - pulseStart < STEP_PULSE_CYCLES)
+		;
+	for(int8_t port = 0; port < STEP_PORTS; port++)
 	{
-		digitalWrite(stepPins[drive], 0);
-		digitalWrite(stepPins[drive], 1);
+		if(portBits[port])
+			stepPorts[port]->PIO_SODR = portBits[port];
 	}
 }
 
@@ -951,6 +1255,11 @@ inline void Platform::PollZHeight()
 	else
 		zProbeOffSum = zProbeOffSum + currentReading - zProbeOffSum/NUMBER_OF_A_TO_D_READINGS_AVERAGED;
 
+	SwapZProbeModulation();
+}
+
+inline void Platform::SwapZProbeModulation()
+{
 	if (zProbeType >= 2)
 	{
 		zModOnThisTime = !zModOnThisTime;
@@ -1119,13 +1428,22 @@ inline float Platform::ThermistorSeriesR(int8_t heater) const
 
 inline float Platform::ThermistorRAt25(int8_t heater) const
 {
-	return thermistorRAt25[heater]*exp(thermistorBetas[heater]/(25.0 - ABS_ZERO));
+	return thermistorRAt25[heater];
+}
+
+inline float Platform::ThermistorC(int8_t heater) const
+{
+	return thermistorCs[heater];
+}
+
+inline TemperatureSensor Platform::GetTemperatureSensor(int8_t heater) const
+{
+	return temperatureSensors[heater];
 }
 
 inline void Platform::SetThermistorBeta(int8_t heater, float b)
 {
 	thermistorBetas[heater] = b;
-	thermistorRAt25[heater] = ( ThermistorRAt25(heater)*exp(-thermistorBetas[heater]/(25.0 - ABS_ZERO)) );
 }
 
 inline void Platform::SetThermistorSeriesR(int8_t heater, float r)
@@ -1135,7 +1453,17 @@ inline void Platform::SetThermistorSeriesR(int8_t heater, float r)
 
 inline void Platform::SetThermistorRAt25(int8_t heater, float r)
 {
-	thermistorRAt25[heater] = r*exp(-thermistorBetas[heater]/(25.0 - ABS_ZERO));
+	thermistorRAt25[heater] = r;
+}
+
+inline void Platform::SetThermistorC(int8_t heater, float c)
+{
+	thermistorCs[heater] = c;
+}
+
+inline void Platform::SetTemperatureSensor(int8_t heater, TemperatureSensor ts)
+{
+	temperatureSensors[heater] = ts;
 }
 
 inline float Platform::TimeToHot() const
@@ -1185,9 +1513,13 @@ inline void Platform::SetInterrupt(float s) // Seconds
     Message(HOST_MESSAGE, "Negative interrupt!\n");
     s = STANDBY_INTERRUPT_RATE;
   }
-  uint32_t rc = (uint32_t)( (((long)(TIME_TO_REPRAP*s))*84l)/128l );
-  TC_SetRA(TC1, 0, rc/2); //50% high, 50% low
-  TC_SetRC(TC1, 0, rc);
+  SetInterruptTicks((uint32_t)(s*STEP_CLOCK_RATE));
+}
+
+inline void Platform::SetInterruptTicks(uint32_t ticks)
+{
+  TC_SetRA(TC1, 0, ticks >> 1); //50% high, 50% low
+  TC_SetRC(TC1, 0, ticks);
   TC_Start(TC1, 0);
   NVIC_EnableIRQ(TC3_IRQn);
 }
@@ -1280,35 +1612,124 @@ inline int8_t Line::Status() const
 	return numChars == 0 ? nothing : byteAvailable;
 }
 
+inline bool Line::LineAvailable() const
+{
+	return lineCount > 0 || numChars == lineBufsize;
+}
+
 inline int Line::Read(char& b)
 {
 	  if (numChars == 0) return 0;
 	  b = buffer[getIndex];
+	  if(b == '\n')
+		  --lineCount;
 	  getIndex = (getIndex + 1) % lineBufsize;
 	  --numChars;
 	  return 1;
 }
 
+inline int Line::ReadBlock(const char*& data)
+{
+	data = &buffer[getIndex];
+	return (getIndex + numChars > lineBufsize) ? lineBufsize - getIndex : numChars;
+}
+
+inline void Line::Consume(int n)
+{
+	for(int i = 0; i < n; i++)
+	{
+		if(buffer[getIndex + i] == '\n')
+			--lineCount;
+	}
+	getIndex = (getIndex + n) % lineBufsize;
+	numChars -= n;
+}
+
 inline void Line::Write(char b)
 {
-	SerialUSB.print(b);
+	char s[2] = { b, 0 };
+	output.Put(s);
 }
 
 inline void Line::Write(const char* b)
 {
-	SerialUSB.print(b);
+	output.Put(b);
 }
 
 inline void Line::Write(float f)
 {
-	snprintf(scratchString, STRING_LENGTH, "%f", f);
-	SerialUSB.print(scratchString);
+	char s[SHORT_STRING_LENGTH];
+	snprintf(s, SHORT_STRING_LENGTH, "%f", f);
+	output.Put(s);
 }
 
 inline void Line::Write(long l)
 {
-	snprintf(scratchString, STRING_LENGTH, "%d", l);
-	SerialUSB.print(scratchString);
+	char s[SHORT_STRING_LENGTH];
+	snprintf(s, SHORT_STRING_LENGTH, "%ld", l);
+	output.Put(s);
+}
+
+inline uint32_t Line::Dropped() const
+{
+	return output.Dropped();
+}
+
+inline uint32_t Line::DroppedMessages() const
+{
+	return output.DroppedMessages();
+}
+
+inline bool Line::OutputEmpty() const
+{
+	return output.Empty();
+}
+
+// A single buffer is always filled, so one that isn't full holds the end of the file.  The
+// double buffers are swapped over with whatever has been read ahead, so either may be part full.
+
+inline bool FileStore::BufferUsedUp() const
+{
+	if(nextBuf == NULL)
+		return bufferPointer >= bufferLength;
+	return bufferPointer >= (int)lastBufferEntry && (!endOfFileRead || nextBufferEntries > 0);
+}
+
+inline uint16_t OutputRing::Free() const
+{
+	return (getIndex - putIndex - 1) & (outputRingLength - 1);
+}
+
+inline uint16_t OutputRing::Get(const char*& data)
+{
+	uint16_t put = putIndex;
+	data = &buffer[getIndex];
+	return (put >= getIndex) ? put - getIndex : outputRingLength - getIndex;
+}
+
+inline void OutputRing::Consume(uint16_t n)
+{
+	getIndex = (getIndex + n) & (outputRingLength - 1);
+}
+
+inline void OutputRing::ConsumeTagged(const char* s)
+{
+	Consume(strlen(s) + 2);
+}
+
+inline uint32_t OutputRing::Dropped() const
+{
+	return dropped;
+}
+
+inline uint32_t OutputRing::DroppedMessages() const
+{
+	return droppedMessages;
+}
+
+inline bool OutputRing::Empty() const
+{
+	return getIndex == putIndex;
 }
 
 
@@ -1340,5 +1761,10 @@ inline bool Network::Enabled()
 	return enabled;
 }
 
+inline bool Network::InputDiverted() const
+{
+	return divertedHs != NULL;
+}
+
 
 #endif
@@ -164,6 +164,7 @@ RepRap::RepRap() : active(false), debug(false)
   gCodes = new GCodes(platform, webserver);
   move = new Move(platform, gCodes);
   heat = new Heat(platform, gCodes);
+  toolsInUse = 0;
   toolList = NULL;
 }
 
@@ -178,11 +179,12 @@ void RepRap::Init()
   currentTool = NULL;
   active = true;
   coldExtrude = false;
+  diagnosticsPart = -1;
 
   snprintf(scratchString, STRING_LENGTH, "%s Version %s dated %s\n", NAME, VERSION, DATE);
   platform->Message(HOST_MESSAGE, scratchString);
 
-  FileStore* startup = platform->GetFileStore(platform->GetSysDir(), platform->GetConfigFile(), false);
+  FileStore* startup = platform->GetFileStore(platform->GetSysDir(), platform->GetConfigFile(), false, generalFile);
 
   platform->Message(HOST_MESSAGE, "\n\nExecuting ");
   if(startup != NULL)
@@ -227,6 +229,10 @@ void RepRap::Init()
   fastLoop = FLT_MAX;
   slowLoop = 0.0;
   lastTime = platform->Time();
+  for(int8_t i = 0; i < SPIN_PROFILES; i++)
+	  spinProfile[i].Init();
+  interruptProfile.Init();
+  profileStartTime = lastTime;
 }
 
 void RepRap::Exit()
@@ -245,11 +251,25 @@ void RepRap::Spin()
   if(!active)
     return;
 
+  uint32_t start = platform->CycleCount();
   platform->Spin();
+  uint32_t end = platform->CycleCount();
+  spinProfile[platformSpin].Record(end - start);
   webserver->Spin();
+  start = platform->CycleCount();
+  spinProfile[webserverSpin].Record(start - end);
   gCodes->Spin();
+  end = platform->CycleCount();
+  spinProfile[gcodesSpin].Record(end - start);
   move->Spin();
+  start = platform->CycleCount();
+  spinProfile[moveSpin].Record(start - end);
   heat->Spin();
+  end = platform->CycleCount();
+  spinProfile[heatSpin].Record(end - start);
+
+  if(diagnosticsPart >= 0 && platform->GetLine()->OutputEmpty())
+	  DiagnosticsPart();
 
   // Keep track of the loop time
 
@@ -262,22 +282,139 @@ void RepRap::Spin()
   lastTime = t;
 }
 
+static const char* spinProfileNames[SPIN_PROFILES] = { "Platform", "Webserver", "GCodes", "Move", "Heat" };
+
 void RepRap::Timing()
 {
 	snprintf(scratchString, STRING_LENGTH, "Slowest main loop (seconds): %f; fastest: %f\n", slowLoop, fastLoop);
 	platform->AppendMessage(BOTH_MESSAGE, scratchString);
 	fastLoop = FLT_MAX;
 	slowLoop = 0.0;
+
+	float t = platform->Time();
+	float seconds = t - profileStartTime;
+	snprintf(scratchString, STRING_LENGTH, "Times in microseconds over the last %.1f seconds; histogram buckets below %.0f, %.0f, %.0f... and above:\n",
+			seconds, (float)(1ul << PROFILE_FIRST_BUCKET_BITS)*1.0e6/CPU_CLOCK_RATE,
+			(float)(1ul << (PROFILE_FIRST_BUCKET_BITS + 2))*1.0e6/CPU_CLOCK_RATE, (float)(1ul << (PROFILE_FIRST_BUCKET_BITS + 4))*1.0e6/CPU_CLOCK_RATE);
+	platform->AppendMessage(BOTH_MESSAGE, scratchString);
+	for(int8_t i = 0; i < SPIN_PROFILES; i++)
+	{
+		spinProfile[i].Report(spinProfileNames[i], seconds);
+		spinProfile[i].Init();
+	}
+
+	// The step interrupt adds to its profile while this runs, so take a copy and start
+	// again with the interrupts off, and report the copy.
+
+	__disable_irq();
+	CycleProfile interrupts = interruptProfile;
+	interruptProfile.Init();
+	__enable_irq();
+	interrupts.Report("Step interrupt", seconds);
+	profileStartTime = t;
+}
+
+void RepRap::ProfileJson(JsonWriter& json) const
+{
+	json.Add("{\"seconds\":");
+	json.AddFixed(reprap.GetPlatform()->Time() - profileStartTime, 1);
+	for(int8_t i = 0; i < SPIN_PROFILES; i++)
+	{
+		json.Add(",\"");
+		json.Add(spinProfileNames[i]);
+		json.Add("\":");
+		spinProfile[i].Json(json);
+	}
+	json.Add(",\"interrupt\":");
+	__disable_irq();
+	CycleProfile interrupts = interruptProfile;
+	__enable_irq();
+	interrupts.Json(json);
+	json.Add('}');
+}
+
+//*************************************************************************************************
+
+void CycleProfile::Init()
+{
+	count = 0;
+	minimum = UINT32_MAX;
+	maximum = 0;
+	total = 0;
+	for(int8_t i = 0; i < PROFILE_BUCKETS; i++)
+		histogram[i] = 0;
+}
+
+float CycleProfile::Load(float seconds) const
+{
+	return (seconds > 0.0) ? (float)total/(seconds*CPU_CLOCK_RATE) : 0.0;
+}
+
+void CycleProfile::Report(const char* name, float seconds)
+{
+	const float us = 1.0e6/CPU_CLOCK_RATE;
+	int n = snprintf(scratchString, STRING_LENGTH, "%s: %lu runs, min %.1f avg %.1f max %.1f, %.2f%% of the time; histogram",
+			name, (unsigned long)count, (count > 0) ? minimum*us : 0.0, (count > 0) ? (float)total*us/count : 0.0, maximum*us,
+			100.0*Load(seconds));
+	for(int8_t i = 0; i < PROFILE_BUCKETS && n < STRING_LENGTH; i++)
+		n += snprintf(&scratchString[n], STRING_LENGTH - n, " %lu", (unsigned long)histogram[i]);
+	if(n < STRING_LENGTH - 1)
+		strcat(scratchString, "\n");
+	reprap.GetPlatform()->AppendMessage(BOTH_MESSAGE, scratchString);
+}
+
+void CycleProfile::Json(JsonWriter& json) const
+{
+	const float us = 1.0e6/CPU_CLOCK_RATE;
+	json.Add("{\"n\":");
+	json.AddUnsigned(count);
+	json.Add(",\"min\":");
+	json.AddFixed((count > 0) ? minimum*us : 0.0, 1);
+	json.Add(",\"avg\":");
+	json.AddFixed((count > 0) ? (float)total*us/count : 0.0, 1);
+	json.Add(",\"max\":");
+	json.AddFixed(maximum*us, 1);
+	json.Add(",\"hist\":[");
+	for(int8_t i = 0; i < PROFILE_BUCKETS; i++)
+	{
+		if(i > 0)
+			json.Add(',');
+		json.AddUnsigned(histogram[i]);
+	}
+	json.Add("]}");
 }
 
+// The report is longer than the USB output ring, so rather than it being cut short (or the
+// main loop waiting for the host) it goes a part at a time, each when the last has been sent.
+
 void RepRap::Diagnostics()
 {
-  platform->Diagnostics();
-  move->Diagnostics();
-  heat->Diagnostics();
-  gCodes->Diagnostics();
-  webserver->Diagnostics();
-  Timing();
+  diagnosticsPart = 0;
+}
+
+void RepRap::DiagnosticsPart()
+{
+  switch(diagnosticsPart++)
+  {
+  case 0:
+	  platform->Diagnostics();
+	  break;
+  case 1:
+	  move->Diagnostics();
+	  break;
+  case 2:
+	  heat->Diagnostics();
+	  break;
+  case 3:
+	  gCodes->Diagnostics();
+	  break;
+  case 4:
+	  webserver->Diagnostics();
+	  break;
+  default:
+	  Timing();
+	  diagnosticsPart = -1;
+  }
 }
 
 // Turn off the heaters, disable the motors, and
@@ -320,8 +457,30 @@ void RepRap::EmergencyStop()
  * The first tool added becomes the one selected.  This will not happen in future releases.
  */
 
-void RepRap::AddTool(Tool* tool)
+void RepRap::AddTool(int toolNumber, long d[], int dCount, long h[], int hCount)
 {
+	if(GetTool(toolNumber) != NULL)
+	{
+		// Should never happen (GCodes redefines existing tools in place).
+
+		snprintf(scratchString, STRING_LENGTH, "Tool creation - attempt to create a tool with a number that's in use: %d\n", toolNumber);
+		platform->Message(HOST_MESSAGE, scratchString);
+		return;
+	}
+
+	if(toolsInUse >= MAX_TOOLS)
+	{
+		snprintf(scratchString, STRING_LENGTH, "Tool creation - no room for tool %d; at most %d tools can be defined.\n", toolNumber, MAX_TOOLS);
+		platform->Message(HOST_MESSAGE, scratchString);
+		return;
+	}
+
+	Tool* tool = &toolPool[toolsInUse];
+	toolsInUse++;
+	tool->myNumber = toolNumber;
+	tool->next = NULL;
+	tool->Init(d, dCount, h, hCount);
+
 	// First one?
 
 	if(toolList == NULL)
@@ -334,18 +493,7 @@ void RepRap::AddTool(Tool* tool)
 
 	// Subsequent one...
 
-	Tool* existingTool = GetTool(tool->Number());
-	if(existingTool == NULL)
-	{
-		toolList->AddTool(tool);
-		return;
-	}
-
-	// Attempting to add a tool with a number that's been taken.
-
-	snprintf(scratchString, STRING_LENGTH, "Tool creation - attempt to create a tool with a number that's in use: %d", tool->Number());
-	reprap.GetPlatform()->Message(HOST_MESSAGE, scratchString);
-	delete tool; // Harsh?  Protects against a memory leak.
+	toolList->AddTool(tool);
 }
 
 void RepRap::PrintTool(int toolNumber, char* reply)
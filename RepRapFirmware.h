@@ -53,6 +53,7 @@ extern char scratchString[];
 #include "Configuration.h"
 #include "Platform.h"
 #include "Webserver.h"
+#include "GCodeFormat.h"
 #include "GCodes.h"
 #include "Move.h"
 #include "Heat.h"
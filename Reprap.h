@@ -21,6 +21,39 @@ Licence: GPL
 #ifndef REPRAP_H
 #define REPRAP_H
 
+// How long a piece of code takes, in processor cycles: how often it has run, the least, the
+// most and the average, and a histogram with buckets that are each 4 times as long as the
+// last.  Recording costs a few instructions, so it is always on.
+
+class CycleProfile
+{
+  public:
+    void Init();
+    void Record(uint32_t cycles);
+    void Report(const char* name, float seconds);	// Message the figures; seconds is how long they cover
+    void Json(JsonWriter& json) const;				// Append the figures as a JSON object, in microseconds
+    float Load(float seconds) const;				// The fraction of seconds spent running
+
+  private:
+    volatile uint32_t count;
+    volatile uint32_t minimum;
+    volatile uint32_t maximum;
+    volatile uint64_t total;
+    volatile uint32_t histogram[PROFILE_BUCKETS];
+};
+
+// The Spin()s that are profiled
+
+enum SpinProfile
+{
+  platformSpin = 0,
+  webserverSpin = 1,
+  gcodesSpin = 2,
+  moveSpin = 3,
+  heatSpin = 4
+};
+#define SPIN_PROFILES 5
+
 class RepRap
 {    
   public:
@@ -33,9 +66,12 @@ class RepRap
     void Interrupt();
     void Diagnostics();
     void Timing();
+    void ProfileJson(JsonWriter& json) const;		// The Spin() and interrupt timing as JSON
+    CycleProfile* InterruptProfile();
     bool Debug() const;
     void SetDebug(bool d);
-    void AddTool(Tool* t);
+    void AddTool(int toolNumber, long d[], int dCount, long h[], int hCount);
+    int ToolsInUse() const;
     void SelectTool(int toolNumber);
     void StandbyTool(int toolNumber);
     Tool* GetCurrentTool();
@@ -56,18 +92,25 @@ class RepRap
     
   private:
   
+    void DiagnosticsPart();						// Send the next part of the report Diagnostics() started
     Platform* platform;
     bool active;
     Move* move;
     Heat* heat;
     GCodes* gCodes;
     Webserver* webserver;
+    Tool toolPool[MAX_TOOLS];					// Taken in order by AddTool() and never given back...
+    int toolsInUse;								// ...so this is all the bookkeeping there is
     Tool* toolList;
     Tool* currentTool;
     bool debug;
     float fastLoop, slowLoop;
+    CycleProfile spinProfile[SPIN_PROFILES];
+    CycleProfile interruptProfile;
+    float profileStartTime;						// When the profiles were last reset
     float lastTime;
     bool coldExtrude;
+    int8_t diagnosticsPart;						// The part of the diagnostics report to send next, or -1 if none
 };
 
 inline Platform* RepRap::GetPlatform() const { return platform; }
@@ -77,6 +120,7 @@ inline GCodes* RepRap::GetGCodes() const { return gCodes; }
 inline Webserver* RepRap::GetWebserver() const { return webserver; }
 inline bool RepRap::Debug() const { return debug; }
 inline Tool* RepRap::GetCurrentTool() { return currentTool; }
+inline int RepRap::ToolsInUse() const { return toolsInUse; }
 inline bool RepRap::ColdExtrude() { return coldExtrude; }
 inline void RepRap::AllowColdExtrude() { coldExtrude = true; }
 
@@ -108,6 +152,25 @@ inline void RepRap::SetDebug(bool d)
 }
 
 inline void RepRap::Interrupt() { move->Interrupt(); }
+inline CycleProfile* RepRap::InterruptProfile() { return &interruptProfile; }
+
+// Bucket i holds times below 2^(PROFILE_FIRST_BUCKET_BITS + 2i) cycles; the last holds the rest
+
+inline void CycleProfile::Record(uint32_t cycles)
+{
+  count++;
+  total += cycles;
+  if(cycles < minimum)
+    minimum = cycles;
+  if(cycles > maximum)
+    maximum = cycles;
+  int8_t bucket = (33 - __builtin_clz(cycles | 1) - PROFILE_FIRST_BUCKET_BITS) >> 1;
+  if(bucket < 0)
+    bucket = 0;
+  else if(bucket >= PROFILE_BUCKETS)
+    bucket = PROFILE_BUCKETS - 1;
+  histogram[bucket]++;
+}
 
 #endif
 
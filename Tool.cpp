@@ -27,11 +27,19 @@ Licence: GPL
 
 
 
-Tool::Tool(int toolNumber, long d[], int dCount, long h[], int hCount)
+// Tools live in a fixed pool in the RepRap class, which gives each one its
+// number and calls Init() when M563 defines it.
+
+Tool::Tool()
 {
-	myNumber = toolNumber;
+	myNumber = -1;
 	next = NULL;
-	Init(d, dCount, h, hCount);
+	active = false;
+	driveCount = 0;
+	heaterCount = 0;
+	heaterFault = false;
+	mixing = false;
+	pressureAdvance = 0.0;
 }
 
 void Tool::Init(long d[], int dCount, long h[], int hCount)
@@ -41,6 +49,7 @@ void Tool::Init(long d[], int dCount, long h[], int hCount)
 	heaterCount = hCount;
 	heaterFault = false;
 	mixing = false;
+	pressureAdvance = 0.0;
 
 	for(int8_t axis = 0; axis < AXES; axis++)
 		offsets[axis] = 0.0;
@@ -117,6 +126,8 @@ void Tool::PrintInternal(char* reply, int bufferSize)
 		snprintf(scratchString, STRING_LENGTH, "%.1f%c ", offsets[axis], comma);
 		strncat(reply, scratchString, bufferSize);
 	}
+	snprintf(scratchString, STRING_LENGTH, " Pressure advance: %.3f;", pressureAdvance);
+	strncat(reply, scratchString, bufferSize);
 	strncat(reply, " status: ", bufferSize);
 	if(active)
 		strncat(reply, "selected", bufferSize);
@@ -30,7 +30,7 @@ class Tool
 {
 public:
 
-	Tool(int toolNumber, long d[], int dCount, long h[], int hCount);
+	Tool();
 	void Init(long d[], int dCount, long h[], int hCount);
 	int DriveCount();
 	int Drive(int driveNumber);
@@ -49,6 +49,8 @@ public:
 	bool Mixing();
 	float MaxFeedrate();
 	float InstantDv();
+	void SetPressureAdvance(float k);
+	float PressureAdvance() const;
 	void Print(char* reply);
 
 	friend class RepRap;
@@ -72,6 +74,7 @@ private:
 	int drives[DRIVES - AXES];
 	float mix[DRIVES - AXES];
 	bool mixing;
+	float pressureAdvance;		// Seconds of extruder velocity added as extra extrusion
 	int driveCount;
 	int heaters[HEATERS];
 	float activeTemperatures[HEATERS];
@@ -140,6 +143,16 @@ inline int Tool::DriveCount()
 	return driveCount;
 }
 
+inline void Tool::SetPressureAdvance(float k)
+{
+	pressureAdvance = k;
+}
+
+inline float Tool::PressureAdvance() const
+{
+	return pressureAdvance;
+}
+
 
 
 #endif /* TOOL_H_ */
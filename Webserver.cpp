@@ -31,27 +31,177 @@ Licence: GPL
 
 //***************************************************************************************************
 
-bool Webserver::MatchBoundary(char c)
+// Uploads.  Once the part headers of a POST have been read, the rest of its input is diverted
+// by the network and dealt with here a whole block at a time, while other requests (such as
+// polls asking how the upload is going) carry on being answered.  The file ends at the first
+// CR LF -- boundary, which is searched for with Boyer-Moore-Horspool.  Up to boundaryLength - 1
+// bytes at the end of each block are held back in postCarry in case the boundary straddles two.
+
+void Webserver::StartUpload()
 {
-  if(!postBoundary[0])
-    return false;
-    
-  if(c == postBoundary[boundaryCount])
+  boundaryLength = strlen(postBoundary);
+  for(int i = 0; i < 256; i++)
+    boundarySkip[i] = boundaryLength;
+  for(int i = 0; i < boundaryLength - 1; i++)
+    boundarySkip[(uint8_t)postBoundary[i]] = boundaryLength - 1 - i;
+  postCarryLength = 0;
+  uploadBytes = 0;
+  uploadStartTime = platform->Time();
+  uploadEndTime = uploadStartTime;
+  strncpy(postRequest, clientRequest, STRING_LENGTH);
+  postRequest[STRING_LENGTH - 1] = 0;
+  postKeepAlive = keepAlive;
+  clientRequest[0] = 0;
+  receivingPost = false;
+  uploadState = uploadingData;
+  platform->GetNetwork()->DivertInput();
+}
+
+// Where the boundary starts in data, or -1 if it isn't there
+
+int Webserver::FindBoundary(const char* data, int length) const
+{
+  int i = 0;
+  while(i <= length - boundaryLength)
   {
-    boundaryCount++;
-    if(!postBoundary[boundaryCount])
+    int j = boundaryLength - 1;
+    while(j >= 0 && data[i + j] == postBoundary[j])
+      j--;
+    if(j < 0)
+      return i;
+    i += boundarySkip[(uint8_t)data[i + boundaryLength - 1]];
+  }
+  return -1;
+}
+
+void Webserver::WriteUpload(const char* data, int length)
+{
+  if(length <= 0)
+    return;
+  postFile->Write(data, length);
+  uploadBytes += length;
+}
+
+// Deal with a block of the file being uploaded.  Returns how much of it was used; all of it
+// unless the boundary was found, in which case what follows is left unread.
+
+int Webserver::UploadBlock(const char* data, int length)
+{
+  int found;
+
+  // First, could the boundary start in what was held back last time?  Enough of this
+  // block is put after it to finish any boundary that does.
+
+  if(postCarryLength > 0)
+  {
+    int take = boundaryLength - 1;
+    if(take > length)
+      take = length;
+    memcpy(&postCarry[postCarryLength], data, take);
+    int windowLength = postCarryLength + take;
+    found = FindBoundary(postCarry, windowLength);
+    if(found >= 0)
     {
-      boundaryCount = 0;
-      return true;
+      WriteUpload(postCarry, found);
+      EndUpload();
+      return found + boundaryLength - postCarryLength;
     }
-  } else
+    if(take < boundaryLength - 1)
+    {
+      // A short block; it still isn't known if the boundary starts here
+
+      int keep = (windowLength < boundaryLength - 1) ? windowLength : boundaryLength - 1;
+      WriteUpload(postCarry, windowLength - keep);
+      memmove(postCarry, &postCarry[windowLength - keep], keep);
+      postCarryLength = keep;
+      return length;
+    }
+    WriteUpload(postCarry, postCarryLength);
+    postCarryLength = 0;
+  }
+
+  found = FindBoundary(data, length);
+  if(found >= 0)
   {
-    for(int i = 0; i < boundaryCount; i++)
-      postFile->Write(postBoundary[i]);
-    postFile->Write(c);
-    boundaryCount = 0;
+    WriteUpload(data, found);
+    EndUpload();
+    return found + boundaryLength;
+  }
+  int keep = (length < boundaryLength - 1) ? length : boundaryLength - 1;
+  WriteUpload(data, length - keep);
+  memcpy(postCarry, &data[length - keep], keep);
+  postCarryLength = keep;
+  return length;
+}
+
+void Webserver::EndUpload()
+{
+  postFile->Close();
+  postFile = NULL;
+  uploadEndTime = platform->Time();
+  uploadState = uploadingTrailer;
+}
+
+// Called from Spin() while there is an upload.  After the file come the closing boundary and
+// anything else up to the Content-Length; then the POST can be answered.
+
+void Webserver::ReceiveUpload()
+{
+  Network* net = platform->GetNetwork();
+
+  if(!net->InputDiverted())
+  {
+    platform->Message(HOST_MESSAGE, "Upload connection lost.\n");
+    if(postFile != NULL)
+      postFile->Close();
+    uploadState = notUploading;
+    InitialisePost();
+    return;
+  }
+
+  if(uploadState == uploadAwaitingReply)
+  {
+    if(!writing && !needToCloseClient && net->ResumeDiverted())
+    {
+      clientQualifier[0] = 0;
+      clientETag[0] = 0;
+      clientModifiedSince[0] = 0;
+      keepAlive = postKeepAlive && postLength > 0;
+      uploadState = notUploading;
+      SendFile(postRequest);
+      InitialisePost();
+    }
+    return;
+  }
+
+  for(int8_t i = 0; i < UPLOAD_BLOCKS_PER_SPIN; i++)
+  {
+    const char* data;
+    int length = net->ReadDivertedBlock(data);
+    if(length > 0)
+    {
+      int used;
+      if(uploadState == uploadingData)
+        used = UploadBlock(data, length);
+      else
+      {
+        used = postLength - postBodyRead;
+        if(used > length)
+          used = length;
+        if(used < 0)
+          used = 0;
+      }
+      net->ConsumeDiverted(used);
+      postBodyRead += used;
+    }
+    if(uploadState == uploadingTrailer && postBodyRead >= postLength)
+    {
+      uploadState = uploadAwaitingReply;
+      return;
+    }
+    if(length <= 0)
+      return;
   }
-  return false;  
 }
 
 
@@ -79,6 +229,19 @@ byte Webserver::ReadGCode()
   return c;
 }
 
+unsigned int Webserver::ReadGCodeBlock(const char*& data)
+{
+  data = &gcodeBuffer[gcodeReadIndex];
+  if (gcodeWriteIndex >= gcodeReadIndex)
+	  return gcodeWriteIndex - gcodeReadIndex;
+  return gcodeBufLength - gcodeReadIndex;
+}
+
+void Webserver::ConsumeGCode(unsigned int n)
+{
+  gcodeReadIndex = (gcodeReadIndex + n) % gcodeBufLength;
+}
+
 // Process a received string of gcodes
 void Webserver::LoadGcodeBuffer(const char* gc, bool convertWeb)
 {
@@ -207,7 +370,7 @@ void Webserver::ProcessGcode(const char* gc)
 
     case 4:
 	  {
-		FileStore *configFile = platform->GetFileStore(platform->GetSysDir(), platform->GetConfigFile(), false);
+		FileStore *configFile = platform->GetFileStore(platform->GetSysDir(), platform->GetConfigFile(), false, generalFile);
 		if(configFile == NULL)
 		{
 		  platform->Message(WEB_ERROR_MESSAGE, "Configuration file not found");
@@ -259,37 +422,92 @@ void Webserver::ProcessGcode(const char* gc)
 
 // Output to the client
 
+// The response is complete.  Keep the connection open for more requests unless
+// the client has asked for it to be closed.
+
 void Webserver::CloseClient()
 {
   writing = false;
   //inPHPFile = false;
   //InitialisePHP();
+  if(keepAlive)
+  {
+	platform->GetNetwork()->FinishResponse();
+	return;
+  }
   clientCloseTime = platform->Time();
   needToCloseClient = true;   
 }
 
 
+// Send a file from the web directory, or a JSON response.  If there is a gzipped copy
+// of the file (its name with ".gz" on the end) that is sent instead.  Files carry an ETag
+// and Last-Modified from their directory entry, and if the browser already has the same
+// version it is told so with a 304 rather than being sent the file again.
+
 void Webserver::SendFile(const char* nameOfFileToSend)
 {
   char sLen[SHORT_STRING_LENGTH];
+  char eTag[SHORT_STRING_LENGTH];
+  char lastModified[SHORT_STRING_LENGTH];
   bool zip = false;
+  bool notFound = false;
+  bool notModified = false;
     
   if(StringStartsWith(nameOfFileToSend, KO_START))
     GetJsonResponse(&nameOfFileToSend[KO_FIRST]);
     
   if(jsonPointer < 0)
   {
-    fileBeingSent = platform->GetFileStore(platform->GetWebDir(), nameOfFileToSend, false);
-    if(fileBeingSent == NULL)
+    MassStorage* massStorage = platform->GetMassStorage();
+    unsigned long size;
+    uint32_t timeStamp;
+    char gzName[GZ_NAME_LENGTH];
+    const char* nameToOpen = nameOfFileToSend;
+
+    snprintf(gzName, GZ_NAME_LENGTH, "%s.gz", nameOfFileToSend);
+    if(strlen(nameOfFileToSend) + 3 < GZ_NAME_LENGTH && massStorage->GetFileInfo(platform->GetWebDir(), gzName, size, timeStamp))
     {
+      nameToOpen = gzName;
+      zip = true;
+    } else if(!massStorage->GetFileInfo(platform->GetWebDir(), nameOfFileToSend, size, timeStamp))
+    {
+      notFound = true;
       nameOfFileToSend = FOUR04_FILE;
-      fileBeingSent = platform->GetFileStore(platform->GetWebDir(), nameOfFileToSend, false);
+      nameToOpen = nameOfFileToSend;
+    }
+
+    if(!notFound)
+    {
+      snprintf(eTag, SHORT_STRING_LENGTH, "\"%08lx-%lx%s\"", (unsigned long)timeStamp, size, zip ? "z" : "");
+      HttpDate(timeStamp, lastModified);
+      notModified = (clientETag[0] && !strcmp(clientETag, eTag)) ||
+    		  (!clientETag[0] && clientModifiedSince[0] && !strcmp(clientModifiedSince, lastModified));
     }
+
+    fileBeingSent = notModified ? NULL : platform->GetFileStore(platform->GetWebDir(), nameToOpen, false, webFile);
     writing = (fileBeingSent != NULL);
   } 
   
   Network *net = platform->GetNetwork();
-  net->Write("HTTP/1.1 200 OK\n");
+
+  // A 304 has no body, so it says nothing about one: just which version the browser has.
+
+  if(notModified)
+  {
+	  net->Write("HTTP/1.1 304 Not Modified\nETag: ");
+	  net->Write(eTag);
+	  net->Write("\nLast-Modified: ");
+	  net->Write(lastModified);
+	  net->Write("\n\n");
+	  CloseClient();
+	  return;
+  }
+
+  if(notFound)
+	  net->Write("HTTP/1.1 404 Not Found\n");
+  else
+	  net->Write("HTTP/1.1 200 OK\n");
   net->Write("Content-Type: ");
   
   if(StringEndsWith(nameOfFileToSend, ".png"))
@@ -311,64 +529,100 @@ void Webserver::SendFile(const char* nameOfFileToSend)
   } else
 	  net->Write("application/octet-stream\n");
 
-  if (jsonPointer >=0)
-  {
-	net->Write("Content-Length: ");
-    snprintf(sLen, SHORT_STRING_LENGTH, "%d", strlen(jsonResponse));
-    net->Write(sLen);
-    net->Write("\n");
-  }
-    
   if(zip)
-  {
 	net->Write("Content-Encoding: gzip\n");
-	net->Write("Content-Length: ");
-    snprintf(sLen, SHORT_STRING_LENGTH, "%llu", fileBeingSent->Length());
-    net->Write(sLen);
-    net->Write("\n");
+
+  if(jsonPointer < 0 && !notFound)
+  {
+	  net->Write("ETag: ");
+	  net->Write(eTag);
+	  net->Write("\nLast-Modified: ");
+	  net->Write(lastModified);
+	  net->Write("\n");
   }
-    
-  net->Write("Connection: close\n");
+
+  // Every response says how long it is so that the connection can be kept open after it.
+
+  net->Write("Content-Length: ");
+  if (jsonPointer >= 0)
+    snprintf(sLen, SHORT_STRING_LENGTH, "%d", strlen(jsonResponse));
+  else if (fileBeingSent != NULL)
+    snprintf(sLen, SHORT_STRING_LENGTH, "%lu", fileBeingSent->Length());
+  else
+    strncpy(sLen, "0", SHORT_STRING_LENGTH);
+  net->Write(sLen);
+  net->Write("\n");
+
+  if(keepAlive)
+	net->Write("Connection: keep-alive\n");
+  else
+	net->Write("Connection: close\n");
   net->Write('\n');
+
+  if(jsonPointer < 0 && fileBeingSent == NULL)
+	CloseClient();
 }
 
-// Write a number of bytes if we can, returning true if we wrote anything
+// Turn a FAT date and time stamp into the form HTTP uses, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+// FAT keeps no time zone, so the clock is taken to be on GMT.
+
+void Webserver::HttpDate(uint32_t timeStamp, char* s)
+{
+	static const char* days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	static const int8_t monthOffsets[] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+
+	int year = 1980 + ((timeStamp >> 25) & 0x7F);
+	int month = (timeStamp >> 21) & 0x0F;
+	int day = (timeStamp >> 16) & 0x1F;
+	if(month < 1 || month > 12)
+		month = 1;
+	if(day < 1)
+		day = 1;
+
+	// Work out the day of the week (Sakamoto's method)
+
+	int y = (month < 3) ? year - 1 : year;
+	int weekDay = (y + y/4 - y/100 + y/400 + monthOffsets[month - 1] + day) % 7;
+
+	snprintf(s, SHORT_STRING_LENGTH, "%s, %02d %s %04d %02d:%02d:%02d GMT", days[weekDay], day, months[month - 1], year,
+			(int)((timeStamp >> 11) & 0x1F), (int)((timeStamp >> 5) & 0x3F), (int)((timeStamp & 0x1F)*2));
+}
+
+// Write as much as the network will take in whole blocks, returning true if we wrote anything.
+// A file is copied from its buffer straight into the network's output buffer.
 bool Webserver::WriteBytes()
 {
 	Network *net = platform->GetNetwork();
-	uint8_t i;
-	for (i = 0; i < 50 && writing && net->CanWrite(); )
+	if(!writing || !net->CanWrite())
+		return false;
+
+	if(jsonPointer >= 0)
 	{
-		++i;
-		if(jsonPointer >= 0)
+		jsonPointer += net->Write(&jsonResponse[jsonPointer], strlen(&jsonResponse[jsonPointer]));
+		if(!jsonResponse[jsonPointer])
 		{
-		  if(jsonResponse[jsonPointer])
-		  {
-			  net->Write(jsonResponse[jsonPointer++]);
-		  }
-		  else
-		  {
 			jsonPointer = -1;
 			jsonResponse[0] = 0;
 			CloseClient();
-			break;
-		  }
-		} else
+		}
+		return true;
+	}
+
+	while(writing && net->CanWrite())
+	{
+		const char* data;
+		int length = fileBeingSent->ReadBlock(data);
+		if(length <= 0)
 		{
-		  char b;
-		  if(fileBeingSent->Read(b))
-		  {
-			  net->Write(b);
-		  }
-		  else
-		  {
 			fileBeingSent->Close();
+			fileBeingSent = NULL;
 			CloseClient();
 			break;
-		  }
 		}
+		fileBeingSent->Consume(net->Write(data, length));
 	}
-	return i != 0;
+	return true;
 }
 
 //----------------------------------------------------------------------------------------------------
@@ -431,159 +685,147 @@ void Webserver::GetJsonResponse(const char* request)
   jsonPointer = 0;
   writing = true;
   
+  json.Init(jsonResponse, STRING_LENGTH);
+
   if(StringStartsWith(request, "poll"))
   {
-	float fractionPrinted = reprap.GetGCodes()->FractionOfFilePrinted();
-    strncpy(jsonResponse, "{\"poll\":[", STRING_LENGTH);
-    if(fractionPrinted >= 0.0)
-    	strncat(jsonResponse, "\"P\",", STRING_LENGTH); // Printing
-    else
-    	strncat(jsonResponse, "\"I\",", STRING_LENGTH); // Idle
-
-    float liveCoordinates[DRIVES+1];
-    reprap.GetMove()->LiveCoordinates(liveCoordinates);
-    for(int8_t drive = 0; drive < AXES; drive++)
-    {
-    	strncat(jsonResponse, "\"", STRING_LENGTH);
-    	snprintf(scratchString, STRING_LENGTH, "%.2f", liveCoordinates[drive]);
-    	strncat(jsonResponse, scratchString, STRING_LENGTH);
-    	strncat(jsonResponse, "\",", STRING_LENGTH);
-    }
-
-    // FIXME: should loop through all Es
-
-    strncat(jsonResponse, "\"", STRING_LENGTH);
-    snprintf(scratchString, STRING_LENGTH, "%.4f", liveCoordinates[AXES]);
-    strncat(jsonResponse, scratchString, STRING_LENGTH);
-    strncat(jsonResponse, "\",", STRING_LENGTH);
-
-    unsigned char activeHeaterBits = 0;
-    for(int8_t heater = 0; heater < HEATERS; heater++)
-    {
-      strncat(jsonResponse, "\"", STRING_LENGTH);
-      snprintf(scratchString, STRING_LENGTH, "%.1f", reprap.GetHeat()->GetTemperature(heater));
-      strncat(jsonResponse, scratchString, STRING_LENGTH);
-      if(heater < HEATERS - 1)
-    	  strncat(jsonResponse, "\",", STRING_LENGTH);
-      else
-    	  strncat(jsonResponse, "\"", STRING_LENGTH);
-      if(!reprap.GetHeat()->SwitchedOff(heater))
-    	  activeHeaterBits |= 1 << heater;
-    }
-
-    strncat(jsonResponse, "]", STRING_LENGTH);
-
-    // Send the Z probe value
+	// rr_poll?since=n asks for just the values that have changed since the reply that carried "st":n
 
-    if (platform->GetZProbeType() >= 2)
-    {
-    	snprintf(scratchString, STRING_LENGTH, ",\"probe\":\"%d (%d)\"", (int)platform->ZProbe(), platform->ZProbeOnVal());
-    }
-    else
-    {
-    	snprintf(scratchString, STRING_LENGTH, ",\"probe\":\"%d\"", (int)platform->ZProbe());
-    }
-    strncat(jsonResponse, scratchString, STRING_LENGTH);
-
-    // Send the amount of buffer space available for gcodes
-   	snprintf(scratchString, STRING_LENGTH, ",\"buff\":%u", GetReportedGcodeBufferSpace());
-   	strncat(jsonResponse, scratchString, STRING_LENGTH);
-
-    // Send the home state. To keep the messages short, we send 1 for homed and 0 for not homed, instead of true and false.
-    strncat(jsonResponse, ",\"hx\":", STRING_LENGTH);
-    strncat(jsonResponse, (reprap.GetGCodes()->GetAxisHasBeenHomed(0)) ? "1" : "0", STRING_LENGTH);
-    strncat(jsonResponse, ",\"hy\":", STRING_LENGTH);
-    strncat(jsonResponse, (reprap.GetGCodes()->GetAxisHasBeenHomed(1)) ? "1" : "0", STRING_LENGTH);
-    strncat(jsonResponse, ",\"hz\":", STRING_LENGTH);
-    strncat(jsonResponse, (reprap.GetGCodes()->GetAxisHasBeenHomed(2)) ? "1" : "0", STRING_LENGTH);
-
-    // Send the fraction printed
-    strncat(jsonResponse, ",\"fraction_printed\":", STRING_LENGTH);
-    snprintf(scratchString, STRING_LENGTH, "%.4f", max(0.0, fractionPrinted));
-    strncat(jsonResponse, scratchString, STRING_LENGTH);
-
-    // Send the name
-    strncat(jsonResponse, ",\"reprap_name\":", STRING_LENGTH);
-    snprintf(scratchString, STRING_LENGTH, "\"%s\"", myName);
-    strncat(jsonResponse, scratchString, STRING_LENGTH);
-
-    // Send the response sequence number
-    strncat(jsonResponse, ",\"seq\":", STRING_LENGTH);
-	snprintf(scratchString, STRING_LENGTH, "%u", (unsigned int)seq);
-	strncat(jsonResponse, scratchString, STRING_LENGTH);
-
-	// Send the list of active heaters
-	strncat(jsonResponse, ",\"act\":", STRING_LENGTH);
-	snprintf(scratchString, STRING_LENGTH, "%u", (unsigned int)activeHeaterBits);
-	strncat(jsonResponse, scratchString, STRING_LENGTH);
-
-    // Send the response to the last command. Do this last because it is long and may need to be truncated.
-    strncat(jsonResponse, ",\"resp\":\"", STRING_LENGTH);
-    size_t jp = strnlen(jsonResponse, STRING_LENGTH);
-    const char *p = gcodeReply;
-    while (*p != 0 && jp < STRING_LENGTH - 2)	// leave room for the final '"}'
-    {
-    	char c = *p++;
-    	char esc;
-    	switch(c)
-    	{
-    	case '\r':
-    		esc = 'r'; break;
-    	case '\n':
-    		esc = 'n'; break;
-    	case '\t':
-    		esc = 't'; break;
-    	case '"':
-    		esc = '"'; break;
-    	case '\\':
-    		esc = '\\'; break;
-    	default:
-    		esc = 0; break;
-    	}
-    	if (esc)
-    	{
-    		if (jp >= STRING_LENGTH - 3)
-    			break;
-   			jsonResponse[jp++] = '\\';
-   			jsonResponse[jp++] = esc;
-    	}
-    	else
-    	{
-    		jsonResponse[jp++] = c;
-    	}
-    }
-    strncat(jsonResponse, "\"}", STRING_LENGTH);
-
-    jsonResponse[STRING_LENGTH] = 0;
-    gcodeReply[0] = 0; // Last one's been copied to jsonResponse; so set up for the next
+	if(StringStartsWith(clientQualifier, "since="))
+		GetPollResponse(true, strtoul(&clientQualifier[6], NULL, 10));
+	else
+		GetPollResponse(false, 0);
+	JsonReport(true, request);
+	return;
+  }
+  
+  if(StringStartsWith(request, "upload"))
+  {
+    // How the current upload is going, or how the last one went
+
+    float t = ((uploadState == uploadingData) ? platform->Time() : uploadEndTime) - uploadStartTime;
+    json.Add("{\"ulActive\":");
+    json.AddUnsigned(uploadState != notUploading);
+    json.Add(",\"ulFile\":\"");
+    json.AddEscaped(postFileName, 80);
+    json.Add("\",\"ulSize\":");
+    json.AddUnsigned(postLength);
+    json.Add(",\"ulDone\":");
+    json.AddUnsigned(uploadBytes);
+    json.Add(",\"ulTime\":");
+    json.AddFixed(t, 1);
+    json.Add(",\"ulRate\":");
+    json.AddUnsigned((t > 0.0) ? (unsigned long)(uploadBytes/t) : 0);
+    json.Add('}');
     JsonReport(true, request);
     return;
   }
-  
+
   if(StringStartsWith(request, "gcode"))
   {
     LoadGcodeBuffer(&clientQualifier[6], true);
-    snprintf(scratchString, STRING_LENGTH, "{\"buff\":%u}", GetReportedGcodeBufferSpace());
-   	strncat(jsonResponse, scratchString, STRING_LENGTH);
+    json.Add("{\"buff\":");
+    json.AddUnsigned(GetReportedGcodeBufferSpace());
+    json.Add('}');
     JsonReport(true, request);
     return;
   }
   
   if(StringStartsWith(request, "files"))
   {
-    char* fileList = platform->GetMassStorage()->FileList(platform->GetGCodeDir(), false);
-    strncpy(jsonResponse, "{\"files\":[", STRING_LENGTH);
-    strncat(jsonResponse, fileList, STRING_LENGTH);
-    strncat(jsonResponse, "]}", STRING_LENGTH);
+    // rr_files?first=n&count=n&sort=date&details=1 lists a page of the files, as objects with
+    // their sizes and dates if details are asked for.  As many as fit are sent; "next" says
+    // where the next page starts.
+
+    MassStorage* massStorage = platform->GetMassStorage();
+    const char* dir = platform->GetGCodeDir();
+    int first = QualifierValue("first=", 0);
+    if(first < 0)
+      first = 0;
+    int count = QualifierValue("count=", DIRECTORY_INDEX_LENGTH);
+    FileSort sort = (StringContains(clientQualifier, "sort=date") >= 0) ? sortByDate : sortByName;
+    bool details = QualifierValue("details=", 0) > 0;
+    int total = massStorage->FileCount(dir);
+    int next = first;
+    const char* name;
+    unsigned long size;
+    uint32_t timeStamp;
+    char date[20];
+
+    json.Add("{\"files\":[");
+    while(next < total && next - first < count && json.Length() < STRING_LENGTH - 100 &&
+    		massStorage->GetFileEntry(dir, next, sort, name, size, timeStamp))
+    {
+      if(next > first)
+        json.Add(',');
+      if(details)
+      {
+        massStorage->TimeStampString(timeStamp, date);
+        json.Add("{\"name\":\"");
+        json.AddEscaped(name, 60);
+        json.Add("\",\"size\":");
+        json.AddUnsigned(size);
+        json.Add(",\"date\":\"");
+        json.Add(date);
+        json.Add("\"}");
+      } else
+      {
+        json.Add('"');
+        json.AddEscaped(name, 60);
+        json.Add('"');
+      }
+      next++;
+    }
+    json.Add("],\"first\":");
+    json.AddUnsigned(first);
+    json.Add(",\"next\":");
+    json.AddUnsigned(next);
+    json.Add(",\"total\":");
+    json.AddUnsigned(total);
+    json.Add('}');
     JsonReport(true, request);
     return;
   }
   
+  if(StringStartsWith(request, "profile"))
+  {
+    reprap.ProfileJson(json);
+    JsonReport(true, request);
+    return;
+  }
+
+  if(StringStartsWith(request, "fileinfo"))
+  {
+    // rr_fileinfo?name=file.gcode gives what the slicer said about a file
+
+    GCodeFileInfo info;
+    const char* name = StringStartsWith(clientQualifier, "name=") ? &clientQualifier[5] : "";
+    if(!platform->GetMassStorage()->GetGCodeFileInfo(platform->GetGCodeDir(), name, info))
+    {
+      json.Add("{\"err\":1}");
+      JsonReport(true, request);
+      return;
+    }
+    json.Add("{\"err\":0,\"size\":");
+    json.AddUnsigned(info.size);
+    json.Add(",\"height\":");
+    json.AddFixed(info.layerHeight, 2);
+    json.Add(",\"filament\":");
+    json.AddFixed(info.filamentUsed, 1);
+    json.Add(",\"printTime\":");
+    json.AddUnsigned((unsigned long)info.printTime);
+    json.Add(",\"generatedBy\":\"");
+    json.AddEscaped(info.generatedBy, 3);
+    json.Add("\"}");
+    JsonReport(true, request);
+    return;
+  }
+
   if(StringStartsWith(request, "name"))
   {
-    strncpy(jsonResponse, "{\"myName\":\"", STRING_LENGTH);
-    strncat(jsonResponse, myName, STRING_LENGTH);
-    strncat(jsonResponse, "\"}", STRING_LENGTH);
+    json.Add("{\"myName\":");
+    json.Add(nameJson);
+    json.Add('}');
     JsonReport(true, request);
     return;
   }
@@ -591,30 +833,23 @@ void Webserver::GetJsonResponse(const char* request)
   if(StringStartsWith(request, "password"))
   {
     CheckPassword();
-    strncpy(jsonResponse, "{\"password\":\"", STRING_LENGTH);
-    if(gotPassword)
-      strncat(jsonResponse, "right", STRING_LENGTH);
-    else
-      strncat(jsonResponse, "wrong", STRING_LENGTH);
-    strncat(jsonResponse, "\"}", STRING_LENGTH);
+    json.Add("{\"password\":\"");
+    json.Add(gotPassword ? "right" : "wrong");
+    json.Add("\"}");
     JsonReport(true, request);
     return;
   }
   
   if(StringStartsWith(request, "axes"))
   {
-    strncpy(jsonResponse, "{\"axes\":[", STRING_LENGTH);
+    json.Add("{\"axes\":[");
     for(int8_t drive = 0; drive < AXES; drive++)
     {
-      strncat(jsonResponse, "\"", STRING_LENGTH);
-      snprintf(scratchString, STRING_LENGTH, "%.2f", platform->AxisLength(drive));
-      strncat(jsonResponse, scratchString, STRING_LENGTH);
-      if(drive < AXES-1)
-        strncat(jsonResponse, "\",", STRING_LENGTH);
-      else
-        strncat(jsonResponse, "\"", STRING_LENGTH);
+      json.Add('"');
+      json.AddFixed(platform->AxisLength(drive), 2);
+      json.Add(drive < AXES-1 ? "\"," : "\"");
     }
-    strncat(jsonResponse, "]}", STRING_LENGTH);
+    json.Add("]}");
     JsonReport(true, request);
     return;
   }
@@ -622,6 +857,319 @@ void Webserver::GetJsonResponse(const char* request)
   JsonReport(false, request);
 }
 
+// The status report for the web interface.  The full one is a positional list followed by named
+// values.  The delta one just has the named groups that have changed since the client's last
+// one, plus "st" for the client to send back next time.  Changes are spotted by comparing a
+// signature of each group's values, at the resolution they are reported to, with last time's.
+
+void Webserver::GetPollResponse(bool delta, uint32_t since)
+{
+	float fractionPrinted = reprap.GetGCodes()->FractionOfFilePrinted();
+	float liveCoordinates[DRIVES+1];
+	reprap.GetMove()->LiveCoordinates(liveCoordinates);
+	unsigned int bufferSpace = GetReportedGcodeBufferSpace();
+	unsigned char activeHeaterBits = 0;
+	for(int8_t heater = 0; heater < HEATERS; heater++)
+		if(!reprap.GetHeat()->SwitchedOff(heater))
+			activeHeaterBits |= 1 << heater;
+	unsigned char homedBits = 0;
+	for(int8_t axis = 0; axis < AXES; axis++)
+		if(reprap.GetGCodes()->GetAxisHasBeenHomed(axis))
+			homedBits |= 1 << axis;
+
+	uint32_t signature[POLL_GROUPS];
+	signature[pollStatus] = (fractionPrinted >= 0.0);
+	signature[pollPosition] = 0;
+	for(int8_t drive = 0; drive < AXES; drive++)
+		signature[pollPosition] = signature[pollPosition]*31 + (int32_t)lrintf(liveCoordinates[drive]*100.0);
+	signature[pollPosition] = signature[pollPosition]*31 + (int32_t)lrintf(liveCoordinates[AXES]*10000.0);
+	signature[pollTemperatures] = 0;
+	for(int8_t heater = 0; heater < HEATERS; heater++)
+		signature[pollTemperatures] = signature[pollTemperatures]*31 + (int32_t)lrintf(reprap.GetHeat()->GetTemperature(heater)*10.0);
+	signature[pollProbe] = platform->ZProbe()*31 + platform->ZProbeOnVal();
+	signature[pollBuffer] = bufferSpace;
+	signature[pollHomed] = homedBits;
+	signature[pollFraction] = (fractionPrinted > 0.0) ? (uint32_t)lrintf(fractionPrinted*10000.0) : 0;
+	signature[pollName] = 0;
+	for(const char* n = myName; *n; n++)
+		signature[pollName] = signature[pollName]*31 + *n;
+	signature[pollActive] = activeHeaterBits;
+
+	if(since > pollSeq)
+		since = 0;	// We must have restarted since the client's last poll
+
+	bool changed = false;
+	for(int8_t group = 0; group < POLL_GROUPS; group++)
+	{
+		if(!pollSignaturesValid || signature[group] != pollSignature[group])
+		{
+			if(!changed)
+				pollSeq++;
+			changed = true;
+			pollSignature[group] = signature[group];
+			pollChanged[group] = pollSeq;
+		}
+	}
+	pollSignaturesValid = true;
+
+	if(delta)
+	{
+		// Only the groups that changed after the client's last poll
+
+		json.Add("{\"st\":");
+		json.AddUnsigned(pollSeq);
+		json.Add(",\"seq\":");
+		json.AddUnsigned(seq);
+		if(pollChanged[pollStatus] > since)
+			json.Add((fractionPrinted >= 0.0) ? ",\"status\":\"P\"" : ",\"status\":\"I\"");
+		if(pollChanged[pollPosition] > since)
+		{
+			json.Add(",\"pos\":[");
+			for(int8_t drive = 0; drive < AXES; drive++)
+			{
+				json.Add('"');
+				json.AddFixed(liveCoordinates[drive], 2);
+				json.Add("\",");
+			}
+			json.Add('"');
+			json.AddFixed(liveCoordinates[AXES], 4);
+			json.Add("\"]");
+		}
+		if(pollChanged[pollTemperatures] > since)
+		{
+			json.Add(",\"heaters\":[");
+			for(int8_t heater = 0; heater < HEATERS; heater++)
+			{
+				json.Add('"');
+				json.AddFixed(reprap.GetHeat()->GetTemperature(heater), 1);
+				json.Add(heater < HEATERS - 1 ? "\"," : "\"");
+			}
+			json.Add(']');
+		}
+	} else
+	{
+		json.Add((fractionPrinted >= 0.0) ? "{\"poll\":[\"P\"," : "{\"poll\":[\"I\","); // Printing or idle
+		for(int8_t drive = 0; drive < AXES; drive++)
+		{
+			json.Add('"');
+			json.AddFixed(liveCoordinates[drive], 2);
+			json.Add("\",");
+		}
+
+		// FIXME: should loop through all Es
+
+		json.Add('"');
+		json.AddFixed(liveCoordinates[AXES], 4);
+		json.Add("\",");
+
+		for(int8_t heater = 0; heater < HEATERS; heater++)
+		{
+			json.Add('"');
+			json.AddFixed(reprap.GetHeat()->GetTemperature(heater), 1);
+			json.Add(heater < HEATERS - 1 ? "\"," : "\"");
+		}
+		json.Add(']');
+	}
+
+	// Send the Z probe value
+
+	if(!delta || pollChanged[pollProbe] > since)
+	{
+		json.Add(",\"probe\":\"");
+		json.AddInt(platform->ZProbe());
+		if (platform->GetZProbeType() >= 2)
+		{
+			json.Add(" (");
+			json.AddInt(platform->ZProbeOnVal());
+			json.Add(')');
+		}
+		json.Add('"');
+	}
+
+	// Send the amount of buffer space available for gcodes
+
+	if(!delta || pollChanged[pollBuffer] > since)
+	{
+		json.Add(",\"buff\":");
+		json.AddUnsigned(bufferSpace);
+	}
+
+	// Send the home state. To keep the messages short, we send 1 for homed and 0 for not homed, instead of true and false.
+
+	if(!delta || pollChanged[pollHomed] > since)
+	{
+		json.Add((homedBits & (1 << X_AXIS)) ? ",\"hx\":1" : ",\"hx\":0");
+		json.Add((homedBits & (1 << Y_AXIS)) ? ",\"hy\":1" : ",\"hy\":0");
+		json.Add((homedBits & (1 << Z_AXIS)) ? ",\"hz\":1" : ",\"hz\":0");
+	}
+
+	// Send the fraction printed
+
+	if(!delta || pollChanged[pollFraction] > since)
+	{
+		json.Add(",\"fraction_printed\":");
+		json.AddFixed((fractionPrinted > 0.0) ? fractionPrinted : 0.0, 4);
+	}
+
+	// Send the name
+
+	if(!delta || pollChanged[pollName] > since)
+	{
+		json.Add(",\"reprap_name\":");
+		json.Add(nameJson);
+	}
+
+	// Send the response sequence number
+
+	if(!delta)
+	{
+		json.Add(",\"seq\":");
+		json.AddUnsigned(seq);
+	}
+
+	// Send the list of active heaters
+
+	if(!delta || pollChanged[pollActive] > since)
+	{
+		json.Add(",\"act\":");
+		json.AddUnsigned(activeHeaterBits);
+	}
+
+	// Send the response to the last command. Do this last because it is long and may need to be truncated.
+	// A delta poll only sends one if there is one.
+
+	if(!delta || gcodeReply[0])
+	{
+		json.Add(",\"resp\":\"");
+		json.AddEscaped(gcodeReply, 2);	// leave room for the final '"}'
+		json.Add('"');
+	}
+	json.Add('}');
+
+	gcodeReply[0] = 0; // Last one's been copied to jsonResponse; so set up for the next
+}
+
+//******************************************************************************************
+
+// JSON writing
+
+void JsonWriter::Init(char* b, int len)
+{
+	buffer = b;
+	length = len;
+	pointer = 0;
+	buffer[0] = 0;
+}
+
+void JsonWriter::Add(const char* s)
+{
+	while(*s && pointer < length)
+		buffer[pointer++] = *s++;
+	buffer[pointer] = 0;
+}
+
+void JsonWriter::Add(char c)
+{
+	if(pointer < length)
+		buffer[pointer++] = c;
+	buffer[pointer] = 0;
+}
+
+void JsonWriter::AddEscaped(const char* s, int reserve)
+{
+	while (*s != 0 && pointer < length - reserve)
+	{
+		char c = *s++;
+		char esc;
+		switch(c)
+		{
+		case '\r':
+			esc = 'r'; break;
+		case '\n':
+			esc = 'n'; break;
+		case '\t':
+			esc = 't'; break;
+		case '"':
+			esc = '"'; break;
+		case '\\':
+			esc = '\\'; break;
+		default:
+			esc = 0; break;
+		}
+		if (esc)
+		{
+			if (pointer >= length - reserve - 1)
+				break;
+			buffer[pointer++] = '\\';
+			buffer[pointer++] = esc;
+		}
+		else
+		{
+			buffer[pointer++] = c;
+		}
+	}
+	buffer[pointer] = 0;
+}
+
+void JsonWriter::AddUnsigned(unsigned long u)
+{
+	char digits[12];
+	int8_t n = 0;
+	do
+	{
+		digits[n++] = '0' + u%10;
+		u /= 10;
+	} while(u);
+	while(n > 0 && pointer < length)
+		buffer[pointer++] = digits[--n];
+	buffer[pointer] = 0;
+}
+
+void JsonWriter::AddInt(long i)
+{
+	if(i < 0)
+	{
+		Add('-');
+		AddUnsigned(-(unsigned long)i);
+	} else
+		AddUnsigned(i);
+}
+
+// Round to the given number of decimal places (0 to 4) and write the result as
+// integer and fraction parts.  Values too big for that go through snprintf.
+
+void JsonWriter::AddFixed(float f, int8_t decimals)
+{
+	static const uint32_t scales[] = { 1, 10, 100, 1000, 10000 };
+	uint32_t scale = scales[decimals];
+	float scaled = fabs(f)*scale + 0.5;
+	if(scaled >= 4.0e9)
+	{
+		char s[SHORT_STRING_LENGTH];
+		snprintf(s, SHORT_STRING_LENGTH, "%.*f", decimals, f);
+		Add(s);
+		return;
+	}
+	uint32_t u = (uint32_t)scaled;
+	if(f < 0.0 && u != 0)
+		Add('-');
+	AddUnsigned(u/scale);
+	if(decimals == 0)
+		return;
+	Add('.');
+	uint32_t fraction = u%scale;
+	for(scale /= 10; scale > 0; scale /= 10)
+	{
+		Add((char)('0' + fraction/scale));
+		fraction %= scale;
+	}
+}
+
+int JsonWriter::Length() const
+{
+	return pointer;
+}
+
 /*
 
 Parse a string in clientLine[] from the user's web browser
@@ -672,18 +1220,75 @@ void Webserver::ParseGetPost()
     } 
 }
 
+// The number after key in the request's qualifier, or defaultValue if it isn't there
+
+long Webserver::QualifierValue(const char* key, long defaultValue) const
+{
+  int i = StringContains(clientQualifier, key);
+  return (i < 0) ? defaultValue : strtol(&clientQualifier[i], NULL, 10);
+}
+
 void Webserver::InitialisePost()
 {
   postSeen = false;
   receivingPost = false;
-  boundaryCount = 0; 
+  if(uploadState != notUploading)
+    return;		// The upload still needs the rest
+  boundaryLength = 0;
   postBoundary[0] = 0;
-  postFileName[0] = 0;
   postFile = NULL;
+  postLength = 0;
+  postBodyRead = 0;
+}
+
+// Answer a POST without reading its body, and close the connection as the body won't be read
+
+void Webserver::RejectPost()
+{
+  keepAlive = false;
+  SendFile(clientRequest);
+  clientRequest[0] = 0;
+  InitialisePost();
 }
 
 void Webserver::ParseClientLine()
 { 
+  // HTTP/1.1 connections persist unless the client says otherwise; HTTP/1.0 ones
+  // only if the client asks.
+
+  if(StringStartsWith(clientLine, "GET") || StringStartsWith(clientLine, "POST"))
+  {
+	keepAlive = !StringEndsWith(clientLine, "HTTP/1.0");
+	clientETag[0] = 0;
+	clientModifiedSince[0] = 0;
+  }
+  else if(StringStartsWith(clientLine, "If-None-Match: "))
+  {
+	strncpy(clientETag, &clientLine[15], SHORT_STRING_LENGTH);
+	clientETag[SHORT_STRING_LENGTH] = 0;
+	return;
+  }
+  else if(StringStartsWith(clientLine, "If-Modified-Since: "))
+  {
+	strncpy(clientModifiedSince, &clientLine[19], SHORT_STRING_LENGTH);
+	clientModifiedSince[SHORT_STRING_LENGTH] = 0;
+	return;
+  }
+  else if(StringStartsWith(clientLine, "Content-Length:"))
+  {
+	if(postSeen)
+	  postLength = atol(&clientLine[15]);
+	return;
+  }
+  else if(StringStartsWith(clientLine, "Connection:"))
+  {
+	if(StringContains(clientLine, "close") >= 0)
+	  keepAlive = false;
+	else if(StringContains(clientLine, "keep-alive") >= 0 || StringContains(clientLine, "Keep-Alive") >= 0)
+	  keepAlive = true;
+	return;
+  }
+
   if(StringStartsWith(clientLine, "GET"))
   {
     ParseGetPost();
@@ -697,11 +1302,22 @@ void Webserver::ParseClientLine()
   if(StringStartsWith(clientLine, "POST"))
   {
     ParseGetPost();
+    if(!clientRequest[0])
+      strncpy(clientRequest, INDEX_PAGE, STRING_LENGTH);
+    if(uploadState != notUploading)
+    {
+      // One upload at a time; answer this like a GET and close the connection on its body
+
+      platform->Message(HOST_MESSAGE, "Upload refused; there is one in progress.\n");
+      keepAlive = false;
+      postSeen = false;
+      getSeen = true;
+      return;
+    }
     InitialisePost();
+    postFileName[0] = 0;
     postSeen = true;
     getSeen = false;
-    if(!clientRequest[0])
-      strncpy(clientRequest, INDEX_PAGE, STRING_LENGTH);
     return;
   }
   
@@ -709,15 +1325,13 @@ void Webserver::ParseClientLine()
   
   if(postSeen && ( (bnd = StringContains(clientLine, "boundary=")) >= 0) )
   {
-    if(strlen(&clientLine[bnd]) >= POST_LENGTH - 4)
+    if(strlen(&clientLine[bnd]) > BOUNDARY_LENGTH - 4)
     {
       platform->Message(HOST_MESSAGE, "Post boundary buffer overflow.\n");
       return;
     }
-    postBoundary[0] = '-';
-    postBoundary[1] = '-';
-    strncpy(&postBoundary[2], &clientLine[bnd], POST_LENGTH - 3);
-    strncat(postBoundary, "--", POST_LENGTH);
+    strcpy(postBoundary, "\r\n--");
+    strcat(postBoundary, &clientLine[bnd]);
     //Serial.print("Got boundary: ");
     //Serial.println(postBoundary);
     return;
@@ -759,38 +1373,50 @@ void Webserver::BlankLineFromClient()
   
   //Serial.println("End of header.");
   
-  // Soak up any rubbish on the end.
-
-  char c;
-  while(platform->GetNetwork()->Read(c));
-
+  // A GET has no body, so anything after it is the next request on
+  // the connection.  Leave that to be read once this one is answered.
 
   if(getSeen)
   {
     SendFile(clientRequest);
     clientRequest[0] = 0;
+    getSeen = false;
     return;
   }
-  
+
+  // For a POST the body follows, perhaps in the same block.  There must be room for it
+  // all on the card, which is checked now rather than finding out part way through.
+
   if(postSeen)
   {
     receivingPost = true;
     postSeen = false;
+    postBodyRead = 0;
+    if(postLength > 0 && platform->GetMassStorage()->FreeSpace() < (uint64_t)postLength)
+    {
+      platform->Message(HOST_MESSAGE, "Not enough room on the SD card for the upload.\n");
+      RejectPost();
+    }
     return;
   }
   
+  // The end of the part headers; the file comes next
+
   if(receivingPost)
   {
-    postFile = platform->GetFileStore(platform->GetGCodeDir(), postFileName, true);
+    postFile = platform->GetFileStore(platform->GetGCodeDir(), postFileName, true, uploadFile);
     if(postFile == NULL  || !postBoundary[0])
     {
       platform->Message(HOST_MESSAGE, "Can't open file for write or no post boundary: ");
       platform->Message(HOST_MESSAGE, postFileName);
       platform->Message(HOST_MESSAGE, "\n");
-      InitialisePost();
       if(postFile != NULL)
         postFile->Close();
+      postFile = NULL;
+      RejectPost();
+      return;
     }
+    StartUpload();
   }
 }
 
@@ -839,6 +1465,9 @@ void Webserver::Spin()
 {
   if(!active)
     return;
+
+  if(uploadState != notUploading)
+	  ReceiveUpload();
     
   if(writing)
   {
@@ -849,7 +1478,9 @@ void Webserver::Spin()
 	  }
   }
   
-  if(platform->GetNetwork()->Active())
+  // Don't start on the next request until this one has been answered
+
+  if(platform->GetNetwork()->Active() && !writing && !needToCloseClient)
   {
 	  for(uint8_t i = 0;
 		   i < 16 && (platform->GetNetwork()->Status() & (clientConnected | byteAvailable)) == (clientConnected | byteAvailable);
@@ -859,19 +1490,8 @@ void Webserver::Spin()
 		  platform->GetNetwork()->Read(c);
 		  //SerialUSB.print(c);
 
-		  if(receivingPost && postFile != NULL)
-		  {
-			  if(MatchBoundary(c))
-			  {
-				  //Serial.println("Got to end of file.");
-				  postFile->Close();
-				  SendFile(clientRequest);
-				  clientRequest[0] = 0;
-				  InitialisePost();
-			  }
-			  platform->ClassReport("Webserver", longWait);
-			  return;
-		  }
+		  if(receivingPost)
+			  postBodyRead++;	// The part headers count towards the Content-Length
 
 		  if (CharFromClient(c))
 			  break;	// break if we did more than just store the character
@@ -908,9 +1528,18 @@ Webserver::Webserver(Platform* p)
 void Webserver::Init()
 {
   writing = false;
+  clientETag[0] = 0;
+  clientModifiedSince[0] = 0;
+  keepAlive = false;
+  fileBeingSent = NULL;
   receivingPost = false;
   postSeen = false;
   getSeen = false;
+  uploadState = notUploading;
+  uploadBytes = 0;
+  uploadStartTime = uploadEndTime = 0.0;
+  postKeepAlive = false;
+  postFileName[0] = 0;
   jsonPointer = -1;
   clientLineIsBlank = true;
   needToCloseClient = false;
@@ -927,6 +1556,8 @@ void Webserver::Init()
   active = true;
   gcodeReply[0] = 0;
   seq = 0;
+  pollSeq = 0;
+  pollSignaturesValid = false;
   webDebug = false;
 }
 
@@ -934,7 +1565,11 @@ void Webserver::Init()
 // In particular, we must cancel any pending writes.
 void Webserver::ConnectionError()
 {
+	  if(writing && jsonPointer < 0 && fileBeingSent != NULL)
+		  fileBeingSent->Close();
+	  fileBeingSent = NULL;
 	  writing = false;
+	  keepAlive = false;
 	  receivingPost = false;
 	  postSeen = false;
 	  getSeen = false;
@@ -974,6 +1609,14 @@ void Webserver::SetName(const char* nm)
 {
 	strncpy(myName, nm, SHORT_STRING_LENGTH);
 	myName[SHORT_STRING_LENGTH] = 0; // NB array is dimensioned to SHORT_STRING_LENGTH+1
+
+	// It is in every poll, so keep it ready escaped for JSON
+
+	JsonWriter nameWriter;
+	nameWriter.Init(nameJson, NAME_JSON_LENGTH);
+	nameWriter.Add('"');
+	nameWriter.AddEscaped(myName, 1);
+	nameWriter.Add('"');
 }
 
 const char* Webserver::GetName() const
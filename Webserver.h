@@ -34,11 +34,60 @@ Licence: GPL
 #define KO_START "rr_"
 #define KO_FIRST 3
 #define POST_LENGTH				(1300)			// max amount of POST data we can accept
+#define BOUNDARY_LENGTH 80						// Longest multipart boundary, with the CR LF -- in front; RFC 2046 allows 70
+#define UPLOAD_BLOCKS_PER_SPIN 4				// How many blocks of an upload are dealt with in each Spin()
+
+enum UploadState
+{
+  notUploading = 0,
+  uploadingData = 1,							// Writing the file
+  uploadingTrailer = 2,							// Soaking up what comes after the file
+  uploadAwaitingReply = 3						// Waiting to answer the upload's request
+};
+
+#define POLL_GROUPS 9							// Groups of values in a poll response that are tracked for changes
+
+enum PollGroup
+{
+  pollStatus = 0,
+  pollPosition = 1,
+  pollTemperatures = 2,
+  pollProbe = 3,
+  pollBuffer = 4,
+  pollHomed = 5,
+  pollFraction = 6,
+  pollName = 7,
+  pollActive = 8
+};
+#define GZ_NAME_LENGTH 64						// Longest name of a web file that is looked for with .gz on the end
+#define NAME_JSON_LENGTH (2*SHORT_STRING_LENGTH + 3)	// The machine name escaped and quoted
 
 const unsigned int gcodeBufLength = 2048;		// size of our gcode ring buffer, ideally a power of 2
 const unsigned int minReportedFreeBuf = 100;	// the minimum free buffer we report if not zero
 const unsigned int maxReportedFreeBuf = 900;	// the max we own up to having free, to avoid overlong messages
 
+// Builds a JSON response in a fixed buffer.  Everything is appended at a cursor, so
+// the string never has to be searched for its end, and numbers are formatted in
+// fixed point rather than with printf.  Anything that won't fit is dropped.
+
+class JsonWriter
+{
+  public:
+    void Init(char* b, int len);						// Start writing in b, which holds len characters plus a terminator
+    void Add(const char* s);							// Append a string as it is
+    void Add(char c);									// Append a character
+    void AddEscaped(const char* s, int reserve);		// Append a string with JSON escapes, leaving reserve characters free
+    void AddUnsigned(unsigned long u);					// Append an unsigned integer
+    void AddInt(long i);								// Append a signed integer
+    void AddFixed(float f, int8_t decimals);			// Append f to a fixed number of decimal places
+    int Length() const;									// How much has been written
+
+  private:
+    char* buffer;
+    int length;
+    int pointer;
+};
+
 class Webserver
 {   
   public:
@@ -46,6 +95,8 @@ class Webserver
     Webserver(Platform* p);
     bool GCodeAvailable();
     byte ReadGCode();
+    unsigned int ReadGCodeBlock(const char*& data);	// Point to the G Code characters that are contiguous in the buffer; return how many
+    void ConsumeGCode(unsigned int n);				// Mark the first n characters from ReadGCodeBlock() as read
     bool WebserverIsWriting();
     void Init();
     void Spin();
@@ -69,6 +120,7 @@ class Webserver
   
     void ParseClientLine();
     void SendFile(const char* nameOfFileToSend);
+    void HttpDate(uint32_t timeStamp, char* s);	// Format a FAT time stamp for HTTP headers
     bool WriteBytes();
     void ParseQualifier();
     void CheckPassword();
@@ -79,11 +131,19 @@ class Webserver
     void GetGCodeList();
     void GetJsonResponse(const char* request);
     void ParseGetPost();
+    long QualifierValue(const char* key, long defaultValue) const;
     bool CharFromClient(char c);
     void BlankLineFromClient();
     void InitialisePost();
-    bool MatchBoundary(char c);
+    void RejectPost();
+    void StartUpload();
+    void ReceiveUpload();
+    int UploadBlock(const char* data, int length);
+    int FindBoundary(const char* data, int length) const;
+    void WriteUpload(const char* data, int length);
+    void EndUpload();
     void JsonReport(bool ok, const char* request);
+    void GetPollResponse(bool delta, uint32_t since);	// Status for the web interface; if delta only what has changed
     unsigned int GetGcodeBufferSpace() const;
     unsigned int GetReportedGcodeBufferSpace() const;
     void ProcessGcode(const char* gc);
@@ -94,12 +154,24 @@ class Webserver
     float longWait;
     FileStore* fileBeingSent;
     bool writing;
+    bool keepAlive;								// Keep the connection open after this response?
     bool receivingPost;
-    char postBoundary[POST_LENGTH];
-    int boundaryCount;  
+    char postBoundary[BOUNDARY_LENGTH+1];
+    int boundaryLength;
+    uint8_t boundarySkip[256];					// Boyer-Moore-Horspool shifts for postBoundary
+    char postCarry[2*BOUNDARY_LENGTH];			// The end of the last block, which may hold the start of the boundary
+    int postCarryLength;
     char postFileName[POST_LENGTH];
+    char postRequest[STRING_LENGTH];			// What to send back when the upload is done
     FileStore* postFile;
     bool postSeen;
+    long postLength;							// The POST's Content-Length, or 0 if not given...
+    long postBodyRead;							// ...and how much of it has been read
+    bool postKeepAlive;							// The POST's keepAlive, for when it is answered
+    UploadState uploadState;
+    unsigned long uploadBytes;					// How much of the file has been written
+    float uploadStartTime;
+    float uploadEndTime;
     bool getSeen;
     bool clientLineIsBlank;
     float clientCloseTime;
@@ -108,6 +180,8 @@ class Webserver
     char clientLine[STRING_LENGTH+2];	// 2 chars extra so we can append \n\0
     char clientRequest[STRING_LENGTH];
     char clientQualifier[STRING_LENGTH];
+    char clientETag[SHORT_STRING_LENGTH+1];		// The request's If-None-Match...
+    char clientModifiedSince[SHORT_STRING_LENGTH+1];	// ...and If-Modified-Since, if any
     char jsonResponse[STRING_LENGTH+1];
     char gcodeBuffer[gcodeBufLength];
     unsigned int gcodeReadIndex, gcodeWriteIndex;		// head and tail indices into gcodeBuffer
@@ -116,6 +190,12 @@ class Webserver
     bool gotPassword;
     char password[SHORT_STRING_LENGTH+1];
     char myName[SHORT_STRING_LENGTH+1];
+    char nameJson[NAME_JSON_LENGTH+1];					// Cached JSON string of myName
+    JsonWriter json;									// Writes into jsonResponse
+    uint32_t pollSignature[POLL_GROUPS];				// What each group of poll values was last time...
+    uint32_t pollChanged[POLL_GROUPS];					// ...and the value of pollSeq when it last changed
+    uint32_t pollSeq;									// Counts polls at which something changed
+    bool pollSignaturesValid;							// False until the first poll
     char gcodeReply[STRING_LENGTH+1];
     uint16_t seq;	// reply sequence number, so that the client can tell if a reply is new or not
     bool webDebug;
@@ -70,12 +70,11 @@ struct http_state {
 // Prototypes for the RepRap functions in Platform.cpp that we
 // need to call.
 
-void RepRapNetworkReceiveInput(char* ip, int length, void* pbuf, void* pcb, void* hs);
+bool RepRapNetworkReceiveInput(char* ip, int length, void* pbuf, void* pcb, void* hs);
 void RepRapNetworkInputBufferReleased(void* pbuf);
 void RepRapNetworkConnectionError(void* h);
 void RepRapNetworkMessage(char* s);
 void RepRapNetworkSentPacketAcknowledged();
-bool RepRapNetworkHasALiveClient();
 
 // Sanity check on initialisations.
 
@@ -172,6 +171,12 @@ http_poll(void *arg, struct tcp_pcb *pcb)
   } else {
     ++hs->retries;
     if (hs->retries == 4) {
+      if (hs->left == 0) {
+        // Nothing is going on on this kept-alive connection, so shut it.
+        RepRapNetworkConnectionError(hs);
+        close_conn(pcb, hs);
+        return ERR_OK;
+      }
       tcp_abort(pcb);
       return ERR_ABRT;
     }
@@ -209,6 +214,12 @@ http_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
 }
 /*-----------------------------------------------------------------------------------*/
 
+// RepRap calls this when it has read the data in a pbuf it was given.
+
+void RepRapNetworkReleaseInput(void* pb)
+{
+	pbuf_free((struct pbuf*)pb);
+}
 
 // ReoRap calls this with data to send.
 // A null transmission implies the end of the data to be sent.
@@ -264,19 +275,20 @@ http_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
 
 	if (err == ERR_OK && p != NULL)
 	{
+		// Requests are queued, so more can arrive on a kept-alive connection while we
+		// are still answering earlier ones.  If there is no room, refuse the data so
+		// that TCP offers it again later.
+
+		if (!RepRapNetworkReceiveInput(p->payload, p->len, p, pcb, hs))
+			return ERR_MEM;
+
 		/* Inform TCP that we have taken the data. */
 		tcp_recved(pcb, p->tot_len);
-
-		if (hs->file == NULL)
-		{
-			RepRapNetworkReceiveInput(p->payload, p->len, p, pcb, hs);
-		} else
-		{
-			pbuf_free(p);
-		}
+		hs->retries = 0;
 	}
 
 	if (err == ERR_OK && p == NULL) {
+		RepRapNetworkConnectionError(hs);	// Forget anything queued from this connection
 		close_conn(pcb, hs);
 	}
 	return ERR_OK;
@@ -288,11 +300,8 @@ http_accept(void *arg, struct tcp_pcb *pcb, err_t err)
 {
   struct http_state *hs;
 
-  // This is a bit nasty.  Fake an out of memory error to prevent new page
-  // requests coming in while we are still sending the old ones.
-
-  if(RepRapNetworkHasALiveClient())
-	  return ERR_MEM;
+  // Several connections may be open at once (up to MEMP_NUM_TCP_PCB); their
+  // requests are queued and answered in turn.
 
   LWIP_UNUSED_ARG(arg);
   LWIP_UNUSED_ARG(err);
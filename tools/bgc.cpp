@@ -0,0 +1,716 @@
+/****************************************************************************************************
+
+bgc - make and check binary G Code (.bgc) files for RepRapFirmware
+
+  bgc convert [-c] in.gcode out.bgc   Convert a G Code file; -c puts a checksum on each move
+  bgc check in.gcode in.bgc           Check that the .bgc file moves the machine as the G Code does
+  bgc bench in.gcode                  Compare the sizes of the two, and how quickly each is read
+
+This runs on the host, not the machine.  It uses the firmware's own GCodeFormat.h to read the
+numbers in the G Codes and to write and read the records, so what it checks is what the firmware
+will see.  Build it from this directory with
+
+  g++ -O2 -Wall -I.. -o bgc bgc.cpp
+
+Only absolute (G90), millimetre (G21) G0 and G1 moves with nothing but X, Y, Z, E and F in them
+become binary moves; everything else goes into the file as a text record, and is done by the
+firmware as it would be from a G Code file.  The check follows what the firmware does with each
+G Code that affects moves: G0/G1, G20/G21, G28, G90/G91, G92 and M82/M83.  It keeps a single
+extruder position, which is enough for the sliced files it is meant for.
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "GCodeFormat.h"
+
+#define LINE_LENGTH 100 // As GCODE_LENGTH in the firmware
+
+static const char fieldLetters[BGC_FIELDS] = { 'X', 'Y', 'Z', 'E', 'F' };
+
+// Copy the G Code in a line of a file to g, leaving out the comment, any line number and
+// checksum, and leading and trailing spaces.  Return false if it is too long.
+
+static bool CleanLine(const char* line, int length, char g[LINE_LENGTH])
+{
+	int n = 0;
+	for(int i = 0; i < length && line[i] != ';' && line[i] != '\n'; i++)
+	{
+		if(line[i] == '\r' || (n == 0 && (line[i] == ' ' || line[i] == '\t')))
+			continue;
+		if(n >= LINE_LENGTH - 1)
+			return false;
+		g[n++] = line[i];
+	}
+	while(n > 0 && (g[n - 1] == ' ' || g[n - 1] == '\t'))
+		n--;
+	g[n] = 0;
+	if(g[0] == 'N' && strchr(g, '*'))
+	{
+		*strchr(g, '*') = 0;
+		char* s = strchr(g, ' ');
+		if(s == NULL)
+			g[0] = 0;
+		else
+			memmove(g, s + 1, strlen(s));
+	}
+	return true;
+}
+
+// A G Code, indexed as GCodeBuffer does it
+
+class GCode
+{
+public:
+	GCode(const char* s) : text(s) { IndexGCodeLetters(s, index); }
+	bool Seen(char c) const { return index[c - 'A'] != NO_LETTER; }
+	float Value(char c) const { return ReadGCodeFloat(&text[index[c - 'A'] + 1]); }
+	long IValue(char c) const { return strtol(&text[index[c - 'A'] + 1], NULL, 10); }
+	bool Is(char c, long n) const { return Seen(c) && IValue(c) == n; }
+	const char* text;
+	uint8_t index[GCODE_LETTERS];
+};
+
+// Where a move leaves the machine
+
+struct MoveEnd
+{
+	float position[3];
+	float e;		// This move's own extrusion
+	float feedRate;	// mm/s
+	bool binary;
+};
+
+// What the firmware's GCodes class keeps that affects the moves
+
+class Machine
+{
+public:
+	Machine();
+	bool Text(const GCode& g, MoveEnd& m);								// Act on a G Code; true if it is a move
+	void Binary(uint8_t mask, const int32_t value[BGC_FIELDS], MoveEnd& m);	// Act on a binary move
+	float position[3];
+	float lastE;
+	float feedRate;
+	float distanceScale;
+	bool axesRelative;
+	bool drivesRelative;
+};
+
+Machine::Machine()
+{
+	for(int i = 0; i < 3; i++)
+		position[i] = 0.0;
+	lastE = 0.0;
+	feedRate = 0.0;
+	distanceScale = 1.0;
+	axesRelative = false;
+	drivesRelative = true;
+}
+
+bool Machine::Text(const GCode& g, MoveEnd& m)
+{
+	if(g.Seen('G'))
+	{
+		switch(g.IValue('G'))
+		{
+		case 0:
+		case 1:
+			m.e = 0.0;
+			if(g.Seen('E'))
+			{
+				if(drivesRelative)
+					m.e = g.Value('E')*distanceScale;
+				else
+				{
+					float absE = g.Value('E')*distanceScale;
+					m.e = absE - lastE;
+					lastE = absE;
+				}
+			}
+			for(int axis = 0; axis < 3; axis++)
+			{
+				if(g.Seen(fieldLetters[axis]))
+				{
+					float moveArg = g.Value(fieldLetters[axis])*distanceScale;
+					if(axesRelative)
+						moveArg += position[axis];
+					position[axis] = moveArg;
+				}
+			}
+			if(g.Seen('F'))
+				feedRate = g.Value('F')*distanceScale*0.016666667;
+			for(int axis = 0; axis < 3; axis++)
+				m.position[axis] = position[axis];
+			m.feedRate = feedRate;
+			m.binary = false;
+			return true;
+
+		case 20:
+			distanceScale = 25.4;
+			break;
+
+		case 21:
+			distanceScale = 1.0;
+			break;
+
+		case 28:
+			for(int axis = 0; axis < 3; axis++)
+				if(g.Seen(fieldLetters[axis]) || !(g.Seen('X') || g.Seen('Y') || g.Seen('Z')))
+					position[axis] = 0.0;
+			break;
+
+		case 90:
+			axesRelative = false;
+			break;
+
+		case 91:
+			axesRelative = true;
+			break;
+
+		case 92:
+			if(g.Seen('E'))
+				lastE = g.Value('E')*distanceScale;
+			for(int axis = 0; axis < 3; axis++)
+				if(g.Seen(fieldLetters[axis]))
+					position[axis] = g.Value(fieldLetters[axis])*distanceScale;
+			break;
+		}
+	} else if(g.Is('M', 82) || g.Is('M', 83))
+	{
+		drivesRelative = g.Is('M', 83);
+		lastE = 0.0;
+	}
+	return false;
+}
+
+// As GCodes::DoBinaryMove(): fields not in the mask keep their values, and the move doesn't
+// change lastE
+
+void Machine::Binary(uint8_t mask, const int32_t value[BGC_FIELDS], MoveEnd& m)
+{
+	for(int axis = 0; axis < 3; axis++)
+		if(mask & (1 << axis))
+			position[axis] = value[axis]*BGC_RESOLUTION;
+	if(mask & (1 << BGC_F_FIELD))
+		feedRate = value[BGC_F_FIELD]*BGC_RESOLUTION*0.016666667;
+	m.e = (mask & (1 << BGC_E_FIELD)) ? value[BGC_E_FIELD]*BGC_RESOLUTION : 0.0;
+	for(int axis = 0; axis < 3; axis++)
+		m.position[axis] = position[axis];
+	m.feedRate = feedRate;
+	m.binary = true;
+}
+
+//*************************************************************************************************
+
+static bool ReadFile(const char* name, std::vector<char>& data)
+{
+	FILE* f = fopen(name, "rb");
+	if(f == NULL)
+	{
+		fprintf(stderr, "bgc: can't open %s\n", name);
+		return false;
+	}
+	char block[65536];
+	size_t n;
+	while((n = fread(block, 1, sizeof(block), f)) > 0)
+		data.insert(data.end(), block, block + n);
+	fclose(f);
+	return true;
+}
+
+// Call act() with each G Code in a text file.  Lines too long for the firmware are reported.
+
+template<class Act> static bool ForEachLine(const std::vector<char>& data, Act act)
+{
+	size_t start = 0;
+	int lineNumber = 0;
+	while(start < data.size())
+	{
+		size_t end = start;
+		while(end < data.size() && data[end] != '\n')
+			end++;
+		lineNumber++;
+		char g[LINE_LENGTH];
+		if(!CleanLine(&data[start], end - start, g))
+		{
+			fprintf(stderr, "bgc: line %d is longer than the firmware can take\n", lineNumber);
+			return false;
+		}
+		if(g[0])
+			act(g);
+		start = end + 1;
+	}
+	return true;
+}
+
+//*************************************************************************************************
+
+// Turn G Code into .bgc records
+
+class Converter
+{
+public:
+	Converter(bool checksums);
+	void Put(const char* g);
+	std::vector<uint8_t> out;
+	long binaryMoves;
+	long textRecords;
+
+private:
+	bool CanBeBinary(const GCode& g) const;
+	void PutText(const char* g);
+	void PutMove(const GCode& g);
+	Machine source;			// What the G Code file does
+	bool checksums;
+	int32_t encoded[BGC_FIELDS];	// The last value written for each field
+	double eWanted;			// The sum of all the extrusion the binary moves should do...
+	int64_t eWritten;		// ...and of what they have done, in BGC_RESOLUTION units
+	bool eStale;			// A binary move has extruded since the firmware last set its absolute E
+	bool eKnown;			// The absolute E the file is using is lastE
+};
+
+Converter::Converter(bool c)
+{
+	checksums = c;
+	out.insert(out.end(), BGC_MAGIC, BGC_MAGIC + strlen(BGC_MAGIC));
+	out.push_back(BGC_VERSION);
+	out.push_back(checksums ? BGC_CHECKSUMS : 0);
+	for(int field = 0; field < BGC_FIELDS; field++)
+		encoded[field] = 0;
+	eWanted = 0.0;
+	eWritten = 0;
+	eStale = false;
+	eKnown = true;
+	binaryMoves = 0;
+	textRecords = 0;
+}
+
+// A G0 or G1 with only X, Y, Z, E and F, each once with a plain number, in absolute
+// millimetres.  With absolute E the position it is measured from must be known.
+
+bool Converter::CanBeBinary(const GCode& g) const
+{
+	if(!(g.Is('G', 0) || g.Is('G', 1)) || source.axesRelative || source.distanceScale != 1.0)
+		return false;
+	if(g.Seen('E') && !source.drivesRelative && !eKnown)
+		return false;
+	int letters = 0;
+	for(const char* s = g.text; *s; s++)
+	{
+		if(isupper(*s))
+		{
+			if(*s != 'G' && !strchr("XYZEF", *s))
+				return false;
+			if(&g.text[g.index[*s - 'A']] != s)
+				return false;
+			letters++;
+		} else if(!isdigit(*s) && !strchr(".-+ ", *s))
+			return false;
+	}
+	char* end;
+	strtol(&g.text[g.index['G' - 'A'] + 1], &end, 10);
+	return letters > 1 && (*end == ' ' || *end == 0);
+}
+
+void Converter::PutText(const char* g)
+{
+	out.push_back(BGC_GCODE);
+	out.insert(out.end(), g, g + strlen(g));
+	out.push_back('\n');
+	textRecords++;
+}
+
+void Converter::PutMove(const GCode& g)
+{
+	MoveEnd m;
+	source.Text(g, m);
+
+	uint8_t r[BGC_MAX_RECORD];
+	uint8_t mask = 0;
+	int length = 1;
+	for(int field = 0; field < BGC_FIELDS; field++)
+	{
+		if(!g.Seen(fieldLetters[field]))
+			continue;
+		mask |= 1 << field;
+		int32_t value;
+		if(field == BGC_E_FIELD)
+		{
+			eWanted += m.e;
+			value = (int32_t)(llround(eWanted/BGC_RESOLUTION) - eWritten);
+			eWritten += value;
+		} else
+		{
+			value = (int32_t)lround(g.Value(fieldLetters[field])/BGC_RESOLUTION);
+			int32_t delta = value - encoded[field];
+			encoded[field] = value;
+			value = delta;
+		}
+		length += BgcWriteVarint(value, &r[length]);
+	}
+	r[0] = BGC_MOVE | mask;
+	if(checksums)
+	{
+		r[length] = BgcChecksum(r, length);
+		length++;
+	}
+	out.insert(out.end(), r, r + length);
+	if((mask & (1 << BGC_E_FIELD)) && !source.drivesRelative)
+		eStale = true;
+	binaryMoves++;
+}
+
+void Converter::Put(const char* text)
+{
+	GCode g(text);
+	if(CanBeBinary(g))
+	{
+		PutMove(g);
+		return;
+	}
+
+	// Before anything but a move that doesn't extrude, tell the firmware where absolute E is
+
+	if(eStale && !((g.Is('G', 0) || g.Is('G', 1)) && !g.Seen('E')))
+	{
+		char g92[LINE_LENGTH];
+		snprintf(g92, LINE_LENGTH, "G92 E%.5f", source.lastE);
+		PutText(g92);
+		eStale = false;
+	}
+	PutText(text);
+
+	MoveEnd m;
+	source.Text(g, m);
+	if((g.Is('G', 92) && g.Seen('E')) || g.Is('M', 82) || g.Is('M', 83))
+		eKnown = true;
+
+	// These may change the firmware's absolute E in ways not followed here
+
+	if(g.Seen('T') || g.Is('M', 98) || g.Is('M', 120) || g.Is('M', 121) ||
+			g.Is('G', 28) || g.Is('G', 29) || g.Is('G', 32))
+		eKnown = false;
+}
+
+static bool Convert(const std::vector<char>& text, Converter& c)
+{
+	return ForEachLine(text, [&c](const char* g) { c.Put(g); });
+}
+
+//*************************************************************************************************
+
+// The moves that a G Code file makes
+
+static bool TextMoves(const std::vector<char>& text, std::vector<MoveEnd>& moves)
+{
+	Machine machine;
+	return ForEachLine(text, [&](const char* g)
+	{
+		MoveEnd m;
+		if(machine.Text(GCode(g), m))
+			moves.push_back(m);
+	});
+}
+
+// The moves that a .bgc file makes, read as GCodes::DoBinaryFilePrint() does
+
+static bool BinaryMoves(const std::vector<char>& file, std::vector<MoveEnd>& moves, long& textRecords)
+{
+	const uint8_t* data = (const uint8_t*)&file[0];
+	long size = file.size();
+	if(size < BGC_HEADER_LENGTH || memcmp(data, BGC_MAGIC, strlen(BGC_MAGIC)) || data[3] != BGC_VERSION)
+	{
+		fprintf(stderr, "bgc: not a version %d .bgc file\n", BGC_VERSION);
+		return false;
+	}
+	bool checksums = (data[4] & BGC_CHECKSUMS) != 0;
+	Machine machine;
+	int32_t value[BGC_FIELDS] = { 0, 0, 0, 0, 0 };
+	textRecords = 0;
+	long i = BGC_HEADER_LENGTH;
+	while(i < size)
+	{
+		const uint8_t* r = &data[i];
+		int length = BgcRecordLength(r, size - i, checksums);
+		if(length <= 0)
+		{
+			fprintf(stderr, "bgc: %s record at byte %ld\n", length < 0 ? "corrupt" : "incomplete", i);
+			return false;
+		}
+		if(r[0] == BGC_GCODE)
+		{
+			long end = i + 1;
+			while(end < size && data[end] != '\n')
+				end++;
+			char g[LINE_LENGTH];
+			if(!CleanLine((const char*)&data[i + 1], end - i - 1, g))
+			{
+				fprintf(stderr, "bgc: text record at byte %ld is too long\n", i);
+				return false;
+			}
+			MoveEnd m;
+			if(machine.Text(GCode(g), m))
+				moves.push_back(m);
+			textRecords++;
+			i = end + 1;
+			continue;
+		}
+		if(checksums && BgcChecksum(r, length - 1) != r[length - 1])
+		{
+			fprintf(stderr, "bgc: checksum error at byte %ld\n", i);
+			return false;
+		}
+		const uint8_t* p = &r[1];
+		for(int field = 0; field < BGC_FIELDS; field++)
+		{
+			if(!(r[0] & (1 << field)))
+				continue;
+			int32_t delta;
+			p = BgcReadVarint(p, delta);
+			if(field == BGC_E_FIELD)
+				value[field] = delta;
+			else
+				value[field] += delta;
+		}
+		MoveEnd m;
+		machine.Binary(r[0], value, m);
+		moves.push_back(m);
+		i += length;
+	}
+	return true;
+}
+
+// Do the two files make the same moves, to within the resolution of the .bgc file?
+
+static int Check(const char* textName, const char* binaryName)
+{
+	std::vector<char> text, binary;
+	std::vector<MoveEnd> textMoves, binaryMoves;
+	long textRecords;
+	if(!ReadFile(textName, text) || !ReadFile(binaryName, binary) || !TextMoves(text, textMoves) ||
+			!BinaryMoves(binary, binaryMoves, textRecords))
+		return 1;
+	if(textMoves.size() != binaryMoves.size())
+	{
+		printf("FAIL: %s makes %ld moves, %s makes %ld\n", textName, (long)textMoves.size(),
+				binaryName, (long)binaryMoves.size());
+		return 1;
+	}
+
+	double positionError = 0.0, eError = 0.0, totalEError = 0.0, feedRateError = 0.0;
+	double textTotalE = 0.0, binaryTotalE = 0.0;
+	long binaryCount = 0, failures = 0;
+	for(size_t i = 0; i < textMoves.size(); i++)
+	{
+		const MoveEnd& t = textMoves[i];
+		const MoveEnd& b = binaryMoves[i];
+		bool bad = false;
+		for(int axis = 0; axis < 3; axis++)
+		{
+			double d = fabs(t.position[axis] - b.position[axis]);
+			positionError = fmax(positionError, d);
+			bad |= d > 0.5*BGC_RESOLUTION + 4.0*FLT_EPSILON*fabs(t.position[axis]);
+		}
+		double d = fabs(t.e - b.e);
+		eError = fmax(eError, d);
+		bad |= d > BGC_RESOLUTION + 4.0*FLT_EPSILON*fabs(t.e);
+		textTotalE += t.e;
+		binaryTotalE += b.e;
+		d = fabs(textTotalE - binaryTotalE);
+		totalEError = fmax(totalEError, d);
+		bad |= d > BGC_RESOLUTION + 4.0*FLT_EPSILON*fabs(textTotalE);
+		d = fabs(t.feedRate - b.feedRate);
+		feedRateError = fmax(feedRateError, d);
+		bad |= d > 0.5*BGC_RESOLUTION*0.016666667 + 4.0*FLT_EPSILON*t.feedRate;
+		if(bad && failures++ < 10)
+			printf("Move %ld: X%.4f Y%.4f Z%.4f E%.5f F%.3f in the G Code; X%.4f Y%.4f Z%.4f E%.5f F%.3f from the %s record\n",
+					(long)i + 1, t.position[0], t.position[1], t.position[2], t.e, t.feedRate*60.0,
+					b.position[0], b.position[1], b.position[2], b.e, b.feedRate*60.0, b.binary ? "binary" : "text");
+		if(b.binary)
+			binaryCount++;
+	}
+	printf("%ld moves, %ld of them binary, and %ld text records.\n", (long)textMoves.size(), binaryCount, textRecords);
+	printf("Largest differences: position %.6f mm, extrusion %.6f mm (%.6f mm in total), feedrate %.6f mm/min.\n",
+			positionError, eError, totalEError, feedRateError*60.0);
+	printf("Total extrusion %.5f mm in the G Code, %.5f mm from the .bgc file.\n", textTotalE, binaryTotalE);
+	if(failures)
+	{
+		printf("FAIL: %ld moves differ by more than the file's resolution\n", failures);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
+
+//*************************************************************************************************
+
+static double Now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1.0e-9;
+}
+
+static volatile float sink;
+
+// What the firmware does with each line of a G Code file: copy it into the buffer up to
+// any comment, index it, and read the numbers of the letters that moves use
+
+static void ReadText(const char* data, long size)
+{
+	float sum = 0.0;
+	long i = 0;
+	while(i < size)
+	{
+		char g[LINE_LENGTH];
+		int n = 0;
+		bool inComment = false;
+		while(i < size && data[i] != '\n')
+		{
+			if(data[i] == ';')
+				inComment = true;
+			if(!inComment && n < LINE_LENGTH - 1)
+				g[n++] = data[i];
+			i++;
+		}
+		i++;
+		g[n] = 0;
+		uint8_t index[GCODE_LETTERS];
+		IndexGCodeLetters(g, index);
+		for(int field = 0; field < BGC_FIELDS; field++)
+			if(index[fieldLetters[field] - 'A'] != NO_LETTER)
+				sum += ReadGCodeFloat(&g[index[fieldLetters[field] - 'A'] + 1]);
+	}
+	sink = sum;
+}
+
+// What the firmware does with each record of a .bgc file
+
+static void ReadBinary(const uint8_t* data, long size, bool checksums)
+{
+	int32_t value[BGC_FIELDS] = { 0, 0, 0, 0, 0 };
+	float sum = 0.0;
+	long i = BGC_HEADER_LENGTH;
+	while(i < size)
+	{
+		const uint8_t* r = &data[i];
+		if(r[0] == BGC_GCODE)
+		{
+			long end = i + 1;
+			while(end < size && data[end] != '\n')
+				end++;
+			ReadText((const char*)&data[i + 1], end - i - 1);
+			i = end + 1;
+			continue;
+		}
+		int length = BgcRecordLength(r, size - i, checksums);
+		if(length <= 0 || (checksums && BgcChecksum(r, length - 1) != r[length - 1]))
+			break;
+		const uint8_t* p = &r[1];
+		for(int field = 0; field < BGC_FIELDS; field++)
+		{
+			if(!(r[0] & (1 << field)))
+				continue;
+			int32_t delta;
+			p = BgcReadVarint(p, delta);
+			value[field] = (field == BGC_E_FIELD) ? delta : value[field] + delta;
+			sum += value[field]*BGC_RESOLUTION;
+		}
+		i += length;
+	}
+	sink = sum;
+}
+
+// Seconds per pass of f(), timed over at least half a second
+
+template<class F> static double Time(F f)
+{
+	int passes = 0;
+	double start = Now(), t;
+	do
+	{
+		f();
+		passes++;
+	} while((t = Now() - start) < 0.5);
+	return t/passes;
+}
+
+static int Bench(const char* textName)
+{
+	std::vector<char> text;
+	if(!ReadFile(textName, text))
+		return 1;
+	long lines = 0;
+	for(size_t i = 0; i < text.size(); i++)
+		if(text[i] == '\n')
+			lines++;
+	Converter plain(false), checked(true);
+	if(!Convert(text, plain) || !Convert(text, checked))
+		return 1;
+
+	printf("%s: %ld lines, %ld bytes\n", textName, lines, (long)text.size());
+	printf("As .bgc: %ld bytes (%.1f%%), or %ld bytes (%.1f%%) with checksums; %ld binary moves, %ld text records\n",
+			(long)plain.out.size(), 100.0*plain.out.size()/text.size(),
+			(long)checked.out.size(), 100.0*checked.out.size()/text.size(), plain.binaryMoves, plain.textRecords);
+
+	double textTime = Time([&]() { ReadText(&text[0], text.size()); });
+	double binaryTime = Time([&]() { ReadBinary(&plain.out[0], plain.out.size(), false); });
+	double checkedTime = Time([&]() { ReadBinary(&checked.out[0], checked.out.size(), true); });
+	printf("Reading on this host: G Code %.2f ms (%.0f lines/s), .bgc %.2f ms (%.1f times faster), "
+			"with checksums %.2f ms (%.1f times faster)\n",
+			textTime*1000.0, lines/textTime, binaryTime*1000.0, textTime/binaryTime, checkedTime*1000.0, textTime/checkedTime);
+	return 0;
+}
+
+//*************************************************************************************************
+
+static int Usage()
+{
+	fprintf(stderr, "Usage: bgc convert [-c] in.gcode out.bgc\n"
+			"       bgc check in.gcode in.bgc\n"
+			"       bgc bench in.gcode\n");
+	return 2;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 3)
+		return Usage();
+
+	if(!strcmp(argv[1], "convert"))
+	{
+		bool checksums = argc == 5 && !strcmp(argv[2], "-c");
+		if(argc != (checksums ? 5 : 4))
+			return Usage();
+		std::vector<char> text;
+		Converter c(checksums);
+		if(!ReadFile(argv[argc - 2], text) || !Convert(text, c))
+			return 1;
+		FILE* f = fopen(argv[argc - 1], "wb");
+		if(f == NULL || fwrite(&c.out[0], 1, c.out.size(), f) != c.out.size() || fclose(f))
+		{
+			fprintf(stderr, "bgc: can't write %s\n", argv[argc - 1]);
+			return 1;
+		}
+		printf("%s: %ld bytes, %ld binary moves and %ld text records\n", argv[argc - 1], (long)c.out.size(),
+				c.binaryMoves, c.textRecords);
+		return 0;
+	}
+
+	if(!strcmp(argv[1], "check") && argc == 4)
+		return Check(argv[2], argv[3]);
+
+	if(!strcmp(argv[1], "bench") && argc == 3)
+		return Bench(argv[2]);
+
+	return Usage();
+}
@@ -0,0 +1,203 @@
+/****************************************************************************************************
+
+gcodetext - check and time how the firmware reads lines of G Code
+
+  gcodetext test               Check ReadGCodeFloat() against strtod()
+  gcodetext bench in.gcode     Time reading the lines of a G Code file, as the firmware does now and
+                               as it used to (searching for each letter, then strtod())
+
+This runs on the host, not the machine, using the firmware's own GCodeFormat.h.  Build it from
+this directory with
+
+  g++ -O2 -Wall -I.. -o gcodetext gcodetext.cpp
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+#include <vector>
+#include "GCodeFormat.h"
+
+#define LINE_LENGTH 100 // As GCODE_LENGTH in the firmware
+#define ULPS 2 // How far ReadGCodeFloat() may be from the nearest float
+
+// Numbers that aren't what slicers usually write, chosen to catch the awkward cases
+
+static const char* const awkward[] =
+{
+	"0", "-0", "+0", "0.0", "00000012.5", "5.", "-5.", ".5", "-.25", "+.125", ".000001",
+	"1e3", "1E3", "1.5e-3", "-2.5E+4", "1e10", "1e-10", "1e15", "1e-15", "3e38", "1.17549435e-38",
+	"1e+0", "12e", "12e-", "1.5e2.5", "-.5e1",
+	"123456789", "1234567890", "123456789012345678901234567890", "0.123456789012345678901234567890",
+	"3.14159265358979323846264338327950288", "0.000000000123456789123456789", "99999999999",
+	"16777217", "16777216.5", "4294967295", "4294967296", "2.000000001", "0.1", "0.3", "0.7",
+	" 12.5", "  -3", "12X", "12.5 Y3", "1.2.3", "12:34", "-", "+", ".", "", "--1", "+-1",
+	"200.000", "-0.00010", "9.999999999", "0.999999999999"
+};
+
+static bool Ulps(float a, float b, int ulps)
+{
+	if(a == b)
+		return true;
+	if(!isfinite(a) || !isfinite(b) || (a < 0.0) != (b < 0.0))
+		return false;
+	if(fabs(b) < FLT_MIN)
+		return fabs(a - b) <= FLT_MIN;
+	for(int i = 0; i < ulps; i++)
+		b = nextafterf(b, a);
+	return a == b;
+}
+
+static long failures = 0;
+
+static void Compare(const char* s)
+{
+	float r = ReadGCodeFloat(s);
+	float d = (float)strtod(s, NULL);
+	if(!Ulps(r, d, ULPS))
+	{
+		if(failures < 20)
+			printf("\"%s\": ReadGCodeFloat() gives %.9g, strtod() %.9g\n", s, r, d);
+		failures++;
+	}
+}
+
+static int Test()
+{
+	for(size_t i = 0; i < sizeof(awkward)/sizeof(awkward[0]); i++)
+		Compare(awkward[i]);
+	long tests = sizeof(awkward)/sizeof(awkward[0]);
+
+	// Then lots of random numbers, written in the ways G Codes might have them
+
+	static const char* const formats[] = { "%.0f", "%.3f", "%.5f", "%.9f", "%.15f", "%g", "%.9g", "%e", "%.3E", "%+.4f" };
+	srand(1);
+	for(int i = 0; i < 1000000; i++)
+	{
+		double scale = pow(10.0, rand() % 17 - 8);
+		double v = (rand()/(double)RAND_MAX - 0.5)*scale;
+		char s[64];
+		snprintf(s, sizeof(s), formats[i % (sizeof(formats)/sizeof(formats[0]))], v);
+		if(i % 7 == 0 && (s[0] == '0' || (s[0] == '-' && s[1] == '0')) && strchr(s, '.'))
+			memmove(strchr(s, '0'), strchr(s, '0') + 1, strlen(strchr(s, '0'))); // Leading dot
+		Compare(s);
+		tests++;
+	}
+
+	if(failures)
+	{
+		printf("FAIL: %ld of %ld numbers are more than %d ulps from strtod()\n", failures, tests, ULPS);
+		return 1;
+	}
+	printf("OK: %ld numbers all within %d ulps of strtod()\n", tests, ULPS);
+	return 0;
+}
+
+//*************************************************************************************************
+
+static double Now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1.0e-9;
+}
+
+static volatile float sink;
+static const char letters[] = { 'G', 'M', 'T', 'X', 'Y', 'Z', 'E', 'F' };
+
+// The lines of the file with their comments stripped, as GCodeBuffer holds them
+
+static std::vector<std::vector<char> > lines;
+
+// How the firmware reads a line now: index it once, then look up each letter
+
+static void ReadNew()
+{
+	float sum = 0.0;
+	for(size_t i = 0; i < lines.size(); i++)
+	{
+		const char* g = &lines[i][0];
+		uint8_t index[GCODE_LETTERS];
+		IndexGCodeLetters(g, index);
+		for(size_t l = 0; l < sizeof(letters); l++)
+			if(index[letters[l] - 'A'] != NO_LETTER)
+				sum += ReadGCodeFloat(&g[index[letters[l] - 'A'] + 1]);
+	}
+	sink = sum;
+}
+
+// How it used to: search the line for each letter, then read the number with strtod()
+
+static void ReadOld()
+{
+	float sum = 0.0;
+	for(size_t i = 0; i < lines.size(); i++)
+	{
+		const char* g = &lines[i][0];
+		for(size_t l = 0; l < sizeof(letters); l++)
+		{
+			int p = 0;
+			while(g[p] && g[p] != letters[l])
+				p++;
+			if(g[p])
+				sum += (float)strtod(&g[p + 1], NULL);
+		}
+	}
+	sink = sum;
+}
+
+// Seconds per pass of f(), timed over at least half a second
+
+static double Time(void (*f)())
+{
+	int passes = 0;
+	double start = Now(), t;
+	do
+	{
+		f();
+		passes++;
+	} while((t = Now() - start) < 0.5);
+	return t/passes;
+}
+
+static int Bench(const char* name)
+{
+	FILE* f = fopen(name, "r");
+	if(f == NULL)
+	{
+		fprintf(stderr, "gcodetext: can't open %s\n", name);
+		return 1;
+	}
+	char line[1024];
+	while(fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, ";\r\n")] = 0;
+		line[LINE_LENGTH - 1] = 0;
+		lines.push_back(std::vector<char>(line, line + strlen(line) + 1));
+	}
+	fclose(f);
+
+	double oldTime = Time(ReadOld);
+	double newTime = Time(ReadNew);
+	printf("%s: %ld lines\n", name, (long)lines.size());
+	printf("On this host: searching and strtod() %.0f lines/s, indexing and ReadGCodeFloat() %.0f lines/s (%.1f times faster)\n",
+			lines.size()/oldTime, lines.size()/newTime, oldTime/newTime);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc == 2 && !strcmp(argv[1], "test"))
+		return Test();
+	if(argc == 3 && !strcmp(argv[1], "bench"))
+		return Bench(argv[2]);
+	fprintf(stderr, "Usage: gcodetext test\n"
+			"       gcodetext bench in.gcode\n");
+	return 2;
+}